@@ -1,6 +1,7 @@
 #include "n2n_wire.h"
 #include "n2n_transforms.h"
 #include "n2n.h"
+#include "chacha20poly1305.h"
 
 #include <sys/time.h>
 #include <time.h>
@@ -29,6 +30,10 @@ uint8_t PKT_CONTENT[]={
 static ssize_t do_encode_packet(uint8_t *pktbuf,
                                 size_t bufsize,
                                 const n2n_community_t c);
+static void bench_rx(const char *name, n2n_trans_op_t *op, size_t n);
+static void bench_sizes(const char *name, n2n_trans_op_t *op, size_t n);
+static void bench_batch(const char *name, n2n_trans_op_t *op, size_t n);
+static int bench_interop(const char *name, n2n_trans_op_t *op);
 
 int main(int argc, char *argv[])
 {
@@ -38,6 +43,7 @@ int main(int argc, char *argv[])
     n2n_common_t cmn;
     n2n_PACKET_t pkt;
     n2n_community_t c;
+    int rc = 0;
 
     struct timeval t1;
     struct timeval t2;
@@ -84,9 +90,403 @@ int main(int argc, char *argv[])
             (uint32_t) t1.tv_sec, (uint32_t) t1.tv_usec,
             (uint32_t) t2.tv_sec, (uint32_t) t2.tv_usec);
 
+    /* Receive side: decode with and without copying the frame out of the
+     * receive buffer. Then both sides across frame sizes. */
+    {
+        n2n_trans_op_t transop_tf;
+        n2n_trans_op_t transop_cc;
+        n2n_cipherspec_t cspec;
+        int kernel;
+#if defined(N2N_HAVE_AES)
+        n2n_trans_op_t transop_aes;
+#endif
+
+        memset(&cspec, 0, sizeof(cspec));
+        cspec.valid_until = (time_t) (-1);
+        cspec.opaque_size = snprintf((char *) cspec.opaque, N2N_MAX_KEYSIZE, "%s",
+                                     "1234_0123456789abcdef0123456789abcdef");
+
+        bench_rx("null", &transop_null, n);
+        bench_sizes("null", &transop_null, n);
+        bench_batch("null", &transop_null, n);
+
+        memset(&transop_tf, 0, sizeof(transop_tf));
+        transop_twofish_setup(&transop_tf, 0x1234, (uint8_t *) "secret", 6);
+        bench_rx("tf", &transop_tf, n);
+        bench_sizes("tf", &transop_tf, n);
+        bench_batch("tf", &transop_tf, n);
+        transop_tf.deinit(&transop_tf);
+
+#if defined(N2N_HAVE_AES)
+        memset(&transop_aes, 0, sizeof(transop_aes));
+        transop_aes_init(&transop_aes);
+        cspec.t = N2N_TRANSFORM_ID_AESCBC;
+        transop_aes.addspec(&transop_aes, &cspec);
+        transop_aes.tick(&transop_aes, time(NULL));
+        bench_rx("aes", &transop_aes, n);
+        bench_sizes("aes", &transop_aes, n);
+        bench_batch("aes", &transop_aes, n);
+        transop_aes.deinit(&transop_aes);
+
+        /* Bursts must decode one frame at a time and the other way round,
+         * whatever the key size. */
+        {
+            static const char *keys[] = {
+                "1234_0123456789abcdef0123456789abcdef",
+                "1234_0123456789abcdef0123456789abcdef0123456789abcdef",
+                "1234_0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" };
+            static const char *names[] = { "aes-128", "aes-192", "aes-256" };
+
+            for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+            {
+                n2n_cipherspec_t kspec = cspec;
+
+                kspec.opaque_size = snprintf((char *) kspec.opaque, N2N_MAX_KEYSIZE, "%s", keys[i]);
+                memset(&transop_aes, 0, sizeof(transop_aes));
+                transop_aes_init(&transop_aes);
+                transop_aes.addspec(&transop_aes, &kspec);
+                transop_aes.tick(&transop_aes, time(NULL));
+                rc |= bench_interop(names[i], &transop_aes);
+                transop_aes.deinit(&transop_aes);
+            }
+        }
+
+        memset(&transop_aes, 0, sizeof(transop_aes));
+        transop_aesgcm_init(&transop_aes);
+        cspec.t = N2N_TRANSFORM_ID_AESGCM;
+        transop_aes.addspec(&transop_aes, &cspec);
+        transop_aes.tick(&transop_aes, time(NULL));
+        bench_rx("aesgcm", &transop_aes, n);
+        bench_sizes("aesgcm", &transop_aes, n);
+        transop_aes.deinit(&transop_aes);
+#endif
+
+        memset(&transop_cc, 0, sizeof(transop_cc));
+        transop_chacha20_init(&transop_cc);
+        cspec.t = N2N_TRANSFORM_ID_CHACHA20;
+        transop_cc.addspec(&transop_cc, &cspec);
+        transop_cc.tick(&transop_cc, time(NULL));
+        bench_rx("chacha20", &transop_cc, n);
+
+        /* Each ChaCha20 kernel the CPU runs. */
+        for (kernel = 0; kernel < CHACHA20_KERNELS; ++kernel)
+        {
+            char name[32];
+
+            if (0 == chacha20_use_kernel(kernel))
+            {
+                snprintf(name, sizeof(name), "chacha20/%s", chacha20_kernel_name(kernel));
+                bench_sizes(name, &transop_cc, n);
+            }
+        }
+
+        chacha20_use_kernel(CHACHA20_KERNEL_AUTO);
+        transop_cc.deinit(&transop_cc);
+    }
+
+    return rc;
+}
+
+/** Decode n copies of an encoded PKT_CONTENT with rev and then rev_inplace.
+ *
+ *  Each round first refills the receive buffer, as recvfrom() would. Bytes
+ *  copied counts the decoded frame bytes which end up outside of it.
+ */
+static void bench_rx(const char *name, n2n_trans_op_t *op, size_t n)
+{
+    uint8_t wire[N2N_PKT_BUF_SIZE];
+    uint8_t rxbuf[N2N_PKT_BUF_SIZE];
+    uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    uint8_t *eth;
+    struct timeval t1;
+    struct timeval t2;
+    size_t copied;
+    size_t i;
+    int wlen;
+    int len;
+    int pass;
+
+    wlen = op->fwd(op, wire, sizeof(wire), PKT_CONTENT, sizeof(PKT_CONTENT));
+    if (wlen <= 0)
+    {
+        fprintf(stderr, "rx %-4s: encode failed\n", name);
+        return;
+    }
+
+    for (pass = 0; pass < 2; ++pass)
+    {
+        if ((1 == pass) && (NULL == op->rev_inplace))
+        {
+            break;
+        }
+
+        copied = 0;
+        gettimeofday(&t1, NULL);
+        for (i = 0; i < n; ++i)
+        {
+            memcpy(rxbuf, wire, wlen);
+
+            if (0 == pass)
+            {
+                eth = decodebuf;
+                len = op->rev(op, eth, sizeof(decodebuf), rxbuf, wlen);
+            }
+            else
+            {
+                len = op->rev_inplace(op, rxbuf, wlen, &eth);
+            }
+
+            if ((len != sizeof(PKT_CONTENT)) || (0 != memcmp(eth, PKT_CONTENT, len)))
+            {
+                fprintf(stderr, "rx %-4s: decode mismatch\n", name);
+                return;
+            }
+
+            if ((eth < rxbuf) || (eth >= (rxbuf + sizeof(rxbuf))))
+            {
+                copied += len;
+            }
+        }
+        gettimeofday(&t2, NULL);
+
+        fprintf(stderr, "rx %-4s %-8s: %u nsec, %u bytes copied per packet\n",
+                name, (0 == pass) ? "copy" : "in place",
+                (unsigned int) (((t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec)) * 1000 / n),
+                (unsigned int) (copied / n));
+    }
+}
+
+/** Encode and decode n frames in bursts of BENCH_BURST, first one at a time
+ *  with fwd_inplace and rev_inplace, then a burst at a time with
+ *  transop_fwd_batch() and transop_rev_batch().
+ */
+#define BENCH_BURST     32
+
+static void bench_batch(const char *name, n2n_trans_op_t *op, size_t n)
+{
+    static uint8_t wire[BENCH_BURST][N2N_PKT_BUF_SIZE];
+    n2n_trans_buf_t bufs[BENCH_BURST];
+    struct timeval t1;
+    struct timeval t2;
+    size_t i;
+    size_t j;
+    int pass;
+
+    if ((NULL == op->fwd_inplace) || (NULL == op->rev_inplace))
+    {
+        return;
+    }
+
+    for (pass = 0; pass < 2; ++pass)
+    {
+        gettimeofday(&t1, NULL);
+        for (i = 0; i < n; i += BENCH_BURST)
+        {
+            for (j = 0; j < BENCH_BURST; ++j)
+            {
+                memcpy(wire[j] + op->headroom, PKT_CONTENT, sizeof(PKT_CONTENT));
+                bufs[j].buf = wire[j] + op->headroom;
+                bufs[j].len = sizeof(PKT_CONTENT);
+                bufs[j].tailroom = N2N_PKT_BUF_SIZE - op->headroom - sizeof(PKT_CONTENT);
+            }
+
+            if (0 == pass)
+            {
+                for (j = 0; j < BENCH_BURST; ++j)
+                {
+                    bufs[j].ret = op->fwd_inplace(op, bufs[j].buf, bufs[j].len, bufs[j].tailroom);
+                }
+            }
+            else
+            {
+                transop_fwd_batch(op, bufs, BENCH_BURST);
+            }
+
+            for (j = 0; j < BENCH_BURST; ++j)
+            {
+                bufs[j].buf = wire[j];
+                bufs[j].len = bufs[j].ret;
+            }
+
+            if (0 == pass)
+            {
+                for (j = 0; j < BENCH_BURST; ++j)
+                {
+                    bufs[j].ret = op->rev_inplace(op, bufs[j].buf, bufs[j].len, &(bufs[j].out));
+                }
+            }
+            else
+            {
+                transop_rev_batch(op, bufs, BENCH_BURST);
+            }
+
+            for (j = 0; j < BENCH_BURST; ++j)
+            {
+                if ((bufs[j].ret != sizeof(PKT_CONTENT)) ||
+                    (0 != memcmp(bufs[j].out, PKT_CONTENT, sizeof(PKT_CONTENT))))
+                {
+                    fprintf(stderr, "batch %-4s: mismatch\n", name);
+                    return;
+                }
+            }
+        }
+        gettimeofday(&t2, NULL);
+
+        fprintf(stderr, "batch %-4s %-8s: %u nsec per frame to encode and decode\n",
+                name, (0 == pass) ? "single" : "burst",
+                (unsigned int) (((t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec)) * 1000 / n));
+    }
+}
+
+/** Check that op decodes a burst encoded with transop_fwd_batch() one frame
+ *  at a time with rev, and a burst encoded one frame at a time with fwd with
+ *  transop_rev_batch(). Frame lengths vary across the burst.
+ *
+ *  @return 0 if every frame came back intact, -1 otherwise
+ */
+static int bench_interop(const char *name, n2n_trans_op_t *op)
+{
+    static uint8_t wire[BENCH_BURST][N2N_PKT_BUF_SIZE];
+    uint8_t frame[BENCH_BURST][1500];
+    uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    n2n_trans_buf_t bufs[BENCH_BURST];
+    size_t lens[BENCH_BURST];
+    size_t i;
+    size_t j;
+    int pass;
+    int len;
+
+    if ((NULL == op->fwd_inplace) || (NULL == op->rev))
+    {
+        return 0;
+    }
+
+    for (j = 0; j < BENCH_BURST; ++j)
+    {
+        lens[j] = 1 + ((j * 97) % sizeof(frame[j]));
+        for (i = 0; i < lens[j]; ++i)
+        {
+            frame[j][i] = (uint8_t) (PKT_CONTENT[i % sizeof(PKT_CONTENT)] + j);
+        }
+    }
+
+    for (pass = 0; pass < 2; ++pass)
+    {
+        for (j = 0; j < BENCH_BURST; ++j)
+        {
+            if (0 == pass)
+            {
+                memcpy(wire[j] + op->headroom, frame[j], lens[j]);
+                bufs[j].buf = wire[j] + op->headroom;
+                bufs[j].len = lens[j];
+                bufs[j].tailroom = N2N_PKT_BUF_SIZE - op->headroom - lens[j];
+            }
+            else
+            {
+                bufs[j].ret = op->fwd(op, wire[j], N2N_PKT_BUF_SIZE, frame[j], lens[j]);
+            }
+        }
+
+        if (0 == pass)
+        {
+            transop_fwd_batch(op, bufs, BENCH_BURST);
+        }
+
+        for (j = 0; j < BENCH_BURST; ++j)
+        {
+            bufs[j].buf = wire[j];
+            bufs[j].len = bufs[j].ret;
+        }
+
+        if (0 != pass)
+        {
+            transop_rev_batch(op, bufs, BENCH_BURST);
+        }
+
+        for (j = 0; j < BENCH_BURST; ++j)
+        {
+            if (0 == pass)
+            {
+                len = (bufs[j].ret > 0) ? op->rev(op, decodebuf, sizeof(decodebuf), wire[j], bufs[j].len) : -1;
+                bufs[j].out = decodebuf;
+            }
+            else
+            {
+                len = bufs[j].ret;
+            }
+
+            if ((len != (int) lens[j]) || (0 != memcmp(bufs[j].out, frame[j], lens[j])))
+            {
+                fprintf(stderr, "interop %-8s: %s frame %u mismatch\n", name,
+                        (0 == pass) ? "burst -> single" : "single -> burst", (unsigned int) j);
+                return -1;
+            }
+        }
+    }
+
+    fprintf(stderr, "interop %-8s: burst and single frames decode either way\n", name);
+
     return 0;
 }
 
+/** Encode and decode n frames of each of a range of sizes with op, in
+ *  place where op can. Prints the time per frame of each size.
+ */
+static void bench_sizes(const char *name, n2n_trans_op_t *op, size_t n)
+{
+    static const size_t sizes[] = { 64, 256, 576, 1024, 1400 };
+    uint8_t frame[1400];
+    uint8_t wire[N2N_PKT_BUF_SIZE];
+    uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    uint8_t *eth;
+    struct timeval t1;
+    struct timeval t2;
+    size_t s;
+    size_t i;
+    int wlen;
+    int len;
+
+    for (i = 0; i < sizeof(frame); ++i)
+    {
+        frame[i] = PKT_CONTENT[i % sizeof(PKT_CONTENT)];
+    }
+
+    fprintf(stderr, "sizes %-14s:", name);
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        gettimeofday(&t1, NULL);
+        for (i = 0; i < n; ++i)
+        {
+            if (op->fwd_inplace && op->rev_inplace)
+            {
+                memcpy(wire + op->headroom, frame, sizes[s]);
+                wlen = op->fwd_inplace(op, wire + op->headroom, sizes[s],
+                                       sizeof(wire) - op->headroom - sizes[s]);
+                len = (wlen > 0) ? op->rev_inplace(op, wire, wlen, &eth) : -1;
+            }
+            else
+            {
+                wlen = op->fwd(op, wire, sizeof(wire), frame, sizes[s]);
+                eth = decodebuf;
+                len = (wlen > 0) ? op->rev(op, eth, sizeof(decodebuf), wire, wlen) : -1;
+            }
+
+            if ((len != (int) sizes[s]) || (0 != memcmp(eth, frame, len)))
+            {
+                fprintf(stderr, " %u: mismatch\n", (unsigned int) sizes[s]);
+                return;
+            }
+        }
+        gettimeofday(&t2, NULL);
+
+        fprintf(stderr, " %4u:%6u", (unsigned int) sizes[s],
+                (unsigned int) (((t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec)) * 1000 / n));
+    }
+
+    fprintf(stderr, " nsec per frame to encode and decode\n");
+}
+
 static ssize_t do_encode_packet(uint8_t *pktbuf,
                                 size_t bufsize,
                                 const n2n_community_t c)
@@ -0,0 +1,826 @@
+/*
+ * chacha20poly1305.c
+ *
+ * The ChaCha20-Poly1305 AEAD of RFC 8439. See chacha20poly1305.h.
+ */
+
+#include <string.h>
+#include "chacha20poly1305.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA20_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__SIZEOF_INT128__)
+#define POLY1305_64             /* 44-bit limbs and 128-bit products */
+#endif
+
+#define CHACHA20_BLOCK_SIZE     64
+
+#define ROTL32(v, n)            (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA20_QR(a, b, c, d)                                         \
+    a += b; d ^= a; d = ROTL32(d, 16);                                  \
+    c += d; b ^= c; b = ROTL32(b, 12);                                  \
+    a += b; d ^= a; d = ROTL32(d, 8);                                   \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+/** XOR keystream blocks of the state onto nblocks blocks of in, writing them
+ *  to out, and count the blocks in the counter word of the state. */
+typedef void (*chacha20_blocks_f)(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks);
+
+struct chacha20_kernel
+{
+    const char         *name;
+    size_t              width;          /* Blocks per call; nblocks is a multiple of it. */
+    chacha20_blocks_f   blocks;
+};
+
+struct poly1305
+{
+#if defined(POLY1305_64)
+    uint64_t            r[3];
+    uint64_t            h[3];
+    uint64_t            pad[2];
+#else
+    uint32_t            r[5];
+    uint32_t            h[5];
+    uint32_t            pad[4];
+#endif
+    size_t              leftover;
+    uint8_t             buffer[16];
+    uint8_t             final;
+};
+
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t load64_le(const uint8_t *p)
+{
+    return (uint64_t) load32_le(p) | ((uint64_t) load32_le(p + 4) << 32);
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static void store64_le(uint8_t *p, uint64_t v)
+{
+    store32_le(p, (uint32_t) v);
+    store32_le(p + 4, (uint32_t) (v >> 32));
+}
+
+
+/* ********************************** */
+/* ChaCha20 kernels */
+
+static void chacha20_block(const uint32_t state[16], uint8_t out[CHACHA20_BLOCK_SIZE])
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, state, sizeof(x));
+
+    for (i = 0; i < 10; ++i)
+    {
+        CHACHA20_QR(x[0], x[4], x[8],  x[12]);
+        CHACHA20_QR(x[1], x[5], x[9],  x[13]);
+        CHACHA20_QR(x[2], x[6], x[10], x[14]);
+        CHACHA20_QR(x[3], x[7], x[11], x[15]);
+        CHACHA20_QR(x[0], x[5], x[10], x[15]);
+        CHACHA20_QR(x[1], x[6], x[11], x[12]);
+        CHACHA20_QR(x[2], x[7], x[8],  x[13]);
+        CHACHA20_QR(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (i = 0; i < 16; ++i)
+    {
+        store32_le(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+static void chacha20_blocks_scalar(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks)
+{
+    uint8_t ks[CHACHA20_BLOCK_SIZE];
+    size_t i;
+
+    while (nblocks > 0)
+    {
+        chacha20_block(state, ks);
+
+        for (i = 0; i < CHACHA20_BLOCK_SIZE; i += 8)
+        {
+            uint64_t a;
+            uint64_t b;
+
+            memcpy(&a, in + i, 8);
+            memcpy(&b, ks + i, 8);
+            a ^= b;
+            memcpy(out + i, &a, 8);
+        }
+
+        ++(state[12]);
+        in += CHACHA20_BLOCK_SIZE;
+        out += CHACHA20_BLOCK_SIZE;
+        --nblocks;
+    }
+}
+
+#if defined(CHACHA20_HAVE_X86)
+
+/* The vector kernels keep word i of the state of each block in lane j of
+ * vector i, so that a round is the scalar round with vector operations.
+ * Afterwards the words are transposed into blocks, four at a time. */
+
+#define SSE2_ROTL(v, n)         _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define SSE2_QR(a, b, c, d)                                                             \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d, 16);             \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b, 12);             \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d, 8);              \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b, 7)
+
+__attribute__((target("sse2")))
+static void chacha20_blocks_sse2(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks)
+{
+    __m128i o[16];
+    __m128i x[16];
+    int i;
+    int g;
+
+    while (nblocks >= 4)
+    {
+        for (i = 0; i < 16; ++i)
+        {
+            o[i] = _mm_set1_epi32((int) state[i]);
+        }
+        o[12] = _mm_add_epi32(o[12], _mm_set_epi32(3, 2, 1, 0));
+
+        memcpy(x, o, sizeof(x));
+
+        for (i = 0; i < 10; ++i)
+        {
+            SSE2_QR(x[0], x[4], x[8],  x[12]);
+            SSE2_QR(x[1], x[5], x[9],  x[13]);
+            SSE2_QR(x[2], x[6], x[10], x[14]);
+            SSE2_QR(x[3], x[7], x[11], x[15]);
+            SSE2_QR(x[0], x[5], x[10], x[15]);
+            SSE2_QR(x[1], x[6], x[11], x[12]);
+            SSE2_QR(x[2], x[7], x[8],  x[13]);
+            SSE2_QR(x[3], x[4], x[9],  x[14]);
+        }
+
+        for (g = 0; g < 4; ++g)
+        {
+            __m128i a = _mm_add_epi32(x[4 * g],     o[4 * g]);
+            __m128i b = _mm_add_epi32(x[4 * g + 1], o[4 * g + 1]);
+            __m128i c = _mm_add_epi32(x[4 * g + 2], o[4 * g + 2]);
+            __m128i d = _mm_add_epi32(x[4 * g + 3], o[4 * g + 3]);
+            __m128i t0 = _mm_unpacklo_epi32(a, b);
+            __m128i t1 = _mm_unpacklo_epi32(c, d);
+            __m128i t2 = _mm_unpackhi_epi32(a, b);
+            __m128i t3 = _mm_unpackhi_epi32(c, d);
+            __m128i r[4];
+
+            r[0] = _mm_unpacklo_epi64(t0, t1);
+            r[1] = _mm_unpackhi_epi64(t0, t1);
+            r[2] = _mm_unpacklo_epi64(t2, t3);
+            r[3] = _mm_unpackhi_epi64(t2, t3);
+
+            for (i = 0; i < 4; ++i)
+            {
+                size_t off = i * CHACHA20_BLOCK_SIZE + g * 16;
+
+                _mm_storeu_si128((__m128i *) (out + off),
+                                 _mm_xor_si128(r[i], _mm_loadu_si128((const __m128i *) (in + off))));
+            }
+        }
+
+        state[12] += 4;
+        in += 4 * CHACHA20_BLOCK_SIZE;
+        out += 4 * CHACHA20_BLOCK_SIZE;
+        nblocks -= 4;
+    }
+}
+
+#define AVX2_ROTL(v, n)         _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define AVX2_QR(a, b, c, d)                                                                     \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 12);               \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8);   \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 7)
+
+__attribute__((target("avx2")))
+static void chacha20_blocks_avx2(uint32_t state[16], uint8_t *out, const uint8_t *in, size_t nblocks)
+{
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                         14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i o[16];
+    __m256i x[16];
+    int i;
+    int g;
+
+    while (nblocks >= 8)
+    {
+        for (i = 0; i < 16; ++i)
+        {
+            o[i] = _mm256_set1_epi32((int) state[i]);
+        }
+        o[12] = _mm256_add_epi32(o[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+
+        memcpy(x, o, sizeof(x));
+
+        for (i = 0; i < 10; ++i)
+        {
+            AVX2_QR(x[0], x[4], x[8],  x[12]);
+            AVX2_QR(x[1], x[5], x[9],  x[13]);
+            AVX2_QR(x[2], x[6], x[10], x[14]);
+            AVX2_QR(x[3], x[7], x[11], x[15]);
+            AVX2_QR(x[0], x[5], x[10], x[15]);
+            AVX2_QR(x[1], x[6], x[11], x[12]);
+            AVX2_QR(x[2], x[7], x[8],  x[13]);
+            AVX2_QR(x[3], x[4], x[9],  x[14]);
+        }
+
+        /* The unpacks work within each 128-bit lane, so the low lanes end
+         * up holding blocks 0 to 3 and the high lanes blocks 4 to 7. */
+        for (g = 0; g < 4; ++g)
+        {
+            __m256i a = _mm256_add_epi32(x[4 * g],     o[4 * g]);
+            __m256i b = _mm256_add_epi32(x[4 * g + 1], o[4 * g + 1]);
+            __m256i c = _mm256_add_epi32(x[4 * g + 2], o[4 * g + 2]);
+            __m256i d = _mm256_add_epi32(x[4 * g + 3], o[4 * g + 3]);
+            __m256i t0 = _mm256_unpacklo_epi32(a, b);
+            __m256i t1 = _mm256_unpacklo_epi32(c, d);
+            __m256i t2 = _mm256_unpackhi_epi32(a, b);
+            __m256i t3 = _mm256_unpackhi_epi32(c, d);
+            __m256i r[4];
+
+            r[0] = _mm256_unpacklo_epi64(t0, t1);
+            r[1] = _mm256_unpackhi_epi64(t0, t1);
+            r[2] = _mm256_unpacklo_epi64(t2, t3);
+            r[3] = _mm256_unpackhi_epi64(t2, t3);
+
+            for (i = 0; i < 4; ++i)
+            {
+                size_t lo = i * CHACHA20_BLOCK_SIZE + g * 16;
+                size_t hi = lo + 4 * CHACHA20_BLOCK_SIZE;
+
+                _mm_storeu_si128((__m128i *) (out + lo),
+                                 _mm_xor_si128(_mm256_castsi256_si128(r[i]),
+                                               _mm_loadu_si128((const __m128i *) (in + lo))));
+                _mm_storeu_si128((__m128i *) (out + hi),
+                                 _mm_xor_si128(_mm256_extracti128_si256(r[i], 1),
+                                               _mm_loadu_si128((const __m128i *) (in + hi))));
+            }
+        }
+
+        state[12] += 8;
+        in += 8 * CHACHA20_BLOCK_SIZE;
+        out += 8 * CHACHA20_BLOCK_SIZE;
+        nblocks -= 8;
+    }
+}
+
+#endif /* CHACHA20_HAVE_X86 */
+
+static const struct chacha20_kernel chacha20_kernels[CHACHA20_KERNELS] =
+{
+    { "scalar", 1, chacha20_blocks_scalar },
+#if defined(CHACHA20_HAVE_X86)
+    { "sse2",   4, chacha20_blocks_sse2 },
+    { "avx2",   8, chacha20_blocks_avx2 },
+#else
+    { "sse2",   4, NULL },
+    { "avx2",   8, NULL },
+#endif
+};
+
+static int chacha20_active = CHACHA20_KERNEL_AUTO;
+
+
+/* ********************************** */
+
+/** @return non-zero if kernel is built in and the CPU runs it */
+int chacha20_kernel_supported(int kernel)
+{
+    if ((kernel < 0) || (kernel >= CHACHA20_KERNELS) || (NULL == chacha20_kernels[kernel].blocks))
+    {
+        return 0;
+    }
+
+#if defined(CHACHA20_HAVE_X86)
+    __builtin_cpu_init();
+
+    switch (kernel)
+    {
+    case CHACHA20_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case CHACHA20_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        break;
+    }
+#endif
+
+    return 1;
+}
+
+/** Run ChaCha20 with kernel, or with the fastest one the CPU supports if
+ *  kernel is CHACHA20_KERNEL_AUTO.
+ *
+ *  @return 0, or -1 if the CPU does not support kernel
+ */
+int chacha20_use_kernel(int kernel)
+{
+    if (CHACHA20_KERNEL_AUTO == kernel)
+    {
+        kernel = CHACHA20_KERNELS - 1;
+        while (!chacha20_kernel_supported(kernel))
+        {
+            --kernel;
+        }
+    }
+    else if (!chacha20_kernel_supported(kernel))
+    {
+        return -1;
+    }
+
+    chacha20_active = kernel;
+
+    return 0;
+}
+
+/** @return the kernel ChaCha20 runs with */
+int chacha20_kernel(void)
+{
+    if (CHACHA20_KERNEL_AUTO == chacha20_active)
+    {
+        chacha20_use_kernel(CHACHA20_KERNEL_AUTO);
+    }
+
+    return chacha20_active;
+}
+
+const char *chacha20_kernel_name(int kernel)
+{
+    return ((kernel >= 0) && (kernel < CHACHA20_KERNELS)) ? chacha20_kernels[kernel].name : "?";
+}
+
+/** XOR the ChaCha20 keystream from block counter on to len bytes of in,
+ *  writing them to out, which may be in. */
+static void chacha20_xor(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                         uint32_t counter, uint8_t *out, const uint8_t *in, size_t len)
+{
+    const struct chacha20_kernel *k = &(chacha20_kernels[chacha20_kernel()]);
+    uint32_t state[16];
+    size_t nblocks = len / CHACHA20_BLOCK_SIZE;
+    size_t n;
+
+    state[0] = 0x61707865; /* "expand 32-byte k" */
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    memcpy(state + 4, ctx->key, sizeof(ctx->key));
+    state[12] = counter;
+    state[13] = load32_le(nonce);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
+
+    n = nblocks - (nblocks % k->width);
+    if (n > 0)
+    {
+        k->blocks(state, out, in, n);
+        in += n * CHACHA20_BLOCK_SIZE;
+        out += n * CHACHA20_BLOCK_SIZE;
+        len -= n * CHACHA20_BLOCK_SIZE;
+    }
+
+    n = len / CHACHA20_BLOCK_SIZE;
+    if (n > 0)
+    {
+        chacha20_blocks_scalar(state, out, in, n);
+        in += n * CHACHA20_BLOCK_SIZE;
+        out += n * CHACHA20_BLOCK_SIZE;
+        len -= n * CHACHA20_BLOCK_SIZE;
+    }
+
+    if (len > 0)
+    {
+        uint8_t ks[CHACHA20_BLOCK_SIZE];
+
+        chacha20_block(state, ks);
+        for (n = 0; n < len; ++n)
+        {
+            out[n] = in[n] ^ ks[n];
+        }
+    }
+}
+
+
+/* ********************************** */
+/* Poly1305 */
+
+#if defined(POLY1305_64)
+
+static void poly1305_init(struct poly1305 *st, const uint8_t key[32])
+{
+    uint64_t t0 = load64_le(key);
+    uint64_t t1 = load64_le(key + 8);
+
+    /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+    st->r[0] = (t0) & 0xffc0fffffff;
+    st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    st->r[2] = ((t1 >> 24)) & 0x00ffffffc0f;
+
+    memset(st->h, 0, sizeof(st->h));
+
+    st->pad[0] = load64_le(key + 16);
+    st->pad[1] = load64_le(key + 24);
+
+    st->leftover = 0;
+    st->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305 *st, const uint8_t *m, size_t bytes)
+{
+    typedef unsigned __int128 uint128_t;
+    const uint64_t hibit = st->final ? 0 : ((uint64_t) 1 << 40); /* 1 << 128 */
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint128_t d0, d1, d2;
+    uint64_t c;
+    uint64_t t0;
+    uint64_t t1;
+
+    while (bytes >= 16)
+    {
+        /* h += m[i] */
+        t0 = load64_le(m);
+        t1 = load64_le(m + 8);
+        h0 += (t0) & 0xfffffffffff;
+        h1 += ((t0 >> 44) | (t1 << 20)) & 0xfffffffffff;
+        h2 += (((t1 >> 24)) & 0x3ffffffffff) | hibit;
+
+        /* h *= r */
+        d0 = ((uint128_t) h0 * r0) + ((uint128_t) h1 * s2) + ((uint128_t) h2 * s1);
+        d1 = ((uint128_t) h0 * r1) + ((uint128_t) h1 * r0) + ((uint128_t) h2 * s2);
+        d2 = ((uint128_t) h0 * r2) + ((uint128_t) h1 * r1) + ((uint128_t) h2 * r0);
+
+        /* (partial) h %= p */
+                     c = (uint64_t) (d0 >> 44); h0 = (uint64_t) d0 & 0xfffffffffff;
+        d1 += c;     c = (uint64_t) (d1 >> 44); h1 = (uint64_t) d1 & 0xfffffffffff;
+        d2 += c;     c = (uint64_t) (d2 >> 42); h2 = (uint64_t) d2 & 0x3ffffffffff;
+        h0 += c * 5; c = (h0 >> 44);            h0 = h0 & 0xfffffffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+static void poly1305_final(struct poly1305 *st, uint8_t mac[POLY1305_TAG_SIZE])
+{
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint64_t g0, g1, g2, c;
+    uint64_t t0 = st->pad[0], t1 = st->pad[1];
+
+    /* fully carry h */
+                 c = (h1 >> 44); h1 &= 0xfffffffffff;
+    h2 += c;     c = (h2 >> 42); h2 &= 0x3ffffffffff;
+    h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffff;
+    h1 += c;     c = (h1 >> 44); h1 &= 0xfffffffffff;
+    h2 += c;     c = (h2 >> 42); h2 &= 0x3ffffffffff;
+    h0 += c * 5; c = (h0 >> 44); h0 &= 0xfffffffffff;
+    h1 += c;
+
+    /* compute h + -p */
+    g0 = h0 + 5; c = (g0 >> 44); g0 &= 0xfffffffffff;
+    g1 = h1 + c; c = (g1 >> 44); g1 &= 0xfffffffffff;
+    g2 = h2 + c - ((uint64_t) 1 << 42);
+
+    /* select h if h < p, or h + -p if h >= p */
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    /* mac = (h + pad) % (2^128) */
+    h0 += ((t0) & 0xfffffffffff);                         c = (h0 >> 44); h0 &= 0xfffffffffff;
+    h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c; c = (h1 >> 44); h1 &= 0xfffffffffff;
+    h2 += (((t1 >> 24)) & 0x3ffffffffff) + c;                              h2 &= 0x3ffffffffff;
+
+    h0 = ((h0) | (h1 << 44));
+    h1 = ((h1 >> 20) | (h2 << 24));
+
+    store64_le(mac, h0);
+    store64_le(mac + 8, h1);
+}
+
+#else /* POLY1305_64 */
+
+static void poly1305_init(struct poly1305 *st, const uint8_t key[32])
+{
+    /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+    st->r[0] = (load32_le(key + 0)) & 0x3ffffff;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+
+    memset(st->h, 0, sizeof(st->h));
+
+    st->pad[0] = load32_le(key + 16);
+    st->pad[1] = load32_le(key + 20);
+    st->pad[2] = load32_le(key + 24);
+    st->pad[3] = load32_le(key + 28);
+
+    st->leftover = 0;
+    st->final = 0;
+}
+
+static void poly1305_blocks(struct poly1305 *st, const uint8_t *m, size_t bytes)
+{
+    const uint32_t hibit = st->final ? 0 : (1UL << 24); /* 1 << 128 */
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    while (bytes >= 16)
+    {
+        /* h += m[i] */
+        h0 += (load32_le(m + 0)) & 0x3ffffff;
+        h1 += (load32_le(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(m + 12) >> 8) | hibit;
+
+        /* h *= r */
+        d0 = ((uint64_t) h0 * r0) + ((uint64_t) h1 * s4) + ((uint64_t) h2 * s3) + ((uint64_t) h3 * s2) + ((uint64_t) h4 * s1);
+        d1 = ((uint64_t) h0 * r1) + ((uint64_t) h1 * r0) + ((uint64_t) h2 * s4) + ((uint64_t) h3 * s3) + ((uint64_t) h4 * s2);
+        d2 = ((uint64_t) h0 * r2) + ((uint64_t) h1 * r1) + ((uint64_t) h2 * r0) + ((uint64_t) h3 * s4) + ((uint64_t) h4 * s3);
+        d3 = ((uint64_t) h0 * r3) + ((uint64_t) h1 * r2) + ((uint64_t) h2 * r1) + ((uint64_t) h3 * r0) + ((uint64_t) h4 * s4);
+        d4 = ((uint64_t) h0 * r4) + ((uint64_t) h1 * r3) + ((uint64_t) h2 * r2) + ((uint64_t) h3 * r1) + ((uint64_t) h4 * r0);
+
+        /* (partial) h %= p */
+                     c = (uint32_t) (d0 >> 26); h0 = (uint32_t) d0 & 0x3ffffff;
+        d1 += c;     c = (uint32_t) (d1 >> 26); h1 = (uint32_t) d1 & 0x3ffffff;
+        d2 += c;     c = (uint32_t) (d2 >> 26); h2 = (uint32_t) d2 & 0x3ffffff;
+        d3 += c;     c = (uint32_t) (d3 >> 26); h3 = (uint32_t) d3 & 0x3ffffff;
+        d4 += c;     c = (uint32_t) (d4 >> 26); h4 = (uint32_t) d4 & 0x3ffffff;
+        h0 += c * 5; c = (h0 >> 26);            h0 = h0 & 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+static void poly1305_final(struct poly1305 *st, uint8_t mac[POLY1305_TAG_SIZE])
+{
+    uint32_t h0, h1, h2, h3, h4, c;
+    uint32_t g0, g1, g2, g3, g4;
+    uint64_t f;
+    uint32_t mask;
+
+    /* fully carry h */
+    h0 = st->h[0];
+    h1 = st->h[1];
+    h2 = st->h[2];
+    h3 = st->h[3];
+    h4 = st->h[4];
+
+                 c = h1 >> 26; h1 = h1 & 0x3ffffff;
+    h2 += c;     c = h2 >> 26; h2 = h2 & 0x3ffffff;
+    h3 += c;     c = h3 >> 26; h3 = h3 & 0x3ffffff;
+    h4 += c;     c = h4 >> 26; h4 = h4 & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 = h0 & 0x3ffffff;
+    h1 += c;
+
+    /* compute h + -p */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    /* select h if h < p, or h + -p if h >= p */
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    /* h = h % (2^128) */
+    h0 = ((h0) | (h1 << 26)) & 0xffffffff;
+    h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+    h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+    h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+    /* mac = (h + pad) % (2^128) */
+    f = (uint64_t) h0 + st->pad[0];             h0 = (uint32_t) f;
+    f = (uint64_t) h1 + st->pad[1] + (f >> 32); h1 = (uint32_t) f;
+    f = (uint64_t) h2 + st->pad[2] + (f >> 32); h2 = (uint32_t) f;
+    f = (uint64_t) h3 + st->pad[3] + (f >> 32); h3 = (uint32_t) f;
+
+    store32_le(mac + 0, h0);
+    store32_le(mac + 4, h1);
+    store32_le(mac + 8, h2);
+    store32_le(mac + 12, h3);
+}
+
+#endif /* POLY1305_64 */
+
+static void poly1305_update(struct poly1305 *st, const uint8_t *m, size_t bytes)
+{
+    size_t i;
+
+    if (st->leftover)
+    {
+        size_t want = 16 - st->leftover;
+
+        if (want > bytes)
+        {
+            want = bytes;
+        }
+
+        for (i = 0; i < want; ++i)
+        {
+            st->buffer[st->leftover + i] = m[i];
+        }
+
+        bytes -= want;
+        m += want;
+        st->leftover += want;
+
+        if (st->leftover < 16)
+        {
+            return;
+        }
+
+        poly1305_blocks(st, st->buffer, 16);
+        st->leftover = 0;
+    }
+
+    if (bytes >= 16)
+    {
+        size_t want = bytes & ~((size_t) 15);
+
+        poly1305_blocks(st, m, want);
+        m += want;
+        bytes -= want;
+    }
+
+    for (i = 0; i < bytes; ++i)
+    {
+        st->buffer[st->leftover + i] = m[i];
+    }
+    st->leftover += bytes;
+}
+
+/** Pad the message with zeroes to a whole block, as the AEAD does. */
+static void poly1305_pad16(struct poly1305 *st, size_t len)
+{
+    static const uint8_t zeroes[16] = { 0 };
+
+    if (0 != (len % 16))
+    {
+        poly1305_update(st, zeroes, 16 - (len % 16));
+    }
+}
+
+static void poly1305_finish(struct poly1305 *st, uint8_t mac[POLY1305_TAG_SIZE])
+{
+    /* process the remaining block */
+    if (st->leftover)
+    {
+        size_t i = st->leftover;
+
+        st->buffer[i++] = 1;
+        for (; i < 16; ++i)
+        {
+            st->buffer[i] = 0;
+        }
+        st->final = 1;
+        poly1305_blocks(st, st->buffer, 16);
+    }
+
+    poly1305_final(st, mac);
+}
+
+
+/* ********************************** */
+/* AEAD */
+
+void chacha20poly1305_init(chacha20poly1305_t *ctx, const uint8_t key[CHACHA20_KEY_SIZE])
+{
+    size_t i;
+
+    for (i = 0; i < CHACHA20_KEY_SIZE / 4; ++i)
+    {
+        ctx->key[i] = load32_le(key + 4 * i);
+    }
+}
+
+/** Compute the tag of the ciphertext ct under the one-time Poly1305 key taken
+ *  from block 0 of the keystream. */
+static void chacha20poly1305_tag(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                                 const uint8_t *aad, size_t aad_len,
+                                 const uint8_t *ct, size_t len, uint8_t tag[POLY1305_TAG_SIZE])
+{
+    uint8_t block0[CHACHA20_BLOCK_SIZE];
+    uint8_t lens[16];
+    struct poly1305 st;
+
+    memset(block0, 0, sizeof(block0));
+    chacha20_xor(ctx, nonce, 0, block0, block0, sizeof(block0));
+
+    poly1305_init(&st, block0);
+    poly1305_update(&st, aad, aad_len);
+    poly1305_pad16(&st, aad_len);
+    poly1305_update(&st, ct, len);
+    poly1305_pad16(&st, len);
+    store64_le(lens, aad_len);
+    store64_le(lens + 8, len);
+    poly1305_update(&st, lens, sizeof(lens));
+    poly1305_finish(&st, tag);
+
+    memset(block0, 0, sizeof(block0));
+}
+
+/** Encrypt the len bytes of buf where they lie and compute the tag over aad
+ *  and the ciphertext. */
+void chacha20poly1305_seal(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *aad, size_t aad_len,
+                           uint8_t *buf, size_t len, uint8_t tag[POLY1305_TAG_SIZE])
+{
+    chacha20_xor(ctx, nonce, 1, buf, buf, len);
+    chacha20poly1305_tag(ctx, nonce, aad, aad_len, buf, len, tag);
+}
+
+/** Check the tag over aad and the len bytes of ciphertext in, then decrypt
+ *  them into out, which may be in. Nothing is decrypted if the tag does not
+ *  match.
+ *
+ *  @return 0, or -1 if the tag does not match
+ */
+int chacha20poly1305_open(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                          const uint8_t *aad, size_t aad_len,
+                          const uint8_t *in, size_t len, const uint8_t tag[POLY1305_TAG_SIZE],
+                          uint8_t *out)
+{
+    uint8_t expect[POLY1305_TAG_SIZE];
+    uint8_t diff = 0;
+    size_t i;
+
+    chacha20poly1305_tag(ctx, nonce, aad, aad_len, in, len, expect);
+
+    for (i = 0; i < POLY1305_TAG_SIZE; ++i)
+    {
+        diff |= expect[i] ^ tag[i]; /* in constant time */
+    }
+
+    if (0 != diff)
+    {
+        return -1;
+    }
+
+    chacha20_xor(ctx, nonce, 1, out, in, len);
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * chacha20poly1305.h
+ *
+ * The ChaCha20-Poly1305 AEAD of RFC 8439, self-contained so that it needs no
+ * crypto library.
+ *
+ * ChaCha20 is run by one of several kernels which produce the same keystream:
+ * a portable scalar one, and on x86 one working on four blocks at once with
+ * SSE2 and one working on eight blocks at once with AVX2. The fastest kernel
+ * the CPU supports is picked on first use; chacha20_use_kernel() picks another
+ * one, e.g. to compare them. Poly1305 is poly1305-donna: the
+ * 44-bit limb form where the compiler has 128-bit integers, else the 26-bit
+ * limb form, which needs nothing wider than 64-bit products.
+ */
+
+#ifndef CHACHA20POLY1305_H_
+#define CHACHA20POLY1305_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE       32
+#define CHACHA20_NONCE_SIZE     12
+#define POLY1305_TAG_SIZE       16
+
+#define CHACHA20_KERNEL_AUTO    -1      /* The fastest kernel the CPU supports. */
+#define CHACHA20_KERNEL_SCALAR  0
+#define CHACHA20_KERNEL_SSE2    1
+#define CHACHA20_KERNEL_AVX2    2
+#define CHACHA20_KERNELS        3
+
+/** A key, as the words ChaCha20 uses. */
+struct chacha20poly1305
+{
+    uint32_t            key[CHACHA20_KEY_SIZE / 4];
+};
+
+typedef struct chacha20poly1305 chacha20poly1305_t;
+
+
+int     chacha20_use_kernel(int kernel);
+int     chacha20_kernel(void);
+int     chacha20_kernel_supported(int kernel);
+const char *chacha20_kernel_name(int kernel);
+
+void    chacha20poly1305_init(chacha20poly1305_t *ctx, const uint8_t key[CHACHA20_KEY_SIZE]);
+void    chacha20poly1305_seal(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                              const uint8_t *aad, size_t aad_len,
+                              uint8_t *buf, size_t len, uint8_t tag[POLY1305_TAG_SIZE]);
+int     chacha20poly1305_open(const chacha20poly1305_t *ctx, const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                              const uint8_t *aad, size_t aad_len,
+                              const uint8_t *in, size_t len, const uint8_t tag[POLY1305_TAG_SIZE],
+                              uint8_t *out);
+
+
+#endif /* CHACHA20POLY1305_H_ */
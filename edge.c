@@ -26,6 +26,14 @@
 #include "n2n.h"
 #include "n2n_transforms.h"
 #include "n2n_net.h"
+#include "n2n_batch.h"
+#include "n2n_vnet.h"
+#include "n2n_compress.h"
+#include "n2n_hc.h"
+#include "n2n_bundle.h"
+#include "n2n_evloop.h"
+#include "n2n_ring.h"
+#include "n2n_peer_table.h"
 #include <assert.h>
 #include <sys/stat.h>
 #include "minilzo.h"
@@ -33,6 +41,17 @@
 #include "sn_multiple.h"
 #endif
 
+#if defined(__linux__) && defined(N2N_HAVE_RING)
+#define N2N_HAVE_PIPELINE 1 /* TAP reader, crypto workers and UDP I/O in separate threads */
+#include <poll.h>
+#include <semaphore.h>
+#endif
+
+#ifdef __linux__
+#define N2N_HAVE_BUNDLE_TIMER 1 /* bundle deadlines in microseconds through a timerfd */
+#include <sys/timerfd.h>
+#endif
+
 #if defined(DEBUG)
 #define SOCKET_TIMEOUT_INTERVAL_SECS    5
 #define REGISTER_SUPER_INTERVAL_DFL     20 /* sec */
@@ -56,6 +75,11 @@
 #define N2N_PATHNAME_MAXLEN             256
 #define N2N_MAX_TRANSFORMS              16
 #define N2N_EDGE_MGMT_PORT              5644
+#define N2N_EDGE_BATCH_DFL              1    /* datagrams per system call; 1 disables batching */
+#define N2N_EDGE_WORKERS_MAX            16   /* upper bound for the TAP queue and crypto thread options */
+#define N2N_PIPE_PKTS                   512  /* packets in flight per direction in pipelined mode */
+#define N2N_EDGE_PEERS_MAX              1024 /* size of each peer table; the least recently seen peer is evicted beyond */
+#define N2N_EDGE_BUNDLE_USEC_MAX        100000 /* longest wait of a frame in a bundle */
 
 /** Positions in the transop array where various transforms are stored.
  *
@@ -64,6 +88,8 @@
 #define N2N_TRANSOP_NULL_IDX    0
 #define N2N_TRANSOP_TF_IDX      1
 #define N2N_TRANSOP_AESCBC_IDX  2
+#define N2N_TRANSOP_AESGCM_IDX  3
+#define N2N_TRANSOP_CHACHA20_IDX 4
 /* etc. */
 
 
@@ -91,6 +117,147 @@ typedef char n2n_sn_name_t[N2N_EDGE_SN_HOST_SIZE];
 #define N2N_EDGE_SUP_ATTEMPTS   3       /* Number of failed attmpts before moving on to next supernode. */
 
 
+/* The peer lists and supernode state are shared with the worker threads. The
+ * data path takes the read side; control messages, timers and management take
+ * the write side. */
+#ifndef WIN32
+#define EDGE_PEERS_RDLOCK(eee)  pthread_rwlock_rdlock(&((eee)->peers_lock))
+#define EDGE_PEERS_WRLOCK(eee)  pthread_rwlock_wrlock(&((eee)->peers_lock))
+#define EDGE_PEERS_UNLOCK(eee)  pthread_rwlock_unlock(&((eee)->peers_lock))
+#else
+#define EDGE_PEERS_RDLOCK(eee)
+#define EDGE_PEERS_WRLOCK(eee)
+#define EDGE_PEERS_UNLOCK(eee)
+#endif
+
+struct n2n_edge;
+
+#define N2N_EDGE_TX_FLOWS       64      /* Tx flow cache entries per worker. Power of 2. */
+
+/** Cached Tx path to one destination MAC.
+ *
+ *  Holds the PACKET header and the socket address for frames to mac, so the
+ *  Tx path needs no peer lookup, header encoding or address conversion while
+ *  the entry is valid. An entry is valid while peers_gen equals
+ *  eee->peers_gen and until the transforms in use change.
+ */
+struct n2n_tx_flow
+{
+    n2n_mac_t           mac;
+    uint16_t            transform;
+    uint8_t             transop_idx;            /**< The transop of transform. */
+    uint8_t             to_peer;                /**< Non-zero: P2P. Zero: via the supernode. */
+    uint8_t             options;                /**< N2N_OPTION_* the peer accepts. Non-zero: an options octet ends hdr. */
+    uint8_t             hdr_len;
+    unsigned int        peers_gen;              /**< 0 if the entry is unused. */
+    struct sockaddr_in  addr;
+    uint8_t             hdr[N2N_PKT_HEADROOM];
+};
+
+/** Data-plane state owned by one thread.
+ *
+ *  Worker 0 runs in the main thread next to the control plane. With a
+ *  multi-queue TAP device every further worker runs in its own thread with
+ *  its own TAP queue, a UDP socket sharing the edge port and private
+ *  transform contexts.
+ */
+struct n2n_edge_worker
+{
+    struct n2n_edge    *eee;
+    size_t              id;
+    tuntap_dev          device;                 /**< Copy of eee->device holding this worker's queue fd. */
+    int                 udp_sock;
+
+    n2n_rx_batch_t      rx_batch;               /**< Receive slots for udp_sock. */
+    size_t              rx_slot;                /**< Slot of the datagram being processed. */
+    n2n_trans_buf_t    *rx_decoded;             /**< One per Rx slot: PACKET payloads decoded ahead, from slot rx_first on. */
+    size_t              rx_first;
+    size_t              rx_ndecoded;            /**< 0 outside readFromIPSocket(). */
+    n2n_tx_batch_t      tx_batch;               /**< PACKETs waiting to be sent on udp_sock. */
+
+    n2n_trans_op_t      transop[N2N_MAX_TRANSFORMS]; /* one for each transform at fixed positions */
+    size_t              tx_transop_idx;         /**< The transop to use when encoding. */
+    size_t              tx_fallback_idx;        /**< The transop for peers without AES-GCM keys. */
+    n2n_compress_t      compress;               /**< Codec work memory and counters. */
+    n2n_hc_t            hc;                     /**< Header compression contexts and counters. */
+    n2n_bundler_t       bundler;                /**< Bundles of small frames waiting to be sent. */
+    int                 bundle_fd;              /**< timerfd firing when a bundle is due; -1 if none. */
+    uint64_t            bundle_armed;           /**< Deadline bundle_fd is armed for; 0 if disarmed. */
+    unsigned int        key_gen;                /**< Value of eee->key_gen the keyschedule was read at. */
+
+    struct n2n_tx_flow *tx_flows;               /**< N2N_EDGE_TX_FLOWS, indexed by a hash of the destination MAC. */
+
+    /* Statistics */
+    size_t              tx_flow_hits;
+    size_t              tx_flow_misses;
+    size_t              tx_p2p;
+    size_t              rx_p2p;
+    size_t              tx_sup;
+    size_t              rx_sup;
+
+#ifndef WIN32
+    pthread_t           thread;
+#endif
+};
+
+typedef struct n2n_edge_worker n2n_edge_worker_t;
+
+#ifdef N2N_HAVE_PIPELINE
+/** A frame or PACKET handed between the threads of the pipelined data plane. */
+struct n2n_pipe_pkt
+{
+    uint8_t            *buf;                    /**< N2N_PKT_BUF_SIZE bytes */
+    uint8_t            *data;                   /**< Frame or PACKET payload within buf. */
+    int                 len;                    /**< Bytes at data; -1 once a job has failed. */
+    int                 tx;                     /**< Non-zero: TAP frame to encode. Zero: payload to decode. */
+    int                 transop_idx;            /**< Rx: the transop to decode with. */
+    int                 codec;                  /**< Rx: the codec to decompress with after decoding. */
+    uint8_t             options;                /**< Rx: N2N_OPTION_* of the PACKET. */
+    n2n_mac_t           src;                    /**< Rx: the edge which sent it. */
+    struct sockaddr_in  addr;                   /**< Tx: where the PACKET goes. */
+    int                 done;                   /**< Set by the crypto worker. Accessed atomically. */
+};
+
+/** Pipelined data plane.
+ *
+ *  A TAP reader thread feeds frames to a pool of crypto workers. The main
+ *  thread does all UDP I/O: it feeds received payloads to the same pool and,
+ *  woken through wake_fd, sends encoded PACKETs and writes decoded frames to
+ *  the TAP device. Each direction keeps its packets in a FIFO (tx_order,
+ *  rx_order) from which they are only taken once done, so packets leave in
+ *  the order they arrived whichever worker handled them.
+ */
+struct n2n_edge_pipe
+{
+    n2n_edge_worker_t   crypto[N2N_EDGE_WORKERS_MAX]; /**< Transforms and statistics of each crypto thread. */
+
+    struct n2n_pipe_pkt *pkts;                  /**< N2N_PIPE_PKTS for Tx followed by as many for Rx. */
+    uint8_t            *bufs;
+
+    n2n_spsc_ring_t     tx_free;                /**< Main thread -> TAP reader. */
+    sem_t               tx_free_sem;            /**< Counts tx_free. */
+    n2n_spsc_ring_t     tx_order;               /**< TAP reader -> main thread. */
+    n2n_spsc_ring_t     rx_order;               /**< Main thread only. */
+    struct n2n_pipe_pkt *rx_free[N2N_PIPE_PKTS]; /**< Main thread only. */
+    size_t              num_rx_free;
+
+    n2n_mpmc_ring_t     jobs;                   /**< TAP reader and main thread -> crypto workers. */
+    sem_t               jobs_sem;               /**< Counts jobs. */
+
+    int                 wake_fd[2];             /**< Written by a crypto worker when a job is done. */
+    int                 wake_pending;           /**< A wakeup has been written and not yet seen. */
+
+    struct n2n_pipe_pkt *held[N2N_BATCH_MAX];   /**< Queued in the Tx batch, released when it is flushed. */
+    size_t              num_held;
+
+    volatile int        running;
+    pthread_t           tap_thread;
+
+    /* Statistics */
+    size_t              rx_drops;               /**< Datagrams dropped with no free Rx packet. */
+};
+#endif
+
 /** Main structure type for edge. */
 struct n2n_edge
 {
@@ -106,21 +273,38 @@ struct n2n_edge
 
     n2n_community_t     community_name;         /**< The community. 16 full octets. */
     char                keyschedule[N2N_PATHNAME_MAXLEN];
+    const char         *encrypt_key;            /**< Twofish key when no keyschedule is used. */
+    volatile unsigned int key_gen;              /**< Bumped each time the keyschedule is reloaded. */
     int                 null_transop;           /**< Only allowed if no key sources defined. */
+    int                 compress_codec;         /**< Codec for outgoing frames; N2N_COMPRESS_NONE for none. */
+    uint8_t             options;                /**< N2N_OPTION_* offered to peers. */
+    int                 bundle_usec;            /**< Longest a frame waits in a bundle; -1 if not bundling. */
 
     int                 udp_sock;
     int                 udp_mgmt_sock;          /**< socket for status info. */
 
+    size_t              batch_size;             /**< Max datagrams moved per system call. */
+
+    size_t              num_workers;            /**< TAP queues, each served by one worker. */
+    n2n_edge_worker_t   workers[N2N_EDGE_WORKERS_MAX];
+    volatile int        workers_running;
+
+    size_t              num_crypto;             /**< Crypto threads of the pipelined data plane; 0 when not pipelined. */
+#ifdef N2N_HAVE_PIPELINE
+    struct n2n_edge_pipe pipeline;
+#endif
+#ifndef WIN32
+    pthread_rwlock_t    peers_lock;             /**< See EDGE_PEERS_RDLOCK(). */
+#endif
+    volatile unsigned int peers_gen;            /**< Bumped when a peer or supernode address changes. Never 0. */
+
     tuntap_dev          device;                 /**< All about the TUNTAP device */
     int                 dyn_ip_mode;            /**< Interface IP address is dynamically allocated, eg. DHCP. */
     int                 allow_routing;          /**< Accept packet no to interface address. */
     int                 drop_multicast;         /**< Multicast ethernet addresses. */
 
-    n2n_trans_op_t      transop[N2N_MAX_TRANSFORMS]; /* one for each transform at fixed positions */
-    size_t              tx_transop_idx;         /**< The transop to use when encoding. */
-
-    struct n2n_list     known_peers;            /**< Edges we are connected to. */
-    struct n2n_list     pending_peers;          /**< Edges we have tried to register with. */
+    n2n_peer_table_t    known_peers;            /**< Edges we are connected to. */
+    n2n_peer_table_t    pending_peers;          /**< Edges we have tried to register with. */
     time_t              last_register_req;      /**< Check if time to re-register with super*/
     size_t              register_lifetime;      /**< Time distance after last_register_req at which to re-register. */
     time_t              last_p2p;               /**< Last time p2p traffic was received. */
@@ -130,12 +314,6 @@ struct n2n_edge
 
     time_t              start_time;             /**< For calculating uptime */
 
-    /* Statistics */
-    size_t              tx_p2p;
-    size_t              rx_p2p;
-    size_t              tx_sup;
-    size_t              rx_sup;
-
 #ifdef N2N_MULTIPLE_SUPERNODES
     uint8_t             snm_discovery_state;
     int                 snm_sock;
@@ -152,9 +330,14 @@ static const char *supernode_ip(const n2n_edge_t *eee)
 
 static void supernode2addr(n2n_sock_t *sn, const n2n_sn_name_t addr);
 
-static void send_packet2net(n2n_edge_t *eee,
+static void send_packet2net(n2n_edge_t *eee, n2n_edge_worker_t *w,
 	        uint8_t *decrypted_msg, size_t len);
 
+#ifdef N2N_HAVE_PIPELINE
+static int edge_pipe_submit_rx(n2n_edge_t *eee, n2n_edge_worker_t *w, const n2n_PACKET_t *pkt,
+                               int transop_idx, int codec, uint8_t *payload, size_t psize);
+#endif
+
 
 /* ************************************** */
 
@@ -304,6 +487,56 @@ static char **buildargv(int *effectiveargc, char * const linebuffer)
 /* ************************************** */
 
 
+/** Initialise the transform operation opstructs and the Tx flows of a worker.
+ *
+ *  @return 0 on success, -1 if out of memory
+ */
+static int edge_worker_init(n2n_edge_t *eee, n2n_edge_worker_t *w, size_t id)
+{
+    w->eee = eee;
+    w->id = id;
+    w->device.fd = -1;
+    w->udp_sock = -1;
+    w->bundle_fd = -1;
+
+    transop_null_init(&(w->transop[N2N_TRANSOP_NULL_IDX]));
+    transop_twofish_init(&(w->transop[N2N_TRANSOP_TF_IDX]));
+    transop_aes_init(&(w->transop[N2N_TRANSOP_AESCBC_IDX]));
+    transop_aesgcm_init(&(w->transop[N2N_TRANSOP_AESGCM_IDX]));
+    transop_chacha20_init(&(w->transop[N2N_TRANSOP_CHACHA20_IDX]));
+    hc_init(&w->hc, id);
+
+    w->tx_transop_idx = N2N_TRANSOP_NULL_IDX; /* No guarantee the others have been setup */
+    w->tx_fallback_idx = N2N_TRANSOP_NULL_IDX;
+
+    w->tx_flows = (struct n2n_tx_flow *) calloc(N2N_EDGE_TX_FLOWS, sizeof(struct n2n_tx_flow));
+    if (NULL == w->tx_flows)
+    {
+        traceError("worker %u: failed to allocate the Tx flows", (unsigned int) id);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Allocate the Rx and Tx batches of a worker, and the decode results of
+ *  each Rx slot, for eee->batch_size datagrams.
+ *
+ *  @return 0 on success, -1 if out of memory
+ */
+static int edge_worker_setup_batches(n2n_edge_t *eee, n2n_edge_worker_t *w)
+{
+    if ((rx_batch_init(&w->rx_batch, eee->batch_size, N2N_PKT_BUF_SIZE) < 0) ||
+        (tx_batch_init(&w->tx_batch, w->udp_sock, eee->batch_size, N2N_PKT_BUF_SIZE) < 0) ||
+        (NULL == (w->rx_decoded = (n2n_trans_buf_t *) calloc(eee->batch_size, sizeof(n2n_trans_buf_t)))))
+    {
+        traceError("Failed to allocate batch of %u datagrams", (unsigned int) eee->batch_size);
+        return -1;
+    }
+
+    return 0;
+}
+
 /** Initialise an edge to defaults.
  *
  *  This also initialises the NULL transform operation opstruct.
@@ -314,13 +547,17 @@ static int edge_init(n2n_edge_t *eee)
     initWin32();
 #endif
     memset(eee, 0, sizeof(n2n_edge_t));
-    eee->start_time = time(NULL);
-
-    transop_null_init(&(eee->transop[N2N_TRANSOP_NULL_IDX]));
-    transop_twofish_init(&(eee->transop[N2N_TRANSOP_TF_IDX]));
-    transop_aes_init(&(eee->transop[N2N_TRANSOP_AESCBC_IDX]));
+    eee->start_time = n2n_now();
 
-    eee->tx_transop_idx = N2N_TRANSOP_NULL_IDX; /* No guarantee the others have been setup */
+    eee->num_workers = 1;
+    if (edge_worker_init(eee, &(eee->workers[0]), 0) < 0)
+    {
+        return (-1);
+    }
+#ifndef WIN32
+    pthread_rwlock_init(&(eee->peers_lock), NULL);
+#endif
+    eee->peers_gen = 1;
 
     eee->daemon = 1; /* By default run in daemon mode. */
     eee->re_resolve_supernode_ip = 0;
@@ -329,11 +566,16 @@ static int edge_init(n2n_edge_t *eee)
     eee->null_transop        = 0;
     eee->udp_sock            = -1;
     eee->udp_mgmt_sock       = -1;
+    eee->batch_size          = N2N_EDGE_BATCH_DFL;
     eee->dyn_ip_mode         = 0;
     eee->allow_routing       = 0;
     eee->drop_multicast      = 1;
-    list_init(&eee->known_peers);
-    list_init(&eee->pending_peers);
+    eee->bundle_usec         = -1;
+    if ((peer_table_init(&eee->known_peers, N2N_EDGE_PEERS_MAX) < 0) ||
+        (peer_table_init(&eee->pending_peers, N2N_EDGE_PEERS_MAX) < 0))
+    {
+        return (-1);
+    }
     eee->last_register_req   = 0;
     eee->register_lifetime   = REGISTER_SUPER_INTERVAL_DFL;
     eee->last_p2p            = 0;
@@ -358,9 +600,9 @@ static int edge_init(n2n_edge_t *eee)
 
 
 /* Called in main() after options are parsed. */
-static int edge_init_twofish(n2n_edge_t *eee, uint8_t *encrypt_pwd, uint32_t encrypt_pwd_len)
+static int edge_init_twofish(n2n_edge_worker_t *w, uint8_t *encrypt_pwd, uint32_t encrypt_pwd_len)
 {
-    return transop_twofish_setup(&(eee->transop[N2N_TRANSOP_TF_IDX]), 0, encrypt_pwd, encrypt_pwd_len);
+    return transop_twofish_setup(&(w->transop[N2N_TRANSOP_TF_IDX]), 0, encrypt_pwd, encrypt_pwd_len);
 }
 
 
@@ -381,6 +623,12 @@ static int transop_enum_to_index(n2n_transform_t id)
     case N2N_TRANSFORM_ID_AESCBC:
         return N2N_TRANSOP_AESCBC_IDX;
         break;
+    case N2N_TRANSFORM_ID_AESGCM:
+        return N2N_TRANSOP_AESGCM_IDX;
+        break;
+    case N2N_TRANSFORM_ID_CHACHA20:
+        return N2N_TRANSOP_CHACHA20_IDX;
+        break;
     default:
         return -1;
     }
@@ -388,33 +636,69 @@ static int transop_enum_to_index(n2n_transform_t id)
 
 
 /** Called periodically to roll keys and do any periodic maintenance in the
- *  tranform operations state machines. */
-static int n2n_tick_transop(n2n_edge_t *eee, time_t now)
+ *  tranform operations state machines.
+ *
+ *  AES-GCM is preferred over the others, but only peers holding AES-GCM keys
+ *  as well are sent it; the rest get the best of the others which can be
+ *  used, the fallback. Of those ChaCha20-Poly1305 is preferred, being
+ *  authenticated and the fastest without AES instructions. */
+static int n2n_tick_transop(n2n_edge_worker_t *w, time_t now)
 {
     n2n_tostat_t tst;
-    size_t trop = eee->tx_transop_idx;
+    size_t trop = w->tx_transop_idx;
+    size_t fallback;
+    size_t i;
 
     /* Tests are done in order that most preferred transform is last and causes
      * tx_transop_idx to be left at most preferred valid transform. */
-    tst = (eee->transop[N2N_TRANSOP_NULL_IDX].tick)(&(eee->transop[N2N_TRANSOP_NULL_IDX]), now);
-    tst = (eee->transop[N2N_TRANSOP_AESCBC_IDX].tick)(&(eee->transop[N2N_TRANSOP_AESCBC_IDX]), now);
+    tst = (w->transop[N2N_TRANSOP_NULL_IDX].tick)(&(w->transop[N2N_TRANSOP_NULL_IDX]), now);
+    tst = (w->transop[N2N_TRANSOP_AESCBC_IDX].tick)(&(w->transop[N2N_TRANSOP_AESCBC_IDX]), now);
     if (tst.can_tx)
     {
         traceDebug("can_tx AESCBC (idx=%u)", (unsigned int) N2N_TRANSOP_AESCBC_IDX);
         trop = N2N_TRANSOP_AESCBC_IDX;
     }
 
-    tst = (eee->transop[N2N_TRANSOP_TF_IDX].tick)(&(eee->transop[N2N_TRANSOP_TF_IDX]), now);
+    tst = (w->transop[N2N_TRANSOP_TF_IDX].tick)(&(w->transop[N2N_TRANSOP_TF_IDX]), now);
     if (tst.can_tx)
     {
         traceDebug("can_tx TF (idx=%u)", (unsigned int) N2N_TRANSOP_TF_IDX);
         trop = N2N_TRANSOP_TF_IDX;
     }
 
-    if (trop != eee->tx_transop_idx)
+    tst = (w->transop[N2N_TRANSOP_CHACHA20_IDX].tick)(&(w->transop[N2N_TRANSOP_CHACHA20_IDX]), now);
+    if (tst.can_tx)
+    {
+        traceDebug("can_tx CHACHA20 (idx=%u)", (unsigned int) N2N_TRANSOP_CHACHA20_IDX);
+        trop = N2N_TRANSOP_CHACHA20_IDX;
+    }
+
+    fallback = trop;
+
+    tst = (w->transop[N2N_TRANSOP_AESGCM_IDX].tick)(&(w->transop[N2N_TRANSOP_AESGCM_IDX]), now);
+    if (tst.can_tx)
+    {
+        traceDebug("can_tx AESGCM (idx=%u)", (unsigned int) N2N_TRANSOP_AESGCM_IDX);
+        trop = N2N_TRANSOP_AESGCM_IDX;
+
+        if (N2N_TRANSOP_NULL_IDX == fallback)
+        {
+            fallback = trop; /* only AES-GCM keys: every peer must have them */
+        }
+    }
+
+    if ((trop != w->tx_transop_idx) || (fallback != w->tx_fallback_idx))
     {
-        eee->tx_transop_idx = trop;
-        traceNormal("Chose new tx_transop_idx=%u", (unsigned int) (eee->tx_transop_idx));
+        w->tx_transop_idx = trop;
+        w->tx_fallback_idx = fallback;
+        traceNormal("Chose new tx_transop_idx=%u fallback=%u",
+                    (unsigned int) (w->tx_transop_idx), (unsigned int) (w->tx_fallback_idx));
+
+        /* The flows hold the transform they were set up with. */
+        for (i = 0; i < N2N_EDGE_TX_FLOWS; ++i)
+        {
+            w->tx_flows[i].peers_gen = 0;
+        }
     }
 
     return 0;
@@ -428,7 +712,7 @@ static int n2n_tick_transop(n2n_edge_t *eee, time_t now)
  *  encoding can be passed to the correct trans_op. The trans_op internal table
  *  will then determine the best SA for that trans_op from the key schedule to
  *  use for encoding. */
-static int edge_init_keyschedule(n2n_edge_t *eee)
+static int edge_init_keyschedule(n2n_edge_t *eee, n2n_edge_worker_t *w)
 {
 
 #define N2N_NUM_CIPHERSPECS 32
@@ -439,6 +723,12 @@ static int edge_init_keyschedule(n2n_edge_t *eee)
     size_t i;
     time_t now = time(NULL);
 
+    if (0 == w->id)
+    {
+        /* Offered again below only if the keyfile still holds AES-GCM keys. */
+        eee->options &= ~N2N_OPTION_AESGCM;
+    }
+
     numSpecs = n2n_read_keyfile(specs, N2N_NUM_CIPHERSPECS, eee->keyschedule);
 
     if (numSpecs > 0)
@@ -453,11 +743,13 @@ static int edge_init_keyschedule(n2n_edge_t *eee)
 
             switch (idx)
             {
+            case N2N_TRANSOP_AESGCM_IDX:
             case N2N_TRANSOP_TF_IDX:
             case N2N_TRANSOP_AESCBC_IDX:
+            case N2N_TRANSOP_CHACHA20_IDX:
             {
-                retval = (eee->transop[idx].addspec)(&(eee->transop[idx]),
-                                                     &(specs[i]));
+                retval = (w->transop[idx].addspec)(&(w->transop[idx]),
+                                                   &(specs[i]));
                 break;
             }
             default:
@@ -472,9 +764,15 @@ static int edge_init_keyschedule(n2n_edge_t *eee)
 
                 return retval;
             }
+
+            if ((N2N_TRANSOP_AESGCM_IDX == idx) && (0 == w->id))
+            {
+                eee->options |= N2N_OPTION_AESGCM; /* offered to peers in REGISTER */
+            }
         }
 
-        n2n_tick_transop(eee, now);
+        n2n_tick_transop(w, now);
+        w->key_gen = eee->key_gen;
     }
     else
     {
@@ -485,9 +783,128 @@ static int edge_init_keyschedule(n2n_edge_t *eee)
 }
 
 
+/** Set up the transforms of a worker from the key source given on the
+ *  command line: a keyschedule file, a twofish key or none (NULL transform).
+ */
+static int edge_worker_setup_transops(n2n_edge_t *eee, n2n_edge_worker_t *w)
+{
+    if (eee->encrypt_key)
+    {
+        if (edge_init_twofish(w, (uint8_t *) (eee->encrypt_key), strlen(eee->encrypt_key)) < 0)
+        {
+            traceError("twofish setup failed");
+            return -1;
+        }
+    }
+    else if (strlen(eee->keyschedule) > 0)
+    {
+        if (edge_init_keyschedule(eee, w) != 0)
+        {
+            traceError("keyschedule setup failed");
+            return -1;
+        }
+    }
+    /* else run in NULL mode */
+
+    return 0;
+}
+
+
+/** With batching, let the kernel segment runs of PACKETs to one peer on
+ *  send (UDP GSO) and coalesce runs from one peer on receive (UDP GRO).
+ *  Either is skipped quietly where the kernel lacks it. */
+static void edge_worker_setup_offload(n2n_edge_worker_t *w)
+{
+    if (w->rx_batch.size < 2)
+    {
+        return;
+    }
+
+    if (0 == tx_batch_enable_gso(&w->tx_batch))
+    {
+        traceInfo("UDP GSO enabled on socket %d", w->udp_sock);
+    }
+
+    if (0 == rx_batch_enable_gro(&w->rx_batch, w->udp_sock))
+    {
+        traceInfo("UDP GRO enabled on socket %d", w->udp_sock);
+    }
+}
+
+
+/** With -A, let w bundle small frames, into bundles no larger than a frame
+ *  of the MTU. Their deadline is kept by a timerfd where there is one; else
+ *  bundles are sent at the end of each wakeup. */
+static void edge_worker_setup_bundles(n2n_edge_t *eee, n2n_edge_worker_t *w)
+{
+    if (eee->bundle_usec < 0)
+    {
+        return;
+    }
+
+    bundle_init(&w->bundler, eee->device.mtu + sizeof(ether_hdr_t));
+
+#ifdef N2N_HAVE_BUNDLE_TIMER
+    if (eee->bundle_usec > 0)
+    {
+        w->bundle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (w->bundle_fd < 0)
+        {
+            traceWarning("timerfd unavailable (%s), bundles are sent at the end of each wakeup",
+                         strerror(errno));
+        }
+    }
+#endif
+}
+
+
+/** Release what a worker owns. Its thread must have finished. */
+static void edge_worker_deinit(n2n_edge_worker_t *w)
+{
+    if (w->id > 0)
+    {
+        /* Worker 0 uses the main socket and device; they are closed with the edge. */
+        if (w->udp_sock >= 0)
+        {
+            closesocket(w->udp_sock);
+        }
+
+#ifndef WIN32
+        if (w->device.fd >= 0)
+        {
+            tuntap_close(&(w->device));
+        }
+#endif
+    }
+
+    rx_batch_deinit(&w->rx_batch);
+    tx_batch_deinit(&w->tx_batch);
+    free(w->rx_decoded);
+    free(w->tx_flows);
+    compress_deinit(&w->compress);
+    hc_deinit(&w->hc);
+    bundle_deinit(&w->bundler);
+
+#ifdef N2N_HAVE_BUNDLE_TIMER
+    if (w->bundle_fd >= 0)
+    {
+        close(w->bundle_fd);
+    }
+#endif
+
+    (w->transop[N2N_TRANSOP_CHACHA20_IDX].deinit)(&w->transop[N2N_TRANSOP_CHACHA20_IDX]);
+    (w->transop[N2N_TRANSOP_AESGCM_IDX].deinit)(&w->transop[N2N_TRANSOP_AESGCM_IDX]);
+    (w->transop[N2N_TRANSOP_AESCBC_IDX].deinit)(&w->transop[N2N_TRANSOP_AESCBC_IDX]);
+    (w->transop[N2N_TRANSOP_TF_IDX].deinit)(&w->transop[N2N_TRANSOP_TF_IDX]);
+    (w->transop[N2N_TRANSOP_NULL_IDX].deinit)(&w->transop[N2N_TRANSOP_NULL_IDX]);
+}
+
+
 /** Deinitialise the edge and deallocate any owned memory. */
 static void edge_deinit(n2n_edge_t *eee)
 {
+    size_t i;
+
     if (eee->udp_sock >= 0)
     {
         closesocket( eee->udp_sock);
@@ -498,11 +915,17 @@ static void edge_deinit(n2n_edge_t *eee)
         closesocket(eee->udp_mgmt_sock);
     }
 
-    list_clear(&eee->pending_peers);
-    list_clear(&eee->known_peers);
+    for (i = 0; i < eee->num_workers; ++i)
+    {
+        edge_worker_deinit(&(eee->workers[i]));
+    }
+
+    peer_table_deinit(&eee->pending_peers);
+    peer_table_deinit(&eee->known_peers);
 
-    (eee->transop[N2N_TRANSOP_TF_IDX].deinit)(&eee->transop[N2N_TRANSOP_TF_IDX]);
-    (eee->transop[N2N_TRANSOP_NULL_IDX].deinit)(&eee->transop[N2N_TRANSOP_NULL_IDX]);
+#ifndef WIN32
+    pthread_rwlock_destroy(&(eee->peers_lock));
+#endif
 
 #ifdef N2N_MULTIPLE_SUPERNODES
     if (eee->snm_sock >= 0)
@@ -515,7 +938,7 @@ static void edge_deinit(n2n_edge_t *eee)
 #endif
 }
 
-static void readFromIPSocket(n2n_edge_t *eee);
+static void readFromIPSocket(n2n_edge_t *eee, n2n_edge_worker_t *w);
 
 static void readFromMgmtSocket(n2n_edge_t *eee, int *keep_running);
 
@@ -542,7 +965,7 @@ static void help()
 	 "\n"
 	 "-l <supernode host:port> "
 	 "[-p <local port>] [-M <mtu>] "
-	 "[-r] [-E] [-v] [-t <mgmt port>] [-b] [-h]\n\n");
+	 "[-r] [-E] [-v] [-t <mgmt port>] [-b] [-B <batch>] [-O] [-z[<codec>]] [-H] [-A <usec>] [-Q <queues>] [-P <threads>|auto] [-h]\n\n");
 
 #ifdef __linux__
   printf("-d <tun device>          | tun device name\n");
@@ -557,6 +980,27 @@ static void help()
   printf("-b                       | Periodically resolve supernode IP\n");
   printf("                         : (when supernodes are running on dynamic IPs)\n");
   printf("-p <local port>          | Fixed local UDP port.\n");
+  printf("-B <batch>               | Max datagrams moved per system call (default %d, max %d).\n",
+         N2N_EDGE_BATCH_DFL, N2N_BATCH_MAX);
+  printf("-z[<codec>]              | Compress frames worth it before encryption. Codec: lzo (default).\n");
+  printf("-H                       | Compress the IP/TCP/UDP headers of frames to peers which also use -H.\n");
+  printf("-A <usec>                | Bundle frames of up to %d bytes to peers which also use -A, each\n",
+         N2N_BUNDLE_FRAME_MAX);
+  printf("                         : waiting up to <usec> (max %d). 0: only frames read together.\n",
+         N2N_EDGE_BUNDLE_USEC_MAX);
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  printf("-O                       | TAP offloads: take large TCP frames from the kernel and give it\n");
+  printf("                         : coalesced ones (checksum offload and TSO through IFF_VNET_HDR).\n");
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+  printf("-Q <queues>              | Multi-queue TAP with one data-plane thread per queue (max %d).\n",
+         N2N_EDGE_WORKERS_MAX);
+#endif
+#ifdef N2N_HAVE_PIPELINE
+  printf("-P <threads>|auto        | Pipelined data plane with <threads> crypto threads (max %d),\n",
+         N2N_EDGE_WORKERS_MAX);
+  printf("                         : auto: sized from the CPU count, 0: off. Not with -Q.\n");
+#endif
 #ifndef WIN32
   printf("-u <UID>                 | User ID (numeric) to use when privileges are dropped.\n");
   printf("-g <GID>                 | Group ID (numeric) to use when privileges are dropped.\n");
@@ -591,8 +1035,9 @@ static void send_register(n2n_edge_t *eee,
     n2n_REGISTER_t reg;
     n2n_sock_str_t sockbuf;
 
-    init_cmn(&cmn, n2n_register, 0, eee->community_name);
+    init_cmn(&cmn, n2n_register, eee->options ? N2N_FLAGS_OPTIONS : 0, eee->community_name);
     memset(&reg, 0, sizeof(reg));
+    reg.options = eee->options;
 
     idx = 0;
     encode_uint32(reg.cookie, &idx, 123456789);
@@ -657,13 +1102,15 @@ static void send_register_ack(n2n_edge_t            *eee,
     n2n_common_t cmn;
     n2n_REGISTER_ACK_t ack;
     n2n_sock_str_t sockbuf;
+    uint8_t options = eee->options & reg->options; /* what both ends accept */
 
-    init_cmn(&cmn, n2n_register_ack, 0, eee->community_name);
+    init_cmn(&cmn, n2n_register_ack, options ? N2N_FLAGS_OPTIONS : 0, eee->community_name);
 
     memset(&ack, 0, sizeof(ack));
     memcpy(ack.cookie, reg->cookie, N2N_COOKIE_SIZE);
     memcpy(ack.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
     memcpy(ack.dstMac, reg->srcMac, N2N_MAC_SIZE);
+    ack.options = options;
 
     idx = 0;
     encode_REGISTER_ACK(pktbuf, &idx, &cmn, &ack);
@@ -701,7 +1148,8 @@ void try_send_register(n2n_edge_t *eee,
                        const n2n_sock_t *peer);
 void set_peer_operational(n2n_edge_t *eee,
                           const n2n_mac_t mac,
-                          const n2n_sock_t *peer);
+                          const n2n_sock_t *peer,
+                          uint8_t options);
 
 
 
@@ -724,26 +1172,23 @@ void try_send_register(n2n_edge_t *eee,
                        const n2n_sock_t *peer)
 {
     /* REVISIT: purge of pending_peers not yet done. */
-    struct peer_info *scan = find_peer_by_mac(&eee->pending_peers, mac);
+    struct peer_info *scan = peer_table_find(&eee->pending_peers, mac);
     macstr_t mac_buf;
     n2n_sock_str_t sockbuf;
 
     if (NULL == scan)
     {
-        scan = calloc(1, sizeof(struct peer_info));
+        /* last_seen is not changed after this; it marks the pending peer for removal. */
+        scan = peer_table_add(&eee->pending_peers, mac, n2n_now());
 
-        memcpy(scan->mac_addr, mac, N2N_MAC_SIZE);
         scan->sock = *peer;
-        scan->last_seen = time(NULL); /* Don't change this it marks the pending peer for removal. */
-
-        peer_list_add(&eee->pending_peers, scan);
 
         traceDebug("=== new pending %s -> %s",
                    macaddr_str(mac_buf, scan->mac_addr),
                    sock_to_cstr(sockbuf, &(scan->sock)));
 
         traceInfo("Pending peers list size=%u",
-                   (unsigned int) list_size(&eee->pending_peers));
+                   (unsigned int) peer_table_size(&eee->pending_peers));
 
         /* trace Sending REGISTER */
 
@@ -763,7 +1208,7 @@ void check_peer(n2n_edge_t *eee,
                 const n2n_mac_t mac,
                 const n2n_sock_t *peer)
 {
-    struct peer_info *scan = find_peer_by_mac(&eee->known_peers, mac);
+    struct peer_info *scan = peer_table_find(&eee->known_peers, mac);
 
     if (NULL == scan)
     {
@@ -773,22 +1218,62 @@ void check_peer(n2n_edge_t *eee,
     else
     {
         /* Already in known_peers. */
-        update_peer_address(eee, from_supernode, mac, peer, time(NULL));
+        update_peer_address(eee, from_supernode, mac, peer, n2n_now());
     }
 }
 
 
-/* Move the peer from the pending_peers list to the known_peers lists.
+/** Fast path of check_peer() for the data path: if mac is a known peer at the
+ *  same socket and already seen at now there is nothing to do. Refreshing
+ *  last_seen moves the peer on the expiry list, so that is left to
+ *  check_peer() under the write lock, at most once a second per peer.
  *
- * peer must be a pointer to an element of the pending_peers list.
+ *  @return 1 if nothing else needs doing, 0 if check_peer() must run under
+ *  the write lock
+ */
+static int touch_known_peer(n2n_edge_t *eee,
+                            const n2n_mac_t mac,
+                            const n2n_sock_t *peer,
+                            time_t now)
+{
+    struct peer_info *scan;
+    int retval = 0;
+
+    EDGE_PEERS_RDLOCK(eee);
+
+    scan = peer_table_find(&eee->known_peers, mac);
+    if ((NULL != scan) && (scan->last_seen == now) && (0 == sock_equal(&(scan->sock), peer)))
+    {
+        retval = 1;
+    }
+
+    EDGE_PEERS_UNLOCK(eee);
+
+    return retval;
+}
+
+
+/** Invalidate the Tx flow caches of all workers. Call with the peers write
+ *  lock held whenever a known peer or the supernode changes address. */
+static void edge_peers_changed(n2n_edge_t *eee)
+{
+    if (0 == ++(eee->peers_gen))
+    {
+        eee->peers_gen = 1;
+    }
+}
+
+
+/* Move the peer from the pending_peers table to the known_peers table.
+ * options are the N2N_OPTION_* both ends accept.
  *
  * Called by main loop when Rx a REGISTER_ACK.
  */
 void set_peer_operational(n2n_edge_t *eee,
                           const n2n_mac_t mac,
-                          const n2n_sock_t *peer)
+                          const n2n_sock_t *peer,
+                          uint8_t options)
 {
-    struct peer_info *prev = NULL;
     struct peer_info *scan;
     macstr_t mac_buf;
     n2n_sock_str_t sockbuf;
@@ -797,44 +1282,30 @@ void set_peer_operational(n2n_edge_t *eee,
                macaddr_str(mac_buf, mac),
                sock_to_cstr(sockbuf, peer));
 
-    N2N_LIST_FOR_EACH_ENTRY(scan, &eee->pending_peers)
-    {
-        if (0 == memcmp(scan->mac_addr, mac, N2N_MAC_SIZE))
-        {
-            break; /* found. */
-        }
-
-        prev = scan;
-    }
+    scan = peer_table_find(&eee->pending_peers, mac);
 
     if (scan)
     {
         /* Remove scan from pending_peers. */
-        if (prev)
-        {
-            prev->list = scan->list;
-        }
-        else
-        {
-            eee->pending_peers = scan->list;
-        }
+        peer_table_remove(&eee->pending_peers, scan);
 
-        /* Add scan to known_peers. */
-        list_add(&eee->known_peers, &scan->list);
+        /* Add to known_peers. */
+        scan = peer_table_add(&eee->known_peers, mac, n2n_now());
+        peer_table_touch(&eee->known_peers, scan, n2n_now()); /* in case it was there already */
 
         scan->sock = *peer;
+        scan->options = options;
+        edge_peers_changed(eee);
 
         traceDebug("=== new peer %s -> %s",
                    macaddr_str(mac_buf, scan->mac_addr),
                    sock_to_cstr(sockbuf, &(scan->sock)));
 
         traceInfo("Pending peers list size=%u",
-                   (unsigned int) list_size(&eee->pending_peers));
+                   (unsigned int) peer_table_size(&eee->pending_peers));
 
         traceInfo("Operational peers list size=%u",
-                   (unsigned int) list_size(&eee->known_peers));
-
-        scan->last_seen = time(NULL);
+                   (unsigned int) peer_table_size(&eee->known_peers));
     }
     else
     {
@@ -843,6 +1314,23 @@ void set_peer_operational(n2n_edge_t *eee,
 }
 
 
+/** Record the N2N_OPTION_* both ends accept, as a REGISTER from a known peer
+ *  says, so a peer restarted with other options is not sent what it no
+ *  longer reads. */
+static void set_peer_options(n2n_edge_t *eee,
+                             const n2n_mac_t mac,
+                             uint8_t options)
+{
+    struct peer_info *scan = peer_table_find(&eee->known_peers, mac);
+
+    if ((NULL != scan) && (scan->options != options))
+    {
+        scan->options = options;
+        edge_peers_changed(eee);
+    }
+}
+
+
 
 /** Keep the known_peers list straight.
  *
@@ -858,7 +1346,6 @@ static void update_peer_address(n2n_edge_t *eee,
                                 time_t when)
 {
     struct peer_info *scan = NULL;
-    struct peer_info *prev = NULL; /* use to remove bad registrations. */
     n2n_sock_str_t sockbuf1;
     n2n_sock_str_t sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
     macstr_t mac_buf;
@@ -875,15 +1362,7 @@ static void update_peer_address(n2n_edge_t *eee,
         return;
     }
 
-    N2N_LIST_FOR_EACH_ENTRY(scan, &eee->known_peers)
-    {
-        if (memcmp(mac, scan->mac_addr, N2N_MAC_SIZE) == 0)
-        {
-            break;
-        }
-
-        prev = scan;
-    }
+    scan = peer_table_find(&eee->known_peers, mac);
 
     if (NULL == scan)
     {
@@ -902,16 +1381,8 @@ static void update_peer_address(n2n_edge_t *eee,
 
             /* The peer has changed public socket. It can no longer be assumed to be reachable. */
             /* Remove the peer. */
-            if (NULL == prev)
-            {
-                /* scan was head of list */
-                eee->known_peers = scan->list;
-            }
-            else
-            {
-                prev->list = scan->list;
-            }
-            free(scan);
+            peer_table_remove(&eee->known_peers, scan);
+            edge_peers_changed(eee);
 
             try_send_register(eee, from_supernode, mac, peer);
         }
@@ -923,7 +1394,7 @@ static void update_peer_address(n2n_edge_t *eee,
     else
     {
         /* Found and unchanged. */
-        scan->last_seen = when;
+        peer_table_touch(&eee->known_peers, scan, when);
     }
 }
 
@@ -1184,7 +1655,7 @@ static void readFromSNMSocket(n2n_edge_t *eee)
     n2n_sock_str_t      sockbuf;
 
     size_t              i;
-    time_t              now = time(NULL);
+    time_t              now = n2n_now();
 
     i = sizeof(sender_sock);
     recvlen = recvfrom(eee->snm_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
@@ -1298,6 +1769,7 @@ static void readFromSNMSocket(n2n_edge_t *eee)
         if (eee->sn_num == 1)
         {
             supernode2addr(&eee->supernode, eee->sn_ip_array[eee->sn_idx]);
+            edge_peers_changed(eee);
 
             eee->reg_sn.sn = eee->supernode;
             eee->reg_sn.timestamp = 0;
@@ -1313,7 +1785,7 @@ static void readFromSNMSocket(n2n_edge_t *eee)
 
 /** @brief Check to see if we should re-register with the supernode.
  *
- *  This is frequently called by the main loop.
+ *  Called by the register timer, which sleeps until supernode_reg_due().
  */
 static void update_supernode_reg(n2n_edge_t *eee, time_t nowTime)
 {
@@ -1344,6 +1816,7 @@ static void update_supernode_reg(n2n_edge_t *eee, time_t nowTime)
             if (sn_cmp(&eee->supernode, &eee->reg_sn.sn) == 0)   /* supernode is the main one */
             {
                 supernode2addr(&(eee->supernode), eee->sn_ip_array[eee->sn_idx]);
+                edge_peers_changed(eee);
 
                 traceWarning("Changed active supernode to %s", eee->sn_ip_array[eee->sn_idx]);
             }
@@ -1372,6 +1845,7 @@ static void update_supernode_reg(n2n_edge_t *eee, time_t nowTime)
     if (eee->re_resolve_supernode_ip || (eee->sn_num > 1))
     {
         supernode2addr(&(eee->supernode), eee->sn_ip_array[eee->sn_idx]);
+        edge_peers_changed(eee);
     }
 
     send_register_super(eee, &(eee->supernode));
@@ -1388,12 +1862,25 @@ static void update_supernode_reg(n2n_edge_t *eee, time_t nowTime)
     eee->last_register_req = nowTime;
 }
 
+/** The time at which update_supernode_reg() next has work to do. */
+static time_t supernode_reg_due(const n2n_edge_t *eee)
+{
+    if (eee->sn_wait)
+    {
+        return eee->last_register_req + (eee->register_lifetime / 10) + 1;
+    }
+
+    return eee->last_register_req + eee->register_lifetime;
+}
+
 
 
-/* @return 1 if destination is a peer, 0 if destination is supernode */
+/* @return 1 if destination is a peer, 0 if destination is supernode. *options
+ * are set to the N2N_OPTION_* the peer accepts. */
 static int find_peer_destination(n2n_edge_t *eee,
                                  n2n_mac_t mac_address,
-                                 n2n_sock_t *destination)
+                                 n2n_sock_t *destination,
+                                 uint8_t *options)
 {
     const struct peer_info *scan = NULL;
     macstr_t mac_buf;
@@ -1404,19 +1891,15 @@ static int find_peer_destination(n2n_edge_t *eee,
                mac_address[0] & 0xFF, mac_address[1] & 0xFF, mac_address[2] & 0xFF,
                mac_address[3] & 0xFF, mac_address[4] & 0xFF, mac_address[5] & 0xFF);
 
-    N2N_LIST_FOR_EACH_ENTRY(scan, &eee->known_peers)
-    {
-        traceDebug("Evaluating peer [MAC=%02X:%02X:%02X:%02X:%02X:%02X]",
-                   scan->mac_addr[0] & 0xFF, scan->mac_addr[1] & 0xFF, scan->mac_addr[2] & 0xFF, 
-                   scan->mac_addr[3] & 0xFF, scan->mac_addr[4] & 0xFF, scan->mac_addr[5] & 0xFF);
+    scan = peer_table_find(&eee->known_peers, mac_address);
 
-        if ((scan->last_seen > 0) && 
-            (memcmp(mac_address, scan->mac_addr, N2N_MAC_SIZE) == 0))
-        {
-            memcpy(destination, &scan->sock, sizeof(n2n_sock_t));
-            retval = 1;
-            break;
-        }
+    *options = 0;
+
+    if ((NULL != scan) && (scan->last_seen > 0))
+    {
+        memcpy(destination, &scan->sock, sizeof(n2n_sock_t));
+        *options = scan->options;
+        retval = 1;
     }
 
     if (0 == retval)
@@ -1440,6 +1923,13 @@ static const struct option long_options[] = {
   { "community",       required_argument, NULL, 'c' },
   { "supernode-list",  required_argument, NULL, 'l' },
   { "tun-device",      required_argument, NULL, 'd' },
+  { "batch",           required_argument, NULL, 'B' },
+  { "offload",         no_argument,       NULL, 'O' },
+  { "compress",        optional_argument, NULL, 'z' },
+  { "header-compress", no_argument,       NULL, 'H' },
+  { "bundle",          required_argument, NULL, 'A' },
+  { "queues",          required_argument, NULL, 'Q' },
+  { "pipeline",        required_argument, NULL, 'P' },
   { "euid",            required_argument, NULL, 'u' },
   { "egid",            required_argument, NULL, 'g' },
   { "help"   ,         no_argument,       NULL, 'h' },
@@ -1450,36 +1940,36 @@ static const struct option long_options[] = {
 /* ***************************************************** */
 
 
-/** Send an ecapsulated ethernet PACKET to a destination edge or broadcast MAC
- *  address. */
-static int send_PACKET(n2n_edge_t *eee,
-                       n2n_mac_t dstMac,
-                       const uint8_t *pktbuf,
-                       size_t pktlen)
+/** Count a PACKET sent along flow in the path statistics of w. */
+static void edge_count_tx(n2n_edge_worker_t *w, const struct n2n_tx_flow *flow)
 {
-    int dest;
-    ssize_t s;
-    n2n_sock_str_t sockbuf;
-    n2n_sock_t destination;
-
-    /* hexdump( pktbuf, pktlen ); */
-
-    dest = find_peer_destination(eee, dstMac, &destination);
-
-    if (dest)
+    if (flow->to_peer)
     {
-        ++(eee->tx_p2p);
+        ++(w->tx_p2p);
     }
     else
     {
-        ++(eee->tx_sup);
+        ++(w->tx_sup);
     }
+}
 
-    traceInfo("send_PACKET to %s", sock_to_cstr(sockbuf, &destination));
 
-    s = sendto_sock(eee->udp_sock, pktbuf, pktlen, &destination);
+/** Send an ecapsulated ethernet PACKET along flow to a destination edge or
+ *  broadcast MAC address.
+ *
+ *  pktbuf must lie within the buffer returned by tx_batch_reserve(). The
+ *  PACKET is queued and goes out with the next flush of the transmit batch.
+ */
+static int send_PACKET(n2n_edge_worker_t *w,
+                       const struct n2n_tx_flow *flow,
+                       const uint8_t *pktbuf,
+                       size_t pktlen)
+{
+    /* hexdump( pktbuf, pktlen ); */
+
+    edge_count_tx(w, flow);
 
-    return 0;
+    return tx_batch_commit(&w->tx_batch, pktbuf, pktlen, &flow->addr);
 }
 
 
@@ -1490,36 +1980,47 @@ static int send_PACKET(n2n_edge_t *eee,
  * better to render edge inoperative than to expose user data in the clear. In
  * the case where all SAs are expired an arbitrary transform will be chosen for
  * Tx. It will fail having no valid SAs but one must be selected.
+ *
+ * options are the N2N_OPTION_* the destination accepts. AES-GCM goes only to
+ * destinations known to hold AES-GCM keys.
  */
-static size_t edge_choose_tx_transop(const n2n_edge_t *eee)
+static size_t edge_choose_tx_transop(const n2n_edge_t *eee, const n2n_edge_worker_t *w,
+                                     uint8_t options)
 {
     if (eee->null_transop)
     {
         return N2N_TRANSOP_NULL_IDX;
     }
 
-    return eee->tx_transop_idx;
+    if ((N2N_TRANSOP_AESGCM_IDX == w->tx_transop_idx) && (0 == (options & N2N_OPTION_AESGCM)))
+    {
+        return w->tx_fallback_idx;
+    }
+
+    return w->tx_transop_idx;
 }
 
 
-/** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
-static void send_packet2net(n2n_edge_t *eee,
-                            uint8_t *tap_pkt, size_t len)
+/** Decide whether a frame read from the TAP device goes to the community.
+ *
+ *  @return 1 to send the frame, 0 to drop it
+ */
+static int edge_tap_frame_wanted(const n2n_edge_t *eee, const uint8_t *eth_pkt, size_t len)
 {
     ipstr_t ip_buf;
-    n2n_mac_t destMac;
-
-    n2n_common_t cmn;
-    n2n_PACKET_t pkt;
-
-    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-    size_t idx = 0;
-    size_t tx_transop_idx = 0;
-
     ether_hdr_t eh;
 
-    /* tap_pkt is not aligned so we have to copy to aligned memory */
-    memcpy(&eh, tap_pkt, sizeof(ether_hdr_t));
+    if (eee->drop_multicast && 
+        (is_ipv6_multicast_mac(eth_pkt) ||
+         is_broadcast_mac(eth_pkt)/* ||
+         is_ethMulticast(eth_pkt, len)*/))
+    {
+        traceDebug("Dropping multicast");
+        return 0;
+    }
+
+    /* eth_pkt is not aligned so we have to copy to aligned memory */
+    memcpy(&eh, eth_pkt, sizeof(ether_hdr_t));
 
     /* Discard IP packets that are not originated by this hosts */
     if (!(eee->allow_routing))
@@ -1529,15 +2030,17 @@ static void send_packet2net(n2n_edge_t *eee,
             /* This is an IP packet from the local source address - not forwarded. */
 #define ETH_FRAMESIZE 14
 #define IP4_SRCOFFSET 12
-            uint32_t *dst = (uint32_t*) &tap_pkt[ETH_FRAMESIZE + IP4_SRCOFFSET];
+            uint32_t dst;
+
+            memcpy(&dst, &eth_pkt[ETH_FRAMESIZE + IP4_SRCOFFSET], sizeof(dst));
 
             /* Note: all elements of the_ip are in network order */
-            if (*dst != eee->device.ip_addr)
+            if (dst != eee->device.ip_addr)
             {
                 /* This is a packet that needs to be routed */
                 traceInfo("Discarding routed packet [%s]",
-                    intoa(ntohl(*dst), ip_buf, sizeof(ip_buf)));
-                return;
+                    intoa(ntohl(dst), ip_buf, sizeof(ip_buf)));
+                return 0;
             }
             else
             {
@@ -1547,1116 +2050,3213 @@ static void send_packet2net(n2n_edge_t *eee,
         }
     }
 
-    /* Optionally compress then apply transforms, eg encryption. */
+    return 1;
+}
+
 
-    /* Once processed, send to destination in PACKET */
+/** Look up the Tx flow of w for frames to mac, filling the entry on a miss
+ *  with the transform chosen for that destination.
+ *
+ *  @return the flow or NULL if the destination cannot be used
+ */
+static const struct n2n_tx_flow *edge_tx_flow(n2n_edge_t *eee, n2n_edge_worker_t *w,
+                                              const n2n_mac_t mac)
+{
+    uint32_t h;
+    struct n2n_tx_flow *flow;
+    unsigned int gen = eee->peers_gen;
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+    n2n_sock_t destination;
+    n2n_sock_str_t sockbuf;
+    size_t idx = 0;
+    size_t transop_idx;
 
-    memcpy(destMac, tap_pkt, N2N_MAC_SIZE); /* dest MAC is first in ethernet header */
+    memcpy(&h, mac + 2, sizeof(h)); /* the low four octets vary most */
+    flow = &(w->tx_flows[((h * 0x9E3779B1U) >> 16) & (N2N_EDGE_TX_FLOWS - 1)]);
 
-    /* no options, not from supernode, no socket */
-    init_cmn(&cmn, n2n_packet, 0, eee->community_name);
+    if ((flow->peers_gen == gen) && (0 == memcmp(flow->mac, mac, N2N_MAC_SIZE)))
+    {
+        ++(w->tx_flow_hits);
+        return flow;
+    }
 
-    memset(&pkt, 0, sizeof(pkt));
-    memcpy(pkt.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
-    memcpy(pkt.dstMac, destMac, N2N_MAC_SIZE);
+    ++(w->tx_flow_misses);
+    flow->peers_gen = 0;
 
-    tx_transop_idx = edge_choose_tx_transop(eee);
+    /* gen was read before the lookup, so a change in between leaves the entry
+     * stale rather than letting it outlive the change. */
+    memset(&destination, 0, sizeof(destination));
+    EDGE_PEERS_RDLOCK(eee);
+    flow->to_peer = find_peer_destination(eee, (uint8_t *) mac, &destination, &(flow->options));
+    EDGE_PEERS_UNLOCK(eee);
 
-    pkt.sock.family = 0; /* do not encode sock */
-    pkt.transform = eee->transop[tx_transop_idx].transform_id;
+    transop_idx = edge_choose_tx_transop(eee, w, flow->options);
 
-    idx = 0;
-    encode_PACKET(pktbuf, &idx, &cmn, &pkt);
-    traceDebug("encoded PACKET header of size=%u transform %u (idx=%u)",
-               (unsigned int) idx, (unsigned int) pkt.transform, (unsigned int) tx_transop_idx);
+    if (0 != fill_sockaddr((struct sockaddr *) &(flow->addr), &destination))
+    {
+        traceError("edge_tx_flow: unsupported address family %u", (unsigned int) destination.family);
+        return NULL;
+    }
 
-    idx += eee->transop[tx_transop_idx].fwd(&(eee->transop[tx_transop_idx]),
-                                            pktbuf + idx, N2N_PKT_BUF_SIZE - idx,
-                                            tap_pkt, len);
-    ++(eee->transop[tx_transop_idx].tx_cnt); /* stats */
+    /* Options only between peers which accept them. Not from supernode, no
+     * socket. */
+    init_cmn(&cmn, n2n_packet, flow->options ? N2N_FLAGS_OPTIONS : 0, eee->community_name);
 
-    send_PACKET(eee, destMac, pktbuf, idx); /* to peer or supernode */
-}
+    memset(&pkt, 0, sizeof(pkt));
+    memcpy(pkt.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+    memcpy(pkt.dstMac, mac, N2N_MAC_SIZE);
+    pkt.sock.family = 0; /* do not encode sock */
+    pkt.transform = w->transop[transop_idx].transform_id;
+
+    encode_PACKET(flow->hdr, &idx, &cmn, &pkt);
 
+    flow->hdr_len = idx;
+    flow->transform = pkt.transform;
+    flow->transop_idx = transop_idx;
+    memcpy(flow->mac, mac, N2N_MAC_SIZE);
+    flow->peers_gen = gen;
 
+    traceInfo("Tx flow to %s via %s, header of %u bytes",
+              sock_to_cstr(sockbuf, &destination), flow->to_peer ? "peer" : "supernode",
+              (unsigned int) idx);
 
+    return flow;
+}
 
 
-/** Read a single packet from the TAP interface, process it and write out the
- *  corresponding packet to the cooked socket.
+/** Count an encoding by op and put the PACKET header of flow in front of it
+ *  at enc, naming transform and options.
+ *
+ *  @return start of the PACKET
  */
-static void readFromTAPSocket(n2n_edge_t *eee)
+static uint8_t *edge_seal_header(n2n_trans_op_t *op, const struct n2n_tx_flow *flow,
+                                 n2n_transform_t transform, uint8_t options, uint8_t *enc)
 {
-    /* tun -> remote */
-    uint8_t    eth_pkt[N2N_PKT_BUF_SIZE];
-    macstr_t   mac_buf;
-    ssize_t    len;
+    size_t idx = flow->hdr_len;
+
+    ++(op->tx_cnt); /* stats */
 
-    len = tuntap_read(&(eee->device), eth_pkt, N2N_PKT_BUF_SIZE);
+    memcpy(enc - idx, flow->hdr, idx); /* header goes in front of the encoding */
 
-    if ((len <= 0) || (len > N2N_PKT_BUF_SIZE))
+    if (flow->options)
     {
-        traceWarning("read()=%d [%d/%s]",
-                   (signed int) len, errno, strerror(errno));
+        /* The options octet ends the header. */
+        (enc - idx)[idx - 1] = options;
     }
-    else
+
+    if (transform != flow->transform)
     {
-        const uint8_t *mac = eth_pkt;
-        traceInfo("### Rx TAP packet (%4d) for %s",
-            (signed int) len, macaddr_str(mac_buf, mac));
+        /* The flow is cached for its plain transform, which ends the header
+         * but for the options. */
+        size_t tidx = idx - sizeof(n2n_transform_t) - (flow->options ? 1 : 0);
 
-        if (eee->drop_multicast && 
-            (is_ipv6_multicast_mac(eth_pkt) ||
-             is_broadcast_mac(eth_pkt)/* ||
-             is_ethMulticast(eth_pkt, len)*/))
-        {
-            traceDebug("Dropping multicast");
-        }
-        else
-        {
-            send_packet2net(eee, eth_pkt, len);
-        }
+        encode_uint16(enc - idx, &tidx, transform);
     }
-}
 
+    return enc - idx;
+}
 
 
-/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
- *  encrypted. */
-static int handle_PACKET(n2n_edge_t *eee,
-                         const n2n_common_t *cmn,
-                         const n2n_PACKET_t *pkt,
-                         const n2n_sock_t *orig_sender,
-                         uint8_t *payload,
-                         size_t psize)
+/** Non-zero if op can encode the payload at payload where it lies, leaving
+ *  room for the PACKET header of flow in front within slot. */
+static int edge_seal_inplace(const n2n_trans_op_t *op, const struct n2n_tx_flow *flow,
+                             const uint8_t *slot, const uint8_t *payload)
 {
-    ssize_t     data_sent_len;
-    uint8_t     from_supernode;
-    uint8_t    *eth_payload = NULL;
-    int         retval = -1;
-    time_t      now;
-
-    now = time(NULL);
+    return op->fwd_inplace && ((flow->hdr_len + op->headroom) <= (size_t) (payload - slot));
+}
 
-    traceDebug("handle_PACKET size %u transform %u",
-               (unsigned int) psize, (unsigned int) pkt->transform);
-    /* hexdump( payload, psize ); */
 
-    from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
+/** Encode the payload of len bytes at payload with op and put the PACKET
+ *  header of flow in front of it, naming transform and options.
+ *
+ *  payload must lie within the buffer of bufsize bytes at slot, at least
+ *  N2N_PKT_HEADROOM bytes into it. *pktbuf is set to the start of the PACKET.
+ *
+ *  @return length of the PACKET or -1 on error
+ */
+static int edge_seal_frame(n2n_trans_op_t *op, const struct n2n_tx_flow *flow,
+                           n2n_transform_t transform, uint8_t options,
+                           uint8_t *slot, uint8_t *payload, size_t len, size_t bufsize,
+                           uint8_t **pktbuf)
+{
+    uint8_t *enc = NULL;
+    int enc_len = -1;
+    size_t idx = flow->hdr_len;
 
-    if (from_supernode)
+    if (edge_seal_inplace(op, flow, slot, payload))
     {
-        ++(eee->rx_sup);
-        eee->last_sup = now;
+        enc = payload - op->headroom;
+        enc_len = op->fwd_inplace(op, payload, len,
+                                  bufsize - (payload - slot) - len);
     }
     else
     {
-        ++(eee->rx_p2p);
-        eee->last_p2p = now;
+        /* The transform can only encode into a separate buffer. */
+        uint8_t eth_copy[N2N_PKT_BUF_SIZE];
+
+        memcpy(eth_copy, payload, len);
+        enc = slot + idx;
+        enc_len = op->fwd(op, enc, bufsize - idx, eth_copy, len);
     }
 
-    /* Update the sender in peer table entry */
-    check_peer(eee, from_supernode, pkt->srcMac, orig_sender);
+    if (enc_len < 0)
+    {
+        traceWarning("Failed to encode %u byte frame with transform %u",
+                     (unsigned int) len, (unsigned int) op->transform_id);
+        return -1;
+    }
 
-    /* Handle transform. */
+    *pktbuf = edge_seal_header(op, flow, transform, options, enc);
+
+    return idx + enc_len;
+}
+
+
+/** Look up the flow of the layer-2 frame of *len bytes at *tap_pkt and
+ *  optionally compress it, ready to be encoded by the transop of the flow.
+ *
+ *  *tap_pkt and *len are updated to the payload to encode, which is sent as
+ *  *transform with the N2N_OPTION_* in *options. The payload may start ahead
+ *  of the frame, but at least op->headroom and the PACKET header of the flow
+ *  after the start of the N2N_PKT_HEADROOM in front of it, where possible.
+ *
+ *  @return 0 or -1 if the frame cannot be sent
+ */
+static int edge_prepare_frame(n2n_edge_t *eee, n2n_edge_worker_t *w,
+                              uint8_t **tap_pkt, size_t *len,
+                              const struct n2n_tx_flow **flow,
+                              n2n_transform_t *transform, uint8_t *options)
+{
+    size_t idx = 0;
+    n2n_trans_op_t *op = NULL;
+
+    /* Optionally compress then apply transforms, eg encryption. */
+
+    /* dest MAC is first in ethernet header */
+    *flow = edge_tx_flow(eee, w, *tap_pkt);
+    if (NULL == *flow)
     {
-        uint8_t decodebuf[N2N_PKT_BUF_SIZE];
-        size_t eth_size;
-        size_t rx_transop_idx = 0;
+        return -1;
+    }
 
-        rx_transop_idx = transop_enum_to_index(pkt->transform);
+    op = &(w->transop[(*flow)->transop_idx]);
+    idx = (*flow)->hdr_len;
+    *transform = op->transform_id;
+    *options = 0;
 
-        if (rx_transop_idx >= 0)
-        {
-            eth_payload = decodebuf;
-            eth_size = eee->transop[rx_transop_idx].rev(&(eee->transop[rx_transop_idx]),
-                                                        eth_payload, N2N_PKT_BUF_SIZE,
-                payload, psize);
-            ++(eee->transop[rx_transop_idx].rx_cnt); /* stats */
+    if (N2N_COMPRESS_NONE != eee->compress_codec)
+    {
+        n2n_transform_t ztransform = compress_transform(*transform, eee->compress_codec);
+        uint8_t zbuf[N2N_COMPRESS_BOUND(N2N_PKT_BUF_SIZE)];
+        int zlen = 0;
 
-            /* Write ethernet packet to tap device. */
-            traceInfo("sending to TAP %u", (unsigned int) eth_size);
-            data_sent_len = tuntap_write(&(eee->device), eth_payload, eth_size);
+        if (N2N_TRANSFORM_ID_INVAL != ztransform)
+        {
+            zlen = compress_frame(&w->compress, eee->compress_codec, *tap_pkt, *len, zbuf, sizeof(zbuf));
+        }
 
-            if (data_sent_len == eth_size)
-            {
-                retval = 0;
-            }
+        if (zlen > 0)
+        {
+            /* Smaller than the frame, so it fits where the frame was. */
+            memcpy(*tap_pkt, zbuf, zlen);
+            *len = zlen;
+            *transform = ztransform;
         }
-        else
+    }
+
+    /* A frame compressed whole keeps its headers as they are. */
+    if ((*transform == op->transform_id) && ((*flow)->options & N2N_OPTION_HDR_COMPRESS))
+    {
+        size_t need = idx + (op->fwd_inplace ? op->headroom : 0);
+        size_t spare = (need < N2N_PKT_HEADROOM) ? (N2N_PKT_HEADROOM - need) : 0;
+        int hlen = hc_compress(&w->hc, (*flow)->mac, tap_pkt, *len, spare);
+
+        if (hlen > 0)
         {
-            traceError("handle_PACKET dropped unknown transform enum %u",
-                       (unsigned int) pkt->transform);
+            *len = hlen;
+            *options |= N2N_OPTION_HDR_COMPRESS;
         }
     }
 
-    return retval;
+    return 0;
 }
 
 
-/** Read a datagram from the management UDP socket and take appropriate
- *  action. */
-static void readFromMgmtSocket(n2n_edge_t *eee, int *keep_running)
+/** Encode a layer-2 frame into a PACKET for the community.
+ *
+ *  tap_pkt must lie N2N_PKT_HEADROOM bytes into a buffer of bufsize bytes.
+ *  The frame is encoded where it lies and the cached PACKET header of its
+ *  flow is copied in front of the encoding, so the datagram is assembled
+ *  without copying the payload. *pktbuf is set to the start of the PACKET and
+ *  *flow to the flow it goes along.
+ *
+ *  @return length of the PACKET or -1 on error
+ */
+static int edge_encode_frame(n2n_edge_t *eee, n2n_edge_worker_t *w,
+                             uint8_t *tap_pkt, size_t len, size_t bufsize,
+                             uint8_t **pktbuf, const struct n2n_tx_flow **flow)
 {
-    uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
-    ssize_t             recvlen;
-    ssize_t             sendlen;
-    struct sockaddr_in  sender_sock;
-    socklen_t           i;
-    size_t              msg_len;
-    time_t              now;
-
-    now = time(NULL);
-    i = sizeof(sender_sock);
-    recvlen = recvfrom(eee->udp_mgmt_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
-                       (struct sockaddr *) &sender_sock, (socklen_t*) &i);
+    uint8_t *slot = tap_pkt - N2N_PKT_HEADROOM;
+    n2n_transform_t transform;
+    uint8_t options;
 
-    if (recvlen < 0)
+    if (0 != edge_prepare_frame(eee, w, &tap_pkt, &len, flow, &transform, &options))
     {
-        traceError("mgmt recvfrom failed with %s", strerror(errno));
-
-        return; /* failed to receive data from UDP */
+        return -1;
     }
 
-    if (recvlen >= 4)
-    {
-        if (0 == memcmp(udp_buf, "stop", 4))
-        {
-            traceError("stop command received.");
-            *keep_running = 0;
-            return;
-        }
+    return edge_seal_frame(&(w->transop[(*flow)->transop_idx]), *flow, transform, options,
+                           slot, tap_pkt, len, bufsize, pktbuf);
+}
 
-        if (0 == memcmp(udp_buf, "help", 4))
-        {
-            msg_len = 0;
-            ++traceLevel;
 
-            msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                                "Help for edge management console:\n"
-                                "  stop    Gracefully exit edge\n"
-                                "  help    This help message\n"
-                                "  +verb   Increase verbosity of logging\n"
-                                "  -verb   Decrease verbosity of logging\n"
-                                "  reload  Re-read the keyschedule\n"
-                                "  <enter> Display statistics\n\n");
+/** Microseconds on the monotonic clock, for bundle deadlines. */
+static uint64_t edge_usec_now(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(WIN32)
+    struct timespec ts;
 
-            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
-                   (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-            return;
-        }
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
 
-    }
+/** Arm the bundle timer of w for the open bundle due first, or disarm it
+ *  when none is open. */
+static void edge_bundle_arm(n2n_edge_worker_t *w)
+{
+#ifdef N2N_HAVE_BUNDLE_TIMER
+    uint64_t due = bundle_next_deadline(&w->bundler);
+    struct itimerspec its;
 
-    if (recvlen >= 5)
+    if ((w->bundle_fd < 0) || (due == w->bundle_armed))
     {
-        if (0 == memcmp(udp_buf, "+verb", 5))
-        {
-            msg_len = 0;
-            ++traceLevel;
+        return;
+    }
 
-            traceError("+verb traceLevel=%u", (unsigned int) traceLevel);
-            msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                                "> +OK traceLevel=%u\n", (unsigned int) traceLevel);
+    memset(&its, 0, sizeof(its)); /* 0 disarms */
+    its.it_value.tv_sec = due / 1000000;
+    its.it_value.tv_nsec = (due % 1000000) * 1000;
 
-            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
-                   (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+    if (0 != timerfd_settime(w->bundle_fd, TFD_TIMER_ABSTIME, &its, NULL))
+    {
+        traceError("timerfd_settime failed (%s)", strerror(errno));
+    }
 
-            return;
-        }
+    w->bundle_armed = due;
+#endif
+}
 
-        if (0 == memcmp(udp_buf, "-verb", 5))
-        {
-            msg_len = 0;
+/** Encode bundle b and queue it, as the frame it holds if there is only one.
+ *
+ *  The PACKET is encoded within the bundle, which is held until the Tx queue
+ *  has been flushed. Should the queue fill up, it is flushed right away.
+ */
+static void edge_bundle_send(n2n_edge_t *eee, n2n_edge_worker_t *w, struct n2n_bundle *b)
+{
+    uint8_t *payload = b->buf + N2N_PKT_HEADROOM;
+    size_t   len = b->len;
+    uint8_t  options = N2N_OPTION_BUNDLE;
+    const struct n2n_tx_flow *flow = NULL;
+    int      transop_idx = transop_enum_to_index(b->transform);
+    uint8_t *pktbuf = NULL;
+    int      pktlen = -1;
+
+    if (transop_idx >= 0)
+    {
+        flow = edge_tx_flow(eee, w, b->mac);
+    }
 
-            if (traceLevel > 0)
-            {
-                --traceLevel;
-                msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
-                                    "> -OK traceLevel=%u\n", traceLevel);
-            }
-            else
-            {
-                msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
-                                    "> -NOK traceLevel=%u\n", traceLevel);
-            }
+    if ((NULL == flow) || (0 == (flow->options & N2N_OPTION_BUNDLE)))
+    {
+        /* The peer went away or came back without bundles meanwhile. */
+        traceInfo("Dropping bundle of %u frames", (unsigned int) b->count);
+        bundle_sent(&w->bundler, b, 0);
+        return;
+    }
 
-            traceError("-verb traceLevel=%u", (unsigned int) traceLevel);
+    if (1 == b->count)
+    {
+        size_t off = 0;
+        int    hc = 0;
 
-            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
-                (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
-            return;
-        }
+        len = bundle_next(payload, b->len, &off, &payload, &hc);
+        options = hc ? N2N_OPTION_HDR_COMPRESS : 0;
+        ++(w->bundler.stats.tx_alone);
+    }
+    else
+    {
+        ++(w->bundler.stats.tx_bundles);
     }
 
-    if (recvlen >= 6)
+    pktlen = edge_seal_frame(&(w->transop[transop_idx]), flow, b->transform, options,
+                             b->buf, payload, len, sizeof(b->buf), &pktbuf);
+
+    if ((pktlen > 0) && (0 == tx_batch_queue(&w->tx_batch, pktbuf, pktlen, &flow->addr)))
     {
-        if (0 == memcmp(udp_buf, "reload", 6))
+        edge_count_tx(w, flow);
+        bundle_sent(&w->bundler, b, 1);
+
+        if (0 == w->tx_batch.count)
         {
-            if (strlen(eee->keyschedule) > 0)
-            {
-                if (edge_init_keyschedule(eee) == 0)
-                {
-                    msg_len = 0;
-                    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                                        "> OK\n");
-                    sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
-                           (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
-                }
-                return;
-            }
+            bundle_release(&w->bundler);
         }
     }
+    else
+    {
+        bundle_sent(&w->bundler, b, 0);
+    }
+}
 
-    traceDebug("mgmt status rq");
-
-    msg_len = 0;
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
-                        "Statistics for edge\n");
+/** Send the bundles of w due by now. */
+static void edge_bundle_flush(n2n_edge_t *eee, n2n_edge_worker_t *w, uint64_t now)
+{
+    struct n2n_bundle *b;
 
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
-                        "uptime %lu\n",
-                        time(NULL) - eee->start_time);
+    while (NULL != (b = bundle_due(&w->bundler, now)))
+    {
+        edge_bundle_send(eee, w, b);
+    }
 
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                        "paths  super:%u,%u p2p:%u,%u\n",
-                        (unsigned int) eee->tx_sup,
-                        (unsigned int) eee->rx_sup,
-                        (unsigned int) eee->tx_p2p,
-                        (unsigned int) eee->rx_p2p);
+    edge_bundle_arm(w);
+}
 
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                        "trans:null |%6u|%6u|\n"
-                        "trans:tf   |%6u|%6u|\n"
-                        "trans:aes  |%6u|%6u|\n",
-                        (unsigned int) eee->transop[N2N_TRANSOP_NULL_IDX].tx_cnt,
-                        (unsigned int) eee->transop[N2N_TRANSOP_NULL_IDX].rx_cnt,
-                        (unsigned int) eee->transop[N2N_TRANSOP_TF_IDX].tx_cnt,
-                        (unsigned int) eee->transop[N2N_TRANSOP_TF_IDX].rx_cnt,
-                        (unsigned int) eee->transop[N2N_TRANSOP_AESCBC_IDX].tx_cnt,
-                        (unsigned int) eee->transop[N2N_TRANSOP_AESCBC_IDX].rx_cnt);
+/** Open a bundle along flow, sending another one to make room if need be.
+ *
+ *  @return the bundle or NULL on error
+ */
+static struct n2n_bundle *edge_bundle_open(n2n_edge_t *eee, n2n_edge_worker_t *w,
+                                           const struct n2n_tx_flow *flow)
+{
+    uint64_t deadline = edge_usec_now() + eee->bundle_usec;
+    struct n2n_bundle *b = bundle_open(&w->bundler, flow->mac, flow->transform, deadline);
 
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                        "peers  pend:%u full:%u\n",
-                        (unsigned int) list_size(&eee->pending_peers),
-                        (unsigned int) list_size(&eee->known_peers));
+    if (NULL == b)
+    {
+        /* All open or held by the Tx queue. */
+        struct n2n_bundle *due = bundle_due(&w->bundler, UINT64_MAX);
 
-    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
-                        "last   super:%lu(%ld sec ago) p2p:%lu(%ld sec ago)\n",
-                        eee->last_sup, (now - eee->last_sup), eee->last_p2p, (now - eee->last_p2p));
+        if (NULL != due)
+        {
+            edge_bundle_send(eee, w, due);
+        }
 
-    traceDebug("mgmt status sending: %s", udp_buf);
+        tx_batch_flush(&w->tx_batch);
+        bundle_release(&w->bundler);
 
-    sendlen = sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
-        (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+        b = bundle_open(&w->bundler, flow->mac, flow->transform, deadline);
+    }
 
+    return b;
 }
 
-
-/** Read a datagram from the main UDP socket to the internet. */
-static void readFromIPSocket(n2n_edge_t *eee)
+/** Put the frame of len bytes at tap_pkt in the bundle to its destination
+ *  if that peer accepts bundles.
+ *
+ *  tap_pkt must lie N2N_PKT_HEADROOM bytes into a buffer, as for
+ *  edge_encode_frame().
+ *
+ *  @return 0 if the frame was bundled, -1 if it is to be sent on its own
+ */
+static int edge_bundle_frame(n2n_edge_t *eee, n2n_edge_worker_t *w, uint8_t *tap_pkt, size_t len)
 {
-    n2n_common_t        cmn; /* common fields in the packet header */
-
-    n2n_sock_str_t      sockbuf1;
-    n2n_sock_str_t      sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
-    macstr_t            mac_buf1;
-    macstr_t            mac_buf2;
-
-    uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
-    ssize_t             recvlen;
-    size_t              rem;
-    size_t              idx;
-    size_t              msg_type;
-    uint8_t             from_supernode;
-    struct sockaddr_in  sender_sock;
-    n2n_sock_t          sender;
-    n2n_sock_t         *orig_sender = NULL;
-    time_t              now = 0;
+    const struct n2n_tx_flow *flow = NULL;
+    struct n2n_bundle *b = NULL;
+    size_t need = len + 2; /* hc_compress() adds at most 2 octets */
+    int hc = 0;
+
+    flow = edge_tx_flow(eee, w, tap_pkt);
+    if ((NULL == flow) || (0 == (flow->options & N2N_OPTION_BUNDLE)) ||
+        (need > bundle_room(&w->bundler, NULL)))
+    {
+        return -1;
+    }
 
-    size_t              i;
+    b = bundle_find(&w->bundler, flow->mac);
+    if ((NULL != b) && ((b->transform != flow->transform) || (need > bundle_room(&w->bundler, b))))
+    {
+        edge_bundle_send(eee, w, b);
+        b = NULL;
+    }
 
-    i = sizeof(sender_sock);
-    recvlen = recvfrom(eee->udp_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
-                       (struct sockaddr *) &sender_sock, (socklen_t*) &i);
+    if (NULL == b)
+    {
+        b = edge_bundle_open(eee, w, flow);
+        if (NULL == b)
+        {
+            return -1;
+        }
+    }
 
-    if (recvlen < 0)
+    /* Only once the frame is sure to be bundled: compression changes it. */
+    if (flow->options & N2N_OPTION_HDR_COMPRESS)
     {
-        traceError("recvfrom failed with %s", strerror(errno));
+        int hlen = hc_compress(&w->hc, flow->mac, &tap_pkt, len, N2N_PKT_HEADROOM);
 
-        return; /* failed to receive data from UDP */
+        if (hlen > 0)
+        {
+            len = hlen;
+            hc = 1;
+        }
     }
 
-    /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
-     * IP transport version the packet arrived on. May need to UDP sockets. */
-    sender.family = AF_INET; /* udp_sock was opened PF_INET v4 */
-    sender.port = ntohs(sender_sock.sin_port);
-    memcpy(&(sender.addr.v4), &(sender_sock.sin_addr.s_addr), IPV4_SIZE);
+    bundle_add(&w->bundler, b, tap_pkt, len, hc);
 
-    /* The packet may not have an orig_sender socket spec. So default to last
-     * hop as sender. */
-    orig_sender = &sender;
+    if (1 == b->count)
+    {
+        edge_bundle_arm(w);
+    }
 
-    traceInfo("### Rx N2N UDP (%d) from %s",
-               (signed int) recvlen, sock_to_cstr(sockbuf1, &sender));
+    return 0;
+}
 
-    /* hexdump( udp_buf, recvlen ); */
+/** Send the bundle to the destination of the frame of len bytes at tap_pkt
+ *  ahead of the frame, so frames to a peer keep their order.
+ *
+ *  tap_pkt must lie N2N_PKT_HEADROOM bytes into the buffer returned by
+ *  tx_batch_reserve(). Queueing the bundle moves the Tx queue on to another
+ *  buffer, so the frame is moved there.
+ *
+ *  @return where the frame lies
+ */
+static uint8_t *edge_bundle_ahead(n2n_edge_t *eee, n2n_edge_worker_t *w, uint8_t *tap_pkt, size_t len)
+{
+    struct n2n_bundle *b = bundle_find(&w->bundler, tap_pkt);
+    uint8_t *slot;
 
-    rem = recvlen; /* Counts down bytes of packet to protect against buffer overruns. */
-    idx = 0; /* marches through packet header as parts are decoded. */
-    if (decode_common(&cmn, udp_buf, &rem, &idx) < 0)
+    if (NULL == b)
     {
-        traceError("Failed to decode common section in N2N_UDP");
-        return; /* failed to decode packet */
+        return tap_pkt;
     }
 
-    now = time(NULL);
-
-    msg_type = cmn.pc; /* packet code */
-    from_supernode = cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
+    edge_bundle_send(eee, w, b);
+    edge_bundle_arm(w);
 
-    if (0 == memcmp(cmn.community, eee->community_name, N2N_COMMUNITY_SIZE))
+    slot = tx_batch_reserve(&w->tx_batch);
+    if (slot + N2N_PKT_HEADROOM != tap_pkt)
     {
-        if (msg_type == MSG_TYPE_PACKET)
-        {
-            /* process PACKET - most frequent so first in list. */
-            n2n_PACKET_t pkt;
+        memcpy(slot + N2N_PKT_HEADROOM, tap_pkt, len);
+        tap_pkt = slot + N2N_PKT_HEADROOM;
+    }
 
-            decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
+    return tap_pkt;
+}
 
-            if (pkt.sock.family)
-            {
-                orig_sender = &(pkt.sock);
-            }
 
-            traceInfo("Rx PACKET from %s (%s)",
-                sock_to_cstr(sockbuf1, &sender),
-                sock_to_cstr(sockbuf2, orig_sender));
+/** A layer-2 packet was received at the tunnel and needs to be sent via UDP.
+ *
+ *  tap_pkt must lie N2N_PKT_HEADROOM bytes into the buffer returned by
+ *  tx_batch_reserve(), so the PACKET is assembled in the Tx queue.
+ */
+static void send_packet2net(n2n_edge_t *eee, n2n_edge_worker_t *w,
+                            uint8_t *tap_pkt, size_t len)
+{
+    const struct n2n_tx_flow *flow = NULL;
+    uint8_t *pktbuf = NULL;
+    int pktlen;
 
-            handle_PACKET(eee, &cmn, &pkt, orig_sender, udp_buf + idx, recvlen - idx);
-        }
-        else if (msg_type == MSG_TYPE_REGISTER)
+    if (eee->bundle_usec >= 0)
+    {
+        if ((len <= N2N_BUNDLE_FRAME_MAX) && (0 == edge_bundle_frame(eee, w, tap_pkt, len)))
         {
-            /* Another edge is registering with us */
-            n2n_REGISTER_t reg;
+            return;
+        }
 
-            decode_REGISTER(&reg, &cmn, udp_buf, &rem, &idx);
+        tap_pkt = edge_bundle_ahead(eee, w, tap_pkt, len);
+    }
 
-            if (reg.sock.family)
-            {
-                orig_sender = &(reg.sock);
-            }
+    pktlen = edge_encode_frame(eee, w, tap_pkt, len, w->tx_batch.bufsize, &pktbuf, &flow);
 
-            traceInfo("Rx REGISTER src=%s dst=%s from peer %s (%s)",
-                       macaddr_str(mac_buf1, reg.srcMac),
-                       macaddr_str(mac_buf2, reg.dstMac),
-                       sock_to_cstr(sockbuf1, &sender),
-                       sock_to_cstr(sockbuf2, orig_sender));
+    if (pktlen > 0)
+    {
+        send_PACKET(w, flow, pktbuf, pktlen); /* to peer or supernode */
+    }
+}
 
-            if (0 == memcmp(reg.dstMac, (eee->device.mac_addr), 6))
-            {
-                check_peer(eee, from_supernode, reg.srcMac, orig_sender);
-            }
 
-            send_register_ack(eee, orig_sender, &reg);
-        }
-        else if (msg_type == MSG_TYPE_REGISTER_ACK)
-        {
-            /* Peer edge is acknowledging our register request */
-            n2n_REGISTER_ACK_t ra;
 
-            decode_REGISTER_ACK(&ra, &cmn, udp_buf, &rem, &idx);
 
-            if (ra.sock.family)
-            {
-                orig_sender = &(ra.sock);
-            }
 
-            traceInfo("Rx REGISTER_ACK src=%s dst=%s from peer %s (%s)",
-                       macaddr_str(mac_buf1, ra.srcMac),
-                       macaddr_str(mac_buf2, ra.dstMac),
-                       sock_to_cstr(sockbuf1, &sender),
-                       sock_to_cstr(sockbuf2, orig_sender));
+/** A frame read from the TAP device, prepared by edge_prepare_frame() and
+ *  waiting to be encoded with the rest of its burst. */
+struct edge_tx_frame
+{
+    const struct n2n_tx_flow   *flow;
+    n2n_transform_t             transform;
+    uint8_t                     options;
+    uint8_t                    *slot;           /* Tx slot the frame was read into. */
+    int                         inplace;        /* Encoded in place along with the burst. */
+};
 
-            /* Move from pending_peers to known_peers; ignore if not in pending. */
-            set_peer_operational(eee, ra.srcMac, &sender);
-        }
-        else if (msg_type == MSG_TYPE_REGISTER_SUPER_ACK)
-        {
-            n2n_REGISTER_SUPER_ACK_t ra;
+/** Frames read into consecutive Tx slots from the one tx_batch_reserve()
+ *  returns, which are encoded together and then committed in order. */
+struct edge_tx_burst
+{
+    size_t                  count;
+    struct edge_tx_frame    frames[N2N_BATCH_MAX];
+    n2n_trans_buf_t         bufs[N2N_BATCH_MAX];  /* payloads, per frame */
+};
 
-            if (eee->sn_wait)
-            {
-                decode_REGISTER_SUPER_ACK(&ra, &cmn, udp_buf, &rem, &idx);
 
-                if (ra.sock.family)
-                {
-                    orig_sender = &(ra.sock);
-                }
+/** Encode the frames of burst, those of one transop with one call to
+ *  transop_fwd_batch(), and queue their PACKETs in the order read. */
+static void edge_send_burst(n2n_edge_t *eee, n2n_edge_worker_t *w, struct edge_tx_burst *burst)
+{
+    n2n_trans_buf_t group[N2N_BATCH_MAX];
+    size_t member[N2N_BATCH_MAX];
+    int grouped[N2N_BATCH_MAX];
+    int hole = 0;
+    size_t i;
+    size_t j;
 
-                traceNormal("Rx REGISTER_SUPER_ACK myMAC=%s [%s] (external %s). Attempts %u",
-                           macaddr_str(mac_buf1, ra.edgeMac),
-                           sock_to_cstr(sockbuf1, &sender),
-                           sock_to_cstr(sockbuf2, orig_sender),
-                           (unsigned int) eee->sup_attempts);
+    memset(grouped, 0, burst->count * sizeof(grouped[0]));
 
-                if (0 == memcmp(ra.cookie, eee->last_cookie, N2N_COOKIE_SIZE))
-                {
-                    if (ra.num_sn > 0)
-                    {
-#ifdef N2N_MULTIPLE_SUPERNODES
-                        for (i = 0; i < ra.num_sn; i++)
-                        {
-                            if (add_supernode(eee, &ra.sn_bak[i]))
-                                break;
+    for (i = 0; i < burst->count; ++i)
+    {
+        size_t transop_idx = burst->frames[i].flow->transop_idx;
+        n2n_trans_op_t *op = &(w->transop[transop_idx]);
+        size_t n = 0;
 
-                            traceNormal("Rx REGISTER_SUPER_ACK backup supernode at %s",
-                                       sock_to_cstr(sockbuf1, &(ra.sn_bak[i])));
-                        }
-#else
-                        traceNormal("Rx REGISTER_SUPER_ACK backup supernode at %s",
-                                   sock_to_cstr(sockbuf1, &(ra.sn_bak)));
-#endif
-                    }
+        if (grouped[i])
+        {
+            continue;
+        }
 
-                    eee->last_sup = now;
-                    eee->sn_wait = 0;
+        for (j = i; j < burst->count; ++j)
+        {
+            struct edge_tx_frame *f = &(burst->frames[j]);
 
-#ifdef N2N_MULTIPLE_SUPERNODES
-                    eee->reg_sn.timestamp = now; //TODO check if sending sn is reg_sn
-                    eee->sup_attempts = 0; /* we got a response, so no more attempts */
-#else
-                    eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS; /* refresh because we got a response */
-#endif
+            if (grouped[j] || (f->flow->transop_idx != transop_idx))
+            {
+                continue;
+            }
 
-                    /* REVISIT: store sn_back */
-                    eee->register_lifetime = ra.lifetime;
-                    eee->register_lifetime = MAX( eee->register_lifetime, REGISTER_SUPER_INTERVAL_MIN );
-                    eee->register_lifetime = MIN( eee->register_lifetime, REGISTER_SUPER_INTERVAL_MAX );
-                }
-                else
-                {
-                    traceWarning("Rx REGISTER_SUPER_ACK with wrong or old cookie.");
-                }
+            grouped[j] = 1;
+
+            if (edge_seal_inplace(op, f->flow, f->slot, burst->bufs[j].buf))
+            {
+                f->inplace = 1;
+                member[n] = j;
+                group[n++] = burst->bufs[j];
             }
             else
             {
-                traceWarning("Rx REGISTER_SUPER_ACK with no outstanding REGISTER_SUPER.");
+                f->inplace = 0;
             }
         }
-        else
+
+        transop_fwd_batch(op, group, n);
+
+        for (j = 0; j < n; ++j)
         {
-            /* Not a known message type */
-            traceWarning("Unable to handle packet type %d: ignored", (signed int) msg_type);
-            return;
+            burst->bufs[member[j]].ret = group[j].ret;
         }
-    } /* if (community match) */
-    else
-    {
-        traceWarning("Received packet with invalid community");
     }
 
-}
-
-/* ***************************************************** */
-
-#ifdef WIN32
-static DWORD tunReadThread(LPVOID lpArg)
-{
-    n2n_edge_t *eee = (n2n_edge_t*) lpArg;
-
-    while (1)
+    for (i = 0; i < burst->count; ++i)
     {
-        readFromTAPSocket(eee);
-    }
-
-    return ((DWORD) NULL);
-}
+        struct edge_tx_frame *f = &(burst->frames[i]);
+        n2n_trans_buf_t *b = &(burst->bufs[i]);
+        n2n_trans_op_t *op = &(w->transop[f->flow->transop_idx]);
+        uint8_t *pktbuf = NULL;
+        int pktlen = -1;
 
+        if (!f->inplace)
+        {
+            pktlen = edge_seal_frame(op, f->flow, f->transform, f->options, f->slot,
+                                     b->buf, b->len, w->tx_batch.bufsize, &pktbuf);
+        }
+        else if (b->ret > 0)
+        {
+            pktbuf = edge_seal_header(op, f->flow, f->transform, f->options, b->buf - op->headroom);
+            pktlen = f->flow->hdr_len + b->ret;
+        }
+        else
+        {
+            traceWarning("Failed to encode %u byte frame with transform %u",
+                         (unsigned int) b->len, (unsigned int) op->transform_id);
+        }
 
-/** Start a second thread in Windows because TUNTAP interfaces do not expose
- *  file descriptors. */
-static void startTunReadThread(n2n_edge_t *eee)
-{
-    HANDLE hThread;
-    DWORD dwThreadId;
+        if (pktlen <= 0)
+        {
+            hole = 1; /* the PACKETs after lie a slot further on than committed */
+        }
+        else if (hole)
+        {
+            edge_count_tx(w, f->flow);
+            tx_batch_queue(&w->tx_batch, pktbuf, pktlen, &(f->flow->addr));
+        }
+        else
+        {
+            send_PACKET(w, f->flow, pktbuf, pktlen); /* to peer or supernode */
+        }
+    }
 
-    hThread = CreateThread(NULL,         /* security attributes */
-                           0,            /* use default stack size */
-                           (LPTHREAD_START_ROUTINE) tunReadThread, /* thread function */
-                           (void*) eee,  /* argument to thread function */
-                           0,            /* thread creation flags */
-                           &dwThreadId); /* thread id out */
+    if (hole)
+    {
+        /* Slots of queued PACKETs would otherwise be reserved again. */
+        tx_batch_flush(&w->tx_batch);
+    }
+
+    burst->count = 0;
 }
-#endif
 
-/* ***************************************************** */
 
-/** Resolve the supernode IP address.
+/** Add the layer-2 frame of len bytes read into the slot of burst at tap_pkt,
+ *  N2N_PKT_HEADROOM bytes into it, to burst.
  *
- *  REVISIT: This is a really bad idea. The edge will block completely while the
- *           hostname resolution is performed. This could take 15 seconds.
+ *  @return 0 or -1 if the frame is dropped, leaving its slot to the next
  */
-static void supernode2addr(n2n_sock_t *sn, const n2n_sn_name_t addrIn)
+static int edge_burst_frame(n2n_edge_t *eee, n2n_edge_worker_t *w, struct edge_tx_burst *burst,
+                            uint8_t *tap_pkt, size_t len)
 {
-    n2n_sn_name_t addr;
-    const char *supernode_host;
-
-    memcpy(addr, addrIn, N2N_EDGE_SN_HOST_SIZE);
+    struct edge_tx_frame *f = &(burst->frames[burst->count]);
+    n2n_trans_buf_t *b = &(burst->bufs[burst->count]);
 
-    supernode_host = strtok(addr, ":");
+    f->slot = tap_pkt - N2N_PKT_HEADROOM;
 
-    if (supernode_host)
+    if (0 != edge_prepare_frame(eee, w, &tap_pkt, &len, &(f->flow), &(f->transform), &(f->options)))
     {
-        in_addr_t sn_addr;
-        char *supernode_port = strtok(NULL, ":");
-        const struct addrinfo aihints = { 0, PF_INET, 0, 0, 0, NULL, NULL, NULL };
-        struct addrinfo *ainfo = NULL;
-        int nameerr;
+        return -1;
+    }
 
-        if (supernode_port)
-            sn->port = atoi(supernode_port);
-        else
-            traceWarning("Bad supernode parameter (-l <host:port>) %s %s:%s",
-                       addr, supernode_host, supernode_port);
+    b->buf = tap_pkt;
+    b->len = len;
+    b->tailroom = w->tx_batch.bufsize - (tap_pkt - f->slot) - len;
+    b->ret = -1;
+    ++(burst->count);
 
-        nameerr = getaddrinfo(supernode_host, NULL, &aihints, &ainfo);
+    return 0;
+}
 
-        if (0 == nameerr)
-        {
-            struct sockaddr_in *saddr;
 
-            /* ainfo s the head of a linked list if non-NULL. */
-            if (ainfo && (PF_INET == ainfo->ai_family))
-            {
-                /* It is definitely and IPv4 address -> sockaddr_in */
-                saddr = (struct sockaddr_in *) ainfo->ai_addr;
+/** Non-zero while segments of a large frame already read from dev remain
+ *  to be returned by tuntap_read(). */
+static int edge_tap_pending(const tuntap_dev *dev)
+{
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    return tuntap_pending(dev);
+#else
+    return 0;
+#endif
+}
 
-                memcpy(sn->addr.v4, &(saddr->sin_addr.s_addr), IPV4_SIZE);
-                sn->family = AF_INET;
-            }
-            else
+/** Read packets from the TAP interface, process them and queue the
+ *  corresponding PACKETs for the cooked socket.
+ *
+ *  Up to batch_size frames are read per call. With batching the TAP fd is non
+ *  blocking and reading stops early when no more frames are waiting. With TAP
+ *  offloads all segments of a large frame are read, even beyond batch_size.
+ *
+ *  Each frame is read straight into the next Tx slot, leaving N2N_PKT_HEADROOM
+ *  bytes in front of it for the headers and N2N_PKT_TAILROOM bytes behind it
+ *  for cipher padding.
+ *
+ *  Without bundling the frames go into consecutive free slots and are
+ *  encoded as one burst (see edge_send_burst()) once the slots run out or
+ *  reading stops.
+ */
+static void readFromTAPSocket(n2n_edge_t *eee, n2n_edge_worker_t *w)
+{
+    /* tun -> remote */
+    const size_t eth_max = w->tx_batch.bufsize - N2N_PKT_HEADROOM - N2N_PKT_TAILROOM;
+    struct edge_tx_burst burst;
+    int        bursts = (eee->bundle_usec < 0) && (eee->batch_size > 1);
+    uint8_t    *eth_pkt;
+    macstr_t   mac_buf;
+    ssize_t    len;
+    size_t     i;
+
+    burst.count = 0;
+
+    /* Segments of a large frame already read are all sent, however many. */
+    for (i = 0; (i < eee->batch_size) || edge_tap_pending(&(w->device)); ++i)
+    {
+        if (bursts)
+        {
+            eth_pkt = tx_batch_ahead(&w->tx_batch, burst.count);
+
+            if ((NULL == eth_pkt) || (N2N_BATCH_MAX == burst.count))
             {
-                /* Should only return IPv4 addresses due to aihints. */
-                traceWarning("Failed to resolve supernode IPv4 address for %s", supernode_host);
+                edge_send_burst(eee, w, &burst);
+                eth_pkt = tx_batch_ahead(&w->tx_batch, 0);
             }
 
-            freeaddrinfo(ainfo); /* free everything allocated by getaddrinfo(). */
-            ainfo = NULL;
+            eth_pkt += N2N_PKT_HEADROOM;
         }
         else
         {
-            traceWarning("Failed to resolve supernode host %s, assuming numeric", supernode_host);
-            sn_addr = inet_addr(supernode_host); /* uint32_t */
-            memcpy(sn->addr.v4, &(sn_addr), IPV4_SIZE);
-            sn->family = AF_INET;
+            eth_pkt = tx_batch_reserve(&w->tx_batch) + N2N_PKT_HEADROOM;
         }
 
+        len = tuntap_read(&(w->device), eth_pkt, eth_max);
+
+        if ((len < 0) && (i > 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+        {
+            break; /* drained */
+        }
+        else if ((len <= 0) || (len > eth_max))
+        {
+            traceWarning("read()=%d [%d/%s]",
+                       (signed int) len, errno, strerror(errno));
+            break;
+        }
+        else
+        {
+            const uint8_t *mac = eth_pkt;
+            traceInfo("### Rx TAP packet (%4d) for %s",
+                (signed int) len, macaddr_str(mac_buf, mac));
+
+            if (edge_tap_frame_wanted(eee, eth_pkt, len))
+            {
+                if (bursts)
+                {
+                    edge_burst_frame(eee, w, &burst, eth_pkt, len);
+                }
+                else
+                {
+                    send_packet2net(eee, w, eth_pkt, len);
+                }
+            }
+        }
+    }
+
+    if (burst.count > 0)
+    {
+        edge_send_burst(eee, w, &burst);
     }
-    else
-        traceWarning("Wrong supernode parameter (-l <host:port>)");
 }
 
-/* ***************************************************** */
 
 
-/** Find the address and IP mode for the tuntap device.
- *
- *  s is one of these forms:
- *
- *  <host> := <hostname> | A.B.C.D
- *
- *  <host> | static:<host> | dhcp:<host>
- *
- *  If the mode is present (colon required) then fill ip_mode with that value
- *  otherwise do not change ip_mode. Fill ip_mode with everything after the
- *  colon if it is present; or s if colon is not present.
- *
- *  ip_add and ip_mode are NULL terminated if modified.
+/** Decompress a decoded frame of eth_size bytes at *eth_payload into buf,
+ *  of N2N_PKT_BUF_SIZE bytes, if it was sent compressed with codec.
  *
- *  return 0 on success and -1 on error
+ *  @return length of the frame, which *eth_payload then points at, or -1
  */
-static int scan_address(char *ip_addr, size_t addr_size,
-                        char *ip_mode, size_t mode_size,
-                        const char *s)
+static int edge_decompress_frame(n2n_edge_worker_t *w, int codec, uint8_t **eth_payload,
+                                 int eth_size, uint8_t *buf)
 {
-    int retval = -1;
-    char *p;
+    if ((N2N_COMPRESS_NONE == codec) || (eth_size <= 0))
+    {
+        return eth_size;
+    }
 
-    if ((NULL == s) || (NULL == ip_addr))
+    eth_size = decompress_frame(&w->compress, codec, *eth_payload, eth_size, buf, N2N_PKT_BUF_SIZE);
+    if (eth_size < 0)
     {
-        return -1;
+        traceWarning("Failed to decompress frame with codec %s", compress_codec_name(codec));
     }
 
-    memset(ip_addr, 0, addr_size);
+    *eth_payload = buf;
 
-    p = strpbrk(s, ":");
+    return eth_size;
+}
 
-    if (p)
-    {
-        /* colon is present */
-        if (ip_mode)
-        {
-            size_t end = 0;
 
-            memset(ip_mode, 0, mode_size);
-            end = MIN( p-s, (ssize_t)(mode_size-1) ); /* ensure NULL term */
-            strncpy(ip_mode, s, end);
-            strncpy(ip_addr, p + 1, addr_size - 1); /* ensure NULL term */
-            retval = 0;
-        }
+/** Restore into buf, of N2N_PKT_BUF_SIZE bytes, the headers of a decoded
+ *  frame of eth_size bytes at *eth_payload if src compressed them.
+ *
+ *  @return length of the frame, which *eth_payload then points at, or -1
+ */
+static int edge_expand_frame(n2n_edge_worker_t *w, const n2n_mac_t src, uint8_t options,
+                             uint8_t **eth_payload, int eth_size, uint8_t *buf)
+{
+    if ((0 == (options & N2N_OPTION_HDR_COMPRESS)) || (eth_size <= 0))
+    {
+        return eth_size;
     }
-    else
+
+    eth_size = hc_expand(&w->hc, src, *eth_payload, eth_size, buf, N2N_PKT_BUF_SIZE);
+    if (eth_size < 0)
     {
-        /* colon is not present */
-        strncpy(ip_addr, s, addr_size);
+        traceInfo("Failed to expand frame with compressed headers");
     }
 
-    return retval;
-}
+    *eth_payload = buf;
 
-static int run_loop(n2n_edge_t *eee);
+    return eth_size;
+}
 
-#define N2N_NETMASK_STR_SIZE    16 /* dotted decimal 12 numbers + 3 dots */
-#define N2N_MACNAMSIZ           18 /* AA:BB:CC:DD:EE:FF + NULL*/
-#define N2N_IF_MODE_SIZE        16 /* static | dhcp */
 
-/** Entry point to program from kernel. */
-int main(int argc, char* argv[])
+/** Write a decoded frame of eth_size bytes from src to the TAP device,
+ *  restoring its headers first if options say they are compressed.
+ *
+ *  @return 0 or -1 on error
+ */
+static int edge_write_frame(n2n_edge_worker_t *w, const n2n_mac_t src, uint8_t options,
+                            uint8_t *eth_payload, int eth_size)
 {
-    int     opt;
-    int     local_port = 0 /* any port */;
-    int     mgmt_port = N2N_EDGE_MGMT_PORT; /* 5644 by default */
-    char    tuntap_dev_name[N2N_IFNAMSIZ] = "edge0";
-    char    ip_mode[N2N_IF_MODE_SIZE] = "static";
-    char    ip_addr[N2N_NETMASK_STR_SIZE] = "";
-    char    netmask[N2N_NETMASK_STR_SIZE] = "255.255.255.0";
-    int     mtu = DEFAULT_MTU;
-    int     got_s = 0;
-
-#ifndef WIN32
-    uid_t   userid = 0; /* root is the only guaranteed ID */
-    gid_t   groupid = 0; /* root is the only guaranteed ID */
-#endif
+    uint8_t hcbuf[N2N_PKT_BUF_SIZE];
 
-    char    device_mac[N2N_MACNAMSIZ] = "";
-    char   *encrypt_key = NULL;
+    eth_size = edge_expand_frame(w, src, options, &eth_payload, eth_size, hcbuf);
+    if (eth_size <= 0)
+    {
+        return -1;
+    }
 
-#ifdef N2N_MULTIPLE_SUPERNODES
-    const char *optstring = "K:k:a:bc:Eu:g:m:M:s:S:d:l:p:fvhrt:";
-#else
-    const char *optstring = "K:k:a:bc:Eu:g:m:M:s:d:l:p:fvhrt:";
-#endif
+    /* Write ethernet packet to tap device. */
+    traceInfo("sending to TAP %u", (unsigned int) eth_size);
 
-    int     i, effectiveargc = 0;
-    char  **effectiveargv = NULL;
-    char   *linebuffer = NULL;
+    return (tuntap_write(&(w->device), eth_payload, eth_size) == eth_size) ? 0 : -1;
+}
 
-#ifdef N2N_MULTIPLE_SUPERNODES
-    int     snm_port = 0;
-#endif
 
-    n2n_edge_t eee; /* single instance for this program */
+/** Write the decoded payload of a PACKET from src to the TAP device: the
+ *  frame it is, or each frame in it if it is a bundle.
+ *
+ *  @return 0 or -1 if a frame could not be written
+ */
+static int edge_write_payload(n2n_edge_worker_t *w, const n2n_mac_t src, uint8_t options,
+                              uint8_t *payload, int size)
+{
+    uint8_t *frame = NULL;
+    size_t   off = 0;
+    int      flen;
+    int      hc = 0;
+    int      rc = 0;
 
-    if (-1 == edge_init(&eee))
+    if (0 == (options & N2N_OPTION_BUNDLE))
     {
-        traceError("Failed in edge_init");
-        exit(1);
+        return edge_write_frame(w, src, options, payload, size);
     }
 
-    if (getenv("N2N_KEY"))
+    ++(w->bundler.stats.rx_bundles);
+
+    while ((flen = bundle_next(payload, size, &off, &frame, &hc)) > 0)
     {
-        encrypt_key = strdup(getenv("N2N_KEY"));
-    }
+        ++(w->bundler.stats.rx_frames);
 
-#ifdef WIN32
-    tuntap_dev_name[0] = '\0';
-#endif
-    memset(&(eee.supernode), 0, sizeof(eee.supernode));
-    eee.supernode.family = AF_INET;
+        if (0 != edge_write_frame(w, src, hc ? N2N_OPTION_HDR_COMPRESS : 0, frame, flen))
+        {
+            rc = -1;
+        }
+    }
 
-    linebuffer = (char *) malloc(MAX_CMDLINE_BUFFER_LENGTH);
-    if (!linebuffer)
+    if (flen < 0)
     {
-        traceError("Unable to allocate memory");
-        exit(1);
+        ++(w->bundler.stats.rx_errors);
+        traceWarning("Malformed bundle of %u bytes", (unsigned int) size);
+        rc = -1;
     }
-    snprintf(linebuffer, MAX_CMDLINE_BUFFER_LENGTH, "%s", argv[0]);
 
-#ifdef WIN32
-    for (i = 0; i < (int) strlen(linebuffer); i++)
-        if (linebuffer[i] == '\\')
-            linebuffer[i] = '/';
-#endif
+    return rc;
+}
 
-    for (i = 1; i < argc; ++i)
+
+/** The payload at payload of the datagram in slot w->rx_slot as decoded by
+ *  edge_decode_burst(), or NULL if it was not. */
+static const n2n_trans_buf_t *edge_rx_decoded(const n2n_edge_worker_t *w, const uint8_t *payload)
+{
+    size_t i = w->rx_slot - w->rx_first;
+
+    if ((w->rx_slot >= w->rx_first) && (i < w->rx_ndecoded) && (payload == w->rx_decoded[i].buf))
     {
-        if (argv[i][0] == '@')
-        {
-            if (readConfFile(&argv[i][1], linebuffer) < 0)
-                exit(1); /* <<<<----- check */
-        }
-        else if ((strlen(linebuffer) + strlen(argv[i]) + 2) < MAX_CMDLINE_BUFFER_LENGTH)
-        {
-            strncat(linebuffer, " ", 1);
-            strncat(linebuffer, argv[i], strlen(argv[i]));
-        }
-        else
-        {
-            traceError("too many argument");
-            exit(1);
-        }
+        return &(w->rx_decoded[i]);
     }
-    /*  strip trailing spaces */
-    while (strlen(linebuffer) && linebuffer[strlen(linebuffer) - 1] == ' ')
-        linebuffer[strlen(linebuffer) - 1] = '\0';
 
-    /* build the new argv from the linebuffer */
-    effectiveargv = buildargv(&effectiveargc, linebuffer);
+    return NULL;
+}
 
-    if (linebuffer)
+/** A PACKET has arrived containing an encapsulated ethernet datagram - usually
+ *  encrypted. */
+static int handle_PACKET(n2n_edge_t *eee,
+                         n2n_edge_worker_t *w,
+                         const n2n_common_t *cmn,
+                         const n2n_PACKET_t *pkt,
+                         const n2n_sock_t *orig_sender,
+                         uint8_t *payload,
+                         size_t psize)
+{
+    uint8_t     from_supernode;
+    uint8_t    *eth_payload = NULL;
+    int         retval = -1;
+    time_t      now;
+    n2n_transform_t transform;
+    int         codec;
+
+    now = n2n_now();
+
+    traceDebug("handle_PACKET size %u transform %u",
+               (unsigned int) psize, (unsigned int) pkt->transform);
+    /* hexdump( payload, psize ); */
+
+    from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
+
+    if (from_supernode)
     {
-        free(linebuffer);
-        linebuffer = NULL;
+        ++(w->rx_sup);
+        eee->last_sup = now;
+    }
+    else
+    {
+        ++(w->rx_p2p);
+        eee->last_p2p = now;
     }
 
-    /* {int k;for(k=0;k<effectiveargc;++k)  printf("%s\n",effectiveargv[k]);} */
+    /* Update the sender in peer table entry */
+    if (!touch_known_peer(eee, pkt->srcMac, orig_sender, now))
+    {
+        EDGE_PEERS_WRLOCK(eee);
+        check_peer(eee, from_supernode, pkt->srcMac, orig_sender);
+        EDGE_PEERS_UNLOCK(eee);
+    }
 
-    optarg = NULL;
-    while ((opt = getopt_long(effectiveargc,
-                              effectiveargv,
-                              optstring, long_options, NULL)) != EOF)
+    /* A compressed frame names the transform it is encoded with and the codec. */
+    codec = compress_transform_split(pkt->transform, &transform);
+
+#ifdef N2N_HAVE_PIPELINE
+    if (eee->num_crypto > 0)
     {
-        switch (opt)
+        int rx_transop_idx = transop_enum_to_index(transform);
+
+        if (rx_transop_idx < 0)
         {
-        case 'K':
+            traceError("handle_PACKET dropped unknown transform enum %u",
+                       (unsigned int) pkt->transform);
+            return -1;
+        }
+
+        /* A crypto worker decodes it; the frame is written to the TAP
+         * device in arrival order once done. */
+        return edge_pipe_submit_rx(eee, w, pkt, rx_transop_idx, codec, payload, psize);
+    }
+#endif
+
+    /* Handle transform. */
+    {
+        uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+        uint8_t framebuf[N2N_PKT_BUF_SIZE];
+        int eth_size = -1;
+        int rx_transop_idx = 0;
+
+        rx_transop_idx = transop_enum_to_index(transform);
+
+        if (rx_transop_idx >= 0)
         {
-            if (encrypt_key)
+            n2n_trans_op_t *op = &(w->transop[rx_transop_idx]);
+            const n2n_trans_buf_t *decoded = edge_rx_decoded(w, payload);
+
+            if (decoded)
             {
-                fprintf(stderr, "Error: -K and -k options are mutually exclusive.\n");
-                exit(1);
+                /* Decoded along with the rest of its burst. */
+                eth_payload = decoded->out;
+                eth_size = decoded->ret;
+            }
+            else if (op->rev_inplace)
+            {
+                /* Decode within the receive buffer. eth_payload ends up
+                 * pointing into it. */
+                eth_size = op->rev_inplace(op, payload, psize, &eth_payload);
             }
             else
             {
-                strncpy(eee.keyschedule, optarg, N2N_PATHNAME_MAXLEN - 1);
-                eee.keyschedule[N2N_PATHNAME_MAXLEN - 1] = 0; /* strncpy does not add NULL if the source has no NULL. */
-                traceDebug("keyfile = '%s'\n", eee.keyschedule);
-                fprintf(stderr, "keyfile = '%s'\n", eee.keyschedule);
+                eth_payload = decodebuf;
+                eth_size = op->rev(op, eth_payload, N2N_PKT_BUF_SIZE, payload, psize);
+            }
+            ++(op->rx_cnt); /* stats */
+
+            eth_size = edge_decompress_frame(w, codec, &eth_payload, eth_size, framebuf);
+
+            if (eth_size > 0)
+            {
+                retval = edge_write_payload(w, pkt->srcMac, pkt->options, eth_payload, eth_size);
+            }
+            else
+            {
+                traceWarning("handle_PACKET failed to decode %u byte payload",
+                             (unsigned int) psize);
             }
-            break;
-        }
-        case 'a': /* IP address and mode of TUNTAP interface */
-        {
-            scan_address(ip_addr, N2N_NETMASK_STR_SIZE,
-                         ip_mode, N2N_IF_MODE_SIZE,
-                         optarg);
-            break;
         }
-        case 'c': /* community as a string */
+        else
         {
-            memset(eee.community_name, 0, N2N_COMMUNITY_SIZE);
-            strncpy((char *) eee.community_name, optarg, N2N_COMMUNITY_SIZE);
-            break;
+            traceError("handle_PACKET dropped unknown transform enum %u",
+                       (unsigned int) pkt->transform);
         }
-        case 'E': /* multicast ethernet addresses accepted. */
+    }
+
+    return retval;
+}
+
+
+/** Add the statistics of worker w to tot. */
+static void edge_worker_add_stats(n2n_edge_worker_t *tot, const n2n_edge_worker_t *w)
+{
+    size_t t;
+
+    tot->tx_sup += w->tx_sup;
+    tot->rx_sup += w->rx_sup;
+    tot->tx_p2p += w->tx_p2p;
+    tot->rx_p2p += w->rx_p2p;
+    tot->tx_flow_hits += w->tx_flow_hits;
+    tot->tx_flow_misses += w->tx_flow_misses;
+
+    for (t = 0; t < N2N_MAX_TRANSFORMS; ++t)
+    {
+        tot->transop[t].tx_cnt += w->transop[t].tx_cnt;
+        tot->transop[t].rx_cnt += w->transop[t].rx_cnt;
+    }
+
+    tot->rx_batch.calls += w->rx_batch.calls;
+    tot->rx_batch.datagrams += w->rx_batch.datagrams;
+    tot->tx_batch.flushes += w->tx_batch.flushes;
+    tot->tx_batch.datagrams += w->tx_batch.datagrams;
+    tot->rx_batch.coalesced += w->rx_batch.coalesced;
+    tot->tx_batch.segmented += w->tx_batch.segmented;
+
+    for (t = 0; t < N2N_COMPRESS_CODECS; ++t)
+    {
+        compress_stats_add(&(tot->compress.stats[t]), &(w->compress.stats[t]));
+    }
+
+    hc_stats_add(&(tot->hc.stats), &(w->hc.stats));
+    bundle_stats_add(&(tot->bundler.stats), &(w->bundler.stats));
+}
+
+
+/** Read a datagram from the management UDP socket and take appropriate
+ *  action. */
+static void readFromMgmtSocket(n2n_edge_t *eee, int *keep_running)
+{
+    uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
+    ssize_t             recvlen;
+    ssize_t             sendlen;
+    struct sockaddr_in  sender_sock;
+    socklen_t           i;
+    n2n_edge_worker_t   tot;                            /* statistics summed over the workers */
+    size_t              msg_len;
+    time_t              now;
+
+    now = n2n_now();
+    i = sizeof(sender_sock);
+    recvlen = recvfrom(eee->udp_mgmt_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
+                       (struct sockaddr *) &sender_sock, (socklen_t*) &i);
+
+    if (recvlen < 0)
+    {
+        traceError("mgmt recvfrom failed with %s", strerror(errno));
+
+        return; /* failed to receive data from UDP */
+    }
+
+    if (recvlen >= 4)
+    {
+        if (0 == memcmp(udp_buf, "stop", 4))
         {
-            eee.drop_multicast = 0;
-            traceDebug("Enabling ethernet multicast traffic\n");
-            break;
+            traceError("stop command received.");
+            *keep_running = 0;
+            return;
         }
 
-#ifndef WIN32
-        case 'u': /* unprivileged uid */
+        if (0 == memcmp(udp_buf, "help", 4))
         {
-            userid = atoi(optarg);
-            break;
+            msg_len = 0;
+            ++traceLevel;
+
+            msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                                "Help for edge management console:\n"
+                                "  stop    Gracefully exit edge\n"
+                                "  help    This help message\n"
+                                "  +verb   Increase verbosity of logging\n"
+                                "  -verb   Decrease verbosity of logging\n"
+                                "  reload  Re-read the keyschedule\n"
+                                "  <enter> Display statistics\n\n");
+
+            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
+                   (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+
+            return;
         }
-        case 'g': /* unprivileged uid */
+
+    }
+
+    if (recvlen >= 5)
+    {
+        if (0 == memcmp(udp_buf, "+verb", 5))
         {
-            groupid = atoi(optarg);
-            break;
+            msg_len = 0;
+            ++traceLevel;
+
+            traceError("+verb traceLevel=%u", (unsigned int) traceLevel);
+            msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                                "> +OK traceLevel=%u\n", (unsigned int) traceLevel);
+
+            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
+                   (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+
+            return;
         }
-#endif
-#ifdef N2N_HAVE_DAEMON
-        case 'f': /* do not fork as daemon */
+
+        if (0 == memcmp(udp_buf, "-verb", 5))
         {
-            eee.daemon = 0;
-            break;
+            msg_len = 0;
+
+            if (traceLevel > 0)
+            {
+                --traceLevel;
+                msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
+                                    "> -OK traceLevel=%u\n", traceLevel);
+            }
+            else
+            {
+                msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
+                                    "> -NOK traceLevel=%u\n", traceLevel);
+            }
+
+            traceError("-verb traceLevel=%u", (unsigned int) traceLevel);
+
+            sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
+                (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+            return;
         }
-#endif /* #ifdef N2N_HAVE_DAEMON */
+    }
 
-        case 'm': /* TUNTAP MAC address */
+    if (recvlen >= 6)
+    {
+        if (0 == memcmp(udp_buf, "reload", 6))
         {
-            strncpy(device_mac, optarg, N2N_MACNAMSIZ);
-            break;
+            if (strlen(eee->keyschedule) > 0)
+            {
+                /* Workers notice the new generation and reload their own copy. */
+                ++(eee->key_gen);
+
+                if (edge_init_keyschedule(eee, &(eee->workers[0])) == 0)
+                {
+                    msg_len = 0;
+                    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                                        "> OK\n");
+                    sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
+                           (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+                }
+                return;
+            }
         }
+    }
+
+    traceDebug("mgmt status rq");
+
+    /* Sum the worker statistics. Counters owned by other threads may be a
+     * little stale. */
+    memset(&tot, 0, sizeof(tot));
+    for (i = 0; i < eee->num_workers; ++i)
+    {
+        edge_worker_add_stats(&tot, &(eee->workers[i]));
+    }
+#ifdef N2N_HAVE_PIPELINE
+    for (i = 0; i < eee->num_crypto; ++i)
+    {
+        edge_worker_add_stats(&tot, &(eee->pipeline.crypto[i]));
+    }
+#endif
+
+    msg_len = 0;
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
+                        "Statistics for edge\n");
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len), 
+                        "uptime %lu\n",
+                        n2n_now() - eee->start_time);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "paths  super:%u,%u p2p:%u,%u\n",
+                        (unsigned int) tot.tx_sup,
+                        (unsigned int) tot.rx_sup,
+                        (unsigned int) tot.tx_p2p,
+                        (unsigned int) tot.rx_p2p);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "flows  hit:%u miss:%u\n",
+                        (unsigned int) tot.tx_flow_hits,
+                        (unsigned int) tot.tx_flow_misses);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "trans:null |%6u|%6u|\n"
+                        "trans:tf   |%6u|%6u|\n"
+                        "trans:aes  |%6u|%6u|\n"
+                        "trans:gcm  |%6u|%6u|\n"
+                        "trans:cc20 |%6u|%6u|\n",
+                        (unsigned int) tot.transop[N2N_TRANSOP_NULL_IDX].tx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_NULL_IDX].rx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_TF_IDX].tx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_TF_IDX].rx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_AESCBC_IDX].tx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_AESCBC_IDX].rx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_AESGCM_IDX].tx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_AESGCM_IDX].rx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_CHACHA20_IDX].tx_cnt,
+                        (unsigned int) tot.transop[N2N_TRANSOP_CHACHA20_IDX].rx_cnt);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "batch  size:%u rx:%u.%u tx:%u.%u (avg datagrams per call)\n",
+                        (unsigned int) eee->batch_size,
+                        batch_fill_x10(tot.rx_batch.datagrams, tot.rx_batch.calls) / 10,
+                        batch_fill_x10(tot.rx_batch.datagrams, tot.rx_batch.calls) % 10,
+                        batch_fill_x10(tot.tx_batch.datagrams, tot.tx_batch.flushes) / 10,
+                        batch_fill_x10(tot.tx_batch.datagrams, tot.tx_batch.flushes) % 10);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "offload gro:%s %lu gso:%s %lu (datagrams coalesced, segmented)\n",
+                        eee->workers[0].rx_batch.gro ? "on" : "off",
+                        (long unsigned int) tot.rx_batch.coalesced,
+                        eee->workers[0].tx_batch.gso ? "on" : "off",
+                        (long unsigned int) tot.tx_batch.segmented);
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if (NULL != eee->device.vnet)
+    {
+        size_t rx_large = 0, rx_segments = 0, tx_large = 0, tx_coalesced = 0, dropped = 0;
+
+        for (i = 0; i < eee->num_workers; ++i)
+        {
+            const n2n_vnet_t *v = eee->workers[i].device.vnet;
+
+            rx_large += v->rx_large;
+            rx_segments += v->rx_segments;
+            tx_large += v->tx_large;
+            tx_coalesced += v->tx_coalesced;
+            dropped += v->rx_dropped;
+        }
+
+        msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                            "tap    rx:%lu->%lu tx:%lu<-%lu dropped:%lu (large frames, segments)\n",
+                            (long unsigned int) rx_large, (long unsigned int) rx_segments,
+                            (long unsigned int) tx_large, (long unsigned int) tx_coalesced,
+                            (long unsigned int) dropped);
+    }
+#endif
+
+    for (i = N2N_COMPRESS_NONE + 1; i < N2N_COMPRESS_CODECS; ++i)
+    {
+        const struct n2n_codec_stats *st = &(tot.compress.stats[i]);
+
+        if ((i != eee->compress_codec) && (0 == st->rx_frames) && (0 == st->rx_errors))
+        {
+            continue;
+        }
+
+        msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                            "zip:%-4s tx:%lu/%lu ratio:%u%% skip small:%lu hint:%lu probe:%lu poor:%lu "
+                            "cpu:%luus rx:%lu err:%lu cpu:%luus\n",
+                            compress_codec_name(i),
+                            (long unsigned int) st->tx_compressed,
+                            (long unsigned int) st->tx_frames,
+                            (unsigned int) ((st->tx_bytes_in > 0) ? (100 * st->tx_bytes_out / st->tx_bytes_in) : 100),
+                            (long unsigned int) st->tx_small,
+                            (long unsigned int) st->tx_hinted,
+                            (long unsigned int) st->tx_probed,
+                            (long unsigned int) st->tx_poor,
+                            (long unsigned int) (st->tx_nsec / 1000),
+                            (long unsigned int) st->rx_frames,
+                            (long unsigned int) st->rx_errors,
+                            (long unsigned int) (st->rx_nsec / 1000));
+    }
+
+    if (eee->options & N2N_OPTION_HDR_COMPRESS)
+    {
+        const struct n2n_hc_stats *st = &(tot.hc.stats);
+
+        msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                            "hdrc   tx:%lu/%lu ir:%lu saved:%ld rx:%lu ir:%lu err:%lu\n",
+                            (long unsigned int) st->tx_co,
+                            (long unsigned int) st->tx_frames,
+                            (long unsigned int) st->tx_ir,
+                            (long int) st->tx_saved,
+                            (long unsigned int) st->rx_co,
+                            (long unsigned int) st->rx_ir,
+                            (long unsigned int) st->rx_errors);
+    }
+
+    if (eee->options & N2N_OPTION_BUNDLE)
+    {
+        const struct n2n_bundle_stats *st = &(tot.bundler.stats);
+
+        msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                            "bundle tx:%lu in %lu alone:%lu rx:%lu in %lu err:%lu (frames in bundles)\n",
+                            (long unsigned int) (st->tx_frames - st->tx_alone),
+                            (long unsigned int) st->tx_bundles,
+                            (long unsigned int) st->tx_alone,
+                            (long unsigned int) st->rx_frames,
+                            (long unsigned int) st->rx_bundles,
+                            (long unsigned int) st->rx_errors);
+    }
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "queues %u\n",
+                        (unsigned int) eee->num_workers);
+
+#ifdef N2N_HAVE_PIPELINE
+    if (eee->num_crypto > 0)
+    {
+        msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                            "pipe   crypto:%u rx_drops:%u\n",
+                            (unsigned int) eee->num_crypto,
+                            (unsigned int) eee->pipeline.rx_drops);
+    }
+#endif
+
+    EDGE_PEERS_RDLOCK(eee);
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "peers  pend:%u full:%u evicted:%u\n",
+                        (unsigned int) peer_table_size(&eee->pending_peers),
+                        (unsigned int) peer_table_size(&eee->known_peers),
+                        (unsigned int) (eee->pending_peers.evictions + eee->known_peers.evictions));
+    EDGE_PEERS_UNLOCK(eee);
+
+    msg_len += snprintf((char *) (udp_buf + msg_len), (N2N_PKT_BUF_SIZE - msg_len),
+                        "last   super:%lu(%ld sec ago) p2p:%lu(%ld sec ago)\n",
+                        eee->last_sup, (now - eee->last_sup), eee->last_p2p, (now - eee->last_p2p));
+
+    traceDebug("mgmt status sending: %s", udp_buf);
+
+    sendlen = sendto(eee->udp_mgmt_sock, udp_buf, msg_len, 0/*flags*/,
+        (struct sockaddr *) &sender_sock, sizeof(struct sockaddr_in));
+
+}
+
+
+/** Examine a datagram received on the main UDP socket and act on it. */
+static void process_udp(n2n_edge_t *eee,
+                        n2n_edge_worker_t *w,
+                        const struct sockaddr_in *sender_sock,
+                        uint8_t *udp_buf,
+                        size_t recvlen)
+{
+    n2n_common_t        cmn; /* common fields in the packet header */
+
+    n2n_sock_str_t      sockbuf1;
+    n2n_sock_str_t      sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
+    macstr_t            mac_buf1;
+    macstr_t            mac_buf2;
+
+    size_t              rem;
+    size_t              idx;
+    size_t              msg_type;
+    uint8_t             from_supernode;
+    n2n_sock_t          sender;
+    n2n_sock_t         *orig_sender = NULL;
+    time_t              now = 0;
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+    size_t              i;
+#endif
+
+    /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
+     * IP transport version the packet arrived on. May need to UDP sockets. */
+    sender.family = AF_INET; /* udp_sock was opened PF_INET v4 */
+    sender.port = ntohs(sender_sock->sin_port);
+    memcpy(&(sender.addr.v4), &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
+
+    /* The packet may not have an orig_sender socket spec. So default to last
+     * hop as sender. */
+    orig_sender = &sender;
+
+    traceInfo("### Rx N2N UDP (%d) from %s",
+               (signed int) recvlen, sock_to_cstr(sockbuf1, &sender));
+
+    /* hexdump( udp_buf, recvlen ); */
+
+    rem = recvlen; /* Counts down bytes of packet to protect against buffer overruns. */
+    idx = 0; /* marches through packet header as parts are decoded. */
+    if (decode_common(&cmn, udp_buf, &rem, &idx) < 0)
+    {
+        traceError("Failed to decode common section in N2N_UDP");
+        return; /* failed to decode packet */
+    }
+
+    now = n2n_now();
+
+    msg_type = cmn.pc; /* packet code */
+    from_supernode = cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
+
+    if (0 == memcmp(cmn.community, eee->community_name, N2N_COMMUNITY_SIZE))
+    {
+        if (msg_type == MSG_TYPE_PACKET)
+        {
+            /* process PACKET - most frequent so first in list. */
+            n2n_PACKET_t pkt;
+
+            decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
+
+            if (pkt.sock.family)
+            {
+                orig_sender = &(pkt.sock);
+            }
+
+            traceInfo("Rx PACKET from %s (%s)",
+                sock_to_cstr(sockbuf1, &sender),
+                sock_to_cstr(sockbuf2, orig_sender));
+
+            handle_PACKET(eee, w, &cmn, &pkt, orig_sender, udp_buf + idx, recvlen - idx);
+        }
+        else if (msg_type == MSG_TYPE_REGISTER)
+        {
+            /* Another edge is registering with us */
+            n2n_REGISTER_t reg;
+
+            decode_REGISTER(&reg, &cmn, udp_buf, &rem, &idx);
+
+            if (reg.sock.family)
+            {
+                orig_sender = &(reg.sock);
+            }
+
+            traceInfo("Rx REGISTER src=%s dst=%s from peer %s (%s)",
+                       macaddr_str(mac_buf1, reg.srcMac),
+                       macaddr_str(mac_buf2, reg.dstMac),
+                       sock_to_cstr(sockbuf1, &sender),
+                       sock_to_cstr(sockbuf2, orig_sender));
+
+            EDGE_PEERS_WRLOCK(eee);
+
+            if (0 == memcmp(reg.dstMac, (eee->device.mac_addr), 6))
+            {
+                check_peer(eee, from_supernode, reg.srcMac, orig_sender);
+            }
+
+            set_peer_options(eee, reg.srcMac, eee->options & reg.options);
+            send_register_ack(eee, orig_sender, &reg);
+
+            EDGE_PEERS_UNLOCK(eee);
+        }
+        else if (msg_type == MSG_TYPE_REGISTER_ACK)
+        {
+            /* Peer edge is acknowledging our register request */
+            n2n_REGISTER_ACK_t ra;
+
+            decode_REGISTER_ACK(&ra, &cmn, udp_buf, &rem, &idx);
+
+            if (ra.sock.family)
+            {
+                orig_sender = &(ra.sock);
+            }
+
+            traceInfo("Rx REGISTER_ACK src=%s dst=%s from peer %s (%s)",
+                       macaddr_str(mac_buf1, ra.srcMac),
+                       macaddr_str(mac_buf2, ra.dstMac),
+                       sock_to_cstr(sockbuf1, &sender),
+                       sock_to_cstr(sockbuf2, orig_sender));
+
+            /* Move from pending_peers to known_peers; ignore if not in pending. */
+            EDGE_PEERS_WRLOCK(eee);
+            set_peer_operational(eee, ra.srcMac, &sender, eee->options & ra.options);
+            EDGE_PEERS_UNLOCK(eee);
+        }
+        else if (msg_type == MSG_TYPE_REGISTER_SUPER_ACK)
+        {
+            n2n_REGISTER_SUPER_ACK_t ra;
+
+            EDGE_PEERS_WRLOCK(eee);
+
+            if (eee->sn_wait)
+            {
+                decode_REGISTER_SUPER_ACK(&ra, &cmn, udp_buf, &rem, &idx);
+
+                if (ra.sock.family)
+                {
+                    orig_sender = &(ra.sock);
+                }
+
+                traceNormal("Rx REGISTER_SUPER_ACK myMAC=%s [%s] (external %s). Attempts %u",
+                           macaddr_str(mac_buf1, ra.edgeMac),
+                           sock_to_cstr(sockbuf1, &sender),
+                           sock_to_cstr(sockbuf2, orig_sender),
+                           (unsigned int) eee->sup_attempts);
+
+                if (0 == memcmp(ra.cookie, eee->last_cookie, N2N_COOKIE_SIZE))
+                {
+                    if (ra.num_sn > 0)
+                    {
+#ifdef N2N_MULTIPLE_SUPERNODES
+                        for (i = 0; i < ra.num_sn; i++)
+                        {
+                            if (add_supernode(eee, &ra.sn_bak[i]))
+                                break;
+
+                            traceNormal("Rx REGISTER_SUPER_ACK backup supernode at %s",
+                                       sock_to_cstr(sockbuf1, &(ra.sn_bak[i])));
+                        }
+#else
+                        traceNormal("Rx REGISTER_SUPER_ACK backup supernode at %s",
+                                   sock_to_cstr(sockbuf1, &(ra.sn_bak)));
+#endif
+                    }
+
+                    eee->last_sup = now;
+                    eee->sn_wait = 0;
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+                    eee->reg_sn.timestamp = now; //TODO check if sending sn is reg_sn
+                    eee->sup_attempts = 0; /* we got a response, so no more attempts */
+#else
+                    eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS; /* refresh because we got a response */
+#endif
+
+                    /* REVISIT: store sn_back */
+                    eee->register_lifetime = ra.lifetime;
+                    eee->register_lifetime = MAX( eee->register_lifetime, REGISTER_SUPER_INTERVAL_MIN );
+                    eee->register_lifetime = MIN( eee->register_lifetime, REGISTER_SUPER_INTERVAL_MAX );
+                }
+                else
+                {
+                    traceWarning("Rx REGISTER_SUPER_ACK with wrong or old cookie.");
+                }
+            }
+            else
+            {
+                traceWarning("Rx REGISTER_SUPER_ACK with no outstanding REGISTER_SUPER.");
+            }
+
+            EDGE_PEERS_UNLOCK(eee);
+        }
+        else
+        {
+            /* Not a known message type */
+            traceWarning("Unable to handle packet type %d: ignored", (signed int) msg_type);
+            return;
+        }
+    } /* if (community match) */
+    else
+    {
+        traceWarning("Received packet with invalid community");
+    }
+
+}
+
+
+/** Decode the payloads of the PACKETs for our community among the count
+ *  datagrams from slot first on, where they lie, for handle_PACKET() to pick
+ *  up. Those of one transop are decoded with one call to transop_rev_batch().
+ */
+static void edge_decode_burst(n2n_edge_t *eee, n2n_edge_worker_t *w, size_t first, size_t count)
+{
+    n2n_trans_buf_t group[N2N_BATCH_MAX];
+    size_t member[N2N_BATCH_MAX];
+    int transop_idx[N2N_BATCH_MAX];
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < count; ++i)
+    {
+        uint8_t *udp_buf = rx_batch_buf(&w->rx_batch, first + i);
+        size_t recvlen = w->rx_batch.lens[first + i];
+        n2n_trans_buf_t *b = &(w->rx_decoded[i]);
+        n2n_transform_t transform;
+        n2n_common_t cmn;
+        n2n_PACKET_t pkt;
+        size_t rem = recvlen;
+        size_t idx = 0;
+
+        transop_idx[i] = -1;
+        b->buf = NULL;
+
+        if ((decode_common(&cmn, udp_buf, &rem, &idx) < 0) || (MSG_TYPE_PACKET != cmn.pc) ||
+            (0 != memcmp(cmn.community, eee->community_name, N2N_COMMUNITY_SIZE)))
+        {
+            continue; /* left to process_udp() */
+        }
+
+        decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
+        compress_transform_split(pkt.transform, &transform);
+
+        transop_idx[i] = transop_enum_to_index(transform);
+        if (transop_idx[i] >= 0)
+        {
+            b->buf = udp_buf + idx;
+            b->len = recvlen - idx;
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        int t = transop_idx[i];
+        size_t n = 0;
+
+        if (t < 0)
+        {
+            continue;
+        }
+
+        for (j = i; j < count; ++j)
+        {
+            if (transop_idx[j] == t)
+            {
+                transop_idx[j] = -1;
+                member[n] = j;
+                group[n++] = w->rx_decoded[j];
+            }
+        }
+
+        transop_rev_batch(&(w->transop[t]), group, n);
+
+        for (j = 0; j < n; ++j)
+        {
+            w->rx_decoded[member[j]] = group[j];
+        }
+    }
+
+    w->rx_first = first;
+    w->rx_ndecoded = count;
+}
+
+
+/** Read a burst of datagrams from the main UDP socket to the internet.
+ *
+ *  Unless pipelined the PACKETs of a burst are decoded together first, up to
+ *  N2N_BATCH_MAX at a time.
+ */
+static void readFromIPSocket(n2n_edge_t *eee, n2n_edge_worker_t *w)
+{
+    ssize_t             n;
+    size_t              i;
+
+    n = rx_batch_recv(&w->rx_batch, w->udp_sock);
+
+    if (n < 0)
+    {
+        traceError("recvfrom failed with %s", strerror(errno));
+
+        return; /* failed to receive data from UDP */
+    }
+
+    for (i = 0; i < (size_t) n; ++i)
+    {
+        if ((0 == (i % N2N_BATCH_MAX)) && (n > 1) && (0 == eee->num_crypto))
+        {
+            edge_decode_burst(eee, w, i, MIN((size_t) n - i, N2N_BATCH_MAX));
+        }
+
+        w->rx_slot = i;
+        process_udp(eee, w, &(w->rx_batch.addrs[i]),
+                    rx_batch_buf(&w->rx_batch, i), w->rx_batch.lens[i]);
+    }
+
+    w->rx_ndecoded = 0;
+}
+
+/* ***************************************************** */
+
+#ifdef WIN32
+static DWORD tunReadThread(LPVOID lpArg)
+{
+    n2n_edge_t *eee = (n2n_edge_t*) lpArg;
+
+    while (1)
+    {
+        readFromTAPSocket(eee, &(eee->workers[0]));
+    }
+
+    return ((DWORD) NULL);
+}
+
+
+/** Start a second thread in Windows because TUNTAP interfaces do not expose
+ *  file descriptors. */
+static void startTunReadThread(n2n_edge_t *eee)
+{
+    HANDLE hThread;
+    DWORD dwThreadId;
+
+    hThread = CreateThread(NULL,         /* security attributes */
+                           0,            /* use default stack size */
+                           (LPTHREAD_START_ROUTINE) tunReadThread, /* thread function */
+                           (void*) eee,  /* argument to thread function */
+                           0,            /* thread creation flags */
+                           &dwThreadId); /* thread id out */
+}
+#endif
+
+/* ***************************************************** */
+
+/** Resolve the supernode IP address.
+ *
+ *  REVISIT: This is a really bad idea. The edge will block completely while the
+ *           hostname resolution is performed. This could take 15 seconds.
+ */
+static void supernode2addr(n2n_sock_t *sn, const n2n_sn_name_t addrIn)
+{
+    n2n_sn_name_t addr;
+    const char *supernode_host;
+
+    memcpy(addr, addrIn, N2N_EDGE_SN_HOST_SIZE);
+
+    supernode_host = strtok(addr, ":");
+
+    if (supernode_host)
+    {
+        in_addr_t sn_addr;
+        char *supernode_port = strtok(NULL, ":");
+        const struct addrinfo aihints = { 0, PF_INET, 0, 0, 0, NULL, NULL, NULL };
+        struct addrinfo *ainfo = NULL;
+        int nameerr;
+
+        if (supernode_port)
+            sn->port = atoi(supernode_port);
+        else
+            traceWarning("Bad supernode parameter (-l <host:port>) %s %s:%s",
+                       addr, supernode_host, supernode_port);
+
+        nameerr = getaddrinfo(supernode_host, NULL, &aihints, &ainfo);
+
+        if (0 == nameerr)
+        {
+            struct sockaddr_in *saddr;
+
+            /* ainfo s the head of a linked list if non-NULL. */
+            if (ainfo && (PF_INET == ainfo->ai_family))
+            {
+                /* It is definitely and IPv4 address -> sockaddr_in */
+                saddr = (struct sockaddr_in *) ainfo->ai_addr;
+
+                memcpy(sn->addr.v4, &(saddr->sin_addr.s_addr), IPV4_SIZE);
+                sn->family = AF_INET;
+            }
+            else
+            {
+                /* Should only return IPv4 addresses due to aihints. */
+                traceWarning("Failed to resolve supernode IPv4 address for %s", supernode_host);
+            }
+
+            freeaddrinfo(ainfo); /* free everything allocated by getaddrinfo(). */
+            ainfo = NULL;
+        }
+        else
+        {
+            traceWarning("Failed to resolve supernode host %s, assuming numeric", supernode_host);
+            sn_addr = inet_addr(supernode_host); /* uint32_t */
+            memcpy(sn->addr.v4, &(sn_addr), IPV4_SIZE);
+            sn->family = AF_INET;
+        }
+
+    }
+    else
+        traceWarning("Wrong supernode parameter (-l <host:port>)");
+}
+
+/* ***************************************************** */
+
+
+/** Find the address and IP mode for the tuntap device.
+ *
+ *  s is one of these forms:
+ *
+ *  <host> := <hostname> | A.B.C.D
+ *
+ *  <host> | static:<host> | dhcp:<host>
+ *
+ *  If the mode is present (colon required) then fill ip_mode with that value
+ *  otherwise do not change ip_mode. Fill ip_mode with everything after the
+ *  colon if it is present; or s if colon is not present.
+ *
+ *  ip_add and ip_mode are NULL terminated if modified.
+ *
+ *  return 0 on success and -1 on error
+ */
+static int scan_address(char *ip_addr, size_t addr_size,
+                        char *ip_mode, size_t mode_size,
+                        const char *s)
+{
+    int retval = -1;
+    char *p;
+
+    if ((NULL == s) || (NULL == ip_addr))
+    {
+        return -1;
+    }
+
+    memset(ip_addr, 0, addr_size);
+
+    p = strpbrk(s, ":");
+
+    if (p)
+    {
+        /* colon is present */
+        if (ip_mode)
+        {
+            size_t end = 0;
+
+            memset(ip_mode, 0, mode_size);
+            end = MIN( p-s, (ssize_t)(mode_size-1) ); /* ensure NULL term */
+            strncpy(ip_mode, s, end);
+            strncpy(ip_addr, p + 1, addr_size - 1); /* ensure NULL term */
+            retval = 0;
+        }
+    }
+    else
+    {
+        /* colon is not present */
+        strncpy(ip_addr, s, addr_size);
+    }
+
+    return retval;
+}
+
+#ifdef N2N_HAVE_PIPELINE
+/** Crypto threads for -P auto: the CPUs left over by the TAP reader and the
+ *  main thread, at least one. None on a single CPU, where the pipeline would
+ *  only add hand-offs between threads taking turns.
+ */
+static size_t edge_auto_crypto_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 2)
+    {
+        return 0;
+    }
+
+    return MAX(1, MIN(cpus - 2, N2N_EDGE_WORKERS_MAX));
+}
+#endif
+
+static int run_loop(n2n_edge_t *eee);
+
+#define N2N_NETMASK_STR_SIZE    16 /* dotted decimal 12 numbers + 3 dots */
+#define N2N_MACNAMSIZ           18 /* AA:BB:CC:DD:EE:FF + NULL*/
+#define N2N_IF_MODE_SIZE        16 /* static | dhcp */
+
+/** Entry point to program from kernel. */
+int main(int argc, char* argv[])
+{
+    int     opt;
+    int     local_port = 0 /* any port */;
+    int     mgmt_port = N2N_EDGE_MGMT_PORT; /* 5644 by default */
+    char    tuntap_dev_name[N2N_IFNAMSIZ] = "edge0";
+    char    ip_mode[N2N_IF_MODE_SIZE] = "static";
+    char    ip_addr[N2N_NETMASK_STR_SIZE] = "";
+    char    netmask[N2N_NETMASK_STR_SIZE] = "255.255.255.0";
+    int     mtu = DEFAULT_MTU;
+    int     got_s = 0;
+    int     tap_offload = 0;
+    int     crypto_auto = 0;
+
+#ifndef WIN32
+    uid_t   userid = 0; /* root is the only guaranteed ID */
+    gid_t   groupid = 0; /* root is the only guaranteed ID */
+#endif
+
+    char    device_mac[N2N_MACNAMSIZ] = "";
+    char   *encrypt_key = NULL;
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+    const char *optstring = "K:k:a:bB:c:Eu:g:m:M:Os:S:d:l:p:Q:P:fvhrt:z::HA:";
+#else
+    const char *optstring = "K:k:a:bB:c:Eu:g:m:M:Os:d:l:p:Q:P:fvhrt:z::HA:";
+#endif
+
+    int     i, effectiveargc = 0;
+    char  **effectiveargv = NULL;
+    char   *linebuffer = NULL;
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+    int     snm_port = 0;
+#endif
+
+    n2n_edge_t eee; /* single instance for this program */
+
+    if (-1 == edge_init(&eee))
+    {
+        traceError("Failed in edge_init");
+        exit(1);
+    }
+
+    if (getenv("N2N_KEY"))
+    {
+        encrypt_key = strdup(getenv("N2N_KEY"));
+    }
+
+#ifdef WIN32
+    tuntap_dev_name[0] = '\0';
+#endif
+    memset(&(eee.supernode), 0, sizeof(eee.supernode));
+    eee.supernode.family = AF_INET;
+
+    linebuffer = (char *) malloc(MAX_CMDLINE_BUFFER_LENGTH);
+    if (!linebuffer)
+    {
+        traceError("Unable to allocate memory");
+        exit(1);
+    }
+    snprintf(linebuffer, MAX_CMDLINE_BUFFER_LENGTH, "%s", argv[0]);
+
+#ifdef WIN32
+    for (i = 0; i < (int) strlen(linebuffer); i++)
+        if (linebuffer[i] == '\\')
+            linebuffer[i] = '/';
+#endif
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (argv[i][0] == '@')
+        {
+            if (readConfFile(&argv[i][1], linebuffer) < 0)
+                exit(1); /* <<<<----- check */
+        }
+        else if ((strlen(linebuffer) + strlen(argv[i]) + 2) < MAX_CMDLINE_BUFFER_LENGTH)
+        {
+            strncat(linebuffer, " ", 1);
+            strncat(linebuffer, argv[i], strlen(argv[i]));
+        }
+        else
+        {
+            traceError("too many argument");
+            exit(1);
+        }
+    }
+    /*  strip trailing spaces */
+    while (strlen(linebuffer) && linebuffer[strlen(linebuffer) - 1] == ' ')
+        linebuffer[strlen(linebuffer) - 1] = '\0';
+
+    /* build the new argv from the linebuffer */
+    effectiveargv = buildargv(&effectiveargc, linebuffer);
+
+    if (linebuffer)
+    {
+        free(linebuffer);
+        linebuffer = NULL;
+    }
+
+    /* {int k;for(k=0;k<effectiveargc;++k)  printf("%s\n",effectiveargv[k]);} */
+
+    optarg = NULL;
+    while ((opt = getopt_long(effectiveargc,
+                              effectiveargv,
+                              optstring, long_options, NULL)) != EOF)
+    {
+        switch (opt)
+        {
+        case 'K':
+        {
+            if (encrypt_key)
+            {
+                fprintf(stderr, "Error: -K and -k options are mutually exclusive.\n");
+                exit(1);
+            }
+            else
+            {
+                strncpy(eee.keyschedule, optarg, N2N_PATHNAME_MAXLEN - 1);
+                eee.keyschedule[N2N_PATHNAME_MAXLEN - 1] = 0; /* strncpy does not add NULL if the source has no NULL. */
+                traceDebug("keyfile = '%s'\n", eee.keyschedule);
+                fprintf(stderr, "keyfile = '%s'\n", eee.keyschedule);
+            }
+            break;
+        }
+        case 'a': /* IP address and mode of TUNTAP interface */
+        {
+            scan_address(ip_addr, N2N_NETMASK_STR_SIZE,
+                         ip_mode, N2N_IF_MODE_SIZE,
+                         optarg);
+            break;
+        }
+        case 'c': /* community as a string */
+        {
+            memset(eee.community_name, 0, N2N_COMMUNITY_SIZE);
+            strncpy((char *) eee.community_name, optarg, N2N_COMMUNITY_SIZE);
+            break;
+        }
+        case 'E': /* multicast ethernet addresses accepted. */
+        {
+            eee.drop_multicast = 0;
+            traceDebug("Enabling ethernet multicast traffic\n");
+            break;
+        }
+
+#ifndef WIN32
+        case 'u': /* unprivileged uid */
+        {
+            userid = atoi(optarg);
+            break;
+        }
+        case 'g': /* unprivileged uid */
+        {
+            groupid = atoi(optarg);
+            break;
+        }
+#endif
+#ifdef N2N_HAVE_DAEMON
+        case 'f': /* do not fork as daemon */
+        {
+            eee.daemon = 0;
+            break;
+        }
+#endif /* #ifdef N2N_HAVE_DAEMON */
+
+        case 'm': /* TUNTAP MAC address */
+        {
+            strncpy(device_mac, optarg, N2N_MACNAMSIZ);
+            break;
+        }
+
+        case 'M': /* TUNTAP MTU */
+        {
+            mtu = atoi(optarg);
+            break;
+        }
+
+        case 'k': /* encrypt key */
+        {
+            if (strlen(eee.keyschedule) > 0)
+            {
+                fprintf(stderr, "Error: -K and -k options are mutually exclusive.\n");
+                exit(1);
+            }
+            else
+            {
+                traceDebug("encrypt_key = '%s'\n", encrypt_key);
+                encrypt_key = strdup(optarg);
+            }
+            break;
+        }
+        case 'r': /* enable packet routing across n2n endpoints */
+        {
+            eee.allow_routing = 1;
+            break;
+        }
+
+        case 'l': /* supernode-list */
+        {
+            if (eee.sn_num < N2N_EDGE_NUM_SUPERNODES)
+            {
+                strncpy((eee.sn_ip_array[eee.sn_num]), optarg, N2N_EDGE_SN_HOST_SIZE);
+                traceDebug("Adding supernode[%u] = %s\n", (unsigned int) eee.sn_num, (eee.sn_ip_array[eee.sn_num]));
+                ++eee.sn_num;
+            }
+            else
+            {
+                fprintf(stderr, "Too many supernodes!\n");
+                exit(1);
+            }
+            break;
+        }
+
+#if defined(N2N_CAN_NAME_IFACE)
+        case 'd': /* TUNTAP name */
+        {
+            strncpy(tuntap_dev_name, optarg, N2N_IFNAMSIZ);
+            break;
+        }
+#endif
+
+        case 'b':
+        {
+            eee.re_resolve_supernode_ip = 1;
+            break;
+        }
+
+        case 'p':
+        {
+            local_port = atoi(optarg);
+            break;
+        }
+
+        case 'B':
+        {
+            eee.batch_size = MAX(1, MIN(atoi(optarg), N2N_BATCH_MAX));
+            break;
+        }
+
+        case 'z':
+        {
+            eee.compress_codec = (NULL != optarg) ? compress_codec_by_name(optarg) : N2N_COMPRESS_LZO;
+            if (eee.compress_codec < 0)
+            {
+                fprintf(stderr, "Error: unknown compression codec '%s'.\n", optarg);
+                exit(1);
+            }
+            break;
+        }
+
+        case 'O':
+        {
+            tap_offload = 1;
+            break;
+        }
+
+        case 'H':
+        {
+            eee.options |= N2N_OPTION_HDR_COMPRESS;
+            break;
+        }
+
+        case 'A':
+        {
+            eee.bundle_usec = MAX(0, MIN(atoi(optarg), N2N_EDGE_BUNDLE_USEC_MAX));
+            eee.options |= N2N_OPTION_BUNDLE;
+            break;
+        }
+
+        case 'Q':
+        {
+            eee.num_workers = MAX(1, MIN(atoi(optarg), N2N_EDGE_WORKERS_MAX));
+            break;
+        }
+
+        case 'P':
+        {
+            /* 0 turns the pipeline off again, e.g. after a -P in a config file. */
+            crypto_auto = (0 == strcmp(optarg, "auto"));
+            eee.num_crypto = crypto_auto ? 0 : MAX(0, MIN(atoi(optarg), N2N_EDGE_WORKERS_MAX));
+            break;
+        }
+
+        case 't':
+        {
+            mgmt_port = atoi(optarg);
+            break;
+        }
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+        case 'S':
+        {
+            snm_port = atoi(optarg);
+            break;
+        }
+#endif
+
+        case 's': /* Subnet Mask */
+        {
+            if (0 != got_s)
+            {
+                traceWarning("Multiple subnet masks supplied.");
+            }
+            strncpy(netmask, optarg, N2N_NETMASK_STR_SIZE);
+            got_s = 1;
+            break;
+        }
+
+        case 'h': /* help */
+        {
+            help();
+            break;
+        }
+
+        case 'v': /* verbose */
+        {
+            ++traceLevel; /* do 2 -v flags to increase verbosity to DEBUG level*/
+            break;
+        }
+
+        } /* end switch */
+    }
+
+
+#ifdef N2N_HAVE_DAEMON
+    if (eee.daemon)
+    {
+        useSyslog = 1; /* traceEvent output now goes to syslog. */
+        if (-1 == daemon(0, 0))
+        {
+            traceError("Failed to become daemon.");
+            exit(-5);
+        }
+    }
+#endif /* #ifdef N2N_HAVE_DAEMON */
+
+
+    traceNormal("Starting n2n edge %s %s", n2n_sw_version, n2n_sw_buildDate);
+
+
+    for (i = 0; i < N2N_EDGE_NUM_SUPERNODES; ++i)
+    {
+        traceNormal("supernode %u => %s\n", i, (eee.sn_ip_array[i]));
+    }
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+    if (load_supernodes(&eee) > 0)
+#endif
+    supernode2addr(&(eee.supernode), eee.sn_ip_array[eee.sn_idx]);
+
+
+    for (i = 0; i < effectiveargc; ++i)
+    {
+        free(effectiveargv[i]);
+    }
+    free(effectiveargv);
+    effectiveargv = 0;
+    effectiveargc = 0;
+
+    if (!(
+#ifdef __linux__
+          (tuntap_dev_name[0] != 0) &&
+#endif
+          (eee.community_name[0] != 0) && 
+          (ip_addr[0] != 0)))
+    {
+        help();
+    }
+
+    if ((NULL == encrypt_key) && (0 == strlen(eee.keyschedule)))
+    {
+        traceWarning("Encryption is disabled in edge.");
+
+        eee.null_transop = 1;
+    }
+
+
+#ifndef WIN32
+    /* If running suid root then we need to setuid before using the force. */
+    setuid(0);
+    /* setgid( 0 ); */
+#endif
+
+    if (0 == strcmp("dhcp", ip_mode))
+    {
+        traceNormal("Dynamic IP address assignment enabled.");
+
+        eee.dyn_ip_mode = 1;
+    }
+    else
+    {
+        traceNormal("ip_mode='%s'", ip_mode);
+    }
+
+#ifdef N2N_HAVE_PIPELINE
+    if (crypto_auto)
+    {
+        eee.num_crypto = edge_auto_crypto_threads();
+
+        if (eee.num_crypto > 0)
+        {
+            traceNormal("-P auto: %u crypto threads for %ld CPUs", (unsigned int) eee.num_crypto,
+                        sysconf(_SC_NPROCESSORS_ONLN));
+        }
+        else
+        {
+            traceNormal("-P auto: single CPU, data plane not pipelined");
+        }
+    }
+
+    if ((eee.num_crypto > 0) && (eee.num_workers > 1))
+    {
+        traceWarning("-P and -Q are mutually exclusive; using one TAP queue.");
+        eee.num_workers = 1;
+    }
+
+    if ((eee.num_crypto > 0) && (eee.bundle_usec >= 0))
+    {
+        traceWarning("-P and -A are mutually exclusive; not bundling frames.");
+        eee.bundle_usec = -1;
+        eee.options &= ~N2N_OPTION_BUNDLE;
+    }
+#else
+    if ((eee.num_crypto > 0) || crypto_auto)
+    {
+        traceWarning("The pipelined data plane is not supported on this platform.");
+        eee.num_crypto = 0;
+    }
+#endif
+
+#ifdef N2N_HAVE_TAP_MQ
+    eee.device.multi_queue = (eee.num_workers > 1);
+#else
+    if (eee.num_workers > 1)
+    {
+        traceWarning("Multi-queue TAP is not supported on this platform; using one queue.");
+        eee.num_workers = 1;
+    }
+#endif
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    eee.device.offload = tap_offload;
+#else
+    if (tap_offload)
+    {
+        traceWarning("TAP offloads are not supported on this platform.");
+    }
+#endif
+
+    if (tuntap_open(&(eee.device), tuntap_dev_name, ip_mode, ip_addr, netmask, device_mac, mtu) < 0)
+        return (-1);
+
+    eee.device.mtu = mtu; /* not filled in by the drivers */
+    eee.workers[0].device = eee.device;
+
+#ifdef N2N_HAVE_TAP_MQ
+    /* Attach the other queues while we still have the privileges to. */
+    for (i = 1; i < eee.num_workers; ++i)
+    {
+        if (edge_worker_init(&eee, &(eee.workers[i]), i) < 0)
+        {
+            return (-1);
+        }
+
+        if (tuntap_open_queue(&(eee.device), &(eee.workers[i].device)) < 0)
+        {
+            traceError("Failed to open TAP queue %u", (unsigned int) i);
+            return (-1);
+        }
+    }
+#endif
+
+#ifndef WIN32
+    if ((userid != 0) || (groupid != 0))
+    {
+        traceNormal("Interface up. Dropping privileges to uid=%d, gid=%d",
+                   (signed int) userid, (signed int) groupid);
+
+        /* Finished with the need for root privileges. Drop to unprivileged user. */
+        setreuid(userid, userid);
+        setregid(groupid, groupid);
+    }
+#endif
+
+    if (local_port > 0)
+        traceNormal("Binding to local port %d", (signed int) local_port);
+
+    eee.encrypt_key = encrypt_key;
+
+    if (edge_worker_setup_transops(&eee, &(eee.workers[0])) < 0)
+    {
+        fprintf(stderr, "Error: transform setup failed.\n");
+        return (-1);
+    }
+
+
+    /* Workers share the port of the main socket. */
+    eee.udp_sock = open_socket_opt(local_port, 1 /*bind ANY*/, (eee.num_workers > 1));
+    if (eee.udp_sock < 0)
+    {
+        traceError("Failed to bind main UDP port %u", (signed int) local_port);
+        return (-1);
+    }
+
+    eee.workers[0].udp_sock = eee.udp_sock;
+
+#ifdef WIN32
+    eee.batch_size = 1; /* TAP is read in its own thread which sends immediately. */
+    eee.bundle_usec = -1;
+    eee.options &= ~N2N_OPTION_BUNDLE;
+#else
+    if (eee.batch_size > 1)
+    {
+        /* Drain up to batch_size frames per wakeup without blocking. */
+        fcntl(eee.device.fd, F_SETFL, fcntl(eee.device.fd, F_GETFL) | O_NONBLOCK);
+        traceNormal("Batching up to %u datagrams per system call", (unsigned int) eee.batch_size);
+    }
+#endif
+
+    if (edge_worker_setup_batches(&eee, &(eee.workers[0])) < 0)
+    {
+        return (-1);
+    }
+
+    edge_worker_setup_offload(&(eee.workers[0]));
+    edge_worker_setup_bundles(&eee, &(eee.workers[0]));
+
+    eee.udp_mgmt_sock = open_socket(mgmt_port, 0 /* bind LOOPBACK*/);
+
+    if (eee.udp_mgmt_sock < 0)
+    {
+        traceError("Failed to bind management UDP port %u", (unsigned int) N2N_EDGE_MGMT_PORT);
+        return (-1);
+    }
+
+
+    traceNormal("edge started");
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+
+    eee.snm_sock = open_socket(snm_port, 1 /*bind ANY*/);
+
+    if (eee.snm_sock < 0)
+    {
+        traceError("Failed to bind SNM UDP port %d", snm_port);
+        return(-1);
+    }
+
+    if (eee.snm_discovery_state == N2N_SNM_STATE_DISCOVERY)
+    {
+        /* send requests to all supernodes */
+        struct sn_info *sni = NULL;
+
+        N2N_LIST_FOR_EACH_ENTRY(sni, &eee.supernodes.head)
+        {
+            edge_send_snm_req(&eee, &sni->sn);
+        }
+    }
+
+#else
+
+    update_supernode_reg(&eee, n2n_now());
+
+#endif
+
+    return run_loop(&eee);
+}
+
+/* ************************************** */
+/* Event loop handlers */
+
+static void edge_udp_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_edge_worker_t *w = (n2n_edge_worker_t *) arg;
+
+    /* Read a cooked socket from the internet socket. Writes on the TAP
+     * socket. */
+    readFromIPSocket(w->eee, w);
+}
+
+static void edge_mgmt_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    int keep_running = 1;
+
+    readFromMgmtSocket((n2n_edge_t *) arg, &keep_running);
+
+    if (!keep_running)
+    {
+        evloop_stop(loop);
+    }
+}
+
+#ifndef WIN32
+static void edge_tap_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_edge_worker_t *w = (n2n_edge_worker_t *) arg;
+
+    /* Read an ethernet frame from the TAP socket. Write on the IP
+     * socket. */
+    readFromTAPSocket(w->eee, w);
+}
+#endif
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+static void edge_snm_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+
+    EDGE_PEERS_WRLOCK(eee);
+    readFromSNMSocket(eee);
+    EDGE_PEERS_UNLOCK(eee);
+}
+#endif
+
+#ifdef N2N_HAVE_BUNDLE_TIMER
+static void edge_bundle_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_edge_worker_t *w = (n2n_edge_worker_t *) arg;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+    {
+        traceDebug("bundle timer read failed (%s)", strerror(errno));
+    }
+
+    w->bundle_armed = 0;
+    edge_bundle_flush(w->eee, w, edge_usec_now());
+}
+#endif
+
+/** Send the PACKETs queued while processing a wakeup. */
+static void edge_flush_cb(n2n_evloop_t *loop, void *arg)
+{
+    n2n_edge_worker_t *w = (n2n_edge_worker_t *) arg;
+
+    if (w->bundle_fd < 0)
+    {
+        /* Without a deadline bundles hold what one wakeup reads. */
+        edge_bundle_flush(w->eee, w, UINT64_MAX);
+    }
+
+    tx_batch_flush(&w->tx_batch);
+    bundle_release(&w->bundler);
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    tuntap_flush(&(w->device));
+#endif
+}
+
+static void edge_transop_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    /* Key schedules are written in wall-clock time. */
+    n2n_tick_transop((n2n_edge_worker_t *) arg, time(NULL));
+}
+
+static void edge_register_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+
+    EDGE_PEERS_WRLOCK(eee);
+
+#ifdef N2N_MULTIPLE_SUPERNODES
+    if (eee->snm_discovery_state != N2N_SNM_STATE_READY)
+    {
+        supernodes_discovery(eee, now);
+    }
+    else
+#endif
+    {
+        update_supernode_reg(eee, now);
+        evloop_timer_due(loop, supernode_reg_due(eee));
+    }
+
+    EDGE_PEERS_UNLOCK(eee);
+}
+
+static void edge_purge_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+    size_t      numPurged;
+
+    EDGE_PEERS_WRLOCK(eee);
+
+    numPurged  = purge_expired_peers(&eee->known_peers);
+    if (numPurged > 0)
+    {
+        edge_peers_changed(eee);
+    }
+    numPurged += purge_expired_peers(&eee->pending_peers);
+    if (numPurged > 0)
+    {
+        traceNormal("Peer removed: pending=%u, operational=%u",
+                   (unsigned int) peer_table_size(&eee->pending_peers),
+                   (unsigned int) peer_table_size(&eee->known_peers));
+    }
+
+    EDGE_PEERS_UNLOCK(eee);
+}
+
+static void edge_iface_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+
+    traceNormal("Re-checking dynamic IP address.");
+    EDGE_PEERS_WRLOCK(eee);
+    tuntap_get_address(&(eee->device));
+    EDGE_PEERS_UNLOCK(eee);
+}
+
+
+#ifdef N2N_HAVE_TAP_MQ
+
+/* ************************************** */
+/* Data-plane workers */
+
+/** Once a second: leave when the edge stops and pick up a reloaded
+ *  keyschedule. */
+static void edge_worker_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_edge_worker_t  *w = (n2n_edge_worker_t *) arg;
+    n2n_edge_t         *eee = w->eee;
+
+    if (!eee->workers_running)
+    {
+        evloop_stop(loop);
+        return;
+    }
+
+    if ((w->key_gen != eee->key_gen) && (strlen(eee->keyschedule) > 0))
+    {
+        traceNormal("worker %u reloading keyschedule", (unsigned int) w->id);
+        w->key_gen = eee->key_gen;
+        edge_init_keyschedule(eee, w);
+    }
+}
+
+static void *edge_worker_thread(void *arg)
+{
+    n2n_edge_worker_t  *w = (n2n_edge_worker_t *) arg;
+    n2n_evloop_t        loop;
+
+    evloop_init(&loop);
+
+    if ((0 != evloop_add_io(&loop, w->udp_sock, 0, edge_udp_cb, w)) ||
+        (0 != evloop_add_io(&loop, w->device.fd, 0, edge_tap_cb, w)) ||
+#ifdef N2N_HAVE_BUNDLE_TIMER
+        ((w->bundle_fd >= 0) && (0 != evloop_add_io(&loop, w->bundle_fd, 0, edge_bundle_cb, w))) ||
+#endif
+        (0 != evloop_add_timer(&loop, TRANSOP_TICK_INTERVAL, edge_transop_timer, w)) ||
+        (0 != evloop_add_timer(&loop, 1, edge_worker_timer, w)))
+    {
+        traceError("worker %u: failed to set up the event loop", (unsigned int) w->id);
+    }
+    else
+    {
+        evloop_set_post(&loop, edge_flush_cb, w);
+        evloop_run(&loop);
+    }
+
+    evloop_deinit(&loop);
+
+    return NULL;
+}
+
+/** Give workers 1..num_workers-1 their sockets, batches and transforms, then
+ *  start their threads. Their TAP queues were opened in main(). */
+static int edge_start_workers(n2n_edge_t *eee)
+{
+    struct sockaddr_in  local_sock;
+    socklen_t           len = sizeof(local_sock);
+    size_t              i;
+
+    if (eee->num_workers < 2)
+    {
+        return 0;
+    }
+
+    /* The main socket may have been given an ephemeral port. */
+    if (getsockname(eee->udp_sock, (struct sockaddr *) &local_sock, &len) < 0)
+    {
+        traceError("getsockname failed %s", strerror(errno));
+        return -1;
+    }
+
+    eee->workers_running = 1;
+
+    for (i = 1; i < eee->num_workers; ++i)
+    {
+        n2n_edge_worker_t *w = &(eee->workers[i]);
+
+        w->udp_sock = open_socket_opt(ntohs(local_sock.sin_port), 1 /*bind ANY*/, 1 /*reuse port*/);
+        if (w->udp_sock < 0)
+        {
+            traceError("worker %u: failed to bind UDP port %u",
+                       (unsigned int) i, (unsigned int) ntohs(local_sock.sin_port));
+            return -1;
+        }
+
+        if (eee->batch_size > 1)
+        {
+            fcntl(w->device.fd, F_SETFL, fcntl(w->device.fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        if ((edge_worker_setup_batches(eee, w) < 0) ||
+            (edge_worker_setup_transops(eee, w) < 0))
+        {
+            return -1;
+        }
+
+        edge_worker_setup_offload(w);
+        edge_worker_setup_bundles(eee, w);
+
+        if (0 != pthread_create(&w->thread, NULL, edge_worker_thread, w))
+        {
+            traceError("worker %u: pthread_create failed %s", (unsigned int) i, strerror(errno));
+            return -1;
+        }
+    }
+
+    traceNormal("Started %u data-plane workers on UDP port %u",
+                (unsigned int) eee->num_workers, (unsigned int) ntohs(local_sock.sin_port));
+
+    return 0;
+}
+
+/** Stop the worker threads and wait until they have finished. */
+static void edge_stop_workers(n2n_edge_t *eee)
+{
+    size_t i;
+
+    eee->workers_running = 0;
+
+    for (i = 1; i < eee->num_workers; ++i)
+    {
+        if (eee->workers[i].thread)
+        {
+            pthread_join(eee->workers[i].thread, NULL);
+            eee->workers[i].thread = 0;
+        }
+    }
+}
+
+#endif /* #ifdef N2N_HAVE_TAP_MQ */
+
+
+#ifdef N2N_HAVE_PIPELINE
+
+/* ************************************** */
+/* Pipelined data plane */
+
+/** Wait up to one second for sem.
+ *
+ *  @return 0 once sem was taken, -1 on timeout
+ */
+static int edge_pipe_wait(sem_t *sem)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+
+    return sem_timedwait(sem, &ts);
+}
+
+/** Hand p to the crypto workers. */
+static void edge_pipe_submit(struct n2n_edge_pipe *pl, struct n2n_pipe_pkt *p)
+{
+    p->done = 0;
+    mpmc_ring_push(&pl->jobs, p); /* cannot fail: it holds every packet */
+    sem_post(&pl->jobs_sem);
+}
+
+/** Queue a received PACKET payload for decoding.
+ *
+ *  payload lies in the receive slot w->rx_slot. The slot buffer is handed to
+ *  the packet and replaced by the spare buffer of the packet, so the payload
+ *  is not copied. Only with GRO, whose slots cannot be swapped, it is.
+ *
+ *  @return 0 on success, -1 if the datagram was dropped
+ */
+static int edge_pipe_submit_rx(n2n_edge_t *eee, n2n_edge_worker_t *w, const n2n_PACKET_t *pkt,
+                               int transop_idx, int codec, uint8_t *payload, size_t psize)
+{
+    struct n2n_edge_pipe   *pl = &(eee->pipeline);
+    struct n2n_pipe_pkt    *p;
+
+    if (0 == pl->num_rx_free)
+    {
+        ++(pl->rx_drops);
+        traceDebug("pipeline full, dropping %u byte PACKET", (unsigned int) psize);
+        return -1;
+    }
+
+    p = pl->rx_free[--(pl->num_rx_free)];
+
+    if (rx_batch_swappable(&w->rx_batch))
+    {
+        p->buf = rx_batch_swap(&w->rx_batch, w->rx_slot, p->buf);
+        p->data = payload;
+    }
+    else
+    {
+        /* Part of a coalesced receive, whose buffer is reused at once. */
+        memcpy(p->buf, payload, psize);
+        p->data = p->buf;
+    }
+    p->len = psize;
+    p->tx = 0;
+    p->transop_idx = transop_idx;
+    p->codec = codec;
+    p->options = pkt->options;
+    memcpy(p->src, pkt->srcMac, N2N_MAC_SIZE);
+
+    spsc_ring_push(&pl->rx_order, p);
+    edge_pipe_submit(pl, p);
+
+    return 0;
+}
+
+/** Return a Tx packet to the TAP reader. */
+static void edge_pipe_release_tx(struct n2n_edge_pipe *pl, struct n2n_pipe_pkt *p)
+{
+    spsc_ring_push(&pl->tx_free, p);
+    sem_post(&pl->tx_free_sem);
+}
+
+/** Return the Tx packets whose PACKETs have left with the last flush. */
+static void edge_pipe_release_held(struct n2n_edge_pipe *pl)
+{
+    size_t i;
+
+    for (i = 0; i < pl->num_held; ++i)
+    {
+        edge_pipe_release_tx(pl, pl->held[i]);
+    }
+
+    pl->num_held = 0;
+}
+
+/** Send and write the packets completed by the crypto workers, stopping in
+ *  each direction at the oldest one still in progress. Main thread only. */
+static void edge_pipe_drain(n2n_edge_t *eee)
+{
+    struct n2n_edge_pipe   *pl = &(eee->pipeline);
+    n2n_edge_worker_t      *w = &(eee->workers[0]);
+    struct n2n_pipe_pkt    *p;
+
+    while ((NULL != (p = spsc_ring_peek(&pl->tx_order))) &&
+           __atomic_load_n(&p->done, __ATOMIC_ACQUIRE))
+    {
+        spsc_ring_pop(&pl->tx_order);
+
+        if ((p->len > 0) && (0 == tx_batch_queue(&w->tx_batch, p->data, p->len, &p->addr)))
+        {
+            /* The batch refers to p->buf until it has been flushed. */
+            pl->held[pl->num_held++] = p;
+
+            if (0 == w->tx_batch.count)
+            {
+                edge_pipe_release_held(pl);
+            }
+        }
+        else
+        {
+            edge_pipe_release_tx(pl, p);
+        }
+    }
+
+    while ((NULL != (p = spsc_ring_peek(&pl->rx_order))) &&
+           __atomic_load_n(&p->done, __ATOMIC_ACQUIRE))
+    {
+        spsc_ring_pop(&pl->rx_order);
+
+        if (p->len > 0)
+        {
+            /* Headers are restored here, in arrival order, as the contexts
+             * they refer to are set up by earlier frames. */
+            edge_write_payload(w, p->src, p->options, p->data, p->len);
+        }
+
+        pl->rx_free[pl->num_rx_free++] = p;
+    }
+}
+
+/** Tell the main thread that a job is done. Wakeups are coalesced until the
+ *  main thread has seen the last one. */
+static void edge_pipe_wake(struct n2n_edge_pipe *pl)
+{
+    if (0 == __atomic_exchange_n(&pl->wake_pending, 1, __ATOMIC_ACQ_REL))
+    {
+        uint8_t c = 0;
+
+        if (write(pl->wake_fd[1], &c, 1) < 0)
+        {
+            traceDebug("pipeline wakeup failed %s", strerror(errno));
+        }
+    }
+}
+
+static void edge_pipe_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+    uint8_t     drain[64];
+
+    /* Clear the flag first: jobs finishing from now on wake us again. */
+    __atomic_exchange_n(&(eee->pipeline.wake_pending), 0, __ATOMIC_ACQ_REL);
+    while (read(fd, drain, sizeof(drain)) > 0)
+    {
+    }
+
+    edge_pipe_drain(eee);
+}
+
+/** Send the PACKETs queued while processing a wakeup. */
+static void edge_pipe_flush_cb(n2n_evloop_t *loop, void *arg)
+{
+    n2n_edge_t *eee = (n2n_edge_t *) arg;
+
+    tx_batch_flush(&(eee->workers[0].tx_batch));
+    edge_pipe_release_held(&(eee->pipeline));
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    tuntap_flush(&(eee->workers[0].device));
+#endif
+}
+
+/** Encode or decode p with the transforms of crypto worker w. */
+static void edge_pipe_process(n2n_edge_t *eee, n2n_edge_worker_t *w, struct n2n_pipe_pkt *p)
+{
+    if (p->tx)
+    {
+        const struct n2n_tx_flow *flow = NULL;
+        uint8_t    *pktbuf = NULL;
 
-        case 'M': /* TUNTAP MTU */
+        p->len = edge_encode_frame(eee, w, p->data, p->len, N2N_PKT_BUF_SIZE, &pktbuf, &flow);
+        if (p->len > 0)
         {
-            mtu = atoi(optarg);
-            break;
+            p->data = pktbuf;
+            p->addr = flow->addr;
+            edge_count_tx(w, flow);
         }
+    }
+    else
+    {
+        n2n_trans_op_t *op = &(w->transop[p->transop_idx]);
+        uint8_t        *eth_payload = NULL;
+        int             eth_size;
 
-        case 'k': /* encrypt key */
+        if (op->rev_inplace)
         {
-            if (strlen(eee.keyschedule) > 0)
-            {
-                fprintf(stderr, "Error: -K and -k options are mutually exclusive.\n");
-                exit(1);
-            }
-            else
-            {
-                traceDebug("encrypt_key = '%s'\n", encrypt_key);
-                encrypt_key = strdup(optarg);
-            }
-            break;
+            eth_size = op->rev_inplace(op, p->data, p->len, &eth_payload);
         }
-        case 'r': /* enable packet routing across n2n endpoints */
+        else
         {
-            eee.allow_routing = 1;
-            break;
-        }
+            uint8_t decodebuf[N2N_PKT_BUF_SIZE];
 
-        case 'l': /* supernode-list */
-        {
-            if (eee.sn_num < N2N_EDGE_NUM_SUPERNODES)
+            eth_size = op->rev(op, decodebuf, N2N_PKT_BUF_SIZE, p->data, p->len);
+            if (eth_size > 0)
             {
-                strncpy((eee.sn_ip_array[eee.sn_num]), optarg, N2N_EDGE_SN_HOST_SIZE);
-                traceDebug("Adding supernode[%u] = %s\n", (unsigned int) eee.sn_num, (eee.sn_ip_array[eee.sn_num]));
-                ++eee.sn_num;
+                memcpy(p->buf, decodebuf, eth_size);
+                eth_payload = p->buf;
             }
-            else
+        }
+        ++(op->rx_cnt); /* stats */
+
+        if (N2N_COMPRESS_NONE != p->codec)
+        {
+            uint8_t framebuf[N2N_PKT_BUF_SIZE];
+
+            eth_size = edge_decompress_frame(w, p->codec, &eth_payload, eth_size, framebuf);
+            if (eth_size > 0)
             {
-                fprintf(stderr, "Too many supernodes!\n");
-                exit(1);
+                memcpy(p->buf, framebuf, eth_size);
+                eth_payload = p->buf;
             }
-            break;
         }
 
-#if defined(N2N_CAN_NAME_IFACE)
-        case 'd': /* TUNTAP name */
+        if (eth_size <= 0)
         {
-            strncpy(tuntap_dev_name, optarg, N2N_IFNAMSIZ);
-            break;
+            traceWarning("handle_PACKET failed to decode %u byte payload",
+                         (unsigned int) p->len);
         }
-#endif
 
-        case 'b':
+        p->data = eth_payload;
+        p->len = eth_size;
+    }
+}
+
+static void *edge_pipe_crypto_thread(void *arg)
+{
+    n2n_edge_worker_t  *w = (n2n_edge_worker_t *) arg;
+    n2n_edge_t         *eee = w->eee;
+    struct n2n_edge_pipe *pl = &(eee->pipeline);
+    time_t              last_tick = 0;  /* tick before the first job picks a Tx transop */
+
+    while (pl->running)
+    {
+        struct n2n_pipe_pkt *p = NULL;
+        time_t now;
+
+        if (0 == edge_pipe_wait(&pl->jobs_sem))
         {
-            eee.re_resolve_supernode_ip = 1;
-            break;
+            /* The job counted by the semaphore may sit behind one another
+             * producer is still writing. */
+            while (NULL == (p = (struct n2n_pipe_pkt *) mpmc_ring_pop(&pl->jobs)))
+            {
+                sched_yield();
+            }
         }
 
-        case 'p':
+        if ((w->key_gen != eee->key_gen) && (strlen(eee->keyschedule) > 0))
         {
-            local_port = atoi(optarg);
-            break;
+            traceNormal("crypto worker %u reloading keyschedule", (unsigned int) w->id);
+            w->key_gen = eee->key_gen;
+            edge_init_keyschedule(eee, w);
         }
 
-        case 't':
+        now = n2n_now();
+        if (now >= last_tick + TRANSOP_TICK_INTERVAL)
         {
-            mgmt_port = atoi(optarg);
-            break;
+            n2n_tick_transop(w, time(NULL));
+            last_tick = now;
         }
 
-#ifdef N2N_MULTIPLE_SUPERNODES
-        case 'S':
+        if (NULL != p)
         {
-            snm_port = atoi(optarg);
-            break;
+            edge_pipe_process(eee, w, p);
+            __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+            edge_pipe_wake(pl);
         }
-#endif
+    }
 
-        case 's': /* Subnet Mask */
+    return NULL;
+}
+
+/** Read frames from the TAP device and queue them for encoding. */
+static void *edge_pipe_tap_thread(void *arg)
+{
+    n2n_edge_t             *eee = (n2n_edge_t *) arg;
+    struct n2n_edge_pipe   *pl = &(eee->pipeline);
+    const size_t            eth_max = N2N_PKT_BUF_SIZE - N2N_PKT_HEADROOM - N2N_PKT_TAILROOM;
+    struct n2n_pipe_pkt    *p = NULL;
+    struct pollfd           pfd;
+    macstr_t                mac_buf;
+
+    pfd.fd = eee->device.fd;
+    pfd.events = POLLIN;
+
+    while (pl->running)
+    {
+        ssize_t len;
+
+        if (NULL == p)
         {
-            if (0 != got_s)
+            /* Wait for the main thread to send a PACKET if all are in use. */
+            if (0 != edge_pipe_wait(&pl->tx_free_sem))
             {
-                traceWarning("Multiple subnet masks supplied.");
+                continue;
             }
-            strncpy(netmask, optarg, N2N_NETMASK_STR_SIZE);
-            got_s = 1;
-            break;
+            p = (struct n2n_pipe_pkt *) spsc_ring_pop(&pl->tx_free);
         }
 
-        case 'h': /* help */
+        if (!edge_tap_pending(&(eee->device)) && (poll(&pfd, 1, 1000) <= 0))
         {
-            help();
-            break;
+            continue;
         }
 
-        case 'v': /* verbose */
+        len = tuntap_read(&(eee->device), p->buf + N2N_PKT_HEADROOM, eth_max);
+        if ((len < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
         {
-            ++traceLevel; /* do 2 -v flags to increase verbosity to DEBUG level*/
-            break;
+            continue;
+        }
+        else if ((len <= 0) || (len > eth_max))
+        {
+            traceWarning("read()=%d [%d/%s]",
+                       (signed int) len, errno, strerror(errno));
+            continue;
         }
 
-        } /* end switch */
-    }
-
+        traceInfo("### Rx TAP packet (%4d) for %s",
+            (signed int) len, macaddr_str(mac_buf, p->buf + N2N_PKT_HEADROOM));
 
-#ifdef N2N_HAVE_DAEMON
-    if (eee.daemon)
-    {
-        useSyslog = 1; /* traceEvent output now goes to syslog. */
-        if (-1 == daemon(0, 0))
+        if (!edge_tap_frame_wanted(eee, p->buf + N2N_PKT_HEADROOM, len))
         {
-            traceError("Failed to become daemon.");
-            exit(-5);
+            continue;
         }
-    }
-#endif /* #ifdef N2N_HAVE_DAEMON */
 
+        p->data = p->buf + N2N_PKT_HEADROOM;
+        p->len = len;
+        p->tx = 1;
 
-    traceNormal("Starting n2n edge %s %s", n2n_sw_version, n2n_sw_buildDate);
+        spsc_ring_push(&pl->tx_order, p);
+        edge_pipe_submit(pl, p);
+        p = NULL;
+    }
 
+    return NULL;
+}
 
-    for (i = 0; i < N2N_EDGE_NUM_SUPERNODES; ++i)
-    {
-        traceNormal("supernode %u => %s\n", i, (eee.sn_ip_array[i]));
-    }
+/** Allocate the packets and rings, register the wakeup pipe with loop and
+ *  start the TAP reader and the crypto threads. */
+static int edge_start_pipeline(n2n_edge_t *eee, n2n_evloop_t *loop)
+{
+    struct n2n_edge_pipe   *pl = &(eee->pipeline);
+    size_t                  i;
 
-#ifdef N2N_MULTIPLE_SUPERNODES
-    if (load_supernodes(&eee) > 0)
-#endif
-    supernode2addr(&(eee.supernode), eee.sn_ip_array[eee.sn_idx]);
+    pl->wake_fd[0] = pl->wake_fd[1] = -1;
 
+    pl->pkts = (struct n2n_pipe_pkt *) calloc(2 * N2N_PIPE_PKTS, sizeof(struct n2n_pipe_pkt));
+    pl->bufs = (uint8_t *) malloc(2 * N2N_PIPE_PKTS * N2N_PKT_BUF_SIZE);
 
-    for (i = 0; i < effectiveargc; ++i)
+    if ((NULL == pl->pkts) || (NULL == pl->bufs) ||
+        (0 != spsc_ring_init(&pl->tx_free, N2N_PIPE_PKTS)) ||
+        (0 != spsc_ring_init(&pl->tx_order, N2N_PIPE_PKTS)) ||
+        (0 != spsc_ring_init(&pl->rx_order, N2N_PIPE_PKTS)) ||
+        (0 != mpmc_ring_init(&pl->jobs, 2 * N2N_PIPE_PKTS)))
     {
-        free(effectiveargv[i]);
+        traceError("pipeline: unable to allocate %u packets", (unsigned int) (2 * N2N_PIPE_PKTS));
+        return -1;
     }
-    free(effectiveargv);
-    effectiveargv = 0;
-    effectiveargc = 0;
 
-    if (!(
-#ifdef __linux__
-          (tuntap_dev_name[0] != 0) &&
-#endif
-          (eee.community_name[0] != 0) && 
-          (ip_addr[0] != 0)))
+    for (i = 0; i < 2 * N2N_PIPE_PKTS; ++i)
     {
-        help();
-    }
+        struct n2n_pipe_pkt *p = &(pl->pkts[i]);
 
-    if ((NULL == encrypt_key) && (0 == strlen(eee.keyschedule)))
-    {
-        traceWarning("Encryption is disabled in edge.");
+        p->buf = pl->bufs + (i * N2N_PKT_BUF_SIZE);
 
-        eee.null_transop = 1;
+        if (i < N2N_PIPE_PKTS)
+        {
+            spsc_ring_push(&pl->tx_free, p);
+        }
+        else
+        {
+            pl->rx_free[pl->num_rx_free++] = p;
+        }
     }
 
+    sem_init(&pl->tx_free_sem, 0, N2N_PIPE_PKTS);
+    sem_init(&pl->jobs_sem, 0, 0);
 
-#ifndef WIN32
-    /* If running suid root then we need to setuid before using the force. */
-    setuid(0);
-    /* setgid( 0 ); */
-#endif
-
-    if (0 == strcmp("dhcp", ip_mode))
-    {
-        traceNormal("Dynamic IP address assignment enabled.");
-
-        eee.dyn_ip_mode = 1;
-    }
-    else
+    if (pipe(pl->wake_fd) < 0)
     {
-        traceNormal("ip_mode='%s'", ip_mode);
+        traceError("pipeline: pipe failed %s", strerror(errno));
+        return -1;
     }
+    fcntl(pl->wake_fd[0], F_SETFL, fcntl(pl->wake_fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(pl->wake_fd[1], F_SETFL, fcntl(pl->wake_fd[1], F_GETFL) | O_NONBLOCK);
 
-    if (tuntap_open(&(eee.device), tuntap_dev_name, ip_mode, ip_addr, netmask, device_mac, mtu) < 0)
-        return (-1);
-
-#ifndef WIN32
-    if ((userid != 0) || (groupid != 0))
+    if (0 != evloop_add_io(loop, pl->wake_fd[0], 0, edge_pipe_cb, eee))
     {
-        traceNormal("Interface up. Dropping privileges to uid=%d, gid=%d",
-                   (signed int) userid, (signed int) groupid);
-
-        /* Finished with the need for root privileges. Drop to unprivileged user. */
-        setreuid(userid, userid);
-        setregid(groupid, groupid);
+        return -1;
     }
-#endif
 
-    if (local_port > 0)
-        traceNormal("Binding to local port %d", (signed int) local_port);
+    /* The TAP reader polls so it can notice when the edge stops. */
+    fcntl(eee->device.fd, F_SETFL, fcntl(eee->device.fd, F_GETFL) | O_NONBLOCK);
+
+    pl->running = 1;
 
-    if (encrypt_key)
+    for (i = 0; i < eee->num_crypto; ++i)
     {
-        if (edge_init_twofish(&eee, (uint8_t *) (encrypt_key), strlen(encrypt_key)) < 0)
+        n2n_edge_worker_t *w = &(pl->crypto[i]);
+
+        if ((edge_worker_init(eee, w, i) < 0) ||
+            (edge_worker_setup_transops(eee, w) < 0))
         {
-            fprintf(stderr, "Error: twofish setup failed.\n");
-            return (-1);
+            return -1;
         }
-    }
-    else if (strlen(eee.keyschedule) > 0)
-    {
-        if (edge_init_keyschedule(&eee) != 0)
+
+        if (0 != pthread_create(&w->thread, NULL, edge_pipe_crypto_thread, w))
         {
-            fprintf(stderr, "Error: keyschedule setup failed.\n");
-            return (-1);
+            traceError("crypto worker %u: pthread_create failed %s", (unsigned int) i, strerror(errno));
+            return -1;
         }
-
-    }
-    /* else run in NULL mode */
-
-
-    eee.udp_sock = open_socket(local_port, 1 /*bind ANY*/);
-    if (eee.udp_sock < 0)
-    {
-        traceError("Failed to bind main UDP port %u", (signed int) local_port);
-        return (-1);
     }
 
-    eee.udp_mgmt_sock = open_socket(mgmt_port, 0 /* bind LOOPBACK*/);
-
-    if (eee.udp_mgmt_sock < 0)
+    if (0 != pthread_create(&pl->tap_thread, NULL, edge_pipe_tap_thread, eee))
     {
-        traceError("Failed to bind management UDP port %u", (unsigned int) N2N_EDGE_MGMT_PORT);
-        return (-1);
+        traceError("pipeline: pthread_create failed %s", strerror(errno));
+        return -1;
     }
 
+    traceNormal("Started pipelined data plane with %u crypto threads", (unsigned int) eee->num_crypto);
 
-    traceNormal("edge started");
+    return 0;
+}
 
-#ifdef N2N_MULTIPLE_SUPERNODES
+/** Stop the pipeline threads and release what the pipeline owns. Buffers
+ *  swapped into the receive batch of worker 0 are freed here, so this must
+ *  run after the main loop has finished with it. */
+static void edge_stop_pipeline(n2n_edge_t *eee)
+{
+    struct n2n_edge_pipe   *pl = &(eee->pipeline);
+    size_t                  i;
 
-    eee.snm_sock = open_socket(snm_port, 1 /*bind ANY*/);
+    pl->running = 0;
 
-    if (eee.snm_sock < 0)
+    if (pl->tap_thread)
     {
-        traceError("Failed to bind SNM UDP port %d", snm_port);
-        return(-1);
+        pthread_join(pl->tap_thread, NULL);
+        pl->tap_thread = 0;
     }
 
-    if (eee.snm_discovery_state == N2N_SNM_STATE_DISCOVERY)
+    for (i = 0; i < eee->num_crypto; ++i)
     {
-        /* send requests to all supernodes */
-        struct sn_info *sni = NULL;
+        n2n_edge_worker_t *w = &(pl->crypto[i]);
 
-        N2N_LIST_FOR_EACH_ENTRY(sni, &eee.supernodes.head)
+        if (w->thread)
         {
-            edge_send_snm_req(&eee, &sni->sn);
+            pthread_join(w->thread, NULL);
+            w->thread = 0;
+            edge_worker_deinit(w);
         }
     }
 
-#else
-
-    update_supernode_reg(&eee, time(NULL));
+    if (pl->wake_fd[0] >= 0)
+    {
+        close(pl->wake_fd[0]);
+        close(pl->wake_fd[1]);
+        sem_destroy(&pl->tx_free_sem);
+        sem_destroy(&pl->jobs_sem);
+    }
 
-#endif
+    spsc_ring_deinit(&pl->tx_free);
+    spsc_ring_deinit(&pl->tx_order);
+    spsc_ring_deinit(&pl->rx_order);
+    mpmc_ring_deinit(&pl->jobs);
 
-    return run_loop(&eee);
+    free(pl->pkts);
+    free(pl->bufs);
+    pl->pkts = NULL;
+    pl->bufs = NULL;
 }
 
+#endif /* #ifdef N2N_HAVE_PIPELINE */
+
+
 static int run_loop(n2n_edge_t *eee)
 {
-    int      keep_running = 1;
-    size_t   numPurged;
-    time_t   lastIfaceCheck = 0;
-    time_t   lastTransop = 0;
+    n2n_evloop_t loop;
+    int          rc = 0;
 
 
 #ifdef WIN32
@@ -2665,109 +5265,76 @@ static int run_loop(n2n_edge_t *eee)
 
     /* Main loop
      *
-     * select() is used to wait for input on either the TAP fd or the UDP/TCP
-     * socket. When input is present the data is read and processed by either
-     * readFromIPSocket() or readFromTAPSocket()
+     * The event loop waits for input on the TAP fd and the UDP sockets. When
+     * input is present the data is read and processed by either
+     * readFromIPSocket() or readFromTAPSocket(). Periodic work runs from
+     * timers; ciphers are ticked before any packet of the wakeup is treated.
      */
 
-    while(keep_running)
-    {
-        int             rc, max_sock = 0;
-        fd_set          socket_mask;
-        struct timeval  wait_time;
-        time_t          nowTime;
+    evloop_init(&loop);
 
-        FD_ZERO(&socket_mask);
-        FD_SET(eee->udp_sock, &socket_mask);
-        FD_SET(eee->udp_mgmt_sock, &socket_mask);
-        max_sock = max( eee->udp_sock, eee->udp_mgmt_sock );
+    if ((0 != evloop_add_io(&loop, eee->udp_sock, 0, edge_udp_cb, &(eee->workers[0]))) ||
+        (0 != evloop_add_io(&loop, eee->udp_mgmt_sock, 0, edge_mgmt_cb, eee)) ||
 #ifndef WIN32
-        FD_SET(eee->device.fd, &socket_mask);
-        max_sock = max( max_sock, eee->device.fd );
+        /* When pipelined the TAP device is read by its own thread. */
+        ((0 == eee->num_crypto) &&
+         (0 != evloop_add_io(&loop, eee->device.fd, 0, edge_tap_cb, &(eee->workers[0])))) ||
+#endif
+#ifdef N2N_HAVE_BUNDLE_TIMER
+        ((eee->workers[0].bundle_fd >= 0) &&
+         (0 != evloop_add_io(&loop, eee->workers[0].bundle_fd, 0, edge_bundle_cb, &(eee->workers[0])))) ||
 #endif
 #ifdef N2N_MULTIPLE_SUPERNODES
-        FD_SET(eee->snm_sock, &socket_mask);
-        max_sock = max(max_sock, eee->snm_sock);
+        (0 != evloop_add_io(&loop, eee->snm_sock, 0, edge_snm_cb, eee)) ||
 #endif
-
-        wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS;
-        wait_time.tv_usec = 0;
-
-        rc = select(max_sock + 1, &socket_mask, NULL, NULL, &wait_time);
-        nowTime = time(NULL);
-
-        /* Make sure ciphers are updated before the packet is treated. */
-        if ((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL)
-        {
-            lastTransop = nowTime;
-
-            n2n_tick_transop(eee, nowTime);
-        }
-
-        if (rc > 0)
-        {
-            /* Any or all of the FDs could have input; check them all. */
-
-            if (FD_ISSET(eee->udp_sock, &socket_mask))
-            {
-                /* Read a cooked socket from the internet socket. Writes on the TAP
-                 * socket. */
-                readFromIPSocket(eee);
-            }
-
-            if (FD_ISSET(eee->udp_mgmt_sock, &socket_mask))
-            {
-                /* Read a cooked socket from the internet socket. Writes on the TAP
-                 * socket. */
-                readFromMgmtSocket(eee, &keep_running);
-            }
-
-#ifndef WIN32
-            if (FD_ISSET(eee->device.fd, &socket_mask))
-            {
-                /* Read an ethernet frame from the TAP socket. Write on the IP
-                 * socket. */
-                readFromTAPSocket(eee);
-            }
+        (0 != evloop_add_timer(&loop, TRANSOP_TICK_INTERVAL, edge_transop_timer, &(eee->workers[0]))) ||
+        (0 != evloop_add_timer(&loop, 1, edge_register_timer, eee)) ||
+        (0 != evloop_add_timer(&loop, SOCKET_TIMEOUT_INTERVAL_SECS, edge_purge_timer, eee)) ||
+        (eee->dyn_ip_mode && (0 != evloop_add_timer(&loop, IFACE_UPDATE_INTERVAL, edge_iface_timer, eee))))
+    {
+        traceError("Failed to set up the event loop");
+        rc = -1;
+    }
+#ifdef N2N_HAVE_TAP_MQ
+    else if (0 != edge_start_workers(eee))
+    {
+        traceError("Failed to start the data-plane workers");
+        rc = -1;
+    }
 #endif
-#ifdef N2N_MULTIPLE_SUPERNODES
-            if (FD_ISSET(eee->snm_sock, &socket_mask))
-            {
-                readFromSNMSocket(eee);
-            }
+#ifdef N2N_HAVE_PIPELINE
+    else if ((eee->num_crypto > 0) && (0 != edge_start_pipeline(eee, &loop)))
+    {
+        traceError("Failed to start the pipelined data plane");
+        rc = -1;
+    }
 #endif
-        }
-
-        /* Finished processing select data. */
-
-#ifdef N2N_MULTIPLE_SUPERNODES
-        if (eee->snm_discovery_state != N2N_SNM_STATE_READY)
+    else
+    {
+#ifdef N2N_HAVE_PIPELINE
+        if (eee->num_crypto > 0)
         {
-            supernodes_discovery(eee, nowTime);
+            evloop_set_post(&loop, edge_pipe_flush_cb, eee);
         }
         else
 #endif
-
-        update_supernode_reg(eee, nowTime);
-
-        numPurged  = purge_expired_registrations(&eee->known_peers);
-        numPurged += purge_expired_registrations(&eee->pending_peers);
-        if (numPurged > 0)
         {
-            traceNormal("Peer removed: pending=%u, operational=%u",
-                       (unsigned int) list_size(&eee->pending_peers),
-                       (unsigned int) list_size(&eee->known_peers));
+            evloop_set_post(&loop, edge_flush_cb, &(eee->workers[0]));
         }
+        rc = evloop_run(&loop);
+    }
 
-        if (eee->dyn_ip_mode && 
-            ((nowTime - lastIfaceCheck) > IFACE_UPDATE_INTERVAL))
-        {
-            traceNormal("Re-checking dynamic IP address.");
-            tuntap_get_address(&(eee->device));
-            lastIfaceCheck = nowTime;
-        }
+#ifdef N2N_HAVE_TAP_MQ
+    edge_stop_workers(eee);
+#endif
+#ifdef N2N_HAVE_PIPELINE
+    if (eee->num_crypto > 0)
+    {
+        edge_stop_pipeline(eee);
+    }
+#endif
 
-    } /* while */
+    evloop_deinit(&loop);
 
 #ifdef N2N_MULTIPLE_SUPERNODES
     deregister_supernodes(eee);
@@ -2780,7 +5347,7 @@ static int run_loop(n2n_edge_t *eee)
 
     edge_deinit(eee);
 
-    return (0);
+    return rc;
 }
 
 
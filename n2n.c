@@ -22,16 +22,15 @@
  */
 
 #include "n2n.h"
+#include "n2n_peer_table.h"
 
 #include "minilzo.h"
 
 #include <assert.h>
 
 #if defined(DEBUG)
-#   define PURGE_REGISTRATION_FREQUENCY   60
 #   define REGISTRATION_TIMEOUT          120
 #else /* #if defined(DEBUG) */
-#   define PURGE_REGISTRATION_FREQUENCY   60
 #   define REGISTRATION_TIMEOUT           (60*20)
 #endif /* #if defined(DEBUG) */
 
@@ -113,6 +112,68 @@ void traceEvent(int eventTraceLevel, char *file, int line, char *format, ...)
 }
 
 
+/* *********************************************** */
+
+/* The clock used for timeouts and timers. It counts seconds of
+ * CLOCK_MONOTONIC, so it does not jump when the wall clock is set, and it is
+ * offset to read like time(NULL) did when it was first updated. The event
+ * loop updates it once per wakeup; everything else reads the cached value
+ * with n2n_now(). Timestamps meant for people (logs) still use time(NULL),
+ * as do key schedules, which are written in wall-clock time. */
+#if defined(CLOCK_MONOTONIC) && !defined(WIN32)
+static time_t clock_offset;             /* Wall-clock minus monotonic seconds at the first update. */
+#endif
+static volatile time_t clock_now;
+
+/** Read the clock and cache it for n2n_now(). The first call must happen
+ *  before any other thread uses the clock.
+ *
+ *  @return the current time
+ */
+time_t n2n_clock_update(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(WIN32)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    if (0 == clock_offset)
+    {
+        clock_offset = time(NULL) - ts.tv_sec;
+    }
+
+    clock_now = clock_offset + ts.tv_sec;
+#else
+    clock_now = time(NULL);
+#endif
+
+    return clock_now;
+}
+
+/** The time of the last n2n_clock_update(). */
+time_t n2n_now(void)
+{
+    time_t now = clock_now;
+
+    return (0 != now) ? now : n2n_clock_update();
+}
+
+#ifndef WIN32
+/** Set ts to the CLOCK_MONOTONIC time at which the clock reaches t. */
+void n2n_clock_deadline(time_t t, struct timespec *ts)
+{
+#if defined(CLOCK_MONOTONIC)
+    n2n_now(); /* sets clock_offset */
+
+    ts->tv_sec  = t - clock_offset;
+#else
+    ts->tv_sec  = t;
+#endif
+    ts->tv_nsec = 0;
+}
+#endif
+
+
 /* *********************************************** */
 
 char *msg_type2str(uint16_t msg_type)
@@ -192,24 +253,25 @@ struct peer_info * find_peer_by_mac(struct n2n_list *list, const n2n_mac_t mac)
 void peer_list_add(struct n2n_list *list, struct peer_info *new)
 {
     list_add(list, &new->list);
-    new->last_seen = time(NULL);
+    new->last_seen = n2n_now();
 }
 
 
-size_t purge_expired_registrations(struct n2n_list *peer_list)
+/** Remove the peers of table whose registration has timed out.
+ *
+ *  Only the expired peers are visited, so this is cheap enough to call often;
+ *  the caller decides how often.
+ *
+ *  @return the number of peers removed
+ */
+size_t purge_expired_peers(struct n2n_peer_table *table)
 {
-    static time_t last_purge = 0;
-    time_t now = time(NULL);
-    size_t num_reg = 0;
-
-    if ((now - last_purge) < PURGE_REGISTRATION_FREQUENCY)
-        return 0;
+    size_t num_reg;
 
     traceInfo("Purging old registrations");
 
-    num_reg = purge_peer_list(peer_list, now - REGISTRATION_TIMEOUT);
+    num_reg = peer_table_purge(table, n2n_now() - REGISTRATION_TIMEOUT);
 
-    last_purge = now;
     traceInfo("Remove %ld registrations", num_reg);
 
     return num_reg;
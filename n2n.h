@@ -80,6 +80,12 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #define N2N_CAN_NAME_IFACE 1
+#ifdef IFF_MULTI_QUEUE
+#define N2N_HAVE_TAP_MQ 1 /* one TAP device, several queue fds */
+#endif
+#ifdef IFF_VNET_HDR
+#define N2N_HAVE_TAP_OFFLOAD 1 /* TSO and checksum offload through the virtio-net header */
+#endif
 #endif /* #ifdef __linux__ */
 
 #ifdef __FreeBSD__
@@ -135,6 +141,9 @@ typedef struct tuntap_dev {
   uint32_t      ip_addr, device_mask;
   uint16_t      mtu;
   char          dev_name[N2N_IFNAMSIZ];
+  uint8_t       multi_queue;  /* set before tuntap_open() to allow tuntap_open_queue() */
+  uint8_t       offload;      /* set before tuntap_open() to exchange large TCP frames */
+  struct n2n_vnet *vnet;      /* offload state of this fd; NULL without offloads */
 } tuntap_dev;
 
 #endif /* #ifndef WIN32 */
@@ -165,6 +174,9 @@ struct peer_info {
     n2n_mac_t           mac_addr;
     n2n_sock_t          sock;
     time_t              last_seen;
+    uint32_t            community_id;   /* Supernode only. See n2n_community.h. */
+    uint32_t            member_idx;     /* Supernode only. */
+    uint8_t             options;        /* Edge only: N2N_OPTION_* both ends accept. */
 };
 
 struct n2n_edge; /* defined in edge.c */
@@ -218,12 +230,26 @@ extern int  tuntap_read(struct tuntap_dev *tuntap, unsigned char *buf, int len);
 extern int  tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len);
 extern void tuntap_close(struct tuntap_dev *tuntap);
 extern void tuntap_get_address(struct tuntap_dev *tuntap);
+#ifdef N2N_HAVE_TAP_MQ
+extern int  tuntap_open_queue(const struct tuntap_dev *tuntap, struct tuntap_dev *queue);
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+extern int  tuntap_pending(const struct tuntap_dev *tuntap);
+extern void tuntap_flush(struct tuntap_dev *tuntap);
+#endif
 
 extern char *msg_type2str(uint16_t msg_type);
 extern void hexdump(const uint8_t *buf, size_t len);
 
 void print_n2n_version();
 
+/* Cached clock. See n2n.c. */
+time_t n2n_clock_update(void);
+time_t n2n_now(void);
+#ifndef WIN32
+void   n2n_clock_deadline(time_t t, struct timespec *ts);
+#endif
+
 
 /* Operations on peer_info lists. */
 struct peer_info *find_peer_by_mac(struct n2n_list *list,
@@ -232,7 +258,10 @@ void   peer_list_add(struct n2n_list *list,
                      struct peer_info *new);
 size_t purge_peer_list(struct n2n_list *peer_list,
                        time_t purge_before);
-size_t purge_expired_registrations(struct n2n_list *peer_list);
+
+/* Operations on peer tables. See n2n_peer_table.h. */
+struct n2n_peer_table;
+size_t purge_expired_peers(struct n2n_peer_table *table);
 
 
 /* version.c */
@@ -0,0 +1,890 @@
+/*
+ * n2n_batch.c
+ *
+ * Batched UDP receive and transmit. See n2n_batch.h.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* recvmmsg() and sendmmsg() */
+#endif
+
+#include "n2n.h"
+#include "n2n_batch.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define N2N_HAVE_MMSG 1
+#endif
+
+#ifdef N2N_HAVE_MMSG
+#include <netinet/udp.h>
+
+/* The kernel may know them even if the C library does not. */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT     103     /* Linux 4.18 */
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO         104     /* Linux 5.0 */
+#endif
+
+#define N2N_BATCH_CTRL_SIZE     CMSG_SPACE(sizeof(int))
+#endif
+
+
+static size_t clamp_batch_size(size_t size)
+{
+    if (size < 1)
+        return 1;
+
+    if (size > N2N_BATCH_MAX)
+        return N2N_BATCH_MAX;
+
+    return size;
+}
+
+
+/* ************************************** */
+/* Receive */
+
+int rx_batch_init(n2n_rx_batch_t *b, size_t size, size_t bufsize)
+{
+    memset(b, 0, sizeof(n2n_rx_batch_t));
+
+    b->size    = clamp_batch_size(size);
+    b->bufsize = bufsize;
+    b->bufs    = (uint8_t *) malloc(b->size * b->bufsize);
+    b->slots   = (uint8_t **) calloc(b->size, sizeof(uint8_t *));
+    b->lens    = (size_t *) calloc(b->size, sizeof(size_t));
+    b->addrs   = (struct sockaddr_in *) calloc(b->size, sizeof(struct sockaddr_in));
+
+    if ((NULL == b->bufs) || (NULL == b->slots) || (NULL == b->lens) || (NULL == b->addrs))
+    {
+        traceError("rx_batch_init: unable to allocate %u slots", (unsigned int) b->size);
+        rx_batch_deinit(b);
+        return -1;
+    }
+
+    {
+        size_t i;
+
+        for (i = 0; i < b->size; ++i)
+        {
+            b->slots[i] = b->bufs + (i * b->bufsize);
+        }
+    }
+
+#ifdef N2N_HAVE_MMSG
+    {
+        struct mmsghdr *msgs;
+        struct iovec   *iovs;
+        size_t          i;
+
+        msgs = (struct mmsghdr *) calloc(b->size, sizeof(struct mmsghdr));
+        iovs = (struct iovec *) calloc(b->size, sizeof(struct iovec));
+        b->msgs = msgs;
+        b->iovs = iovs;
+
+        if ((NULL == msgs) || (NULL == iovs))
+        {
+            traceError("rx_batch_init: unable to allocate message headers");
+            rx_batch_deinit(b);
+            return -1;
+        }
+
+        for (i = 0; i < b->size; ++i)
+        {
+            iovs[i].iov_base = rx_batch_buf(b, i);
+            iovs[i].iov_len  = b->bufsize;
+            msgs[i].msg_hdr.msg_iov    = &(iovs[i]);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name   = &(b->addrs[i]);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+void rx_batch_deinit(n2n_rx_batch_t *b)
+{
+    free(b->bufs);
+    free(b->slots);
+    free(b->lens);
+    free(b->addrs);
+    free(b->msgs);
+    free(b->iovs);
+    free(b->gro_bufs);
+    free(b->gro_addrs);
+    free(b->ctrl);
+    memset(b, 0, sizeof(n2n_rx_batch_t));
+}
+
+#ifdef N2N_HAVE_MMSG
+/** Fill the slots with the datagrams of the n messages received with GRO,
+ *  splitting coalesced messages at the segment size the kernel reports.
+ *  Datagrams longer than bufsize are dropped, as a plain slot could not have
+ *  held them either. */
+static void split_coalesced(n2n_rx_batch_t *b, size_t n)
+{
+    struct mmsghdr *msgs = (struct mmsghdr *) b->msgs;
+    size_t          max_count = b->size * N2N_BATCH_GSO_SEGS;
+    size_t          i;
+
+    b->count = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        struct msghdr  *h = &(msgs[i].msg_hdr);
+        struct cmsghdr *c;
+        uint8_t        *buf = b->gro_bufs + (i * N2N_BATCH_GRO_BUFSIZE);
+        size_t          len = msgs[i].msg_len;
+        size_t          seg = len;
+        size_t          off;
+
+        for (c = CMSG_FIRSTHDR(h); NULL != c; c = CMSG_NXTHDR(h, c))
+        {
+            if ((IPPROTO_UDP == c->cmsg_level) && (UDP_GRO == c->cmsg_type))
+            {
+                int gso_size;
+
+                memcpy(&gso_size, CMSG_DATA(c), sizeof(int));
+
+                if (gso_size > 0)
+                {
+                    seg = gso_size;
+                }
+            }
+        }
+
+        if (seg > b->bufsize)
+        {
+            traceDebug("dropping %u byte datagram", (unsigned int) seg);
+            continue;
+        }
+
+        if (len > seg)
+        {
+            b->coalesced += (len + seg - 1) / seg;
+        }
+
+        for (off = 0; (off < len) && (b->count < max_count); off += seg)
+        {
+            b->slots[b->count] = buf + off;
+            b->lens[b->count]  = MIN(seg, len - off);
+            b->addrs[b->count] = b->gro_addrs[i];
+            ++(b->count);
+        }
+    }
+}
+#endif
+
+/** Have the kernel coalesce runs of datagrams from one sender on sock, which
+ *  must be the socket the batch receives from. Call before the first
+ *  receive. Needs a batch of more than one slot.
+ *
+ *  @return 0 if GRO is now enabled, -1 if it is not available
+ */
+int rx_batch_enable_gro(n2n_rx_batch_t *b, SOCKET sock)
+{
+#ifdef N2N_HAVE_MMSG
+    struct mmsghdr     *msgs = (struct mmsghdr *) b->msgs;
+    struct iovec       *iovs = (struct iovec *) b->iovs;
+    size_t              max_count = b->size * N2N_BATCH_GSO_SEGS;
+    uint8_t            *gro_bufs;
+    struct sockaddr_in *gro_addrs;
+    uint8_t            *ctrl;
+    uint8_t           **slots;
+    size_t             *lens;
+    struct sockaddr_in *addrs;
+    int                 on = 1;
+    size_t              i;
+
+    if ((b->size < 2) || b->gro)
+    {
+        return -1;
+    }
+
+    gro_bufs  = (uint8_t *) malloc(b->size * N2N_BATCH_GRO_BUFSIZE);
+    gro_addrs = (struct sockaddr_in *) calloc(b->size, sizeof(struct sockaddr_in));
+    ctrl      = (uint8_t *) calloc(b->size, N2N_BATCH_CTRL_SIZE);
+    slots     = (uint8_t **) calloc(max_count, sizeof(uint8_t *));
+    lens      = (size_t *) calloc(max_count, sizeof(size_t));
+    addrs     = (struct sockaddr_in *) calloc(max_count, sizeof(struct sockaddr_in));
+
+    if ((NULL == gro_bufs) || (NULL == gro_addrs) || (NULL == ctrl) ||
+        (NULL == slots) || (NULL == lens) || (NULL == addrs))
+    {
+        traceError("rx_batch_enable_gro: unable to allocate %u receive buffers", (unsigned int) b->size);
+    }
+    else if (setsockopt(sock, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) < 0)
+    {
+        traceInfo("UDP GRO not available [%s]", strerror(errno));
+    }
+    else
+    {
+        free(b->slots);
+        free(b->lens);
+        free(b->addrs);
+
+        b->slots     = slots;
+        b->lens      = lens;
+        b->addrs     = addrs;
+        b->gro_bufs  = gro_bufs;
+        b->gro_addrs = gro_addrs;
+        b->ctrl      = ctrl;
+
+        for (i = 0; i < b->size; ++i)
+        {
+            iovs[i].iov_base = gro_bufs + (i * N2N_BATCH_GRO_BUFSIZE);
+            iovs[i].iov_len  = N2N_BATCH_GRO_BUFSIZE;
+            msgs[i].msg_hdr.msg_name    = &(gro_addrs[i]);
+            msgs[i].msg_hdr.msg_control = ctrl + (i * N2N_BATCH_CTRL_SIZE);
+        }
+
+        b->gro = 1;
+
+        return 0;
+    }
+
+    free(gro_bufs);
+    free(gro_addrs);
+    free(ctrl);
+    free(slots);
+    free(lens);
+    free(addrs);
+#endif
+
+    return -1;
+}
+
+/** Receive up to b->size datagrams which are already queued on sock.
+ *
+ *  Call when sock is known to be readable. The datagrams are available in the
+ *  slots 0..b->count-1. With GRO there may be more datagrams than b->size.
+ *
+ *  @return number of datagrams received or -1 on error
+ */
+ssize_t rx_batch_recv(n2n_rx_batch_t *b, SOCKET sock)
+{
+    b->count = 0;
+
+#ifdef N2N_HAVE_MMSG
+    if (b->size > 1)
+    {
+        struct mmsghdr *msgs = (struct mmsghdr *) b->msgs;
+        size_t          i;
+        int             n;
+
+        for (i = 0; i < b->size; ++i)
+        {
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+            if (b->gro)
+            {
+                msgs[i].msg_hdr.msg_controllen = N2N_BATCH_CTRL_SIZE;
+            }
+        }
+
+        n = recvmmsg(sock, msgs, b->size, MSG_DONTWAIT, NULL);
+
+        if (n < 0)
+        {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                return 0; /* spurious wakeup */
+            }
+
+            return -1;
+        }
+
+        if (b->gro)
+        {
+            split_coalesced(b, n);
+        }
+        else
+        {
+            for (i = 0; i < (size_t) n; ++i)
+            {
+                b->lens[i] = msgs[i].msg_len;
+            }
+
+            b->count = n;
+        }
+    }
+    else
+#endif
+    {
+        socklen_t   i = sizeof(struct sockaddr_in);
+        ssize_t     recvlen;
+
+        recvlen = recvfrom(sock, rx_batch_buf(b, 0), b->bufsize, 0/*flags*/,
+                           (struct sockaddr *) &(b->addrs[0]), &i);
+
+        if (recvlen < 0)
+        {
+            return -1;
+        }
+
+        b->lens[0] = recvlen;
+        b->count = 1;
+    }
+
+    if (b->count > 0)
+    {
+        ++(b->calls);
+        b->datagrams += b->count;
+    }
+
+    return b->count;
+}
+
+
+/** Take the buffer of slot i, holding the datagram last received there, and
+ *  receive into buf from now on. buf must hold bufsize bytes.
+ *
+ *  @return the buffer taken from the slot, or NULL if the batch is not
+ *  rx_batch_swappable()
+ */
+uint8_t *rx_batch_swap(n2n_rx_batch_t *b, size_t i, uint8_t *buf)
+{
+    uint8_t *old = b->slots[i];
+
+    if (b->gro)
+    {
+        return NULL;
+    }
+
+    b->slots[i] = buf;
+
+#ifdef N2N_HAVE_MMSG
+    if (NULL != b->iovs)
+    {
+        ((struct iovec *) b->iovs)[i].iov_base = buf;
+    }
+#endif
+
+    return old;
+}
+
+
+/* ************************************** */
+/* Transmit */
+
+int tx_batch_init(n2n_tx_batch_t *b, SOCKET sock, size_t size, size_t bufsize)
+{
+    memset(b, 0, sizeof(n2n_tx_batch_t));
+
+    b->sock    = sock;
+    b->size    = clamp_batch_size(size);
+    b->bufsize = bufsize;
+    b->bufs    = (uint8_t *) malloc(b->size * b->bufsize);
+    b->pkts    = (const uint8_t **) calloc(b->size, sizeof(uint8_t *));
+    b->lens    = (size_t *) calloc(b->size, sizeof(size_t));
+    b->addrs   = (struct sockaddr_in *) calloc(b->size, sizeof(struct sockaddr_in));
+    b->hdrs    = (uint8_t *) malloc(b->size * N2N_BATCH_HDR_MAX);
+    b->hdr_lens = (size_t *) calloc(b->size, sizeof(size_t));
+
+    if ((NULL == b->bufs) || (NULL == b->pkts) || (NULL == b->lens) || (NULL == b->addrs) ||
+        (NULL == b->hdrs) || (NULL == b->hdr_lens))
+    {
+        traceError("tx_batch_init: unable to allocate %u slots", (unsigned int) b->size);
+        tx_batch_deinit(b);
+        return -1;
+    }
+
+#ifdef N2N_HAVE_MMSG
+    {
+        struct mmsghdr *msgs;
+        struct iovec   *iovs;
+        size_t          i;
+
+        msgs = (struct mmsghdr *) calloc(b->size, sizeof(struct mmsghdr));
+        iovs = (struct iovec *) calloc(2 * b->size, sizeof(struct iovec));
+        b->msgs = msgs;
+        b->iovs = iovs;
+        b->segs = (size_t *) calloc(b->size, sizeof(size_t));
+        b->ctrl = (uint8_t *) calloc(b->size, N2N_BATCH_CTRL_SIZE);
+
+        if ((NULL == msgs) || (NULL == iovs) || (NULL == b->segs) || (NULL == b->ctrl))
+        {
+            traceError("tx_batch_init: unable to allocate message headers");
+            tx_batch_deinit(b);
+            return -1;
+        }
+
+        for (i = 0; i < b->size; ++i)
+        {
+            msgs[i].msg_hdr.msg_iov     = &(iovs[2 * i]);
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+            msgs[i].msg_hdr.msg_name    = &(b->addrs[i]);
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+void tx_batch_deinit(n2n_tx_batch_t *b)
+{
+    free(b->bufs);
+    free(b->pkts);
+    free(b->lens);
+    free(b->addrs);
+    free(b->hdrs);
+    free(b->hdr_lens);
+    free(b->msgs);
+    free(b->iovs);
+    free(b->segs);
+    free(b->ctrl);
+    memset(b, 0, sizeof(n2n_tx_batch_t));
+}
+
+/** Let flushes send runs of datagrams for the same address as one message
+ *  which the kernel splits up. Needs a batch of more than one slot.
+ *
+ *  @return 0 if GSO is now enabled, -1 if it is not available
+ */
+int tx_batch_enable_gso(n2n_tx_batch_t *b)
+{
+#ifdef N2N_HAVE_MMSG
+    int       val = 0;
+    socklen_t len = sizeof(val);
+
+    if (b->size < 2)
+    {
+        return -1;
+    }
+
+    if (getsockopt(b->sock, IPPROTO_UDP, UDP_SEGMENT, &val, &len) < 0)
+    {
+        traceInfo("UDP GSO not available [%s]", strerror(errno));
+        return -1;
+    }
+
+    b->gso = 1;
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/** Return the buffer in which the next datagram should be built. It is queued
+ *  by a following call to tx_batch_commit(). */
+uint8_t *tx_batch_reserve(n2n_tx_batch_t *b)
+{
+    return b->bufs + (b->count * b->bufsize);
+}
+
+/** Return the buffer ahead slots after the one tx_batch_reserve() returns,
+ *  or NULL if the queue has no such free slot. A datagram built there is
+ *  committed once the ahead datagrams before it have been queued. */
+uint8_t *tx_batch_ahead(n2n_tx_batch_t *b, size_t ahead)
+{
+    if ((b->count + ahead) >= b->size)
+    {
+        return NULL;
+    }
+
+    return b->bufs + ((b->count + ahead) * b->bufsize);
+}
+
+/** Header of slot i. */
+static uint8_t *slot_hdr(const n2n_tx_batch_t *b, size_t i)
+{
+    return b->hdrs + (i * N2N_BATCH_HDR_MAX);
+}
+
+/** Record the datagram whose address has been written to b->addrs and whose
+ *  header, if any, to its slot header. */
+static int queue_tail(n2n_tx_batch_t *b, size_t hdr_len, const uint8_t *pkt, size_t len)
+{
+    b->hdr_lens[b->count] = hdr_len;
+    b->pkts[b->count] = pkt;
+    b->lens[b->count] = len;
+    ++(b->count);
+    ++(b->queued);
+
+    if (b->count >= b->size)
+    {
+        tx_batch_flush(b);
+    }
+
+    return 0;
+}
+
+/** Queue the datagram of len bytes at pkt for addr. pkt must lie within the
+ *  last reserved buffer. The queue is flushed if this fills it.
+ *
+ *  @return 0 on success, -1 if the datagram lies outside the buffer
+ */
+int tx_batch_commit(n2n_tx_batch_t *b, const uint8_t *pkt, size_t len, const struct sockaddr_in *addr)
+{
+    const uint8_t *slot = tx_batch_reserve(b);
+
+    if ((pkt < slot) || ((size_t) (pkt - slot) + len > b->bufsize))
+    {
+        ++(b->errors);
+        traceError("tx_batch_commit: datagram of %u bytes outside its slot", (unsigned int) len);
+        return -1;
+    }
+
+    return tx_batch_queue(b, pkt, len, addr);
+}
+
+/** Queue the datagram of len bytes at pkt for addr. pkt is not copied and
+ *  must stay valid until the queue has been flushed. The queue is flushed if
+ *  this fills it.
+ *
+ *  @return 0
+ */
+int tx_batch_queue(n2n_tx_batch_t *b, const uint8_t *pkt, size_t len, const struct sockaddr_in *addr)
+{
+    b->addrs[b->count] = *addr;
+
+    return queue_tail(b, 0, pkt, len);
+}
+
+/** Queue a copy of the len bytes at pktbuf for dest.
+ *
+ *  @return 0 on success, -1 if the datagram does not fit or dest cannot be used
+ */
+int tx_batch_add(n2n_tx_batch_t *b, const uint8_t *pktbuf, size_t len, const n2n_sock_t *dest)
+{
+    if (len > b->bufsize)
+    {
+        ++(b->errors);
+        traceError("tx_batch_add: datagram of %u bytes too large", (unsigned int) len);
+        return -1;
+    }
+
+    if (0 != fill_sockaddr((struct sockaddr *) &(b->addrs[b->count]), dest))
+    {
+        ++(b->errors);
+        traceError("tx_batch_add: unsupported address family %u", (unsigned int) dest->family);
+        return -1;
+    }
+
+    memcpy(tx_batch_reserve(b), pktbuf, len);
+
+    return queue_tail(b, 0, tx_batch_reserve(b), len);
+}
+
+/** Queue for dest the datagram made of the hdr_len bytes at hdr followed by
+ *  the len bytes at payload. The header is copied; payload is not and must
+ *  stay valid until the queue has been flushed. The queue is flushed if this
+ *  fills it.
+ *
+ *  @return 0 on success, -1 if the datagram does not fit or dest cannot be used
+ */
+int tx_batch_splice(n2n_tx_batch_t *b, const uint8_t *hdr, size_t hdr_len,
+                    const uint8_t *payload, size_t len, const n2n_sock_t *dest)
+{
+    if ((hdr_len > N2N_BATCH_HDR_MAX) || (hdr_len + len > b->bufsize))
+    {
+        ++(b->errors);
+        traceError("tx_batch_splice: datagram of %u+%u bytes too large",
+                   (unsigned int) hdr_len, (unsigned int) len);
+        return -1;
+    }
+
+    if (0 != fill_sockaddr((struct sockaddr *) &(b->addrs[b->count]), dest))
+    {
+        ++(b->errors);
+        traceError("tx_batch_splice: unsupported address family %u", (unsigned int) dest->family);
+        return -1;
+    }
+
+    ++(b->spliced);
+
+#ifdef WIN32
+    /* No gather send: assemble the datagram in its slot. */
+    memcpy(tx_batch_reserve(b), hdr, hdr_len);
+    memcpy(tx_batch_reserve(b) + hdr_len, payload, len);
+
+    return queue_tail(b, 0, tx_batch_reserve(b), hdr_len + len);
+#else
+    memcpy(slot_hdr(b, b->count), hdr, hdr_len);
+
+    return queue_tail(b, hdr_len, payload, len);
+#endif
+}
+
+#ifdef N2N_HAVE_MMSG
+/** Length of queued datagram i including its header. */
+static size_t dgram_len(const n2n_tx_batch_t *b, size_t i)
+{
+    return b->hdr_lens[i] + b->lens[i];
+}
+
+/** Point iov at the parts of queued datagram i.
+ *
+ *  @return the number of iovecs used, 1 or 2
+ */
+static size_t fill_iov(const n2n_tx_batch_t *b, size_t i, struct iovec *iov)
+{
+    size_t n = 0;
+
+    if (b->hdr_lens[i] > 0)
+    {
+        iov[n].iov_base = slot_hdr(b, i);
+        iov[n].iov_len  = b->hdr_lens[i];
+        ++n;
+    }
+
+    iov[n].iov_base = (void *) b->pkts[i];
+    iov[n].iov_len  = b->lens[i];
+
+    return n + 1;
+}
+
+/** Non-zero if queued datagram i can be appended to the segmented message
+ *  holding bytes bytes from datagram first on. Every segment but the last
+ *  must be as long as the first. */
+static int gso_joins(const n2n_tx_batch_t *b, size_t first, size_t i, size_t bytes)
+{
+    size_t seg = dgram_len(b, first);
+
+    return (i - first < N2N_BATCH_GSO_SEGS) &&
+           (dgram_len(b, i - 1) == seg) &&
+           (dgram_len(b, i) <= seg) &&
+           (bytes + dgram_len(b, i) <= N2N_BATCH_GSO_BYTES) &&
+           (b->addrs[i].sin_addr.s_addr == b->addrs[first].sin_addr.s_addr) &&
+           (b->addrs[i].sin_port == b->addrs[first].sin_port);
+}
+#endif
+
+/** Send queued datagram i on its own.
+ *
+ *  @return 0 on success, -1 on error
+ */
+/* Send errors that clear once the socket buffer drains. */
+#ifdef WIN32
+#define TX_TRANSIENT(e) ((WSAEWOULDBLOCK == (e)) || (WSAENOBUFS == (e)))
+#else
+#define TX_TRANSIENT(e) ((EAGAIN == (e)) || (EWOULDBLOCK == (e)) || (ENOBUFS == (e)))
+#endif
+
+static int send_one(const n2n_tx_batch_t *b, size_t i)
+{
+    ssize_t s;
+
+#ifndef WIN32
+    if (b->hdr_lens[i] > 0)
+    {
+        struct iovec  iov[2];
+        struct msghdr msg;
+
+        iov[0].iov_base = slot_hdr(b, i);
+        iov[0].iov_len  = b->hdr_lens[i];
+        iov[1].iov_base = (void *) b->pkts[i];
+        iov[1].iov_len  = b->lens[i];
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name    = (void *) &(b->addrs[i]);
+        msg.msg_namelen = sizeof(struct sockaddr_in);
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = 2;
+
+        s = sendmsg(b->sock, &msg, 0);
+    }
+    else
+#endif
+    {
+        s = sendto(b->sock, (const char *) b->pkts[i], b->lens[i], 0/*flags*/,
+                   (const struct sockaddr *) &(b->addrs[i]), sizeof(struct sockaddr_in));
+    }
+
+    if (s < 0)
+    {
+        if (TX_TRANSIENT(errno))
+        {
+            traceDebug("sendto failed (%d) %s", errno, strerror(errno));
+        }
+        else
+        {
+            traceError("sendto failed (%d) %s", errno, strerror(errno));
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Send every queued datagram.
+ *
+ *  @return number of datagrams sent
+ */
+ssize_t tx_batch_flush(n2n_tx_batch_t *b)
+{
+    size_t i;
+    size_t sent = 0;
+    size_t failed = 0;
+
+    if (0 == b->count)
+    {
+        return 0;
+    }
+
+#ifdef N2N_HAVE_MMSG
+    if (b->count > 1)
+    {
+        struct mmsghdr *msgs = (struct mmsghdr *) b->msgs;
+        struct iovec   *iov = (struct iovec *) b->iovs;
+        size_t          num_msgs = 0;
+        size_t          first;
+
+        /* One message per datagram, or per run of datagrams to segment. */
+        i = 0;
+        while (i < b->count)
+        {
+            struct msghdr *h = &(msgs[num_msgs].msg_hdr);
+            size_t         bytes = 0;
+
+            first = i;
+            h->msg_iov        = iov;
+            h->msg_name       = &(b->addrs[i]);
+            h->msg_control    = NULL;
+            h->msg_controllen = 0;
+
+            do
+            {
+                iov += fill_iov(b, i, iov);
+                bytes += dgram_len(b, i);
+                ++i;
+            } while (b->gso && (i < b->count) && gso_joins(b, first, i, bytes));
+
+            h->msg_iovlen = iov - h->msg_iov;
+            b->segs[num_msgs] = i - first;
+
+            if (i - first > 1)
+            {
+                struct cmsghdr *c;
+                uint16_t        seg = dgram_len(b, first);
+
+                h->msg_control    = b->ctrl + (num_msgs * N2N_BATCH_CTRL_SIZE);
+                h->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                c = CMSG_FIRSTHDR(h);
+                c->cmsg_level = IPPROTO_UDP;
+                c->cmsg_type  = UDP_SEGMENT;
+                c->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(c), &seg, sizeof(uint16_t));
+            }
+
+            ++num_msgs;
+        }
+
+        i = 0;          /* message */
+        first = 0;      /* its first datagram */
+        while (i < num_msgs)
+        {
+            int n = sendmmsg(b->sock, msgs + i, num_msgs - i, 0);
+
+            if (n < 0)
+            {
+                int     err = errno;
+                size_t  j;
+
+                if (EINTR == err)
+                {
+                    continue;
+                }
+
+                /* sendmmsg() only fails if the first message fails. A full
+                 * socket buffer fails the rest as well: send the remainder
+                 * one datagram at a time, which is as far as it would get. */
+                if (TX_TRANSIENT(err))
+                {
+                    traceDebug("sendmmsg failed (%d) %s; sending %u singly", err, strerror(err),
+                               (unsigned int) (b->count - first));
+
+                    for (j = first; j < b->count; ++j)
+                    {
+                        if (0 != send_one(b, j))
+                        {
+                            ++failed;
+                        }
+                        else
+                        {
+                            ++sent;
+                        }
+                    }
+                    break;
+                }
+
+                /* Otherwise skip the failing message and carry on. */
+                if (b->segs[i] > 1)
+                {
+                    /* EIO if the route cannot segment after all. */
+                    if ((EIO == err) || (EINVAL == err) || (EOPNOTSUPP == err))
+                    {
+                        traceWarning("UDP GSO failed (%d) %s; no longer segmenting", err, strerror(err));
+                        b->gso = 0;
+                    }
+
+                    for (j = first; j < first + b->segs[i]; ++j)
+                    {
+                        if (0 != send_one(b, j))
+                        {
+                            ++failed;
+                        }
+                        else
+                        {
+                            ++sent;
+                        }
+                    }
+                }
+                else
+                {
+                    traceWarning("sendmmsg failed (%d) %s; datagram dropped", err, strerror(err));
+                    ++failed;
+                }
+
+                first += b->segs[i];
+                ++i;
+            }
+            else
+            {
+                for (; n > 0; --n, ++i)
+                {
+                    sent += b->segs[i];
+                    first += b->segs[i];
+
+                    if (b->segs[i] > 1)
+                    {
+                        b->segmented += b->segs[i];
+                    }
+                }
+            }
+        }
+    }
+    else
+#endif
+    {
+        for (i = 0; i < b->count; ++i)
+        {
+            if (0 != send_one(b, i))
+            {
+                ++failed;
+            }
+            else
+            {
+                ++sent;
+            }
+        }
+    }
+
+    traceDebug("tx_batch_flush sent=%u failed=%u", (unsigned int) sent, (unsigned int) failed);
+
+    ++(b->flushes);
+    b->datagrams += sent;
+    b->errors += failed;
+    b->count = 0;
+
+    return sent;
+}
@@ -0,0 +1,147 @@
+/*
+ * n2n_batch.h
+ *
+ * Batched UDP receive and transmit.
+ *
+ * On Linux a whole burst of datagrams is moved with one recvmmsg() or
+ * sendmmsg() system call. Elsewhere the same interface falls back to one
+ * recvfrom()/sendto() per datagram so callers need not care.
+ *
+ * Where the kernel supports UDP segmentation offload, a batch may also move
+ * several datagrams per message: on transmit, runs of datagrams of equal
+ * size for the same address leave as one super-buffer split by the kernel
+ * (UDP_SEGMENT); on receive, the kernel may deliver a run of datagrams from
+ * one sender coalesced (UDP_GRO), which the batch splits up again. Both are
+ * enabled by the owner and fall back to plain datagrams if unsupported.
+ */
+
+#ifndef N2N_BATCH_H_
+#define N2N_BATCH_H_
+
+#include "n2n_wire.h"
+
+#define N2N_BATCH_MAX           64      /* Upper bound for the batch size option. */
+#define N2N_BATCH_HDR_MAX       64      /* Largest header tx_batch_splice() can put in front. */
+#define N2N_BATCH_GSO_SEGS      64      /* Max datagrams per segmented message (UDP_MAX_SEGMENTS). */
+#define N2N_BATCH_GSO_BYTES     65000   /* Max bytes per segmented message. */
+#define N2N_BATCH_GRO_BUFSIZE   65536   /* Receive buffer for a coalesced message. */
+
+
+/** A set of receive slots filled by one call to rx_batch_recv().
+ *
+ *  The owner may take the buffer of a slot with rx_batch_swap(), giving
+ *  another buffer of bufsize bytes in exchange. bufs is only released by
+ *  rx_batch_deinit(), so buffers exchanged this way must stay valid until
+ *  then.
+ *
+ *  With GRO the batch receives into gro_bufs and each slot points at one
+ *  datagram within them, so up to size * N2N_BATCH_GSO_SEGS slots may be
+ *  filled; such slots cannot be swapped (see rx_batch_swappable()).
+ */
+struct n2n_rx_batch
+{
+    size_t              size;           /* Number of slots. */
+    size_t              bufsize;        /* Size of each slot buffer. */
+    size_t              count;          /* Datagrams held after the last receive. */
+    uint8_t            *bufs;           /* size * bufsize bytes */
+    uint8_t           **slots;          /* Buffer of each slot, initially within bufs. */
+    size_t             *lens;           /* Length of each received datagram. */
+    struct sockaddr_in *addrs;          /* Sender of each received datagram. */
+    void               *msgs;           /* struct mmsghdr array where supported. */
+    void               *iovs;           /* struct iovec array where supported. */
+
+    int                 gro;            /* Non-zero once UDP_GRO is enabled. */
+    uint8_t            *gro_bufs;       /* size * N2N_BATCH_GRO_BUFSIZE bytes */
+    struct sockaddr_in *gro_addrs;      /* Sender of each received message. */
+    uint8_t            *ctrl;           /* Control buffer of each message. */
+
+    /* Statistics */
+    size_t              calls;          /* Receive calls which returned data. */
+    size_t              datagrams;      /* Datagrams received in total. */
+    size_t              coalesced;      /* Of which arrived coalesced with others. */
+};
+
+typedef struct n2n_rx_batch n2n_rx_batch_t;
+
+
+/** A queue of outgoing datagrams flushed with one call to tx_batch_flush().
+ *
+ *  Datagrams are built directly in the slot buffer returned by
+ *  tx_batch_reserve() and queued with tx_batch_commit(). A datagram need not
+ *  start at the beginning of its slot, which lets the owner read a payload at
+ *  a fixed offset and write the headers in front of it afterwards. Datagrams
+ *  held in the owner's memory are queued with tx_batch_queue(). The queue is
+ *  flushed when it becomes full or when the owner calls tx_batch_flush(),
+ *  normally once per main loop iteration.
+ *
+ *  A datagram relayed with a new header is queued with tx_batch_splice():
+ *  only the header is copied, into a small per slot buffer, and it is sent
+ *  together with the payload where that lies, using one iovec for each.
+ */
+struct n2n_tx_batch
+{
+    SOCKET              sock;           /* Socket the datagrams are sent on. */
+    size_t              size;           /* Number of slots. */
+    size_t              bufsize;        /* Size of each slot buffer. */
+    size_t              count;          /* Datagrams waiting to be sent. */
+    uint8_t            *bufs;           /* size * bufsize bytes */
+    const uint8_t     **pkts;           /* Start of each queued datagram. */
+    size_t             *lens;
+    struct sockaddr_in *addrs;
+    uint8_t            *hdrs;           /* size * N2N_BATCH_HDR_MAX bytes */
+    size_t             *hdr_lens;       /* Header of each queued datagram; 0 if none. */
+    void               *msgs;           /* struct mmsghdr array where supported. */
+    void               *iovs;           /* struct iovec array, two per slot, where supported. */
+    size_t             *segs;           /* Datagrams sent by each message. */
+    uint8_t            *ctrl;           /* Control buffer of each message. */
+    int                 gso;            /* Non-zero once UDP_SEGMENT is enabled. */
+
+    /* Statistics */
+    size_t              queued;         /* Datagrams queued in total. */
+    size_t              spliced;        /* Of which queued by tx_batch_splice(). */
+    size_t              segmented;      /* Datagrams sent within segmented messages. */
+    size_t              flushes;        /* Flushes which sent at least one datagram. */
+    size_t              datagrams;      /* Datagrams sent in total. */
+    size_t              errors;         /* Datagrams which could not be sent. */
+};
+
+typedef struct n2n_tx_batch n2n_tx_batch_t;
+
+
+int     rx_batch_init(n2n_rx_batch_t *b, size_t size, size_t bufsize);
+void    rx_batch_deinit(n2n_rx_batch_t *b);
+ssize_t rx_batch_recv(n2n_rx_batch_t *b, SOCKET sock);
+int     rx_batch_enable_gro(n2n_rx_batch_t *b, SOCKET sock);
+uint8_t *rx_batch_swap(n2n_rx_batch_t *b, size_t i, uint8_t *buf);
+
+static inline uint8_t *rx_batch_buf(const n2n_rx_batch_t *b, size_t i)
+{
+    return b->slots[i];
+}
+
+/** Non-zero if the buffers of the slots may be taken with rx_batch_swap(). */
+static inline int rx_batch_swappable(const n2n_rx_batch_t *b)
+{
+    return !b->gro;
+}
+
+int     tx_batch_init(n2n_tx_batch_t *b, SOCKET sock, size_t size, size_t bufsize);
+void    tx_batch_deinit(n2n_tx_batch_t *b);
+int     tx_batch_enable_gso(n2n_tx_batch_t *b);
+uint8_t *tx_batch_reserve(n2n_tx_batch_t *b);
+uint8_t *tx_batch_ahead(n2n_tx_batch_t *b, size_t ahead);
+int     tx_batch_commit(n2n_tx_batch_t *b, const uint8_t *pkt, size_t len, const struct sockaddr_in *addr);
+int     tx_batch_add(n2n_tx_batch_t *b, const uint8_t *pktbuf, size_t len, const n2n_sock_t *dest);
+int     tx_batch_queue(n2n_tx_batch_t *b, const uint8_t *pkt, size_t len, const struct sockaddr_in *addr);
+int     tx_batch_splice(n2n_tx_batch_t *b, const uint8_t *hdr, size_t hdr_len,
+                        const uint8_t *payload, size_t len, const n2n_sock_t *dest);
+ssize_t tx_batch_flush(n2n_tx_batch_t *b);
+
+/** Average number of datagrams moved per system call, times 10. */
+static inline unsigned int batch_fill_x10(size_t datagrams, size_t calls)
+{
+    return (calls > 0) ? (unsigned int) ((datagrams * 10) / calls) : 0;
+}
+
+
+#endif /* N2N_BATCH_H_ */
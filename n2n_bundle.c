@@ -0,0 +1,245 @@
+/*
+ * n2n_bundle.c
+ *
+ * Bundling of small frames to one peer into a single PACKET. See
+ * n2n_bundle.h.
+ */
+
+#include "n2n.h"
+#include "n2n_bundle.h"
+
+#define BUNDLE_RECORD_HDR       2       /* Length octets in front of each frame. */
+
+
+/* ********************************** */
+
+/** Set up bd for bundles of up to max_len bytes. */
+void bundle_init(n2n_bundler_t *bd, size_t max_len)
+{
+    memset(bd, 0, sizeof(n2n_bundler_t));
+
+    bd->max_len = MIN(max_len, N2N_PKT_BUF_SIZE - N2N_PKT_HEADROOM - N2N_PKT_TAILROOM);
+}
+
+void bundle_deinit(n2n_bundler_t *bd)
+{
+    free(bd->b);
+    bd->b = NULL;
+    bd->num_open = 0;
+}
+
+/** @return the open bundle to mac, or NULL if there is none. */
+struct n2n_bundle *bundle_find(n2n_bundler_t *bd, const n2n_mac_t mac)
+{
+    size_t i;
+
+    if (0 == bd->num_open)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < N2N_BUNDLE_OPEN; ++i)
+    {
+        if ((bd->b[i].count > 0) && (0 == memcmp(bd->b[i].mac, mac, N2N_MAC_SIZE)))
+        {
+            return &(bd->b[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/** Open an empty bundle to mac which is to be sent by deadline.
+ *
+ *  @return the bundle, or NULL if all of them are open or being sent
+ */
+struct n2n_bundle *bundle_open(n2n_bundler_t *bd, const n2n_mac_t mac, uint16_t transform, uint64_t deadline)
+{
+    size_t i;
+
+    if (NULL == bd->b)
+    {
+        bd->b = (struct n2n_bundle *) calloc(N2N_BUNDLE_OPEN, sizeof(struct n2n_bundle));
+        if (NULL == bd->b)
+        {
+            traceError("bundle_open: unable to allocate bundles");
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < N2N_BUNDLE_OPEN; ++i)
+    {
+        struct n2n_bundle *b = &(bd->b[i]);
+
+        if ((0 == b->count) && !b->held)
+        {
+            memcpy(b->mac, mac, N2N_MAC_SIZE);
+            b->transform = transform;
+            b->len = 0;
+            b->deadline = deadline;
+            ++(bd->num_open);
+
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/** @return how long a frame still fits in b, or in a new bundle if b is NULL */
+size_t bundle_room(const n2n_bundler_t *bd, const struct n2n_bundle *b)
+{
+    size_t used = BUNDLE_RECORD_HDR + ((NULL != b) ? b->len : 0);
+
+    return (bd->max_len > used) ? MIN(bd->max_len - used, N2N_BUNDLE_LEN_MASK) : 0;
+}
+
+/** Append the frame of len bytes to b. hc is non-zero if its headers are
+ *  compressed.
+ *
+ *  @return 0, or -1 if it does not fit
+ */
+int bundle_add(n2n_bundler_t *bd, struct n2n_bundle *b, const uint8_t *frame, size_t len, int hc)
+{
+    uint8_t *rec = b->buf + N2N_PKT_HEADROOM + b->len;
+    uint16_t rlen = len | (hc ? N2N_BUNDLE_HC : 0);
+
+    if ((len > N2N_BUNDLE_LEN_MASK) || (b->len + BUNDLE_RECORD_HDR + len > bd->max_len))
+    {
+        return -1;
+    }
+
+    rec[0] = rlen >> 8;
+    rec[1] = rlen & 0xFF;
+    memcpy(rec + BUNDLE_RECORD_HDR, frame, len);
+
+    b->len += BUNDLE_RECORD_HDR + len;
+    ++(b->count);
+    ++(bd->stats.tx_frames);
+
+    return 0;
+}
+
+/** @return the open bundle due first if it is due by now, else NULL */
+struct n2n_bundle *bundle_due(n2n_bundler_t *bd, uint64_t now)
+{
+    struct n2n_bundle *due = NULL;
+    size_t i;
+
+    if (0 == bd->num_open)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < N2N_BUNDLE_OPEN; ++i)
+    {
+        struct n2n_bundle *b = &(bd->b[i]);
+
+        if ((b->count > 0) && (b->deadline <= now) &&
+            ((NULL == due) || (b->deadline < due->deadline)))
+        {
+            due = b;
+        }
+    }
+
+    return due;
+}
+
+/** @return the deadline of the open bundle due first, 0 if none is open */
+uint64_t bundle_next_deadline(const n2n_bundler_t *bd)
+{
+    uint64_t next = 0;
+    size_t i;
+
+    if (0 == bd->num_open)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < N2N_BUNDLE_OPEN; ++i)
+    {
+        const struct n2n_bundle *b = &(bd->b[i]);
+
+        if ((b->count > 0) && ((0 == next) || (b->deadline < next)))
+        {
+            next = b->deadline;
+        }
+    }
+
+    return next;
+}
+
+/** Close b once it has been sent or dropped. held is non-zero if its buffer
+ *  waits in the Tx queue, in which case b is not reused before
+ *  bundle_release(). */
+void bundle_sent(n2n_bundler_t *bd, struct n2n_bundle *b, int held)
+{
+    b->count = 0;
+    b->len = 0;
+    b->held = (held != 0);
+    --(bd->num_open);
+}
+
+/** Let bundles held by the Tx queue be reused. Called once it is flushed. */
+void bundle_release(n2n_bundler_t *bd)
+{
+    size_t i;
+
+    if (NULL == bd->b)
+    {
+        return;
+    }
+
+    for (i = 0; i < N2N_BUNDLE_OPEN; ++i)
+    {
+        bd->b[i].held = 0;
+    }
+}
+
+/** Take the frame of the record at *off from the len bytes of records of a
+ *  received bundle. *frame is set to the frame, *hc to non-zero if its
+ *  headers are compressed, and *off to the next record.
+ *
+ *  @return length of the frame, 0 after the last one or -1 if the record is
+ *  malformed
+ */
+int bundle_next(uint8_t *records, size_t len, size_t *off, uint8_t **frame, int *hc)
+{
+    uint16_t rlen;
+    size_t   flen;
+
+    if (*off >= len)
+    {
+        return 0;
+    }
+
+    if (*off + BUNDLE_RECORD_HDR > len)
+    {
+        return -1;
+    }
+
+    rlen = (records[*off] << 8) | records[*off + 1];
+    flen = rlen & N2N_BUNDLE_LEN_MASK;
+
+    if ((0 == flen) || (*off + BUNDLE_RECORD_HDR + flen > len))
+    {
+        return -1;
+    }
+
+    *frame = records + *off + BUNDLE_RECORD_HDR;
+    *hc = (0 != (rlen & N2N_BUNDLE_HC));
+    *off += BUNDLE_RECORD_HDR + flen;
+
+    return flen;
+}
+
+/** Add the counters s to tot. */
+void bundle_stats_add(struct n2n_bundle_stats *tot, const struct n2n_bundle_stats *s)
+{
+    tot->tx_frames += s->tx_frames;
+    tot->tx_bundles += s->tx_bundles;
+    tot->tx_alone += s->tx_alone;
+    tot->rx_bundles += s->rx_bundles;
+    tot->rx_frames += s->rx_frames;
+    tot->rx_errors += s->rx_errors;
+}
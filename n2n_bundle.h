@@ -0,0 +1,84 @@
+/*
+ * n2n_bundle.h
+ *
+ * Bundling of small frames to one peer into a single PACKET.
+ *
+ * Interactive and VoIP traffic is mostly frames of a few dozen to a couple
+ * of hundred bytes, each of which would pay for a PACKET header, the
+ * transform's nonce and padding and a datagram of its own. Frames of up to
+ * N2N_BUNDLE_FRAME_MAX bytes to a peer which accepts bundles wait in an open
+ * bundle for that peer instead. The bundle is sent when the next frame does
+ * not fit, when a larger frame to the same peer has to go out (so frames are
+ * never reordered) or when the oldest frame in it has waited long enough.
+ *
+ * A bundle is encoded like a frame and sent in a PACKET whose options octet
+ * has N2N_OPTION_BUNDLE set. Its plaintext is a sequence of records, each a
+ * two octet length followed by a frame. N2N_BUNDLE_HC in the length says the
+ * frame has compressed headers (see n2n_hc.h). A bundle holding a single
+ * frame when it is sent goes out as that frame in a plain PACKET.
+ *
+ * Edges offer to accept bundles in REGISTER and both ends confirm it in
+ * REGISTER_ACK. Bundles are never sent through the supernode.
+ *
+ * The state is private to one data-plane thread.
+ */
+
+#ifndef N2N_BUNDLE_H_
+#define N2N_BUNDLE_H_
+
+#include "n2n.h"
+
+#define N2N_BUNDLE_FRAME_MAX    256     /* Longer frames are sent on their own. */
+#define N2N_BUNDLE_OPEN         8       /* Bundles a thread keeps at once. */
+#define N2N_BUNDLE_HC           0x8000  /* In a record length: the frame has compressed headers. */
+#define N2N_BUNDLE_LEN_MASK     0x7FFF
+
+/** Frames waiting for one peer. The records start N2N_PKT_HEADROOM bytes
+ *  into buf so the bundle is encoded where it lies. */
+struct n2n_bundle
+{
+    n2n_mac_t           mac;            /* Destination edge. */
+    uint16_t            transform;      /* Transform of the flow it goes along. */
+    uint16_t            count;          /* Frames held; 0 if the bundle is not open. */
+    uint8_t             held;           /* Queued for sending; buf is in use until the queue is flushed. */
+    size_t              len;            /* Bytes of records. */
+    uint64_t            deadline;       /* usec, monotonic clock. */
+    uint8_t             buf[N2N_PKT_BUF_SIZE];
+};
+
+struct n2n_bundle_stats
+{
+    size_t              tx_frames;      /* Frames put in bundles. */
+    size_t              tx_bundles;     /* Bundles sent, holding two frames or more. */
+    size_t              tx_alone;       /* Bundles sent as the single frame they held. */
+    size_t              rx_bundles;
+    size_t              rx_frames;      /* Frames taken from bundles. */
+    size_t              rx_errors;      /* Bundles with a malformed record. */
+};
+
+struct n2n_bundler
+{
+    size_t              max_len;        /* Longest bundle, records included. */
+    struct n2n_bundle  *b;              /* N2N_BUNDLE_OPEN, allocated on first use. */
+    size_t              num_open;
+    struct n2n_bundle_stats stats;
+};
+
+typedef struct n2n_bundler n2n_bundler_t;
+
+
+void    bundle_init(n2n_bundler_t *bd, size_t max_len);
+void    bundle_deinit(n2n_bundler_t *bd);
+struct n2n_bundle *bundle_find(n2n_bundler_t *bd, const n2n_mac_t mac);
+struct n2n_bundle *bundle_open(n2n_bundler_t *bd, const n2n_mac_t mac, uint16_t transform, uint64_t deadline);
+size_t  bundle_room(const n2n_bundler_t *bd, const struct n2n_bundle *b);
+int     bundle_add(n2n_bundler_t *bd, struct n2n_bundle *b, const uint8_t *frame, size_t len, int hc);
+struct n2n_bundle *bundle_due(n2n_bundler_t *bd, uint64_t now);
+uint64_t bundle_next_deadline(const n2n_bundler_t *bd);
+void    bundle_sent(n2n_bundler_t *bd, struct n2n_bundle *b, int held);
+void    bundle_release(n2n_bundler_t *bd);
+int     bundle_next(uint8_t *records, size_t len, size_t *off, uint8_t **frame, int *hc);
+void    bundle_stats_add(struct n2n_bundle_stats *tot, const struct n2n_bundle_stats *s);
+
+
+#endif /* N2N_BUNDLE_H_ */
@@ -0,0 +1,306 @@
+/*
+ * n2n_community.c
+ *
+ * Communities of the edges registered with a supernode. See n2n_community.h.
+ */
+
+#include "n2n.h"
+#include "n2n_community.h"
+
+#define N2N_COMM_SLOTS_MIN      16
+#define N2N_COMM_MEMBERS_MIN    4
+
+
+static uint32_t name_hash(const n2n_community_t name)
+{
+    uint64_t a;
+    uint64_t b;
+
+    memcpy(&a, name, sizeof(uint64_t));
+    memcpy(&b, name + sizeof(uint64_t), sizeof(uint64_t));
+
+    a = (a ^ (b * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+
+    return (uint32_t) (a >> 32);
+}
+
+/** Put id in the first empty slot of the probe sequence of hash. */
+static void slot_insert(n2n_comm_table_t *t, uint32_t hash, uint32_t id)
+{
+    size_t i;
+
+    for (i = hash & t->mask; 0 != t->slots[i]; i = (i + 1) & t->mask)
+    {
+    }
+
+    t->slots[i] = id + 1;
+}
+
+/** Empty slot i and shift later slots of its probe sequence back into the
+ *  gap so that lookups need no tombstones. */
+static void slot_clear(n2n_comm_table_t *t, size_t i)
+{
+    size_t j = i;
+
+    for (;;)
+    {
+        size_t home;
+
+        j = (j + 1) & t->mask;
+
+        if (0 == t->slots[j])
+        {
+            break;
+        }
+
+        home = t->comms[t->slots[j] - 1].hash & t->mask;
+
+        /* Leave j where it is if its home lies cyclically in (i, j]. */
+        if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+        {
+            continue;
+        }
+
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+
+    t->slots[i] = 0;
+}
+
+/** Hand a member array that is no longer in use to the retire hook. */
+static void retire_members(n2n_comm_table_t *t, struct peer_info **members)
+{
+    if (NULL == members)
+    {
+        return;
+    }
+
+    if (NULL != t->retire)
+    {
+        t->retire(members, t->retire_arg);
+    }
+    else
+    {
+        free(members);
+    }
+}
+
+/** Drop community id, which has no members left. */
+static void release_id(n2n_comm_table_t *t, uint32_t id)
+{
+    struct n2n_community *c = &(t->comms[id]);
+    size_t i = c->hash & t->mask;
+
+    while (t->slots[i] != id + 1)
+    {
+        i = (i + 1) & t->mask;
+    }
+
+    slot_clear(t, i);
+
+    traceDebug("community %.*s released", N2N_COMMUNITY_SIZE, (const char *) c->name);
+
+    retire_members(t, c->members);
+    c->members     = NULL;
+    c->max_members = 0;
+
+    t->free_ids[(t->num_free)++] = id;
+    --(t->count);
+}
+
+
+/** Set up an empty table holding up to capacity communities.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int comm_table_init(n2n_comm_table_t *t, size_t capacity)
+{
+    size_t num_slots = N2N_COMM_SLOTS_MIN;
+
+    memset(t, 0, sizeof(n2n_comm_table_t));
+
+    t->capacity = MAX(1, MIN(capacity, N2N_COMMUNITY_NONE - 1));
+
+    while (num_slots < 2 * t->capacity)
+    {
+        num_slots <<= 1;
+    }
+
+    t->mask     = num_slots - 1;
+    t->slots    = (uint32_t *) calloc(num_slots, sizeof(uint32_t));
+    t->comms    = (struct n2n_community *) calloc(t->capacity, sizeof(struct n2n_community));
+    t->free_ids = (uint32_t *) calloc(t->capacity, sizeof(uint32_t));
+
+    if ((NULL == t->slots) || (NULL == t->comms) || (NULL == t->free_ids))
+    {
+        traceError("comm_table_init: unable to allocate %u communities", (unsigned int) t->capacity);
+        comm_table_deinit(t);
+        return -1;
+    }
+
+    /* Hand out low ids first. */
+    for (t->num_free = 0; t->num_free < t->capacity; ++(t->num_free))
+    {
+        t->free_ids[t->num_free] = t->capacity - 1 - t->num_free;
+    }
+
+    return 0;
+}
+
+void comm_table_deinit(n2n_comm_table_t *t)
+{
+    size_t id;
+
+    for (id = 0; (NULL != t->comms) && (id < t->capacity); ++id)
+    {
+        free(t->comms[id].members);
+    }
+
+    free(t->comms);
+    free(t->free_ids);
+    free(t->slots);
+    memset(t, 0, sizeof(n2n_comm_table_t));
+}
+
+/** Have cb called with arg for every member array that is replaced or
+ *  released, instead of freeing it. */
+void comm_table_set_retire(n2n_comm_table_t *t, comm_table_retire_f cb, void *arg)
+{
+    t->retire     = cb;
+    t->retire_arg = arg;
+}
+
+/** Find the community called name.
+ *
+ *  @return NULL if no edge is a member; otherwise pointer to the community.
+ */
+struct n2n_community *comm_table_find(const n2n_comm_table_t *t, const n2n_community_t name)
+{
+    uint32_t hash = name_hash(name);
+    size_t   i = hash & t->mask;
+
+    /* Terminates because the table is never more than half full. */
+    for (;;)
+    {
+        struct n2n_community *c;
+        uint32_t slot = __atomic_load_n(&(t->slots[i]), __ATOMIC_RELAXED);
+
+        if (0 == slot)
+        {
+            return NULL;
+        }
+
+        c = &(t->comms[slot - 1]);
+
+        if ((c->hash == hash) && (0 == memcmp(c->name, name, sizeof(n2n_community_t))))
+        {
+            return c;
+        }
+
+        i = (i + 1) & t->mask;
+    }
+}
+
+/** Make peer, which must not be in a community, a member of the community
+ *  called name. The community is created if needed.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int comm_table_join(n2n_comm_table_t *t, const n2n_community_t name, struct peer_info *peer)
+{
+    struct n2n_community *c = comm_table_find(t, name);
+
+    if (NULL == c)
+    {
+        uint32_t id;
+
+        if (0 == t->num_free)
+        {
+            traceError("comm_table_join: more than %u communities", (unsigned int) t->capacity);
+            return -1;
+        }
+
+        id = t->free_ids[--(t->num_free)];
+        c = &(t->comms[id]);
+        memset(c, 0, sizeof(struct n2n_community));
+        memcpy(c->name, name, sizeof(n2n_community_t));
+        c->hash = name_hash(name);
+
+        slot_insert(t, c->hash, id);
+        ++(t->count);
+
+        traceDebug("community %.*s created with id %u",
+                   N2N_COMMUNITY_SIZE, (const char *) name, (unsigned int) id);
+    }
+
+    if (c->num_members == c->max_members)
+    {
+        uint32_t max_members = MAX(N2N_COMM_MEMBERS_MIN, 2 * c->max_members);
+        struct peer_info **members;
+        struct peer_info **old = c->members;
+
+        /* Not realloc(): readers may still be looking at the old array. */
+        members = (struct peer_info **) malloc(max_members * sizeof(struct peer_info *));
+        if (NULL == members)
+        {
+            traceError("comm_table_join: unable to allocate %u members", (unsigned int) max_members);
+
+            if (0 == c->num_members)
+            {
+                release_id(t, comm_table_id(t, c)); /* just created */
+            }
+
+            return -1;
+        }
+
+        if (c->num_members > 0)
+        {
+            memcpy(members, old, c->num_members * sizeof(struct peer_info *));
+        }
+
+        __atomic_store_n(&(c->members), members, __ATOMIC_RELEASE);
+        c->max_members = max_members;
+        retire_members(t, old);
+    }
+
+    peer->community_id = comm_table_id(t, c);
+    peer->member_idx   = c->num_members;
+    c->members[c->num_members] = peer;
+    __atomic_store_n(&(c->num_members), c->num_members + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/** Remove peer from its community, if it is in one. The community is
+ *  released when its last member leaves. */
+void comm_table_leave(n2n_comm_table_t *t, struct peer_info *peer)
+{
+    struct n2n_community *c;
+    struct peer_info     *last;
+    uint32_t              id = peer->community_id;
+
+    if (id >= t->capacity)
+    {
+        return;
+    }
+
+    c = &(t->comms[id]);
+
+    if ((peer->member_idx >= c->num_members) || (c->members[peer->member_idx] != peer))
+    {
+        traceError("comm_table_leave: peer not a member of community %u", (unsigned int) id);
+        return;
+    }
+
+    last = c->members[--(c->num_members)];
+    c->members[peer->member_idx] = last;
+    last->member_idx = peer->member_idx;
+
+    peer->community_id = N2N_COMMUNITY_NONE;
+
+    if (0 == c->num_members)
+    {
+        release_id(t, id);
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * n2n_community.h
+ *
+ * Communities of the edges registered with a supernode.
+ *
+ * Community names are interned: each community in use has a small numeric id
+ * which is stored in the community_id of its member peers, so checking that
+ * two edges share a community compares two integers. Names are found through
+ * an open addressing hash table of ids which is kept at most half full. The
+ * table holds at most <capacity> communities; as every community has at
+ * least one member, a capacity equal to that of the edge table never runs
+ * out.
+ *
+ * Each community keeps a compact array of pointers to its members, so a
+ * broadcast visits only the edges of its own community. Members are removed
+ * by moving the last member into the gap; member_idx in the peer records its
+ * position. A community is released when its last member leaves and its id
+ * is reused.
+ *
+ * The peers must not move while they are members, which holds for the
+ * entries of a peer table (n2n_peer_table.h).
+ *
+ * Lookups may run concurrently with a single writer if the reader checks
+ * afterwards that no write overlapped (seqlock) and retries otherwise. Only
+ * the member arrays are ever reallocated; a replaced or released array is
+ * passed to the retire hook, which must keep it readable until no reader
+ * can still hold it. Readers must check the pair (members, num_members)
+ * before indexing the array.
+ */
+
+#ifndef N2N_COMMUNITY_H_
+#define N2N_COMMUNITY_H_
+
+#include "n2n.h"
+
+#define N2N_COMMUNITY_NONE      0xFFFFFFFFU     /* community_id of a peer in no community */
+
+/** Called with a member array that is no longer in use. */
+typedef void (*comm_table_retire_f)(void *ptr, void *arg);
+
+struct n2n_community
+{
+    n2n_community_t     name;
+    uint32_t            hash;
+    uint32_t            num_members;
+    uint32_t            max_members;
+    struct peer_info  **members;
+};
+
+struct n2n_comm_table
+{
+    size_t              capacity;       /* Max number of communities. */
+    size_t              count;          /* Communities with members. */
+    struct n2n_community *comms;        /* Indexed by community id; capacity entries. */
+    uint32_t           *free_ids;       /* Stack of unused ids. */
+    size_t              num_free;
+
+    uint32_t           *slots;          /* Community id plus one; 0 if the slot is empty. */
+    size_t              mask;           /* Number of slots minus one. */
+
+    comm_table_retire_f retire;         /* Optional; member arrays are freed at once without. */
+    void               *retire_arg;
+};
+
+typedef struct n2n_comm_table n2n_comm_table_t;
+
+
+int     comm_table_init(n2n_comm_table_t *t, size_t capacity);
+void    comm_table_deinit(n2n_comm_table_t *t);
+void    comm_table_set_retire(n2n_comm_table_t *t, comm_table_retire_f cb, void *arg);
+struct n2n_community *comm_table_find(const n2n_comm_table_t *t, const n2n_community_t name);
+int     comm_table_join(n2n_comm_table_t *t, const n2n_community_t name, struct peer_info *peer);
+void    comm_table_leave(n2n_comm_table_t *t, struct peer_info *peer);
+
+static inline size_t comm_table_size(const n2n_comm_table_t *t)
+{
+    return t->count;
+}
+
+/** Id of community c, an entry of t. */
+static inline uint32_t comm_table_id(const n2n_comm_table_t *t, const struct n2n_community *c)
+{
+    return (uint32_t) (c - t->comms);
+}
+
+
+#endif /* N2N_COMMUNITY_H_ */
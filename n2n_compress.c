@@ -0,0 +1,408 @@
+/*
+ * n2n_compress.c
+ *
+ * Compression of ethernet frames ahead of the transforms. See n2n_compress.h.
+ */
+
+#include "n2n.h"
+#include "n2n_compress.h"
+#include "minilzo.h"
+
+#define N2N_COMPRESS_MIN_LEN    128     /* Shorter frames are sent as they are. */
+#define N2N_COMPRESS_PROBE_LEN  128     /* Payload bytes sampled by the entropy probe. */
+#define N2N_COMPRESS_PROBE_MIN  32      /* Smaller samples tell too little; the codec decides. */
+
+typedef int (*codec_compress_f)(void *wrkmem, const uint8_t *in, size_t in_len,
+                                uint8_t *out, size_t out_len);
+typedef int (*codec_decompress_f)(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
+
+struct n2n_codec
+{
+    const char         *name;
+    size_t              wrkmem_size;
+    codec_compress_f    compress;
+    codec_decompress_f  decompress;
+};
+
+/** Transform ID of frames encrypted with base after compression by codec. */
+struct n2n_codec_transform
+{
+    n2n_transform_t     base;
+    int                 codec;
+    n2n_transform_t     id;
+};
+
+
+static int lzo_compress(void *wrkmem, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+    lzo_uint len = out_len;
+
+    if (out_len < N2N_COMPRESS_BOUND(in_len))
+    {
+        return -1; /* lzo1x_1_compress() does not check */
+    }
+
+    if (LZO_E_OK != lzo1x_1_compress(in, in_len, out, &len, wrkmem))
+    {
+        return -1;
+    }
+
+    return (int) len;
+}
+
+static int lzo_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+    lzo_uint len = out_len;
+
+    if (LZO_E_OK != lzo1x_decompress_safe(in, in_len, out, &len, NULL))
+    {
+        return -1;
+    }
+
+    return (int) len;
+}
+
+static const struct n2n_codec codecs[N2N_COMPRESS_CODECS] =
+{
+    { "none",   0,                      NULL,           NULL },
+    { "lzo",    LZO1X_1_MEM_COMPRESS,   lzo_compress,   lzo_decompress },
+};
+
+static const struct n2n_codec_transform codec_transforms[] =
+{
+    { N2N_TRANSFORM_ID_NULL,    N2N_COMPRESS_LZO,   N2N_TRANSFORM_ID_LZO },
+    { N2N_TRANSFORM_ID_TWOFISH, N2N_COMPRESS_LZO,   N2N_TRANSFORM_ID_TWOFISH_LZO },
+    { N2N_TRANSFORM_ID_AESCBC,  N2N_COMPRESS_LZO,   N2N_TRANSFORM_ID_AESCBC_LZO },
+    { N2N_TRANSFORM_ID_AESGCM,  N2N_COMPRESS_LZO,   N2N_TRANSFORM_ID_AESGCM_LZO },
+    { N2N_TRANSFORM_ID_CHACHA20, N2N_COMPRESS_LZO,  N2N_TRANSFORM_ID_CHACHA20_LZO },
+};
+
+#define N2N_CODEC_TRANSFORMS    (sizeof(codec_transforms) / sizeof(codec_transforms[0]))
+
+/* Well known ports of protocols which encrypt their payload. */
+static const uint16_t encrypted_ports[] =
+{
+    22,         /* ssh */
+    443,        /* https, QUIC */
+    465,        /* smtps */
+    853,        /* DNS over TLS */
+    993,        /* imaps */
+    995,        /* pop3s */
+    1194,       /* OpenVPN */
+    4500,       /* IPsec NAT traversal */
+    5061,       /* SIP over TLS */
+    8443,       /* https, alternative */
+    51820,      /* WireGuard */
+};
+
+#define N2N_ENCRYPTED_PORTS     (sizeof(encrypted_ports) / sizeof(encrypted_ports[0]))
+
+
+static uint64_t nsec_now(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(WIN32)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static int encrypted_port(uint16_t port)
+{
+    size_t i;
+
+    for (i = 0; i < N2N_ENCRYPTED_PORTS; ++i)
+    {
+        if (encrypted_ports[i] == port)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/** Find where the payload of the IP packet in frame starts.
+ *
+ *  @return offset of the payload, or -1 if the headers say it is encrypted.
+ *  Frames which are not IP are treated as all payload after the ethernet
+ *  header.
+ */
+static ssize_t payload_offset(const uint8_t *frame, size_t len)
+{
+    size_t   off = 12;
+    size_t   l4off;
+    uint16_t type;
+    uint8_t  proto;
+
+    type = (frame[off] << 8) | frame[off + 1];
+    if ((0x8100 == type) && (len >= off + 6))
+    {
+        off += 4;
+        type = (frame[off] << 8) | frame[off + 1];
+    }
+    off += 2;
+
+    if ((0x0800 == type) && (len >= off + 20))
+    {
+        proto = frame[off + 9];
+        l4off = off + 4 * (frame[off] & 0x0F);
+
+        if (0 != (((frame[off + 6] << 8) | frame[off + 7]) & 0x1FFF))
+        {
+            return l4off; /* a later fragment: no ports */
+        }
+    }
+    else if ((0x86DD == type) && (len >= off + 40))
+    {
+        proto = frame[off + 6];
+        l4off = off + 40;
+    }
+    else
+    {
+        return off;
+    }
+
+    switch (proto)
+    {
+    case 50: /* ESP */
+    case 51: /* AH */
+        return -1;
+
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+        if (len >= l4off + 20)
+        {
+            if (encrypted_port((frame[l4off] << 8) | frame[l4off + 1]) ||
+                encrypted_port((frame[l4off + 2] << 8) | frame[l4off + 3]))
+            {
+                return -1;
+            }
+
+            return l4off + ((IPPROTO_TCP == proto) ? 4 * (frame[l4off + 12] >> 4) : 8);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return l4off;
+}
+
+/** Guess from a sample whether data is random, as encrypted or compressed
+ *  data is. n random bytes take on about 256 * (1 - exp(-n / 256)) distinct
+ *  values, i.e. 79% of n for n = 128 with a standard deviation near 3%;
+ *  text and most binary formats far fewer.
+ */
+static int looks_random(const uint8_t *p, size_t n)
+{
+    uint32_t seen[256 / 32];
+    size_t   distinct = 0;
+    size_t   i;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (i = 0; i < n; ++i)
+    {
+        uint32_t bit = 1U << (p[i] & 31);
+
+        distinct += !(seen[p[i] >> 5] & bit);
+        seen[p[i] >> 5] |= bit;
+    }
+
+    return (10 * distinct > 7 * n);
+}
+
+
+/* ********************************** */
+
+void compress_deinit(n2n_compress_t *c)
+{
+    free(c->wrkmem);
+    c->wrkmem = NULL;
+}
+
+/** @return the codec called name, or -1 if there is none. */
+int compress_codec_by_name(const char *name)
+{
+    int codec;
+
+    for (codec = 0; codec < N2N_COMPRESS_CODECS; ++codec)
+    {
+        if (0 == strcmp(name, codecs[codec].name))
+        {
+            return codec;
+        }
+    }
+
+    return -1;
+}
+
+const char *compress_codec_name(int codec)
+{
+    return ((codec >= 0) && (codec < N2N_COMPRESS_CODECS)) ? codecs[codec].name : "?";
+}
+
+/** @return the transform ID of frames compressed with codec then encoded
+ *  with the transform base, or N2N_TRANSFORM_ID_INVAL if there is none. */
+n2n_transform_t compress_transform(n2n_transform_t base, int codec)
+{
+    size_t i;
+
+    for (i = 0; i < N2N_CODEC_TRANSFORMS; ++i)
+    {
+        if ((codec_transforms[i].base == base) && (codec_transforms[i].codec == codec))
+        {
+            return codec_transforms[i].id;
+        }
+    }
+
+    return N2N_TRANSFORM_ID_INVAL;
+}
+
+/** Split the transform ID of a received PACKET into the transform to decode
+ *  it with, stored in *base, and the codec.
+ *
+ *  @return the codec, N2N_COMPRESS_NONE if id is not one of compression
+ */
+int compress_transform_split(n2n_transform_t id, n2n_transform_t *base)
+{
+    size_t i;
+
+    for (i = 0; i < N2N_CODEC_TRANSFORMS; ++i)
+    {
+        if (codec_transforms[i].id == id)
+        {
+            *base = codec_transforms[i].base;
+            return codec_transforms[i].codec;
+        }
+    }
+
+    *base = id;
+    return N2N_COMPRESS_NONE;
+}
+
+/** Compress frame into out if that looks worthwhile. out must have room for
+ *  N2N_COMPRESS_BOUND(len) bytes.
+ *
+ *  @return length of the compressed frame, or 0 if the frame is better sent
+ *  as it is
+ */
+int compress_frame(n2n_compress_t *c, int codec, const uint8_t *frame, size_t len,
+                   uint8_t *out, size_t out_len)
+{
+    const struct n2n_codec *cd = &(codecs[codec]);
+    struct n2n_codec_stats *st = &(c->stats[codec]);
+    ssize_t  off;
+    uint64_t start;
+    int      zlen;
+
+    if (NULL == cd->compress)
+    {
+        return 0;
+    }
+
+    ++(st->tx_frames);
+
+    if (len < N2N_COMPRESS_MIN_LEN)
+    {
+        ++(st->tx_small);
+        return 0;
+    }
+
+    off = payload_offset(frame, len);
+    if (off < 0)
+    {
+        ++(st->tx_hinted);
+        return 0;
+    }
+
+    if (((size_t) off + N2N_COMPRESS_PROBE_MIN <= len) &&
+        looks_random(frame + off, MIN(len - off, N2N_COMPRESS_PROBE_LEN)))
+    {
+        ++(st->tx_probed);
+        return 0;
+    }
+
+    if ((NULL == c->wrkmem) && (cd->wrkmem_size > 0))
+    {
+        c->wrkmem = malloc(cd->wrkmem_size);
+        if (NULL == c->wrkmem)
+        {
+            traceError("compress_frame: unable to allocate %u bytes", (unsigned int) cd->wrkmem_size);
+            return 0;
+        }
+    }
+
+    start = nsec_now();
+    zlen = cd->compress(c->wrkmem, frame, len, out, out_len);
+    st->tx_nsec += nsec_now() - start;
+
+    /* A small gain does not pay for decompressing at the other end. */
+    if ((zlen <= 0) || ((size_t) zlen > len - len / 16))
+    {
+        ++(st->tx_poor);
+        return 0;
+    }
+
+    ++(st->tx_compressed);
+    st->tx_bytes_in += len;
+    st->tx_bytes_out += zlen;
+
+    return zlen;
+}
+
+/** Decompress a frame compressed with codec into out.
+ *
+ *  @return length of the frame or -1 on error
+ */
+int decompress_frame(n2n_compress_t *c, int codec, const uint8_t *in, size_t in_len,
+                     uint8_t *out, size_t out_len)
+{
+    struct n2n_codec_stats *st;
+    uint64_t start;
+    int      len;
+
+    if ((codec <= N2N_COMPRESS_NONE) || (codec >= N2N_COMPRESS_CODECS))
+    {
+        return -1;
+    }
+
+    st = &(c->stats[codec]);
+
+    start = nsec_now();
+    len = codecs[codec].decompress(in, in_len, out, out_len);
+    st->rx_nsec += nsec_now() - start;
+
+    if (len <= 0)
+    {
+        ++(st->rx_errors);
+        return -1;
+    }
+
+    ++(st->rx_frames);
+
+    return len;
+}
+
+/** Add the counters s to tot. */
+void compress_stats_add(struct n2n_codec_stats *tot, const struct n2n_codec_stats *s)
+{
+    tot->tx_frames += s->tx_frames;
+    tot->tx_small += s->tx_small;
+    tot->tx_hinted += s->tx_hinted;
+    tot->tx_probed += s->tx_probed;
+    tot->tx_poor += s->tx_poor;
+    tot->tx_compressed += s->tx_compressed;
+    tot->tx_bytes_in += s->tx_bytes_in;
+    tot->tx_bytes_out += s->tx_bytes_out;
+    tot->tx_nsec += s->tx_nsec;
+    tot->rx_frames += s->rx_frames;
+    tot->rx_errors += s->rx_errors;
+    tot->rx_nsec += s->rx_nsec;
+}
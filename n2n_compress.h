@@ -0,0 +1,72 @@
+/*
+ * n2n_compress.h
+ *
+ * Compression of ethernet frames ahead of the transforms.
+ *
+ * A codec compresses a whole frame before it is encrypted. Whether a frame
+ * is worth it is decided per frame: frames of protocols whose payload is
+ * encrypted or compressed already (TLS, SSH, QUIC, IPsec, WireGuard...) are
+ * skipped on a hint from their headers, and for the others a sample of the
+ * payload is probed for entropy before the codec runs. The result is used
+ * only if it is noticeably smaller than the frame.
+ *
+ * A compressed frame is sent with the transform ID that pairs its cipher
+ * with the codec (N2N_TRANSFORM_ID_TWOFISH_LZO for twofish and minilzo), so
+ * every frame says how to decode it and edges that do not compress still
+ * read compressed frames. A new codec needs its own transform IDs.
+ *
+ * The state is private to one data-plane thread.
+ */
+
+#ifndef N2N_COMPRESS_H_
+#define N2N_COMPRESS_H_
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#define N2N_COMPRESS_NONE       0
+#define N2N_COMPRESS_LZO        1       /* minilzo, LZO1X-1 */
+#define N2N_COMPRESS_CODECS     2
+
+/** Output space compress_frame() needs for a frame of len bytes. */
+#define N2N_COMPRESS_BOUND(len) ((len) + (len) / 16 + 64 + 3)
+
+/** Counters of one codec. Times are wall-clock, in nanoseconds. */
+struct n2n_codec_stats
+{
+    size_t              tx_frames;      /* Frames offered to compress_frame(). */
+    size_t              tx_small;       /* Skipped: too short to gain. */
+    size_t              tx_hinted;      /* Skipped: protocol carries encrypted data. */
+    size_t              tx_probed;      /* Skipped: sample of the payload looked random. */
+    size_t              tx_poor;        /* Compressed, but not enough smaller to use. */
+    size_t              tx_compressed;  /* Sent compressed. */
+    uint64_t            tx_bytes_in;    /* Size of the frames sent compressed... */
+    uint64_t            tx_bytes_out;   /* ...and of what was sent instead. */
+    uint64_t            tx_nsec;        /* Spent compressing, including poor results. */
+    size_t              rx_frames;      /* Frames decompressed. */
+    size_t              rx_errors;      /* Frames which failed to decompress. */
+    uint64_t            rx_nsec;        /* Spent decompressing. */
+};
+
+struct n2n_compress
+{
+    void               *wrkmem;         /* Codec work memory, allocated on first use. */
+    struct n2n_codec_stats stats[N2N_COMPRESS_CODECS];
+};
+
+typedef struct n2n_compress n2n_compress_t;
+
+
+void    compress_deinit(n2n_compress_t *c);
+int     compress_codec_by_name(const char *name);
+const char *compress_codec_name(int codec);
+n2n_transform_t compress_transform(n2n_transform_t base, int codec);
+int     compress_transform_split(n2n_transform_t id, n2n_transform_t *base);
+int     compress_frame(n2n_compress_t *c, int codec, const uint8_t *frame, size_t len,
+                       uint8_t *out, size_t out_len);
+int     decompress_frame(n2n_compress_t *c, int codec, const uint8_t *in, size_t in_len,
+                         uint8_t *out, size_t out_len);
+void    compress_stats_add(struct n2n_codec_stats *tot, const struct n2n_codec_stats *s);
+
+
+#endif /* N2N_COMPRESS_H_ */
@@ -0,0 +1,583 @@
+/*
+ * n2n_evloop.c
+ *
+ * Event loop shared by edge and supernode. See n2n_evloop.h.
+ */
+
+#include "n2n.h"
+#include "n2n_evloop.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define N2N_HAVE_EPOLL 1
+#endif
+
+#define EVLOOP_EVENTS_MAX       64      /* Events fetched per epoll_wait(). */
+#define EVLOOP_TIMERFD_IDX      0xFFFFFFFFU /* Slot index marking timerfd events. */
+
+#define WHEEL_MASK              (EVLOOP_WHEEL_SLOTS - 1)
+
+
+int evloop_init(n2n_evloop_t *loop)
+{
+    memset(loop, 0, sizeof(n2n_evloop_t));
+    loop->epfd = -1;
+    loop->timerfd = -1;
+
+    /* Timers added before the first wakeup run at that wakeup. */
+    loop->wheel_now = n2n_clock_update() - 1;
+
+#ifdef N2N_HAVE_EPOLL
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0)
+    {
+        traceWarning("epoll_create1 failed (%s), falling back to select()", strerror(errno));
+    }
+    else
+    {
+        loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->timerfd >= 0)
+        {
+            struct epoll_event ev;
+
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.u64 = ((uint64_t) EVLOOP_TIMERFD_IDX << 32) | (uint32_t) loop->timerfd;
+
+            if (0 != epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev))
+            {
+                close(loop->timerfd);
+                loop->timerfd = -1;
+            }
+        }
+
+        if (loop->timerfd < 0)
+        {
+            traceWarning("timerfd unavailable (%s), polling every %u sec",
+                         strerror(errno), (unsigned int) EVLOOP_WAIT_MAX);
+        }
+    }
+#endif
+
+    return 0;
+}
+
+void evloop_deinit(n2n_evloop_t *loop)
+{
+    size_t level;
+    size_t slot;
+
+#ifdef N2N_HAVE_EPOLL
+    if (loop->timerfd >= 0)
+    {
+        close(loop->timerfd);
+    }
+
+    if (loop->epfd >= 0)
+    {
+        close(loop->epfd);
+    }
+#endif
+
+    for (level = 0; level < EVLOOP_WHEEL_LEVELS; ++level)
+    {
+        for (slot = 0; slot < EVLOOP_WHEEL_SLOTS; ++slot)
+        {
+            while (NULL != loop->wheel[level][slot])
+            {
+                struct evloop_timer *t = loop->wheel[level][slot];
+
+                loop->wheel[level][slot] = t->next;
+                free(t);
+            }
+        }
+    }
+
+    free(loop->io);
+    memset(loop, 0, sizeof(n2n_evloop_t));
+    loop->epfd = -1;
+    loop->timerfd = -1;
+}
+
+
+/* ************************************** */
+/* Registration */
+
+#ifdef N2N_HAVE_EPOLL
+/* The slot index travels with the event so dispatch needs no lookup. The fd
+ * is kept alongside to detect slots reused by evloop_del_io(). */
+static int epoll_update(n2n_evloop_t *loop, int op, size_t idx)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (loop->io[idx].flags & EVLOOP_ET)
+    {
+        ev.events |= EPOLLET;
+    }
+    ev.data.u64 = ((uint64_t) idx << 32) | (uint32_t) loop->io[idx].fd;
+
+    return epoll_ctl(loop->epfd, op, loop->io[idx].fd, &ev);
+}
+#endif
+
+/** Register fd. cb is called with arg whenever fd is readable.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int evloop_add_io(n2n_evloop_t *loop, SOCKET fd, int flags, evloop_io_f cb, void *arg)
+{
+    struct evloop_io *io;
+
+    if (loop->num_io == loop->max_io)
+    {
+        size_t max_io = (loop->max_io > 0) ? (2 * loop->max_io) : 8;
+
+        io = (struct evloop_io *) realloc(loop->io, max_io * sizeof(struct evloop_io));
+        if (NULL == io)
+        {
+            traceError("evloop_add_io: out of memory");
+            return -1;
+        }
+
+        loop->io = io;
+        loop->max_io = max_io;
+    }
+
+    io = &(loop->io[loop->num_io]);
+    io->fd    = fd;
+    io->flags = flags;
+    io->cb    = cb;
+    io->arg   = arg;
+
+#ifdef N2N_HAVE_EPOLL
+    if ((loop->epfd >= 0) && (0 != epoll_update(loop, EPOLL_CTL_ADD, loop->num_io)))
+    {
+        traceError("evloop_add_io: epoll_ctl failed for fd %d (%s)", (int) fd, strerror(errno));
+        return -1;
+    }
+#endif
+
+    ++(loop->num_io);
+
+    return 0;
+}
+
+/** Unregister fd. Safe to call from a handler.
+ *
+ *  @return 0 on success, -1 if fd is not registered
+ */
+int evloop_del_io(n2n_evloop_t *loop, SOCKET fd)
+{
+    size_t i;
+
+    for (i = 0; i < loop->num_io; ++i)
+    {
+        if (loop->io[i].fd == fd)
+        {
+            break;
+        }
+    }
+
+    if (i == loop->num_io)
+    {
+        return -1;
+    }
+
+#ifdef N2N_HAVE_EPOLL
+    if (loop->epfd >= 0)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+#endif
+
+    --(loop->num_io);
+
+    if (i != loop->num_io)
+    {
+        /* Move the last slot into the hole. */
+        loop->io[i] = loop->io[loop->num_io];
+
+#ifdef N2N_HAVE_EPOLL
+        if (loop->epfd >= 0)
+        {
+            epoll_update(loop, EPOLL_CTL_MOD, i);
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/* ************************************** */
+/* Timer wheel */
+
+/** Put t into the slot for t->expires. Timers expiring within the current
+ *  second go to the slot about to run; only cascades insert those. */
+static void wheel_insert(n2n_evloop_t *loop, struct evloop_timer *t)
+{
+    time_t      expires = MAX(t->expires, loop->wheel_now);
+    uint64_t    delta = expires - loop->wheel_now;
+    size_t      level = 0;
+    size_t      slot;
+
+    while ((level < EVLOOP_WHEEL_LEVELS - 1) &&
+           (delta >= ((uint64_t) 1 << (EVLOOP_WHEEL_BITS * (level + 1)))))
+    {
+        ++level;
+    }
+
+    if (delta >= ((uint64_t) 1 << (EVLOOP_WHEEL_BITS * EVLOOP_WHEEL_LEVELS)))
+    {
+        /* Beyond the wheel. Park in the farthest slot, it is placed again
+         * when that comes up. */
+        expires = loop->wheel_now + ((time_t) 1 << (EVLOOP_WHEEL_BITS * EVLOOP_WHEEL_LEVELS)) - 1;
+    }
+
+    slot = (size_t) (expires >> (EVLOOP_WHEEL_BITS * level)) & WHEEL_MASK;
+
+    t->next = loop->wheel[level][slot];
+    loop->wheel[level][slot] = t;
+    loop->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+/** Detach and return the timers of a slot. */
+static struct evloop_timer *wheel_take(n2n_evloop_t *loop, size_t level, size_t slot)
+{
+    struct evloop_timer *list = loop->wheel[level][slot];
+
+    loop->wheel[level][slot] = NULL;
+    loop->occupied[level] &= ~((uint64_t) 1 << slot);
+
+    return list;
+}
+
+/** Run the timers due up to and including second now. */
+static void wheel_run(n2n_evloop_t *loop, time_t now)
+{
+    while (loop->wheel_now < now)
+    {
+        time_t              tick = ++(loop->wheel_now);
+        struct evloop_timer *t;
+        size_t              level;
+
+        /* Move down the timers of each higher level slot whose range starts
+         * at tick. */
+        for (level = EVLOOP_WHEEL_LEVELS - 1; level > 0; --level)
+        {
+            size_t shift = EVLOOP_WHEEL_BITS * level;
+
+            if (0 == (tick & (((time_t) 1 << shift) - 1)))
+            {
+                t = wheel_take(loop, level, (size_t) (tick >> shift) & WHEEL_MASK);
+
+                while (NULL != t)
+                {
+                    struct evloop_timer *next = t->next;
+
+                    wheel_insert(loop, t);
+                    t = next;
+                }
+            }
+        }
+
+        t = wheel_take(loop, 0, (size_t) tick & WHEEL_MASK);
+
+        while (NULL != t)
+        {
+            struct evloop_timer *next = t->next;
+
+            /* Runs missed while the process was stopped collapse into one. */
+            loop->current = t;
+            loop->current_due = 0;
+            t->cb(loop, now, t->arg);
+            loop->current = NULL;
+
+            t->expires = (0 != loop->current_due) ?
+                MAX(loop->current_due, loop->wheel_now + 1) : (now + t->interval);
+            wheel_insert(loop, t);
+
+            t = next;
+        }
+    }
+}
+
+/** The earliest time a timer is due, or 0 if there are no timers. */
+static time_t wheel_next(const n2n_evloop_t *loop)
+{
+    time_t  next = 0;
+    size_t  level;
+
+    for (level = 0; level < EVLOOP_WHEEL_LEVELS; ++level)
+    {
+        size_t  shift = EVLOOP_WHEEL_BITS * level;
+        size_t  start = (size_t) ((loop->wheel_now >> shift) + 1) & WHEEL_MASK;
+        size_t  off;
+        time_t  due;
+
+        if (0 == loop->occupied[level])
+        {
+            continue;
+        }
+
+        /* Slots come up in order starting after the current one. */
+        for (off = 0; off < EVLOOP_WHEEL_SLOTS; ++off)
+        {
+            if (loop->occupied[level] & ((uint64_t) 1 << ((start + off) & WHEEL_MASK)))
+            {
+                break;
+            }
+        }
+
+        if (0 == level)
+        {
+            due = loop->wheel_now + 1 + off;
+        }
+        else
+        {
+            const struct evloop_timer *t = loop->wheel[level][(start + off) & WHEEL_MASK];
+
+            for (due = t->expires; NULL != t; t = t->next)
+            {
+                due = MIN(due, t->expires);
+            }
+        }
+
+        next = (0 == next) ? due : MIN(next, due);
+    }
+
+    return next;
+}
+
+
+/** Register a timer run every interval seconds. The first run happens at the
+ *  first wakeup of the loop.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int evloop_add_timer(n2n_evloop_t *loop, time_t interval, evloop_timer_f cb, void *arg)
+{
+    struct evloop_timer *t = (struct evloop_timer *) calloc(1, sizeof(struct evloop_timer));
+
+    if (NULL == t)
+    {
+        traceError("evloop_add_timer: out of memory");
+        return -1;
+    }
+
+    t->interval = MAX(interval, 1);
+    t->expires  = loop->wheel_now + 1;
+    t->cb       = cb;
+    t->arg      = arg;
+
+    wheel_insert(loop, t);
+
+    return 0;
+}
+
+/** Call from a timer callback to run that timer next at when rather than
+ *  after its interval. For work whose deadline is known, so the loop need not
+ *  wake up just to find it is too early. */
+void evloop_timer_due(n2n_evloop_t *loop, time_t when)
+{
+    if (NULL != loop->current)
+    {
+        loop->current_due = when;
+    }
+}
+
+/** Set a function run at the end of every wakeup, after all handlers. Used to
+ *  flush work queued by the handlers. */
+void evloop_set_post(n2n_evloop_t *loop, evloop_post_f cb, void *arg)
+{
+    loop->post_cb  = cb;
+    loop->post_arg = arg;
+}
+
+
+/* ************************************** */
+/* Dispatch */
+
+/** Arm the timerfd for the next timer, unless it already is.
+ *
+ *  @return the timeout in msec for the wait: -1 if the timerfd is armed or
+ *  there are no timers
+ */
+static int arm_timeout(n2n_evloop_t *loop)
+{
+    time_t next = wheel_next(loop);
+
+#ifdef N2N_HAVE_EPOLL
+    if (loop->timerfd >= 0)
+    {
+        if (next != loop->armed)
+        {
+            struct itimerspec its;
+
+            memset(&its, 0, sizeof(its));
+            if (0 != next)
+            {
+                n2n_clock_deadline(next, &(its.it_value));
+            }
+
+            if (0 != timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+            {
+                traceError("timerfd_settime failed (%s)", strerror(errno));
+                return 1000;
+            }
+
+            loop->armed = next;
+        }
+
+        return -1;
+    }
+#endif
+
+    if (0 == next)
+    {
+        return -1;
+    }
+
+    return (int) (MIN(MAX(next - n2n_now(), 0), EVLOOP_WAIT_MAX) * 1000);
+}
+
+#ifdef N2N_HAVE_EPOLL
+static int wait_epoll(n2n_evloop_t *loop, int timeout)
+{
+    struct epoll_event  events[EVLOOP_EVENTS_MAX];
+    time_t              now;
+    int                 rc;
+    int                 i;
+
+    rc = epoll_wait(loop->epfd, events, EVLOOP_EVENTS_MAX, timeout);
+    if (rc < 0)
+    {
+        return (EINTR == errno) ? 0 : -1;
+    }
+
+    now = n2n_clock_update();
+    wheel_run(loop, now);
+
+    for (i = 0; i < rc; ++i)
+    {
+        size_t  idx = (size_t) (events[i].data.u64 >> 32);
+        SOCKET  fd  = (SOCKET) (uint32_t) events[i].data.u64;
+
+        if (EVLOOP_TIMERFD_IDX == idx)
+        {
+            uint64_t expirations;
+
+            /* The timers it stands for have run above. */
+            if (read(fd, &expirations, sizeof(expirations)) < 0)
+            {
+                traceDebug("timerfd read failed (%s)", strerror(errno));
+            }
+
+            loop->armed = 0;
+            continue;
+        }
+
+        /* Skip events for slots changed by an earlier handler. */
+        if ((idx < loop->num_io) && (loop->io[idx].fd == fd))
+        {
+            loop->io[idx].cb(loop, fd, now, loop->io[idx].arg);
+        }
+    }
+
+    loop->events += rc;
+
+    return rc;
+}
+#endif
+
+static int wait_select(n2n_evloop_t *loop, int timeout)
+{
+    fd_set          socket_mask;
+    struct timeval  wait_time;
+    SOCKET          max_sock = 0;
+    time_t          now;
+    size_t          i;
+    int             rc;
+
+    FD_ZERO(&socket_mask);
+    for (i = 0; i < loop->num_io; ++i)
+    {
+        FD_SET(loop->io[i].fd, &socket_mask);
+        max_sock = MAX(max_sock, loop->io[i].fd);
+    }
+
+    wait_time.tv_sec = timeout / 1000;
+    wait_time.tv_usec = (timeout % 1000) * 1000;
+
+    rc = select(max_sock + 1, &socket_mask, NULL, NULL, (timeout >= 0) ? &wait_time : NULL);
+    if (rc < 0)
+    {
+        return (EINTR == errno) ? 0 : -1;
+    }
+
+    now = n2n_clock_update();
+    wheel_run(loop, now);
+
+    /* Walk backwards so a handler removing its own fd does not hide the
+     * slot moved into its place. */
+    for (i = loop->num_io; (rc > 0) && (i-- > 0); )
+    {
+        if (FD_ISSET(loop->io[i].fd, &socket_mask))
+        {
+            FD_CLR(loop->io[i].fd, &socket_mask);
+            loop->io[i].cb(loop, loop->io[i].fd, now, loop->io[i].arg);
+            ++(loop->events);
+        }
+    }
+
+    return rc;
+}
+
+/** Wait for events and dispatch them until evloop_stop() is called.
+ *
+ *  @return 0 after evloop_stop(), -1 if waiting failed
+ */
+int evloop_run(n2n_evloop_t *loop)
+{
+    loop->running = 1;
+
+    while (loop->running)
+    {
+        int     timeout = arm_timeout(loop);
+        int     rc;
+
+#ifdef N2N_HAVE_EPOLL
+        if (loop->epfd >= 0)
+        {
+            rc = wait_epoll(loop, timeout);
+        }
+        else
+#endif
+        {
+            rc = wait_select(loop, timeout);
+        }
+
+        if (rc < 0)
+        {
+            traceError("evloop_run: wait failed (%d) %s", errno, strerror(errno));
+            return -1;
+        }
+
+        ++(loop->wakeups);
+
+        if (loop->post_cb)
+        {
+            loop->post_cb(loop, loop->post_arg);
+        }
+    }
+
+    return 0;
+}
+
+/** Make evloop_run() return at the end of the current wakeup. */
+void evloop_stop(n2n_evloop_t *loop)
+{
+    loop->running = 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * n2n_evloop.h
+ *
+ * Event loop shared by edge and supernode.
+ *
+ * Descriptors are registered once and dispatched to their handlers when they
+ * become readable. On Linux the loop is built on epoll so the cost of a wakeup
+ * does not depend on the number of registered descriptors. Elsewhere it falls
+ * back to select().
+ *
+ * Periodic work is registered as timers which fire every <interval> seconds.
+ * Timers due at a wakeup run before the I/O handlers. They are kept on a
+ * hierarchical timer wheel: level 0 has one slot per second, each higher
+ * level one slot per revolution of the level below. Adding, running and
+ * rescheduling a timer costs O(1); timers of a higher level are moved down
+ * when their slot comes up. On Linux the loop sleeps on a timerfd armed for
+ * the earliest deadline, so it only wakes up for I/O or a timer that is due.
+ *
+ * The clock is read once per wakeup (n2n_clock_update()). Handlers get it as
+ * now; code they call reads the same value with n2n_now().
+ */
+
+#ifndef N2N_EVLOOP_H_
+#define N2N_EVLOOP_H_
+
+#include "n2n.h"
+
+#define EVLOOP_WAIT_MAX         10      /* sec. Longest sleep when no timerfd is available. */
+
+#define EVLOOP_WHEEL_BITS       6
+#define EVLOOP_WHEEL_SLOTS      (1 << EVLOOP_WHEEL_BITS)
+#define EVLOOP_WHEEL_LEVELS     3       /* 2^18 s, about 3 days. Later deadlines wait in the top level. */
+
+/* Flags for evloop_add_io() */
+#define EVLOOP_ET               0x0001  /* Edge triggered. The handler must drain fd. */
+
+
+struct n2n_evloop;
+
+typedef void (*evloop_io_f)(struct n2n_evloop *loop, SOCKET fd, time_t now, void *arg);
+typedef void (*evloop_timer_f)(struct n2n_evloop *loop, time_t now, void *arg);
+typedef void (*evloop_post_f)(struct n2n_evloop *loop, void *arg);
+
+struct evloop_io
+{
+    SOCKET              fd;
+    int                 flags;
+    evloop_io_f         cb;
+    void               *arg;
+};
+
+struct evloop_timer
+{
+    time_t              interval;       /* sec */
+    time_t              expires;        /* Time of the next run. */
+    evloop_timer_f      cb;
+    void               *arg;
+    struct evloop_timer *next;          /* In its wheel slot. */
+};
+
+struct n2n_evloop
+{
+    int                 epfd;           /* -1 when select() is used. */
+    int                 running;
+
+    size_t              num_io;
+    size_t              max_io;
+    struct evloop_io   *io;
+
+    time_t              wheel_now;      /* Last second whose timers have run. */
+    uint64_t            occupied[EVLOOP_WHEEL_LEVELS]; /* Bit per non-empty slot. */
+    struct evloop_timer *wheel[EVLOOP_WHEEL_LEVELS][EVLOOP_WHEEL_SLOTS];
+    struct evloop_timer *current;       /* Timer whose callback is running. */
+    time_t              current_due;    /* Set by evloop_timer_due(). */
+
+    int                 timerfd;        /* -1 if not available. */
+    time_t              armed;          /* Deadline timerfd is armed for; 0 if disarmed. */
+
+    evloop_post_f       post_cb;        /* Run at the end of every wakeup. */
+    void               *post_arg;
+
+    /* Statistics */
+    size_t              wakeups;
+    size_t              events;
+};
+
+typedef struct n2n_evloop n2n_evloop_t;
+
+
+int     evloop_init(n2n_evloop_t *loop);
+void    evloop_deinit(n2n_evloop_t *loop);
+int     evloop_add_io(n2n_evloop_t *loop, SOCKET fd, int flags, evloop_io_f cb, void *arg);
+int     evloop_del_io(n2n_evloop_t *loop, SOCKET fd);
+int     evloop_add_timer(n2n_evloop_t *loop, time_t interval, evloop_timer_f cb, void *arg);
+void    evloop_timer_due(n2n_evloop_t *loop, time_t when);
+void    evloop_set_post(n2n_evloop_t *loop, evloop_post_f cb, void *arg);
+int     evloop_run(n2n_evloop_t *loop);
+void    evloop_stop(n2n_evloop_t *loop);
+
+
+#endif /* N2N_EVLOOP_H_ */
@@ -0,0 +1,699 @@
+/*
+ * n2n_hc.c
+ *
+ * Compression of the inner headers of frames between edges. See n2n_hc.h.
+ *
+ * An IR frame is the octet HC_IR | generation, the context ID and the frame
+ * as it is. A compressed frame is laid out as
+ *
+ *   generation, context ID, mask of HC_* fields, the fields present in the
+ *   order of the HC_* bits, TCP or UDP checksum, check octet, payload
+ *
+ * Fields absent from the mask keep the value they have in the context.
+ * Results shorter than HC_MIN_LEN are padded with zeros between the check
+ * octet and the payload, and say how long their payload is (HC_PAD).
+ */
+
+#include "n2n.h"
+#include "n2n_hc.h"
+
+#define HC_IR           0x80    /* First octet of an IR frame; the low bits hold the generation. */
+#define HC_GEN_MASK     0x7F
+
+#define HC_IPID         0x01    /* IPv4 ID, 8 bit delta. */
+#define HC_SEQ          0x02    /* TCP sequence number, 16 bit delta. */
+#define HC_ACK          0x04    /* TCP acknowledgement number, 16 bit delta. */
+#define HC_WIN          0x08    /* TCP window. */
+#define HC_FLAGS        0x10    /* TCP flags. */
+#define HC_OPTS         0x20    /* TCP options, all of them. */
+#define HC_PAD          0x40    /* Payload length, as padding precedes the payload. */
+
+/* Transforms used to be handed whole frames only. Twofish returns payloads
+ * shorter than one cipher block less its nonce padded to the block. */
+#define HC_MIN_LEN      14
+
+#define HC_ETH_LEN      14
+#define HC_IP4_LEN      20
+#define HC_IP6_LEN      40
+#define HC_TCP_LEN      20
+#define HC_UDP_LEN      8
+
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void wr32(uint8_t *p, uint32_t v)
+{
+    wr16(p, v >> 16);
+    wr16(p + 2, v & 0xFFFF);
+}
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        h = (h ^ p[i]) * 16777619U;
+    }
+
+    return h;
+}
+
+/** Check octet over the headers of a frame. */
+static uint8_t hc_check(const uint8_t *hdr, size_t hlen)
+{
+    uint32_t h = fnv1a(2166136261U, hdr, hlen);
+
+    return (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24)) & 0xFF;
+}
+
+static uint16_t ip4_checksum(const uint8_t *ip)
+{
+    uint32_t sum = 0;
+    size_t   i;
+
+    for (i = 0; i < HC_IP4_LEN; i += 2)
+    {
+        sum += rd16(ip + i);
+    }
+
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return ~sum & 0xFFFF;
+}
+
+/** Find the headers of frame and fill in their layout in c.
+ *
+ *  @return 0 if the headers can be compressed, -1 if not: no IPv4 or IPv6
+ *  carrying TCP or UDP, IPv4 options or fragments, lengths which disagree
+ *  with the frame (as with ethernet padding)
+ */
+static int hc_parse(const uint8_t *f, size_t len, struct n2n_hc_ctx *c)
+{
+    size_t   l4off;
+    size_t   hlen;
+    uint16_t type;
+    uint8_t  proto;
+
+    if (len < HC_ETH_LEN)
+    {
+        return -1;
+    }
+
+    type = rd16(f + 12);
+
+    if (0x0800 == type)
+    {
+        const uint8_t *ip = f + HC_ETH_LEN;
+
+        l4off = HC_ETH_LEN + HC_IP4_LEN;
+        if ((len < l4off) || (0x45 != ip[0]) || (0 != (rd16(ip + 6) & 0x3FFF)) ||
+            (rd16(ip + 2) != len - HC_ETH_LEN))
+        {
+            return -1;
+        }
+
+        proto = ip[9];
+    }
+    else if (0x86DD == type)
+    {
+        const uint8_t *ip = f + HC_ETH_LEN;
+
+        l4off = HC_ETH_LEN + HC_IP6_LEN;
+        if ((len < l4off) || (6 != (ip[0] >> 4)) || (rd16(ip + 4) != len - l4off))
+        {
+            return -1;
+        }
+
+        proto = ip[6];
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (IPPROTO_TCP == proto)
+    {
+        if (len < l4off + HC_TCP_LEN)
+        {
+            return -1;
+        }
+
+        hlen = l4off + 4 * (f[l4off + 12] >> 4);
+        if (hlen < l4off + HC_TCP_LEN)
+        {
+            return -1;
+        }
+    }
+    else if (IPPROTO_UDP == proto)
+    {
+        hlen = l4off + HC_UDP_LEN;
+        if ((len < hlen) || (rd16(f + l4off + 4) != len - l4off))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+
+    if ((hlen > len) || (hlen > N2N_HC_HDR_MAX))
+    {
+        return -1;
+    }
+
+    c->hlen = hlen;
+    c->l3off = HC_ETH_LEN;
+    c->l4off = l4off;
+    c->proto = proto;
+    c->v6 = (0x86DD == type);
+
+    return 0;
+}
+
+/** Length of the TCP options in the headers of c. */
+static size_t hc_optlen(const struct n2n_hc_ctx *c)
+{
+    return c->hlen - c->l4off - HC_TCP_LEN;
+}
+
+/** Length of the mask, the fields it names and the checksum, or -1 if the
+ *  mask names fields the headers of c do not have. */
+static int hc_fields_len(const struct n2n_hc_ctx *c, uint8_t mask)
+{
+    uint8_t allowed = c->v6 ? 0 : HC_IPID;
+    int     n = 1 + 2;
+
+    allowed |= HC_PAD;
+
+    if (IPPROTO_TCP == c->proto)
+    {
+        allowed |= HC_SEQ | HC_ACK | HC_WIN | HC_FLAGS | HC_OPTS;
+    }
+
+    if (0 != (mask & ~allowed))
+    {
+        return -1;
+    }
+
+    n += (mask & HC_IPID) ? 1 : 0;
+    n += (mask & HC_SEQ) ? 2 : 0;
+    n += (mask & HC_ACK) ? 2 : 0;
+    n += (mask & HC_WIN) ? 2 : 0;
+    n += (mask & HC_FLAGS) ? 1 : 0;
+    n += (mask & HC_OPTS) ? hc_optlen(c) : 0;
+    n += (mask & HC_PAD) ? 1 : 0;
+
+    return n;
+}
+
+/** Rebuild into hdr the headers of a frame with plen bytes of payload from
+ *  the context c and the fields of a compressed frame, starting at the mask.
+ *  The fields must have been checked with hc_fields_len(). */
+static void hc_rebuild(const struct n2n_hc_ctx *c, const uint8_t *fields, size_t plen, uint8_t *hdr)
+{
+    uint8_t *l3 = hdr + c->l3off;
+    uint8_t *l4 = hdr + c->l4off;
+    uint8_t  mask = fields[0];
+    size_t   i = 1;
+
+    memcpy(hdr, c->hdr, c->hlen);
+
+    if (c->v6)
+    {
+        wr16(l3 + 4, c->hlen - c->l4off + plen);
+    }
+    else
+    {
+        if (mask & HC_IPID)
+        {
+            wr16(l3 + 4, rd16(l3 + 4) + fields[i++]);
+        }
+        wr16(l3 + 2, c->hlen - c->l3off + plen);
+    }
+
+    if (IPPROTO_TCP == c->proto)
+    {
+        if (mask & HC_SEQ)
+        {
+            wr32(l4 + 4, rd32(l4 + 4) + rd16(fields + i));
+            i += 2;
+        }
+        if (mask & HC_ACK)
+        {
+            wr32(l4 + 8, rd32(l4 + 8) + rd16(fields + i));
+            i += 2;
+        }
+        if (mask & HC_WIN)
+        {
+            memcpy(l4 + 14, fields + i, 2);
+            i += 2;
+        }
+        if (mask & HC_FLAGS)
+        {
+            l4[13] = fields[i++];
+        }
+        if (mask & HC_OPTS)
+        {
+            memcpy(l4 + HC_TCP_LEN, fields + i, hc_optlen(c));
+            i += hc_optlen(c);
+        }
+        i += (mask & HC_PAD) ? 1 : 0;
+        memcpy(l4 + 16, fields + i, 2);
+    }
+    else
+    {
+        i += (mask & HC_PAD) ? 1 : 0;
+        wr16(l4 + 4, c->hlen - c->l4off + plen);
+        memcpy(l4 + 6, fields + i, 2);
+    }
+
+    if (!c->v6)
+    {
+        wr16(l3 + 10, 0);
+        wr16(l3 + 10, ip4_checksum(l3));
+    }
+}
+
+/** Compress the headers of frame f, laid out as in c, against c into co.
+ *
+ *  @return length of the compressed headers, or 0 if f has to be sent in
+ *  full
+ */
+static size_t hc_encode(const struct n2n_hc_ctx *c, const uint8_t *f, size_t plen, uint8_t *co)
+{
+    const uint8_t *l3 = f + c->l3off;
+    const uint8_t *l4 = f + c->l4off;
+    const uint8_t *r3 = c->hdr + c->l3off;
+    const uint8_t *r4 = c->hdr + c->l4off;
+    uint8_t  hdr[N2N_HC_HDR_MAX];
+    uint8_t  mask = 0;
+    uint32_t d;
+    size_t   i = 3;
+
+    co[0] = c->gen;
+    co[1] = c->cid;
+
+    if (!c->v6)
+    {
+        d = (rd16(l3 + 4) - rd16(r3 + 4)) & 0xFFFF;
+        if (d > 0xFF)
+        {
+            return 0;
+        }
+        if (d)
+        {
+            mask |= HC_IPID;
+            co[i++] = d;
+        }
+    }
+
+    if (IPPROTO_TCP == c->proto)
+    {
+        d = rd32(l4 + 4) - rd32(r4 + 4);
+        if (d > 0xFFFF)
+        {
+            return 0;
+        }
+        if (d)
+        {
+            mask |= HC_SEQ;
+            wr16(co + i, d);
+            i += 2;
+        }
+
+        d = rd32(l4 + 8) - rd32(r4 + 8);
+        if (d > 0xFFFF)
+        {
+            return 0;
+        }
+        if (d)
+        {
+            mask |= HC_ACK;
+            wr16(co + i, d);
+            i += 2;
+        }
+
+        if (0 != memcmp(l4 + 14, r4 + 14, 2))
+        {
+            mask |= HC_WIN;
+            memcpy(co + i, l4 + 14, 2);
+            i += 2;
+        }
+
+        if (l4[13] != r4[13])
+        {
+            mask |= HC_FLAGS;
+            co[i++] = l4[13];
+        }
+
+        if (0 != memcmp(l4 + HC_TCP_LEN, r4 + HC_TCP_LEN, hc_optlen(c)))
+        {
+            mask |= HC_OPTS;
+            memcpy(co + i, l4 + HC_TCP_LEN, hc_optlen(c));
+            i += hc_optlen(c);
+        }
+    }
+
+    /* Checksum and check octet to come. */
+    if (i + 3 + plen < HC_MIN_LEN)
+    {
+        mask |= HC_PAD;
+        co[i++] = plen;
+    }
+
+    memcpy(co + i, l4 + ((IPPROTO_TCP == c->proto) ? 16 : 6), 2);
+    i += 2;
+
+    co[2] = mask;
+
+    /* Whatever else differs shows up here; the receiver rebuilds the same. */
+    hc_rebuild(c, co + 2, plen, hdr);
+    if (0 != memcmp(hdr, f, c->hlen))
+    {
+        return 0;
+    }
+
+    co[i++] = hc_check(f, c->hlen);
+
+    return i;
+}
+
+static uint32_t hc_mac_hash(const n2n_mac_t mac)
+{
+    return fnv1a(2166136261U, mac, N2N_MAC_SIZE);
+}
+
+/** Hash of the addresses, protocol and ports of a frame laid out as in c. */
+static uint32_t hc_flow_hash(const uint8_t *f, const struct n2n_hc_ctx *c)
+{
+    uint32_t h = 2166136261U;
+
+    if (c->v6)
+    {
+        h = fnv1a(h, f + c->l3off + 8, 32);
+    }
+    else
+    {
+        h = fnv1a(h, f + c->l3off + 12, 8);
+    }
+
+    h = fnv1a(h, &(c->proto), 1);
+
+    return fnv1a(h, f + c->l4off, 4);
+}
+
+/** Find the Rx context of peer with context ID cid. Contexts are kept in
+ *  sets of N2N_HC_RX_WAYS, so peers whose contexts map to the same set do
+ *  not evict each other. For an IR frame (ir non-zero) a context is set
+ *  aside if there is none yet: a free one, or else the least recently used
+ *  of the set.
+ *
+ *  @return the context or NULL if there is none
+ */
+static struct n2n_hc_ctx *hc_rx_context(n2n_hc_t *hc, const n2n_mac_t peer, uint8_t cid, int ir)
+{
+    uint32_t h = hc_mac_hash(peer);
+    struct n2n_hc_ctx *set;
+    struct n2n_hc_ctx *victim;
+    size_t i;
+
+    set = &(hc->rx[(((h >> 8) ^ (h << 4) ^ cid) & ((N2N_HC_RX_CONTEXTS / N2N_HC_RX_WAYS) - 1)) * N2N_HC_RX_WAYS]);
+    victim = &(set[0]);
+
+    for (i = 0; i < N2N_HC_RX_WAYS; ++i)
+    {
+        struct n2n_hc_ctx *c = &(set[i]);
+
+        if ((0 != c->gen) && (c->cid == cid) && (0 == memcmp(c->peer, peer, N2N_MAC_SIZE)))
+        {
+            c->used = ++(hc->rx_clock);
+            return c;
+        }
+
+        if ((0 != victim->gen) &&
+            ((0 == c->gen) || ((int32_t) (c->used - victim->used) < 0)))
+        {
+            victim = c;
+        }
+    }
+
+    if (!ir)
+    {
+        return NULL;
+    }
+
+    victim->gen = 0;
+    victim->used = ++(hc->rx_clock);
+
+    return victim;
+}
+
+/** See hc_expand(). */
+static int hc_restore(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *in, size_t in_len,
+                      uint8_t *out, size_t out_len)
+{
+    struct n2n_hc_ctx *c;
+    size_t   plen;
+    int      n;
+
+    if (in_len < 3)
+    {
+        return -1;
+    }
+
+    if (NULL == hc->rx)
+    {
+        hc->rx = (struct n2n_hc_ctx *) calloc(N2N_HC_RX_CONTEXTS, sizeof(struct n2n_hc_ctx));
+        if (NULL == hc->rx)
+        {
+            traceError("hc_expand: unable to allocate contexts");
+            return -1;
+        }
+    }
+
+    if (in[0] & HC_IR)
+    {
+        struct n2n_hc_ctx cur;
+
+        in_len -= 2;
+        if ((in_len > out_len) || (0 == (in[0] & HC_GEN_MASK)) || (0 != hc_parse(in + 2, in_len, &cur)))
+        {
+            return -1;
+        }
+
+        c = hc_rx_context(hc, peer, in[1], 1);
+
+        memcpy(c->peer, peer, N2N_MAC_SIZE);
+        c->cid = in[1];
+        c->gen = in[0] & HC_GEN_MASK;
+        c->hlen = cur.hlen;
+        c->l3off = cur.l3off;
+        c->l4off = cur.l4off;
+        c->proto = cur.proto;
+        c->v6 = cur.v6;
+        memcpy(c->hdr, in + 2, cur.hlen);
+
+        memcpy(out, in + 2, in_len);
+        ++(hc->stats.rx_ir);
+
+        return in_len;
+    }
+
+    c = hc_rx_context(hc, peer, in[1], 0);
+
+    if ((NULL == c) || (c->gen != in[0]))
+    {
+        traceDebug("hc_expand: no context %u generation %u", (unsigned int) in[1], (unsigned int) in[0]);
+        return -1;
+    }
+
+    n = hc_fields_len(c, in[2]);
+    if ((n < 0) || (in_len < 2 + (size_t) n + 1))
+    {
+        return -1;
+    }
+
+    plen = in_len - (2 + n + 1);
+    if (in[2] & HC_PAD)
+    {
+        /* Before the checksum. */
+        if (in[2 + n - 3] > plen)
+        {
+            return -1;
+        }
+        plen = in[2 + n - 3];
+    }
+
+    if (c->hlen + plen > out_len)
+    {
+        return -1;
+    }
+
+    hc_rebuild(c, in + 2, plen, out);
+    if (hc_check(out, c->hlen) != in[2 + n])
+    {
+        traceDebug("hc_expand: check failed for context %u", (unsigned int) in[1]);
+        return -1;
+    }
+
+    memcpy(out + c->hlen, in + in_len - plen, plen);
+    ++(hc->stats.rx_co);
+
+    return c->hlen + plen;
+}
+
+
+/* ********************************** */
+
+/** Set up the state of the data-plane thread thread_id, below 16. */
+void hc_init(n2n_hc_t *hc, size_t thread_id)
+{
+    memset(hc, 0, sizeof(n2n_hc_t));
+    hc->cid_base = (thread_id & 0x0F) << 4;
+}
+
+void hc_deinit(n2n_hc_t *hc)
+{
+    free(hc->tx);
+    free(hc->rx);
+    hc->tx = NULL;
+    hc->rx = NULL;
+}
+
+/** Compress the headers of the frame of len bytes at *frame, bound for peer,
+ *  where it lies. *frame is moved to the start of the result, which may lie
+ *  up to two bytes in front of the frame; headroom says how many bytes there
+ *  are to spare.
+ *
+ *  @return length of the result, or 0 if the frame is better sent as it is
+ */
+int hc_compress(n2n_hc_t *hc, const n2n_mac_t peer, uint8_t **frame, size_t len, size_t headroom)
+{
+    uint8_t            *f = *frame;
+    struct n2n_hc_ctx   cur;
+    struct n2n_hc_ctx  *c;
+    uint8_t             co[3 + N2N_HC_HDR_MAX + 3];
+    uint32_t            h;
+    uint8_t             cid;
+    size_t              n;
+
+    ++(hc->stats.tx_frames);
+
+    if (0 != hc_parse(f, len, &cur))
+    {
+        return 0;
+    }
+
+    if (NULL == hc->tx)
+    {
+        hc->tx = (struct n2n_hc_ctx *) calloc(N2N_HC_TX_CONTEXTS, sizeof(struct n2n_hc_ctx));
+        if (NULL == hc->tx)
+        {
+            traceError("hc_compress: unable to allocate contexts");
+            return 0;
+        }
+    }
+
+    /* 16 contexts for each peer, picked by flow. */
+    h = hc_flow_hash(f, &cur) & 0x0F;
+    cid = hc->cid_base | h;
+    c = &(hc->tx[((hc_mac_hash(peer) << 4) | h) & (N2N_HC_TX_CONTEXTS - 1)]);
+
+    if ((0 != c->gen) && (c->cid == cid) && (0 == memcmp(c->peer, peer, N2N_MAC_SIZE)) &&
+        (c->hlen == cur.hlen) && (c->proto == cur.proto) && (c->v6 == cur.v6) &&
+        (c->count < N2N_HC_REFRESH))
+    {
+        n = hc_encode(c, f, len - cur.hlen, co);
+        if ((n > 0) && (n < cur.hlen))
+        {
+            size_t pad = (n + len - cur.hlen < HC_MIN_LEN) ? HC_MIN_LEN - (n + len - cur.hlen) : 0;
+
+            ++(c->count);
+            ++(hc->stats.tx_co);
+            hc->stats.tx_saved += cur.hlen - n - pad;
+
+            /* The payload stays where it is; the headers are longer than HC_MIN_LEN. */
+            *frame = f + cur.hlen - n - pad;
+            memcpy(*frame, co, n);
+            memset(*frame + n, 0, pad);
+
+            return n + pad + len - cur.hlen;
+        }
+    }
+
+    if (headroom < 2)
+    {
+        return 0;
+    }
+
+    /* Refresh the context with the headers of this frame. */
+    memcpy(c->peer, peer, N2N_MAC_SIZE);
+    c->cid = cid;
+    c->gen = (c->gen % HC_GEN_MASK) + 1;
+    c->hlen = cur.hlen;
+    c->l3off = cur.l3off;
+    c->l4off = cur.l4off;
+    c->proto = cur.proto;
+    c->v6 = cur.v6;
+    c->count = 0;
+    memcpy(c->hdr, f, cur.hlen);
+
+    ++(hc->stats.tx_ir);
+    hc->stats.tx_saved -= 2;
+
+    *frame = f - 2;
+    (*frame)[0] = HC_IR | c->gen;
+    (*frame)[1] = cid;
+
+    return len + 2;
+}
+
+
+/** Restore into out, of out_len bytes, the frame of in_len bytes at in which
+ *  peer compressed with hc_compress().
+ *
+ *  @return length of the frame or -1 on error
+ */
+int hc_expand(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *in, size_t in_len,
+              uint8_t *out, size_t out_len)
+{
+    int len = hc_restore(hc, peer, in, in_len, out, out_len);
+
+    if (len < 0)
+    {
+        ++(hc->stats.rx_errors);
+    }
+
+    return len;
+}
+
+/** Add the counters s to tot. */
+void hc_stats_add(struct n2n_hc_stats *tot, const struct n2n_hc_stats *s)
+{
+    tot->tx_frames += s->tx_frames;
+    tot->tx_ir += s->tx_ir;
+    tot->tx_co += s->tx_co;
+    tot->tx_saved += s->tx_saved;
+    tot->rx_ir += s->rx_ir;
+    tot->rx_co += s->rx_co;
+    tot->rx_errors += s->rx_errors;
+}
@@ -0,0 +1,90 @@
+/*
+ * n2n_hc.h
+ *
+ * Compression of the inner Ethernet, IP and TCP or UDP headers of frames
+ * sent between two edges, in the manner of ROHC.
+ *
+ * The sender keeps contexts holding the headers of a recent frame of each
+ * flow to a peer. A frame whose headers differ from those of its context only
+ * in fields that are expected to change (lengths, IP ID, TCP sequence and
+ * acknowledgement numbers, window, flags, options, checksums) is sent as a
+ * context ID, a mask of the fields which changed, their deltas and the
+ * TCP or UDP checksum; the rest is rebuilt by the receiver. Other frames
+ * refresh the context by sending their headers in full with the context ID
+ * (an IR frame, as ROHC calls them).
+ *
+ * Deltas are taken from the headers last sent in full, never from the
+ * previous frame, so a lost or reordered frame does not upset the frames
+ * after it. A context is refreshed after N2N_HC_REFRESH frames, or sooner
+ * when the deltas outgrow their fields, which bounds what a lost IR costs.
+ * Each compressed frame carries a check octet over its original headers; a
+ * frame rebuilt from the wrong context is dropped, not delivered.
+ *
+ * Edges offer header compression in REGISTER and accept it in REGISTER_ACK
+ * (N2N_OPTION_HDR_COMPRESS), and PACKETs compressed this way say so in their
+ * options octet. The frame is compressed before the transforms run, so the
+ * compressed headers are encrypted like the rest of the frame.
+ *
+ * The state is private to one data-plane thread. Context IDs are built from
+ * the ID of that thread, so several threads sending to one peer do not share
+ * contexts there.
+ */
+
+#ifndef N2N_HC_H_
+#define N2N_HC_H_
+
+#include "n2n.h"
+
+#define N2N_HC_HDR_MAX          128     /* Longest headers kept in a context. */
+#define N2N_HC_TX_CONTEXTS      256     /* Tx contexts of a thread: 16 per peer, direct mapped. */
+#define N2N_HC_RX_CONTEXTS      256     /* Rx contexts of a thread, in sets of N2N_HC_RX_WAYS. */
+#define N2N_HC_RX_WAYS          4       /* Rx contexts a (peer, context ID) may be kept in. */
+#define N2N_HC_REFRESH          64      /* Frames compressed against a context before it is sent in full again. */
+
+struct n2n_hc_ctx
+{
+    n2n_mac_t           peer;           /* Tx: destination edge. Rx: source edge. */
+    uint8_t             cid;
+    uint8_t             gen;            /* Bumped with each refresh, 1 to 127; 0 if unused. */
+    uint8_t             hlen;
+    uint8_t             l3off;
+    uint8_t             l4off;
+    uint8_t             proto;          /* IPPROTO_TCP or IPPROTO_UDP */
+    uint8_t             v6;
+    uint16_t            count;          /* Tx: frames sent against it since the last refresh. */
+    uint32_t            used;           /* Rx: value of rx_clock when last used, for LRU. */
+    uint8_t             hdr[N2N_HC_HDR_MAX];
+};
+
+struct n2n_hc_stats
+{
+    size_t              tx_frames;      /* Frames offered to hc_compress(). */
+    size_t              tx_ir;          /* Sent with full headers to set up a context. */
+    size_t              tx_co;          /* Sent with compressed headers. */
+    int64_t             tx_saved;       /* Bytes saved, less what IR frames added. */
+    size_t              rx_ir;
+    size_t              rx_co;
+    size_t              rx_errors;      /* No such context, or the check failed. */
+};
+
+struct n2n_hc
+{
+    uint8_t             cid_base;       /* High bits of the context IDs of this thread. */
+    struct n2n_hc_ctx  *tx;             /* Allocated on first use. */
+    struct n2n_hc_ctx  *rx;             /* Allocated on first use. */
+    uint32_t            rx_clock;       /* Bumped with each frame expanded. */
+    struct n2n_hc_stats stats;
+};
+
+typedef struct n2n_hc n2n_hc_t;
+
+
+void    hc_init(n2n_hc_t *hc, size_t thread_id);
+void    hc_deinit(n2n_hc_t *hc);
+int     hc_compress(n2n_hc_t *hc, const n2n_mac_t peer, uint8_t **frame, size_t len, size_t headroom);
+int     hc_expand(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *in, size_t in_len,
+                  uint8_t *out, size_t out_len);
+void    hc_stats_add(struct n2n_hc_stats *tot, const struct n2n_hc_stats *s);
+
+
+#endif /* N2N_HC_H_ */
@@ -35,7 +35,7 @@ struct n2n_list
     for (pos = (head)->next; pos != NULL; pos = pos->next)
 
 #define LIST_FOR_EACH_SAFE(pos, n, head) \
-    for (pos = (head)->next, n = pos->next; pos != NULL; pos = n, n = pos->next)
+    for (pos = (head)->next, n = pos ? pos->next : NULL; pos != NULL; pos = n, n = pos ? pos->next : NULL)
 
 /*************************************/
 
@@ -50,11 +50,13 @@ struct n2n_list
          pos != NULL;                                               \
          pos = LIST_ENTRY(pos->member.next, typeof(*pos), member))
 
-#define LIST_FOR_EACH_ENTRY_SAFE(pos, n, head, member)              \
-    for (pos = LIST_ENTRY((head)->next, typeof(*pos), member),      \
-         n = LIST_ENTRY(pos->member.next, typeof(*pos), member);    \
-         &pos->member != NULL;                                      \
-         pos = n, n = LIST_ENTRY(n->member.next, typeof(*n), member))
+/* Only for lists whose member is the first of the entry, so that an entry
+ * pointer is NULL exactly when its list pointer is. */
+#define LIST_FOR_EACH_ENTRY_SAFE(pos, n, head, member)                          \
+    for (pos = LIST_ENTRY((head)->next, typeof(*pos), member),                  \
+         n = pos ? LIST_ENTRY(pos->member.next, typeof(*pos), member) : NULL;   \
+         pos != NULL;                                                           \
+         pos = n, n = n ? LIST_ENTRY(n->member.next, typeof(*n), member) : NULL)
 
 /*************************************/
 
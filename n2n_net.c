@@ -175,6 +175,17 @@ char* intoa(uint32_t /* host order */addr, char *buf, uint16_t buf_len)
 /* Layer 4 */
 
 SOCKET open_socket(int local_port, int bind_any)
+{
+    return open_socket_opt(local_port, bind_any, 0);
+}
+
+/** Open a UDP socket bound to local_port.
+ *
+ *  With reuse_port set several sockets can be bound to the same port; the
+ *  kernel spreads incoming flows between them (SO_REUSEPORT). Every socket
+ *  sharing the port must be opened this way.
+ */
+SOCKET open_socket_opt(int local_port, int bind_any, int reuse_port)
 {
     SOCKET sock_fd;
     struct sockaddr_in local_address;
@@ -193,6 +204,22 @@ SOCKET open_socket(int local_port, int bind_any)
 
     setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &sockopt, sizeof(sockopt));
 
+    if (reuse_port)
+    {
+#ifdef SO_REUSEPORT
+        if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, (char *) &sockopt, sizeof(sockopt)) < 0)
+        {
+            traceError("Unable to set SO_REUSEPORT [%s]\n", strerror(errno));
+            closesocket(sock_fd);
+            return (-1);
+        }
+#else
+        traceError("SO_REUSEPORT is not supported on this platform\n");
+        closesocket(sock_fd);
+        return (-1);
+#endif
+    }
+
     memset(&local_address, 0, sizeof(local_address));
     local_address.sin_family = AF_INET;
     local_address.sin_port = htons(local_port);
@@ -207,7 +234,7 @@ SOCKET open_socket(int local_port, int bind_any)
 }
 
 
-static int fill_sockaddr(struct sockaddr *out_addr, const n2n_sock_t *sock)
+int fill_sockaddr(struct sockaddr *out_addr, const n2n_sock_t *sock)
 {
     struct sockaddr_in *si = NULL;
 
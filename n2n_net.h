@@ -131,6 +131,9 @@ typedef char n2n_sock_str_t[N2N_SOCKBUF_SIZE]; /* tracing string buffer */
 
 /* functions */
 extern SOCKET open_socket(int local_port, int bind_any);
+extern SOCKET open_socket_opt(int local_port, int bind_any, int reuse_port);
+
+extern int fill_sockaddr(struct sockaddr *out_addr, const n2n_sock_t *sock);
 
 extern ssize_t sendto_sock(int         sock_fd,
                            const void *pktbuf,
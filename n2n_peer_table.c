@@ -0,0 +1,300 @@
+/*
+ * n2n_peer_table.c
+ *
+ * Bounded hash table of peers keyed by MAC address. See n2n_peer_table.h.
+ */
+
+#include "n2n.h"
+#include "n2n_peer_table.h"
+
+
+/** Home slot of mac. Fibonacci hashing of the 48 bit address. */
+static size_t mac_home(const n2n_peer_table_t *t, const uint8_t *mac)
+{
+    uint64_t k = 0;
+
+    memcpy(&k, mac, N2N_MAC_SIZE);
+    k *= 0x9E3779B97F4A7C15ULL;
+
+    return (size_t) (k >> 32) & t->mask;
+}
+
+/** Slot holding mac, or -1 if mac is not in the table. */
+static ssize_t find_slot(const n2n_peer_table_t *t, const uint8_t *mac)
+{
+    size_t i = mac_home(t, mac);
+
+    /* Terminates because the table is never more than half full. */
+    for (;;)
+    {
+        const struct n2n_peer_slot *s = &(t->slots[i]);
+
+        if (0 == s->entry)
+        {
+            return -1;
+        }
+
+        if (0 == memcmp(s->mac, mac, N2N_MAC_SIZE))
+        {
+            return i;
+        }
+
+        i = (i + 1) & t->mask;
+    }
+}
+
+/** Unlink entry idx from the expiry list. */
+static void lru_unlink(n2n_peer_table_t *t, size_t idx)
+{
+    t->lru_next[t->lru_prev[idx]] = t->lru_next[idx];
+    t->lru_prev[t->lru_next[idx]] = t->lru_prev[idx];
+}
+
+/** Append entry idx to the expiry list as the most recently seen. */
+static void lru_append(n2n_peer_table_t *t, size_t idx)
+{
+    size_t head = t->capacity;
+    size_t last = t->lru_prev[head];
+
+    t->lru_prev[idx]  = last;
+    t->lru_next[idx]  = head;
+    t->lru_next[last] = idx;
+    t->lru_prev[head] = idx;
+}
+
+/** Empty slot i and shift later slots of its probe sequence back into the
+ *  gap so that lookups need no tombstones. */
+static void clear_slot(n2n_peer_table_t *t, size_t i)
+{
+    size_t j = i;
+
+    for (;;)
+    {
+        size_t home;
+
+        j = (j + 1) & t->mask;
+
+        if (0 == t->slots[j].entry)
+        {
+            break;
+        }
+
+        home = mac_home(t, t->slots[j].mac);
+
+        /* Leave j where it is if its home lies cyclically in (i, j]. */
+        if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+        {
+            continue;
+        }
+
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+
+    t->slots[i].entry = 0;
+}
+
+
+/** Set up an empty table holding up to capacity peers.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int peer_table_init(n2n_peer_table_t *t, size_t capacity)
+{
+    size_t num_slots = 2;
+
+    memset(t, 0, sizeof(n2n_peer_table_t));
+
+    t->capacity = MAX(1, MIN(capacity, N2N_PEER_TABLE_MAX));
+
+    while (num_slots < 2 * t->capacity)
+    {
+        num_slots <<= 1;
+    }
+
+    t->mask     = num_slots - 1;
+    t->slots    = (struct n2n_peer_slot *) calloc(num_slots, sizeof(struct n2n_peer_slot));
+    t->entries  = (struct peer_info *) calloc(t->capacity, sizeof(struct peer_info));
+    t->used     = (uint8_t *) calloc(t->capacity, sizeof(uint8_t));
+    t->free_idx = (uint32_t *) calloc(t->capacity, sizeof(uint32_t));
+    t->lru_prev = (uint32_t *) calloc(t->capacity + 1, sizeof(uint32_t));
+    t->lru_next = (uint32_t *) calloc(t->capacity + 1, sizeof(uint32_t));
+
+    if ((NULL == t->slots) || (NULL == t->entries) || (NULL == t->used) || (NULL == t->free_idx) ||
+        (NULL == t->lru_prev) || (NULL == t->lru_next))
+    {
+        traceError("peer_table_init: unable to allocate %u peers", (unsigned int) t->capacity);
+        peer_table_deinit(t);
+        return -1;
+    }
+
+    t->lru_prev[t->capacity] = t->capacity;
+    t->lru_next[t->capacity] = t->capacity;
+
+    /* Hand out low indices first. */
+    for (t->num_free = 0; t->num_free < t->capacity; ++(t->num_free))
+    {
+        t->free_idx[t->num_free] = t->capacity - 1 - t->num_free;
+    }
+
+    return 0;
+}
+
+void peer_table_deinit(n2n_peer_table_t *t)
+{
+    free(t->slots);
+    free(t->entries);
+    free(t->used);
+    free(t->free_idx);
+    free(t->lru_prev);
+    free(t->lru_next);
+    memset(t, 0, sizeof(n2n_peer_table_t));
+}
+
+/** Have cb called with arg for every peer leaving the table. */
+void peer_table_set_remove(n2n_peer_table_t *t, peer_table_remove_f cb, void *arg)
+{
+    t->on_remove     = cb;
+    t->on_remove_arg = arg;
+}
+
+/** Find the peer with mac_addr equal to mac.
+ *
+ *  @return NULL if not found; otherwise pointer to peer entry.
+ */
+struct peer_info *peer_table_find(const n2n_peer_table_t *t, const n2n_mac_t mac)
+{
+    ssize_t  i = find_slot(t, mac);
+    uint32_t entry;
+
+    if (i < 0)
+    {
+        return NULL;
+    }
+
+    /* Read once: a concurrent writer may be emptying the slot. */
+    entry = __atomic_load_n(&(t->slots[i].entry), __ATOMIC_RELAXED);
+
+    return (0 != entry) ? &(t->entries[entry - 1]) : NULL;
+}
+
+/** Add the peer with mac_addr mac, last seen at when. If the table is full
+ *  the least recently seen peer is evicted first.
+ *
+ *  @return the peer entry. A new entry is zeroed apart from mac_addr and
+ *  last_seen; if mac is already in the table its entry is returned unchanged.
+ */
+struct peer_info *peer_table_add(n2n_peer_table_t *t, const n2n_mac_t mac, time_t when)
+{
+    struct peer_info *peer = peer_table_find(t, mac);
+    size_t idx;
+    size_t i;
+
+    if (NULL != peer)
+    {
+        return peer;
+    }
+
+    if (0 == t->num_free)
+    {
+        struct peer_info *oldest = peer_table_first(t);
+        macstr_t mac_buf;
+
+        traceDebug("peer table full, evicting %s", macaddr_str(mac_buf, oldest->mac_addr));
+        peer_table_remove(t, oldest);
+        ++(t->evictions);
+    }
+
+    idx = t->free_idx[--(t->num_free)];
+    peer = &(t->entries[idx]);
+    memset(peer, 0, sizeof(struct peer_info));
+    memcpy(peer->mac_addr, mac, N2N_MAC_SIZE);
+    peer->last_seen = when;
+    t->used[idx] = 1;
+    lru_append(t, idx);
+
+    for (i = mac_home(t, mac); 0 != t->slots[i].entry; i = (i + 1) & t->mask)
+    {
+    }
+
+    memcpy(t->slots[i].mac, mac, N2N_MAC_SIZE);
+    t->slots[i].entry = idx + 1;
+    ++(t->count);
+
+    return peer;
+}
+
+/** Set the last_seen time of peer, an entry of the table, to when. when must
+ *  not be earlier than any other last_seen in the table. */
+void peer_table_touch(n2n_peer_table_t *t, struct peer_info *peer, time_t when)
+{
+    size_t idx = peer - t->entries;
+
+    peer->last_seen = when;
+
+    if (t->lru_prev[t->capacity] != idx)
+    {
+        lru_unlink(t, idx);
+        lru_append(t, idx);
+    }
+}
+
+/** Remove peer, which must be an entry of the table. */
+void peer_table_remove(n2n_peer_table_t *t, struct peer_info *peer)
+{
+    size_t  idx = peer - t->entries;
+    ssize_t i = find_slot(t, peer->mac_addr);
+
+    if ((i < 0) || (t->slots[i].entry != idx + 1))
+    {
+        traceError("peer_table_remove: entry %u not in table", (unsigned int) idx);
+        return;
+    }
+
+    if (NULL != t->on_remove)
+    {
+        t->on_remove(t, peer, t->on_remove_arg);
+    }
+
+    clear_slot(t, i);
+    lru_unlink(t, idx);
+
+    t->used[idx] = 0;
+    t->free_idx[(t->num_free)++] = idx;
+    --(t->count);
+}
+
+/** Remove the peers last seen before purge_before. Only the removed peers
+ *  are visited.
+ *
+ *  @return the number of peers removed
+ */
+size_t peer_table_purge(n2n_peer_table_t *t, time_t purge_before)
+{
+    struct peer_info *oldest;
+    size_t retval = 0;
+
+    while ((NULL != (oldest = peer_table_first(t))) && (oldest->last_seen < purge_before))
+    {
+        peer_table_remove(t, oldest);
+        ++retval;
+    }
+
+    return retval;
+}
+
+/** The least recently seen peer, or NULL if the table is empty. */
+struct peer_info *peer_table_first(const n2n_peer_table_t *t)
+{
+    size_t idx = t->lru_next[t->capacity];
+
+    return (idx != t->capacity) ? &(t->entries[idx]) : NULL;
+}
+
+/** The peer seen next after peer, or NULL if peer is the most recent. */
+struct peer_info *peer_table_next(const n2n_peer_table_t *t, const struct peer_info *peer)
+{
+    size_t idx = t->lru_next[peer - t->entries];
+
+    return (idx != t->capacity) ? &(t->entries[idx]) : NULL;
+}
@@ -0,0 +1,100 @@
+/*
+ * n2n_peer_table.h
+ *
+ * Bounded hash table of peers keyed by MAC address.
+ *
+ * Lookups use open addressing with linear probing over a slot array holding
+ * only the MAC and the index of the peer entry, so a probe sequence usually
+ * stays within one cache line and peer entries are only touched on a hit.
+ * The slot array is kept at most half full. Removal shifts later slots of the
+ * probe sequence back, so no tombstones accumulate.
+ *
+ * Peer entries live in a fixed array and never move while they are in the
+ * table; pointers returned by the table stay valid until the peer is removed.
+ * No array is ever reallocated, so lookups may run concurrently with one
+ * writer if the reader checks afterwards that no write overlapped (seqlock).
+ *
+ * The table holds at most <capacity> peers. Adding a peer to a full table
+ * evicts the least recently seen one (smallest last_seen).
+ *
+ * Peers are also kept on an expiry list ordered by last_seen: last_seen is
+ * only set through peer_table_add() and peer_table_touch(), which move the
+ * peer to the end of the list. Since the clock (n2n_now()) never goes back,
+ * the least recently seen peer is always at the head, so eviction and
+ * purging only look at the peers they remove.
+ */
+
+#ifndef N2N_PEER_TABLE_H_
+#define N2N_PEER_TABLE_H_
+
+#include "n2n.h"
+
+#define N2N_PEER_TABLE_MAX      ((1 << 24) - 1)
+
+struct n2n_peer_table;
+
+/** Called for every peer leaving the table, whether removed, purged or
+ *  evicted, while the entry is still valid. */
+typedef void (*peer_table_remove_f)(struct n2n_peer_table *t, struct peer_info *peer, void *arg);
+
+struct n2n_peer_slot
+{
+    uint32_t            entry;          /* Index into entries plus one; 0 if the slot is empty. */
+    uint8_t             mac[N2N_MAC_SIZE];
+};
+
+struct n2n_peer_table
+{
+    size_t              capacity;       /* Max number of peers. */
+    size_t              count;          /* Peers in the table. */
+    size_t              mask;           /* Number of slots minus one. */
+    struct n2n_peer_slot *slots;
+
+    struct peer_info   *entries;        /* capacity entries */
+    uint8_t            *used;           /* Non-zero for entries in the table. */
+    uint32_t           *free_idx;       /* Stack of unused entry indices. */
+    size_t              num_free;
+
+    /* Expiry list of entry indices, least recently seen first. Index
+     * capacity is the list head, so both arrays hold capacity + 1 links. */
+    uint32_t           *lru_prev;
+    uint32_t           *lru_next;
+
+    peer_table_remove_f on_remove;      /* Optional. */
+    void               *on_remove_arg;
+
+    /* Statistics */
+    size_t              evictions;
+};
+
+typedef struct n2n_peer_table n2n_peer_table_t;
+
+
+int     peer_table_init(n2n_peer_table_t *t, size_t capacity);
+void    peer_table_deinit(n2n_peer_table_t *t);
+void    peer_table_set_remove(n2n_peer_table_t *t, peer_table_remove_f cb, void *arg);
+struct peer_info *peer_table_find(const n2n_peer_table_t *t, const n2n_mac_t mac);
+struct peer_info *peer_table_add(n2n_peer_table_t *t, const n2n_mac_t mac, time_t when);
+void    peer_table_touch(n2n_peer_table_t *t, struct peer_info *peer, time_t when);
+void    peer_table_remove(n2n_peer_table_t *t, struct peer_info *peer);
+size_t  peer_table_purge(n2n_peer_table_t *t, time_t purge_before);
+struct peer_info *peer_table_first(const n2n_peer_table_t *t);
+struct peer_info *peer_table_next(const n2n_peer_table_t *t, const struct peer_info *peer);
+
+static inline size_t peer_table_size(const n2n_peer_table_t *t)
+{
+    return t->count;
+}
+
+/* Visit every peer, least recently seen first. The current peer may be
+ * removed from the loop body. */
+#define PEER_TABLE_FOR_EACH_SAFE(pos, n, t)                                 \
+    for (pos = peer_table_first(t), n = pos ? peer_table_next(t, pos) : NULL; \
+         pos != NULL;                                                       \
+         pos = n, n = pos ? peer_table_next(t, pos) : NULL)
+
+#define PEER_TABLE_FOR_EACH(pos, t) \
+    for (pos = peer_table_first(t); pos != NULL; pos = peer_table_next(t, pos))
+
+
+#endif /* N2N_PEER_TABLE_H_ */
@@ -0,0 +1,227 @@
+/*
+ * n2n_ring.c
+ *
+ * Bounded lock-free rings of pointers. See n2n_ring.h.
+ */
+
+#include "n2n.h"
+#include "n2n_ring.h"
+
+#ifdef N2N_HAVE_RING
+
+/** Smallest power of two not below size. */
+static size_t ring_size(size_t size)
+{
+    size_t n = 2;
+
+    while (n < size)
+    {
+        n <<= 1;
+    }
+
+    return n;
+}
+
+
+/* ************************************** */
+/* Single producer, single consumer */
+
+/** Set up a ring holding at least size pointers.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int spsc_ring_init(n2n_spsc_ring_t *r, size_t size)
+{
+    memset(r, 0, sizeof(n2n_spsc_ring_t));
+
+    size = ring_size(size);
+    r->slots = (void **) calloc(size, sizeof(void *));
+    if (NULL == r->slots)
+    {
+        traceError("spsc_ring_init: unable to allocate %u slots", (unsigned int) size);
+        return -1;
+    }
+
+    r->mask = size - 1;
+
+    return 0;
+}
+
+void spsc_ring_deinit(n2n_spsc_ring_t *r)
+{
+    free(r->slots);
+    memset(r, 0, sizeof(n2n_spsc_ring_t));
+}
+
+/** Append p. Producer side only.
+ *
+ *  @return 0 on success, -1 if the ring is full
+ */
+int spsc_ring_push(n2n_spsc_ring_t *r, void *p)
+{
+    size_t tail = r->tail;
+
+    if ((tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) > r->mask)
+    {
+        return -1;
+    }
+
+    r->slots[tail & r->mask] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/** The oldest pointer without removing it, or NULL if the ring is empty.
+ *  Consumer side only. */
+void *spsc_ring_peek(n2n_spsc_ring_t *r)
+{
+    size_t head = r->head;
+
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return r->slots[head & r->mask];
+}
+
+/** Remove and return the oldest pointer, or NULL if the ring is empty.
+ *  Consumer side only. */
+void *spsc_ring_pop(n2n_spsc_ring_t *r)
+{
+    void *p = spsc_ring_peek(r);
+
+    if (NULL != p)
+    {
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    }
+
+    return p;
+}
+
+
+/* ************************************** */
+/* Multiple producers, multiple consumers */
+
+/** Set up a ring holding at least size pointers.
+ *
+ *  @return 0 on success, -1 on error
+ */
+int mpmc_ring_init(n2n_mpmc_ring_t *r, size_t size)
+{
+    size_t i;
+
+    memset(r, 0, sizeof(n2n_mpmc_ring_t));
+
+    size = ring_size(size);
+    r->cells = (struct n2n_mpmc_cell *) calloc(size, sizeof(struct n2n_mpmc_cell));
+    if (NULL == r->cells)
+    {
+        traceError("mpmc_ring_init: unable to allocate %u cells", (unsigned int) size);
+        return -1;
+    }
+
+    for (i = 0; i < size; ++i)
+    {
+        r->cells[i].seq = i;
+    }
+
+    r->mask = size - 1;
+
+    return 0;
+}
+
+void mpmc_ring_deinit(n2n_mpmc_ring_t *r)
+{
+    free(r->cells);
+    memset(r, 0, sizeof(n2n_mpmc_ring_t));
+}
+
+/** Append p.
+ *
+ *  A cell is free for the producer holding position pos when its sequence
+ *  equals pos, and holds data for the consumer at pos when it equals pos + 1.
+ *
+ *  @return 0 on success, -1 if the ring is full
+ */
+int mpmc_ring_push(n2n_mpmc_ring_t *r, void *p)
+{
+    struct n2n_mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        size_t seq;
+        intptr_t dif;
+
+        cell = &(r->cells[pos & r->mask]);
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (intptr_t) seq - (intptr_t) pos;
+
+        if (0 == dif)
+        {
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1 /*weak*/,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            /* pos was reloaded by the failed exchange */
+        }
+        else if (dif < 0)
+        {
+            return -1; /* full */
+        }
+        else
+        {
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = p;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/** Remove and return the oldest pointer, or NULL if the ring is empty. */
+void *mpmc_ring_pop(n2n_mpmc_ring_t *r)
+{
+    struct n2n_mpmc_cell *cell;
+    size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    void *p;
+
+    for (;;)
+    {
+        size_t seq;
+        intptr_t dif;
+
+        cell = &(r->cells[pos & r->mask]);
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (0 == dif)
+        {
+            if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1 /*weak*/,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return NULL; /* empty */
+        }
+        else
+        {
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    p = cell->data;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+    return p;
+}
+
+#endif /* #ifdef N2N_HAVE_RING */
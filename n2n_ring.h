@@ -0,0 +1,81 @@
+/*
+ * n2n_ring.h
+ *
+ * Bounded lock-free rings of pointers used to hand packets between threads.
+ *
+ * n2n_spsc_ring_t may be used by exactly one producer thread and one consumer
+ * thread. n2n_mpmc_ring_t may be used by any number of both; it follows the
+ * bounded queue design of Dmitry Vyukov where every cell carries a sequence
+ * number telling whether it is ready to be written or read.
+ *
+ * Neither ring blocks. Callers wanting to wait for space or data pair a ring
+ * with a semaphore or a wakeup descriptor.
+ */
+
+#ifndef N2N_RING_H_
+#define N2N_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The rings are built on the GCC atomic builtins. */
+#if defined(__GNUC__)
+#define N2N_HAVE_RING 1
+#endif
+
+#define N2N_RING_CACHELINE      64      /* Producer and consumer indices are kept this far apart. */
+
+
+/** Ring for one producer and one consumer thread. */
+struct n2n_spsc_ring
+{
+    size_t              mask;           /* Number of slots minus one. */
+    void              **slots;
+
+    uint8_t             pad0[N2N_RING_CACHELINE];
+    size_t              head;           /* Next slot to read. Written by the consumer. */
+    uint8_t             pad1[N2N_RING_CACHELINE];
+    size_t              tail;           /* Next slot to write. Written by the producer. */
+    uint8_t             pad2[N2N_RING_CACHELINE];
+};
+
+typedef struct n2n_spsc_ring n2n_spsc_ring_t;
+
+
+struct n2n_mpmc_cell
+{
+    size_t              seq;
+    void               *data;
+};
+
+/** Ring for any number of producer and consumer threads. */
+struct n2n_mpmc_ring
+{
+    size_t              mask;           /* Number of cells minus one. */
+    struct n2n_mpmc_cell *cells;
+
+    uint8_t             pad0[N2N_RING_CACHELINE];
+    size_t              enqueue_pos;
+    uint8_t             pad1[N2N_RING_CACHELINE];
+    size_t              dequeue_pos;
+    uint8_t             pad2[N2N_RING_CACHELINE];
+};
+
+typedef struct n2n_mpmc_ring n2n_mpmc_ring_t;
+
+
+#ifdef N2N_HAVE_RING
+int     spsc_ring_init(n2n_spsc_ring_t *r, size_t size);
+void    spsc_ring_deinit(n2n_spsc_ring_t *r);
+int     spsc_ring_push(n2n_spsc_ring_t *r, void *p);
+void   *spsc_ring_peek(n2n_spsc_ring_t *r);
+void   *spsc_ring_pop(n2n_spsc_ring_t *r);
+
+int     mpmc_ring_init(n2n_mpmc_ring_t *r, size_t size);
+void    mpmc_ring_deinit(n2n_mpmc_ring_t *r);
+int     mpmc_ring_push(n2n_mpmc_ring_t *r, void *p);
+void   *mpmc_ring_pop(n2n_mpmc_ring_t *r);
+#endif
+
+
+#endif /* N2N_RING_H_ */
@@ -0,0 +1,99 @@
+/*
+ * n2n_transforms.c
+ *
+ * Batches of packets for the transforms. See n2n_transforms.h.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+
+/* ********************************** */
+
+/** Encode count packets with op->fwd_batch, or else one at a time with
+ *  fwd_inplace or, copying the payload aside, fwd. */
+size_t transop_fwd_batch(n2n_trans_op_t *op, n2n_trans_buf_t *bufs, size_t count)
+{
+    size_t done = 0;
+    size_t i;
+
+    if (op->fwd_batch)
+    {
+        return op->fwd_batch(op, bufs, count);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        n2n_trans_buf_t *b = &(bufs[i]);
+
+        if (op->fwd_inplace)
+        {
+            b->ret = op->fwd_inplace(op, b->buf, b->len, b->tailroom);
+        }
+        else if (b->len <= N2N_PKT_BUF_SIZE)
+        {
+            uint8_t copy[N2N_PKT_BUF_SIZE];
+
+            /* Without in place encoding the headroom is 0, so the encoding
+             * starts where the payload did. */
+            memcpy(copy, b->buf, b->len);
+            b->ret = op->fwd(op, b->buf - op->headroom, op->headroom + b->len + b->tailroom,
+                             copy, b->len);
+        }
+        else
+        {
+            b->ret = -1;
+        }
+
+        done += (b->ret > 0);
+    }
+
+    return done;
+}
+
+/** Decode count packets with op->rev_batch, or else one at a time with
+ *  rev_inplace or, decoding into a copy, rev. */
+size_t transop_rev_batch(n2n_trans_op_t *op, n2n_trans_buf_t *bufs, size_t count)
+{
+    size_t done = 0;
+    size_t i;
+
+    if (op->rev_batch)
+    {
+        return op->rev_batch(op, bufs, count);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        n2n_trans_buf_t *b = &(bufs[i]);
+
+        b->out = NULL;
+
+        if (op->rev_inplace)
+        {
+            b->ret = op->rev_inplace(op, b->buf, b->len, &(b->out));
+        }
+        else
+        {
+            uint8_t plain[N2N_PKT_BUF_SIZE];
+
+            b->ret = op->rev(op, plain, sizeof(plain), b->buf, b->len);
+
+            if (b->ret > (int) b->len)
+            {
+                traceError("transop_rev_batch: %d byte decoding of %u bytes does not fit",
+                           b->ret, (unsigned int) b->len);
+                b->ret = -1;
+            }
+            else if (b->ret > 0)
+            {
+                memcpy(b->buf, plain, b->ret);
+                b->out = b->buf;
+            }
+        }
+
+        done += (b->ret > 0);
+    }
+
+    return done;
+}
@@ -14,6 +14,10 @@
 #define N2N_TRANSFORM_ID_LZO            4
 #define N2N_TRANSFORM_ID_TWOFISH_LZO    5
 #define N2N_TRANSFORM_ID_AESCBC_LZO     6
+#define N2N_TRANSFORM_ID_AESGCM         7
+#define N2N_TRANSFORM_ID_AESGCM_LZO     8
+#define N2N_TRANSFORM_ID_CHACHA20       9
+#define N2N_TRANSFORM_ID_CHACHA20_LZO   10
 #define N2N_TRANSFORM_ID_USER_START     64
 #define N2N_TRANSFORM_ID_MAX            65535
 
@@ -42,6 +46,60 @@ typedef int             (*n2n_transform_f)     (n2n_trans_op_t *arg,
                                                 const uint8_t *inbuf,
                                                 size_t in_len);
 
+/** Encode in_len bytes at payload where they lie.
+ *
+ *  The encoding starts headroom bytes (see n2n_trans_op) in front of payload
+ *  and may extend up to tailroom bytes past its end. The caller reserves both.
+ *
+ *  @return length of the encoding or -1 on error
+ */
+typedef int             (*n2n_transform_inplace_f)(n2n_trans_op_t *arg,
+                                                   uint8_t *payload,
+                                                   size_t in_len,
+                                                   size_t tailroom);
+
+/** Decode the in_len bytes at buf where they lie.
+ *
+ *  On success *payload points at the decoded payload inside buf.
+ *
+ *  @return length of the decoded payload, 0 or -1 on error
+ */
+typedef int             (*n2n_transform_rev_inplace_f)(n2n_trans_op_t *arg,
+                                                       uint8_t *buf,
+                                                       size_t in_len,
+                                                       uint8_t **payload);
+
+/** One packet of a batch for fwd_batch or rev_batch.
+ *
+ *  For fwd_batch buf holds len bytes of payload as for fwd_inplace: the
+ *  encoding starts headroom bytes in front of it and may extend up to
+ *  tailroom bytes past its end. For rev_batch buf holds the len bytes of an
+ *  encoding as for rev_inplace, and out is set to the decoded payload inside
+ *  it.
+ *
+ *  ret is set to what fwd_inplace or rev_inplace returns for the packet.
+ */
+struct n2n_trans_buf
+{
+    uint8_t            *buf;
+    size_t              len;
+    size_t              tailroom;       /* fwd_batch only */
+    uint8_t            *out;            /* rev_batch only */
+    int                 ret;
+};
+
+typedef struct n2n_trans_buf n2n_trans_buf_t;
+
+/** Encode or decode count independent packets where they lie, each as
+ *  fwd_inplace or rev_inplace would, so that the work on several packets may
+ *  be interleaved.
+ *
+ *  @return number of packets with ret > 0
+ */
+typedef size_t          (*n2n_transform_batch_f)(n2n_trans_op_t *arg,
+                                                 n2n_trans_buf_t *bufs,
+                                                 size_t count);
+
 /** Holds the info associated with a data transform plugin.
  *
  *  When a packet arrives the transform ID is extracted. This defines the code
@@ -61,8 +119,19 @@ struct n2n_trans_op
     n2n_transtick_f     tick;       /* periodic maintenance */
     n2n_transform_f     fwd;        /* encode a payload */
     n2n_transform_f     rev;        /* decode a payload */
+
+    size_t              headroom;   /* bytes fwd_inplace writes in front of the payload */
+    n2n_transform_inplace_f fwd_inplace; /* encode a payload without copying it. May be NULL. */
+    n2n_transform_rev_inplace_f rev_inplace; /* decode a payload without copying it. May be NULL. */
+    n2n_transform_batch_f fwd_batch; /* encode several payloads in place. May be NULL. */
+    n2n_transform_batch_f rev_batch; /* decode several payloads in place. May be NULL. */
 };
 
+/* Encode or decode a batch with fwd_batch or rev_batch, or one packet at a
+ * time where the transop has none. */
+size_t transop_fwd_batch(n2n_trans_op_t *op, n2n_trans_buf_t *bufs, size_t count);
+size_t transop_rev_batch(n2n_trans_op_t *op, n2n_trans_buf_t *bufs, size_t count);
+
 /* Setup a single twofish SA for single-key operation. */
 int transop_twofish_setup(n2n_trans_op_t *ttt,
                           n2n_sa_t sa_num,
@@ -72,6 +141,8 @@ int transop_twofish_setup(n2n_trans_op_t *ttt,
 /* Initialise an empty transop ready to receive cipherspec elements. */
 int  transop_twofish_init(n2n_trans_op_t *ttt);
 int  transop_aes_init(n2n_trans_op_t *ttt);
+int  transop_aesgcm_init(n2n_trans_op_t *ttt);
+int  transop_chacha20_init(n2n_trans_op_t *ttt);
 void transop_null_init(n2n_trans_op_t *ttt);
 
 #endif /* #if !defined(N2N_TRANSFORMS_H_) */
@@ -0,0 +1,642 @@
+/*
+ * n2n_vnet.c
+ *
+ * TAP offloads through the virtio-net header. See n2n_vnet.h.
+ */
+
+#include "n2n.h"
+#include "n2n_vnet.h"
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+
+#include <sys/uio.h>
+
+#define N2N_VNET_HDR_SIZE       sizeof(struct n2n_vnet_hdr)
+
+#define N2N_ETH_P_IPV4          0x0800
+#define N2N_ETH_P_IPV6          0x86DD
+#define N2N_ETH_P_VLAN          0x8100
+
+#define N2N_TCP_FIN             0x01
+#define N2N_TCP_PSH             0x08
+#define N2N_TCP_ACK             0x10
+#define N2N_TCP_CWR             0x80
+
+/** A TCP segment which vnet_write() may coalesce. */
+struct n2n_vnet_seg
+{
+    size_t              l3off;
+    size_t              l4off;
+    size_t              hlen;           /* Ethernet, IP and TCP headers. */
+    size_t              payload;
+    uint32_t            seq;
+    uint8_t             flags;
+    int                 v6;
+};
+
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static void put16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t) (val >> 8);
+    p[1] = (uint8_t) val;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t val)
+{
+    p[0] = (uint8_t) (val >> 24);
+    p[1] = (uint8_t) (val >> 16);
+    p[2] = (uint8_t) (val >> 8);
+    p[3] = (uint8_t) val;
+}
+
+/** Add the 16 bit words of p to the one's complement sum. Words are taken in
+ *  host byte order, 32 bits at a time, and only folded by csum_fold(); the
+ *  result stored back in host byte order is the right one either way. */
+static uint64_t csum_add(uint64_t sum, const uint8_t *p, size_t len)
+{
+    uint32_t w32;
+    uint16_t w16;
+
+    for (; len >= 4; p += 4, len -= 4)
+    {
+        memcpy(&w32, p, sizeof(w32));
+        sum += w32;
+    }
+
+    if (len >= 2)
+    {
+        memcpy(&w16, p, sizeof(w16));
+        sum += w16;
+        p += 2;
+        len -= 2;
+    }
+
+    if (len > 0)
+    {
+        w16 = 0;
+        memcpy(&w16, p, 1); /* padded with a zero byte */
+        sum += w16;
+    }
+
+    return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum)
+{
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (uint16_t) sum;
+}
+
+/** Add the TCP pseudo header of the IP header at l3 to sum. */
+static uint64_t csum_pseudo(uint64_t sum, const uint8_t *l3, int v6, size_t l4len)
+{
+    sum = v6 ? csum_add(sum, l3 + 8, 32) : csum_add(sum, l3 + 12, 8);
+    sum += htons(IPPROTO_TCP);
+    sum += htons((uint16_t) l4len);
+
+    return sum;
+}
+
+/** Offset of the IP header of an ethernet frame, or 0 if it carries neither
+ *  IPv4 nor IPv6. One VLAN tag is skipped. */
+static size_t l3_offset(const uint8_t *frame, size_t len, int *v6)
+{
+    size_t   off = 12;
+    uint16_t type;
+
+    if (len < off + 2 + 4)
+    {
+        return 0;
+    }
+
+    type = get16(frame + off);
+    if (N2N_ETH_P_VLAN == type)
+    {
+        off += 4;
+        type = get16(frame + off);
+    }
+
+    off += 2;
+    *v6 = (N2N_ETH_P_IPV6 == type);
+
+    return ((N2N_ETH_P_IPV4 == type) || (N2N_ETH_P_IPV6 == type)) ? off : 0;
+}
+
+
+/* ********************************** */
+
+n2n_vnet_t *vnet_new(int fd)
+{
+    n2n_vnet_t *v = (n2n_vnet_t *) calloc(1, sizeof(n2n_vnet_t));
+
+    if (NULL == v)
+    {
+        traceError("vnet_new: unable to allocate");
+        return NULL;
+    }
+
+    v->fd   = fd;
+    v->rbuf = (uint8_t *) malloc(N2N_VNET_FRAME_MAX);
+    v->wbuf = (uint8_t *) malloc(N2N_VNET_HDR_SIZE + N2N_VNET_FRAME_MAX);
+
+    if ((NULL == v->rbuf) || (NULL == v->wbuf))
+    {
+        traceError("vnet_new: unable to allocate frame buffers");
+        vnet_free(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+/** Ask the kernel to pass large TCP frames, with checksums left partial, to
+ *  the TAP device fd, which was set up with IFF_VNET_HDR, and allocate the
+ *  state for exchanging frames on it. Without TUNSETOFFLOAD the frames just
+ *  stay small.
+ *
+ *  @return NULL on error
+ */
+n2n_vnet_t *vnet_open(int fd)
+{
+    if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) < 0)
+    {
+        traceWarning("ioctl(TUNSETOFFLOAD) [%s][%d]; TAP frames stay small", strerror(errno), errno);
+    }
+
+    return vnet_new(fd);
+}
+
+void vnet_free(n2n_vnet_t *v)
+{
+    if (NULL != v)
+    {
+        free(v->rbuf);
+        free(v->wbuf);
+        free(v);
+    }
+}
+
+
+/* ********************************** */
+
+/** Complete the checksum the kernel left partial in a frame which needs no
+ *  segmentation: csum_start onwards is summed, the field holding the sum of
+ *  the pseudo header. */
+static int complete_csum(uint8_t *frame, size_t len, const struct n2n_vnet_hdr *hdr)
+{
+    size_t   start = hdr->csum_start;
+    size_t   off = start + hdr->csum_offset;
+    uint16_t c;
+
+    if (off + 2 > len)
+    {
+        return -1;
+    }
+
+    c = (uint16_t) ~csum_fold(csum_add(0, frame + start, len - start));
+    if ((0 == c) && (6 == hdr->csum_offset))
+    {
+        c = 0xFFFF; /* UDP: zero means no checksum */
+    }
+
+    memcpy(frame + off, &c, sizeof(c));
+
+    return 0;
+}
+
+/** Check the large TCP frame in rbuf and get ready to cut it into segments.
+ *  The header lengths are taken from the frame, not from hdr_len. */
+static int start_segments(n2n_vnet_t *v, size_t len, const struct n2n_vnet_hdr *hdr)
+{
+    const uint8_t *frame = v->rbuf;
+    const uint8_t *ip;
+    size_t l3off;
+    size_t l4off = hdr->csum_start;
+    size_t thlen;
+    int    v6;
+
+    l3off = l3_offset(frame, len, &v6);
+    if ((0 == l3off) || (v6 != ((hdr->gso_type & ~N2N_VNET_GSO_ECN) == N2N_VNET_GSO_TCPV6)) ||
+        (l3off + 40 > len))
+    {
+        return -1;
+    }
+
+    ip = frame + l3off;
+    if (v6 ? ((6 != (ip[0] >> 4)) || (IPPROTO_TCP != ip[6]) || (l4off != l3off + 40))
+           : ((4 != (ip[0] >> 4)) || (IPPROTO_TCP != ip[9]) || (l4off != l3off + 4 * (ip[0] & 0x0F))))
+    {
+        return -1;
+    }
+
+    if (l4off + 20 > len)
+    {
+        return -1;
+    }
+
+    thlen = 4 * (frame[l4off + 12] >> 4);
+    if ((thlen < 20) || (l4off + thlen >= len) || (0 == hdr->gso_size))
+    {
+        return -1;
+    }
+
+    v->rlen    = len;
+    v->r_l3off = l3off;
+    v->r_l4off = l4off;
+    v->r_hlen  = l4off + thlen;
+    v->r_seg   = hdr->gso_size;
+    v->r_off   = v->r_hlen;
+    v->r_idx   = 0;
+    v->r_v6    = v6;
+
+    return 0;
+}
+
+/** Cut the next segment from the frame in rbuf into buf, with the headers
+ *  of the frame adjusted for it and its checksums complete. */
+static ssize_t next_segment(n2n_vnet_t *v, uint8_t *buf, size_t len)
+{
+    size_t   chunk = MIN(v->r_seg, v->rlen - v->r_off);
+    size_t   out = v->r_hlen + chunk;
+    int      last = (v->r_off + chunk == v->rlen);
+    uint8_t *ip = buf + v->r_l3off;
+    uint8_t *tcp = buf + v->r_l4off;
+    uint16_t c;
+
+    if (out > len)
+    {
+        traceWarning("vnet: segment of %u bytes too large", (unsigned int) out);
+        v->r_off = v->rlen;
+        ++(v->rx_dropped);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memcpy(buf, v->rbuf, v->r_hlen);
+    memcpy(buf + v->r_hlen, v->rbuf + v->r_off, chunk);
+
+    if (v->r_v6)
+    {
+        put16(ip + 4, (uint16_t) (out - v->r_l4off));
+    }
+    else
+    {
+        put16(ip + 2, (uint16_t) (out - v->r_l3off));
+        put16(ip + 4, (uint16_t) (get16(ip + 4) + v->r_idx));
+        ip[10] = ip[11] = 0;
+        c = (uint16_t) ~csum_fold(csum_add(0, ip, v->r_l4off - v->r_l3off));
+        memcpy(ip + 10, &c, sizeof(c));
+    }
+
+    put32(tcp + 4, get32(tcp + 4) + (uint32_t) (v->r_off - v->r_hlen));
+
+    if (!last)
+    {
+        tcp[13] &= ~(N2N_TCP_FIN | N2N_TCP_PSH);
+    }
+    if (v->r_idx > 0)
+    {
+        tcp[13] &= ~N2N_TCP_CWR;
+    }
+
+    tcp[16] = tcp[17] = 0;
+    c = (uint16_t) ~csum_fold(csum_add(csum_pseudo(0, ip, v->r_v6, out - v->r_l4off),
+                                       tcp, out - v->r_l4off));
+    memcpy(tcp + 16, &c, sizeof(c));
+
+    v->r_off += chunk;
+    ++(v->r_idx);
+    ++(v->rx_segments);
+
+    return out;
+}
+
+/** Read a frame of at most len bytes from the device into buf, as read()
+ *  would. A large frame is returned one segment per call; vnet_pending() is
+ *  non-zero until the last one has been returned.
+ *
+ *  @return length of the frame, or -1 with errno set. A frame which cannot
+ *  be handled is dropped with errno EAGAIN.
+ */
+ssize_t vnet_read(n2n_vnet_t *v, uint8_t *buf, size_t len)
+{
+    struct n2n_vnet_hdr hdr;
+    struct iovec iov[3];
+    ssize_t rc;
+    size_t  flen;
+
+    if (vnet_pending(v))
+    {
+        return next_segment(v, buf, len);
+    }
+
+    len = MIN(len, N2N_VNET_FRAME_MAX);
+
+    /* Most frames fit buf; the rest of a large one goes behind its head in rbuf. */
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = N2N_VNET_HDR_SIZE;
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = len;
+    iov[2].iov_base = v->rbuf + len;
+    iov[2].iov_len  = N2N_VNET_FRAME_MAX - len;
+
+    rc = readv(v->fd, iov, 3);
+    if (rc < 0)
+    {
+        return rc;
+    }
+
+    ++(v->rx_frames);
+
+    if (rc < (ssize_t) N2N_VNET_HDR_SIZE)
+    {
+        ++(v->rx_dropped);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    flen = rc - N2N_VNET_HDR_SIZE;
+
+    if (N2N_VNET_GSO_NONE == hdr.gso_type)
+    {
+        if ((flen > len) ||
+            ((hdr.flags & N2N_VNET_F_NEEDS_CSUM) && (0 != complete_csum(buf, flen, &hdr))))
+        {
+            ++(v->rx_dropped);
+            errno = EAGAIN;
+            return -1;
+        }
+
+        return flen;
+    }
+
+    memcpy(v->rbuf, buf, MIN(len, flen));
+
+    switch (hdr.gso_type & ~N2N_VNET_GSO_ECN)
+    {
+    case N2N_VNET_GSO_TCPV4:
+    case N2N_VNET_GSO_TCPV6:
+        if (0 == start_segments(v, flen, &hdr))
+        {
+            ++(v->rx_large);
+            return next_segment(v, buf, len);
+        }
+        break;
+
+    default:
+        break; /* not offered to the kernel */
+    }
+
+    traceDebug("vnet: dropped frame of %u bytes, gso_type %u",
+               (unsigned int) flen, (unsigned int) hdr.gso_type);
+    ++(v->rx_dropped);
+    errno = EAGAIN;
+    return -1;
+}
+
+
+/* ********************************** */
+
+/** Check whether frame is a TCP segment with data that vnet_write() may hold
+ *  back: plain IPv4 or IPv6 with correct checksums, only ACK (and PSH) set.
+ *  Its checksums must be right since the kernel trusts those of a coalesced
+ *  frame. */
+static int parse_seg(const uint8_t *frame, size_t len, struct n2n_vnet_seg *s)
+{
+    const uint8_t *ip;
+    const uint8_t *tcp;
+    size_t thlen;
+
+    s->l3off = l3_offset(frame, len, &s->v6);
+    if ((0 == s->l3off) || (s->l3off + 40 + 20 > len))
+    {
+        return -1;
+    }
+
+    ip = frame + s->l3off;
+
+    if (s->v6)
+    {
+        if ((6 != (ip[0] >> 4)) || (IPPROTO_TCP != ip[6]) || (get16(ip + 4) != len - s->l3off - 40))
+        {
+            return -1;
+        }
+
+        s->l4off = s->l3off + 40;
+    }
+    else
+    {
+        if ((0x45 != ip[0]) || (IPPROTO_TCP != ip[9]) || (0 != (get16(ip + 6) & 0x3FFF)) ||
+            (get16(ip + 2) != len - s->l3off) || (0xFFFF != csum_fold(csum_add(0, ip, 20))))
+        {
+            return -1;
+        }
+
+        s->l4off = s->l3off + 20;
+    }
+
+    tcp   = frame + s->l4off;
+    thlen = 4 * (tcp[12] >> 4);
+    s->flags = tcp[13];
+
+    if ((thlen < 20) || (s->l4off + thlen >= len) || (N2N_TCP_ACK != (s->flags & ~N2N_TCP_PSH)))
+    {
+        return -1;
+    }
+
+    if (0xFFFF != csum_fold(csum_add(csum_pseudo(0, ip, s->v6, len - s->l4off), tcp, len - s->l4off)))
+    {
+        return -1;
+    }
+
+    s->hlen    = s->l4off + thlen;
+    s->payload = len - s->hlen;
+    s->seq     = get32(tcp + 4);
+
+    return 0;
+}
+
+/** Check whether segment s continues the aggregate held in wbuf. */
+static int seg_follows(const n2n_vnet_t *v, const uint8_t *frame, const struct n2n_vnet_seg *s)
+{
+    const uint8_t *agg = v->wbuf + N2N_VNET_HDR_SIZE;
+    const uint8_t *ip = frame + s->l3off;
+    const uint8_t *aip = agg + s->l3off;
+    const uint8_t *tcp = frame + s->l4off;
+    const uint8_t *atcp = agg + s->l4off;
+    size_t iplen = v->wlen - s->l3off + s->payload;
+
+    if (v->w_closed || (s->v6 != v->w_v6) || (s->l3off != v->w_l3off) || (s->hlen != v->w_hlen) ||
+        (s->seq != v->w_next_seq) || (s->payload > v->w_seg) ||
+        (v->wlen + s->payload > N2N_VNET_FRAME_MAX) || (iplen - (s->v6 ? 40 : 0) > 0xFFFF))
+    {
+        return 0;
+    }
+
+    if (0 != memcmp(frame, agg, s->l3off))
+    {
+        return 0;
+    }
+
+    if (s->v6)
+    {
+        if ((0 != memcmp(ip, aip, 4)) || (0 != memcmp(ip + 6, aip + 6, 34)))
+        {
+            return 0;
+        }
+    }
+    else if ((0 != memcmp(ip, aip, 2)) || ((ip[6] & 0x40) != (aip[6] & 0x40)) ||
+             (0 != memcmp(ip + 8, aip + 8, 2)) || (0 != memcmp(ip + 12, aip + 12, 8)))
+    {
+        return 0;
+    }
+
+    /* Ports, ack, header length, window, urgent pointer and options. */
+    return ((0 == memcmp(tcp, atcp, 4)) && (0 == memcmp(tcp + 8, atcp + 8, 5)) &&
+            (0 == memcmp(tcp + 14, atcp + 14, 2)) && (0 == memcmp(tcp + 18, atcp + 18, s->hlen - s->l4off - 18)));
+}
+
+static ssize_t write_plain(n2n_vnet_t *v, const uint8_t *buf, size_t len)
+{
+    struct n2n_vnet_hdr hdr;
+    struct iovec iov[2];
+    ssize_t rc;
+
+    memset(&hdr, 0, sizeof(hdr));
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = N2N_VNET_HDR_SIZE;
+    iov[1].iov_base = (void *) buf;
+    iov[1].iov_len  = len;
+
+    rc = writev(v->fd, iov, 2);
+
+    return (rc < (ssize_t) N2N_VNET_HDR_SIZE) ? MIN(rc, 0) : rc - (ssize_t) N2N_VNET_HDR_SIZE;
+}
+
+/** Write a frame to the device, as write() would. A TCP segment may be held
+ *  back to go out with the next ones of its stream; vnet_flush() writes what
+ *  is held.
+ *
+ *  @return len, or -1 with errno set
+ */
+ssize_t vnet_write(n2n_vnet_t *v, const uint8_t *buf, size_t len)
+{
+    struct n2n_vnet_seg s;
+
+    ++(v->tx_frames);
+
+    if (0 != parse_seg(buf, len, &s))
+    {
+        vnet_flush(v);
+        return write_plain(v, buf, len);
+    }
+
+    if ((v->wlen > 0) && seg_follows(v, buf, &s))
+    {
+        uint8_t *agg = v->wbuf + N2N_VNET_HDR_SIZE;
+
+        memcpy(agg + v->wlen, buf + s.hlen, s.payload);
+        agg[v->w_l4off + 13] |= (s.flags & N2N_TCP_PSH);
+        v->wlen += s.payload;
+        v->w_next_seq += s.payload;
+        ++(v->w_count);
+        v->w_closed = ((s.payload < v->w_seg) || (s.flags & N2N_TCP_PSH));
+
+        return len;
+    }
+
+    vnet_flush(v);
+
+    if (s.flags & N2N_TCP_PSH)
+    {
+        return write_plain(v, buf, len);
+    }
+
+    memcpy(v->wbuf + N2N_VNET_HDR_SIZE, buf, len);
+    v->wlen       = len;
+    v->w_count    = 1;
+    v->w_l3off    = s.l3off;
+    v->w_l4off    = s.l4off;
+    v->w_hlen     = s.hlen;
+    v->w_seg      = s.payload;
+    v->w_next_seq = s.seq + (uint32_t) s.payload;
+    v->w_v6       = s.v6;
+    v->w_closed   = 0;
+
+    return len;
+}
+
+/** Write the segments held back by vnet_write(), as one frame for the
+ *  kernel to segment if there are several. */
+void vnet_flush(n2n_vnet_t *v)
+{
+    struct n2n_vnet_hdr hdr;
+    uint8_t *agg = v->wbuf + N2N_VNET_HDR_SIZE;
+
+    if (0 == v->wlen)
+    {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    if (v->w_count > 1)
+    {
+        uint8_t *ip = agg + v->w_l3off;
+        uint8_t *tcp = agg + v->w_l4off;
+        uint16_t c;
+
+        if (v->w_v6)
+        {
+            put16(ip + 4, (uint16_t) (v->wlen - v->w_l4off));
+            hdr.gso_type = N2N_VNET_GSO_TCPV6;
+        }
+        else
+        {
+            put16(ip + 2, (uint16_t) (v->wlen - v->w_l3off));
+            ip[10] = ip[11] = 0;
+            c = (uint16_t) ~csum_fold(csum_add(0, ip, 20));
+            memcpy(ip + 10, &c, sizeof(c));
+            hdr.gso_type = N2N_VNET_GSO_TCPV4;
+        }
+
+        /* Partial checksum: the pseudo header only, not inverted. */
+        c = csum_fold(csum_pseudo(0, ip, v->w_v6, v->wlen - v->w_l4off));
+        memcpy(tcp + 16, &c, sizeof(c));
+
+        hdr.flags       = N2N_VNET_F_NEEDS_CSUM;
+        hdr.hdr_len     = (uint16_t) v->w_hlen;
+        hdr.gso_size    = (uint16_t) v->w_seg;
+        hdr.csum_start  = (uint16_t) v->w_l4off;
+        hdr.csum_offset = 16;
+
+        v->tx_coalesced += v->w_count;
+        ++(v->tx_large);
+    }
+
+    memcpy(v->wbuf, &hdr, N2N_VNET_HDR_SIZE);
+
+    if (write(v->fd, v->wbuf, N2N_VNET_HDR_SIZE + v->wlen) < 0)
+    {
+        traceInfo("vnet: write of %u bytes failed [%s]", (unsigned int) v->wlen, strerror(errno));
+    }
+
+    v->wlen    = 0;
+    v->w_count = 0;
+}
+
+#endif /* #ifdef N2N_HAVE_TAP_OFFLOAD */
@@ -0,0 +1,104 @@
+/*
+ * n2n_vnet.h
+ *
+ * TAP offloads through the virtio-net header (IFF_VNET_HDR).
+ *
+ * With offloads enabled on the TAP device (TUNSETOFFLOAD) the kernel hands
+ * the edge TCP frames of up to 64 KiB with their checksum left to fill in,
+ * preceded by a small header describing how to cut them up. Since a PACKET
+ * carries one MTU sized frame, vnet_read() segments such a frame in userspace
+ * and returns the segments one at a time, each ready to be encrypted, with
+ * its checksums complete. Handing a large frame to the kernel costs one
+ * system call instead of one per segment.
+ *
+ * The other way, vnet_write() holds back consecutive segments of one TCP
+ * stream and vnet_flush() writes them to the kernel as one frame with a
+ * header asking for segmentation, much like GRO on a network card. The owner
+ * calls vnet_flush() once per main loop iteration; a frame that cannot be
+ * coalesced flushes what is held and is written at once.
+ *
+ * The read and write sides touch disjoint state, so one thread may read
+ * while another writes.
+ */
+
+#ifndef N2N_VNET_H_
+#define N2N_VNET_H_
+
+#include "n2n.h"
+
+#define N2N_VNET_FRAME_MAX      (65536 + 64)    /* Largest frame exchanged with the kernel. */
+
+/* Values of n2n_vnet_hdr, as in linux/virtio_net.h */
+#define N2N_VNET_F_NEEDS_CSUM   1
+#define N2N_VNET_GSO_NONE       0
+#define N2N_VNET_GSO_TCPV4      1
+#define N2N_VNET_GSO_TCPV6      4
+#define N2N_VNET_GSO_ECN        0x80
+
+/** struct virtio_net_hdr, in host byte order. */
+struct n2n_vnet_hdr
+{
+    uint8_t             flags;
+    uint8_t             gso_type;
+    uint16_t            hdr_len;        /* Ethernet, IP and TCP headers. */
+    uint16_t            gso_size;       /* Payload bytes per segment. */
+    uint16_t            csum_start;     /* Checksum computed from here to the end... */
+    uint16_t            csum_offset;    /* ...and stored this far after csum_start. */
+};
+
+struct n2n_vnet
+{
+    int                 fd;
+
+    /* Read side: a frame from the kernel and how far it has been segmented. */
+    uint8_t            *rbuf;           /* Frame being segmented. */
+    size_t              rlen;           /* Length of the frame. */
+    size_t              r_hlen;         /* Headers repeated in every segment. */
+    size_t              r_l3off;
+    size_t              r_l4off;
+    size_t              r_seg;          /* Payload bytes per segment. */
+    size_t              r_off;          /* Payload offset of the next segment; rlen when done. */
+    uint16_t            r_idx;          /* Number of the next segment. */
+    int                 r_v6;
+
+    /* Write side: segments of one TCP stream held back to be coalesced. */
+    uint8_t            *wbuf;           /* Header and aggregate frame. */
+    size_t              wlen;           /* Length of the aggregate; 0 if none is held. */
+    size_t              w_count;        /* Frames in the aggregate. */
+    size_t              w_l3off;
+    size_t              w_l4off;
+    size_t              w_hlen;
+    size_t              w_seg;          /* Payload bytes of the first segment. */
+    uint32_t            w_next_seq;     /* Sequence number the next segment must have. */
+    int                 w_v6;
+    int                 w_closed;       /* Short or PSH segment seen; nothing may follow. */
+
+    /* Statistics */
+    size_t              rx_frames;      /* Frames read from the kernel. */
+    size_t              rx_large;       /* Of which had to be segmented. */
+    size_t              rx_segments;    /* Segments cut from those. */
+    size_t              rx_dropped;     /* Frames which could not be handled. */
+    size_t              tx_frames;      /* Frames passed to vnet_write(). */
+    size_t              tx_coalesced;   /* Of which were written as part of a larger frame. */
+    size_t              tx_large;       /* Large frames written. */
+};
+
+typedef struct n2n_vnet n2n_vnet_t;
+
+
+n2n_vnet_t *vnet_new(int fd);
+n2n_vnet_t *vnet_open(int fd);
+void    vnet_free(n2n_vnet_t *v);
+ssize_t vnet_read(n2n_vnet_t *v, uint8_t *buf, size_t len);
+ssize_t vnet_write(n2n_vnet_t *v, const uint8_t *buf, size_t len);
+void    vnet_flush(n2n_vnet_t *v);
+
+/** Non-zero while segments of the last frame read remain to be returned by
+ *  vnet_read() without reading the device. */
+static inline int vnet_pending(const n2n_vnet_t *v)
+{
+    return (v->r_off < v->rlen);
+}
+
+
+#endif /* N2N_VNET_H_ */
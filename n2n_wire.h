@@ -31,9 +31,12 @@
 #define N2N_PKT_VERSION                 2
 #define N2N_DEFAULT_TTL                 2       /* can be forwarded twice at most */
 #define N2N_COMMUNITY_SIZE              16
+#define N2N_COMMUNITY_OFFSET            4       /* of the community in the common header */
 #define N2N_MAC_SIZE                    ETH_ADDR_LEN
 #define N2N_COOKIE_SIZE                 4
 #define N2N_PKT_BUF_SIZE                2048
+#define N2N_PKT_HEADROOM                64      /* Reserved in front of a payload for the PACKET header and transform prefix. */
+#define N2N_PKT_TAILROOM                32      /* Reserved behind a payload for cipher padding. */
 #define N2N_SOCKBUF_SIZE                64      /* string representation of INET or INET6 sockets */
 
 typedef uint8_t n2n_community_t[N2N_COMMUNITY_SIZE];
@@ -59,6 +62,14 @@ typedef enum n2n_pc n2n_pc_t;
 #define N2N_FLAGS_SOCKET                0x0040
 #define N2N_FLAGS_FROM_SUPERNODE        0x0020
 
+/* Bits of the options octet which follows REGISTER, REGISTER_ACK and PACKET
+ * when N2N_FLAGS_OPTIONS is set. In a REGISTER they are what the sender
+ * accepts, in a REGISTER_ACK what both ends accept and in a PACKET how the
+ * payload is encoded. */
+#define N2N_OPTION_HDR_COMPRESS         0x01    /* Inner headers compressed, see n2n_hc.h */
+#define N2N_OPTION_BUNDLE               0x02    /* Several frames in one PACKET, see n2n_bundle.h */
+#define N2N_OPTION_AESGCM               0x04    /* Holds AES-GCM keys. Not used in PACKET. */
+
 /* The bits in flag that are the packet type */
 #define N2N_FLAGS_TYPE_MASK             0x001f  /* 0 - 31 */
 #define N2N_FLAGS_BITS_MASK             0xffe0
@@ -109,6 +120,7 @@ struct n2n_REGISTER
     n2n_mac_t           srcMac;         /* MAC of registering party */
     n2n_mac_t           dstMac;         /* MAC of target edge */
     n2n_sock_t          sock;           /* REVISIT: unused? */
+    uint8_t             options;        /* N2N_OPTION_*, with N2N_FLAGS_OPTIONS */
 };
 
 typedef struct n2n_REGISTER n2n_REGISTER_t;
@@ -119,6 +131,7 @@ struct n2n_REGISTER_ACK
     n2n_mac_t           srcMac;         /* MAC of acknowledging party (supernode or edge) */
     n2n_mac_t           dstMac;         /* Reflected MAC of registering edge from REGISTER */
     n2n_sock_t          sock;           /* Supernode's view of edge socket (IP Addr, port) */
+    uint8_t             options;        /* N2N_OPTION_*, with N2N_FLAGS_OPTIONS */
 };
 
 typedef struct n2n_REGISTER_ACK n2n_REGISTER_ACK_t;
@@ -129,6 +142,7 @@ struct n2n_PACKET
     n2n_mac_t           dstMac;
     n2n_sock_t          sock;
     n2n_transform_t     transform;
+    uint8_t             options;        /* N2N_OPTION_*, with N2N_FLAGS_OPTIONS */
 };
 
 typedef struct n2n_PACKET n2n_PACKET_t;
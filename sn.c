@@ -7,8 +7,15 @@
  *    Struan Bartlett
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
 
 #include "n2n.h"
+#include "n2n_batch.h"
+#include "n2n_evloop.h"
+#include "n2n_peer_table.h"
+#include "n2n_community.h"
 
 #ifdef N2N_MULTIPLE_SUPERNODES
 #include "sn_multiple.h"
@@ -16,9 +23,36 @@
 
 #define N2N_SN_LPORT_DEFAULT 7654
 #define N2N_SN_PKTBUF_SIZE   2048
+#define N2N_SN_BATCH_DFL     32
+#define N2N_SN_EDGES_DFL     16384
+#define N2N_SN_PURGE_INTERVAL 10 /* sec */
 
 #define N2N_SN_MGMT_PORT                5645
 
+#if !defined(WIN32) && defined(SO_REUSEPORT)
+#define N2N_SN_HAVE_WORKERS 1 /* worker threads with a SO_REUSEPORT socket each */
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF) && !defined(N2N_MULTIPLE_SUPERNODES)
+#define N2N_SN_HAVE_SHARDS 1 /* processes owning the communities the kernel steers to them */
+#include <linux/filter.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#endif
+
+#define N2N_SN_WORKERS_MAX   16 /* also the max number of shards */
+#define N2N_SN_SHARD_COMMS   3  /* community names each shard shows on the management port */
+
+#ifdef N2N_SN_HAVE_WORKERS
+#define SN_LOCK(sss)    pthread_mutex_lock(&((sss)->lock))
+#define SN_UNLOCK(sss)  pthread_mutex_unlock(&((sss)->lock))
+#else
+#define SN_LOCK(sss)
+#define SN_UNLOCK(sss)
+#endif
+
 
 struct sn_stats
 {
@@ -27,20 +61,76 @@ struct sn_stats
     size_t reg_super_nak;       /* Number of REGISTER_SUPER requests declined. */
     size_t fwd;                 /* Number of messages forwarded. */
     size_t broadcast;           /* Number of messages broadcast to a community. */
+    size_t fwd_foreign;         /* Number of messages dropped for a destination outside the community. */
     time_t last_fwd;            /* Time when last message was forwarded. */
     time_t last_reg_super;      /* Time when last REGISTER_SUPER was received. */
+    size_t rx_burst_max;        /* Most datagrams received by one system call. */
+    size_t tx_burst_max;        /* Most datagrams queued while processing one receive burst. */
 };
 
 typedef struct sn_stats sn_stats_t;
 
+struct n2n_sn;
+
+/** Forwards the datagrams received on its own socket. Worker 0 runs in the
+ *  main thread on the main socket; the others have a thread and a socket
+ *  bound to the same port (SO_REUSEPORT) each. */
+struct sn_worker
+{
+    struct n2n_sn      *sss;
+    size_t              id;
+    int                 sock;
+    int                 cpu;            /* CPU to pin the thread to; -1 for none. */
+    n2n_rx_batch_t      rx_batch;
+    n2n_tx_batch_t      tx_batch;       /* Forwarded and broadcast datagrams. */
+    n2n_sock_t         *dests;          /* Broadcast destinations copied out of the edge table. */
+    size_t              max_dests;
+    sn_stats_t          stats;
+    unsigned long       quiescent;      /* Bumped after every round of events. Accessed atomically. */
+#ifdef N2N_SN_HAVE_WORKERS
+    pthread_t           thread;
+#endif
+};
+
+typedef struct sn_worker sn_worker_t;
+
+/** What a shard publishes for the management port of shard 0, once a
+ *  second. Lives in memory shared by all shards and is read without
+ *  synchronisation: it is only for display. */
+struct sn_shard_info
+{
+    pid_t               pid;
+    size_t              rx;             /* Datagrams received. */
+    size_t              fwd;
+    size_t              broadcast;
+    size_t              reg_super;
+    size_t              edges;
+    size_t              num_comms;
+    n2n_community_t     comms[N2N_SN_SHARD_COMMS]; /* The first of its communities. */
+};
+
+/** A member array waiting until no worker can still be reading it. */
+struct sn_retired
+{
+    struct sn_retired  *next;
+    void               *ptr;
+};
+
 struct n2n_sn
 {
     time_t              start_time;     /* Used to measure uptime. */
-    sn_stats_t          stats;
     int                 daemon;         /* If non-zero then daemonise. */
     uint16_t            lport;          /* Local UDP port to bind to. */
     int                 sock;           /* Main socket for UDP traffic with edges. */
     int                 mgmt_sock;      /* management socket. */
+    size_t              batch_size;     /* Datagrams moved per system call on sock. */
+    size_t              num_workers;
+    sn_worker_t         workers[N2N_SN_WORKERS_MAX];
+    int                 workers_running;
+    size_t              num_shards;     /* Processes, each owning the communities hashed to it. */
+    size_t              shard;          /* Index of this process. Shard 0 is the parent. */
+    struct sn_shard_info *shards;       /* num_shards entries shared by all shards. */
+    pid_t               shard_pids[N2N_SN_WORKERS_MAX]; /* Shard 0 only. */
 #ifdef N2N_MULTIPLE_SUPERNODES
     uint8_t             snm_discovery_state;
     int                 sn_port;
@@ -49,26 +139,165 @@ struct n2n_sn
     sn_list_t           supernodes;
     comm_list_t         communities;
 #endif
-    struct n2n_list     edges;          /* Link list of registered edges. */
+    size_t              max_edges;      /* Capacity of edges. */
+    n2n_peer_table_t    edges;          /* Registered edges. */
+    n2n_comm_table_t    edge_comms;     /* Communities of the registered edges. */
+
+    /* See sn_edges_write_begin(). */
+#ifdef N2N_SN_HAVE_WORKERS
+    pthread_mutex_t     lock;           /* Writers of edges and edge_comms; SNM state. */
+#endif
+    uint32_t            edges_seq;      /* Odd while edges or edge_comms change. */
+    struct sn_retired  *retired;        /* Retired since the last grace period started. */
+    struct sn_retired  *retiring;       /* Retired before the current grace period started. */
+    unsigned long       grace[N2N_SN_WORKERS_MAX]; /* quiescent of each worker when it started */
 };
 
 typedef struct n2n_sn n2n_sn_t;
 
 
-static int try_forward(n2n_sn_t *sss,
+static int try_forward(sn_worker_t *w,
                        const n2n_common_t *cmn,
                        const n2n_mac_t dstMac,
-                       const uint8_t *pktbuf,
-                       size_t pktsize);
+                       const uint8_t *hdr,
+                       size_t hdr_len,
+                       const uint8_t *payload,
+                       size_t len);
 
-static int try_broadcast(n2n_sn_t *sss,
+static int try_broadcast(sn_worker_t *w,
                          const n2n_common_t *cmn,
                          const n2n_mac_t srcMac,
-                         const uint8_t *pktbuf,
-                         size_t pktsize);
+                         const uint8_t *hdr,
+                         size_t hdr_len,
+                         const uint8_t *payload,
+                         size_t len);
+
+#ifdef N2N_SN_HAVE_SHARDS
+static uint32_t sn_shard_of(const n2n_community_t community, size_t num_shards);
+static int sn_start_shards(n2n_sn_t *sss);
+static void sn_stop_shards(n2n_sn_t *sss);
+static void sn_shard_timer(n2n_evloop_t *loop, time_t now, void *arg);
+static size_t sn_shards_mgmt(const n2n_sn_t *sss, char *resbuf, size_t ressize);
+#endif
 
 
 
+/* ************************************** */
+/* Edge table access
+ *
+ * The edge table and its communities have one writer at a time, serialised
+ * by sss->lock: REGISTER_SUPER handling in any worker and the purge timer.
+ * Workers forwarding datagrams read them without a lock. A writer keeps
+ * edges_seq odd while it changes the tables; a reader copies what it needs
+ * and starts over if edges_seq changed meanwhile (seqlock).
+ *
+ * The tables never move, apart from community member arrays. Those are
+ * retired rather than freed, and freed by sn_reclaim() once every worker
+ * thread has finished a round of events since (quiescent state based
+ * reclamation). Readers only hold pointers into the tables within one
+ * round of events.
+ */
+
+static void sn_edges_write_begin(n2n_sn_t *sss)
+{
+    SN_LOCK(sss);
+    __atomic_store_n(&(sss->edges_seq), sss->edges_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sn_edges_write_end(n2n_sn_t *sss)
+{
+    __atomic_store_n(&(sss->edges_seq), sss->edges_seq + 1, __ATOMIC_RELEASE);
+    SN_UNLOCK(sss);
+}
+
+/** @return the value to pass to sn_edges_read_retry() */
+static uint32_t sn_edges_read_begin(const n2n_sn_t *sss)
+{
+    uint32_t seq;
+
+    while (0 != ((seq = __atomic_load_n(&(sss->edges_seq), __ATOMIC_ACQUIRE)) & 1))
+    {
+#ifdef N2N_SN_HAVE_WORKERS
+        sched_yield(); /* A writer is busy. */
+#endif
+    }
+
+    return seq;
+}
+
+/** Non-zero if the tables may have changed since sn_edges_read_begin()
+ *  returned seq; anything read from them since must then be dropped. */
+static int sn_edges_read_retry(const n2n_sn_t *sss, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return (__atomic_load_n(&(sss->edges_seq), __ATOMIC_RELAXED) != seq);
+}
+
+/** Retire hook of the community table. Called by writers. */
+static void sn_retire(void *ptr, void *arg)
+{
+    n2n_sn_t          *sss = (n2n_sn_t *) arg;
+    struct sn_retired *r = (struct sn_retired *) malloc(sizeof(struct sn_retired));
+
+    if (NULL == r)
+    {
+        /* Leak it rather than free it under a reader. */
+        traceError("sn_retire: out of memory");
+        return;
+    }
+
+    r->ptr  = ptr;
+    r->next = sss->retired;
+    sss->retired = r;
+}
+
+static void free_retired(struct sn_retired *r)
+{
+    while (NULL != r)
+    {
+        struct sn_retired *next = r->next;
+
+        free(r->ptr);
+        free(r);
+        r = next;
+    }
+}
+
+/** Free what was retired before the previous call, provided every worker
+ *  thread has finished a round of events since, and start a new grace
+ *  period for what was retired after. Main thread only: worker 0 is
+ *  between rounds here. */
+static void sn_reclaim(n2n_sn_t *sss)
+{
+    size_t i;
+
+    if (NULL != sss->retiring)
+    {
+        for (i = 1; i < sss->num_workers; ++i)
+        {
+            if (__atomic_load_n(&(sss->workers[i].quiescent), __ATOMIC_ACQUIRE) == sss->grace[i])
+            {
+                return; /* Worker i may still be reading. Try again next time. */
+            }
+        }
+
+        free_retired(sss->retiring);
+    }
+
+    SN_LOCK(sss);
+    sss->retiring = sss->retired;
+    sss->retired = NULL;
+    SN_UNLOCK(sss);
+
+    for (i = 1; i < sss->num_workers; ++i)
+    {
+        sss->grace[i] = __atomic_load_n(&(sss->workers[i].quiescent), __ATOMIC_ACQUIRE);
+    }
+}
+
+
 /** Initialise the supernode structure */
 static int init_sn(n2n_sn_t *sss)
 {
@@ -81,7 +310,26 @@ static int init_sn(n2n_sn_t *sss)
     sss->lport = N2N_SN_LPORT_DEFAULT;
     sss->sock = -1;
     sss->mgmt_sock = -1;
-    list_init(&sss->edges);
+    sss->batch_size = N2N_SN_BATCH_DFL;
+    sss->max_edges = N2N_SN_EDGES_DFL;
+    sss->num_workers = 1;
+    sss->num_shards = 1;
+
+    {
+        size_t i;
+
+        for (i = 0; i < N2N_SN_WORKERS_MAX; ++i)
+        {
+            sss->workers[i].sss  = sss;
+            sss->workers[i].id   = i;
+            sss->workers[i].sock = -1;
+            sss->workers[i].cpu  = -1;
+        }
+    }
+
+#ifdef N2N_SN_HAVE_WORKERS
+    pthread_mutex_init(&(sss->lock), NULL);
+#endif
 
 #ifdef N2N_MULTIPLE_SUPERNODES
     sss->snm_discovery_state = N2N_SNM_STATE_DISCOVERY;
@@ -98,6 +346,8 @@ static int init_sn(n2n_sn_t *sss)
  *  it. */
 static void deinit_sn(n2n_sn_t *sss)
 {
+    size_t i;
+
     if (sss->sock >= 0)
     {
         closesocket(sss->sock);
@@ -110,7 +360,41 @@ static void deinit_sn(n2n_sn_t *sss)
     }
     sss->mgmt_sock = -1;
 
-    purge_peer_list(&(sss->edges), 0xffffffff);
+#ifdef N2N_SN_HAVE_SHARDS
+    if (NULL != sss->shards)
+    {
+        munmap(sss->shards, sss->num_shards * sizeof(struct sn_shard_info));
+        sss->shards = NULL;
+    }
+#endif
+
+    for (i = 0; i < sss->num_workers; ++i)
+    {
+        sn_worker_t *w = &(sss->workers[i]);
+
+        if ((i > 0) && (w->sock >= 0))
+        {
+            closesocket(w->sock);
+        }
+        w->sock = -1;
+
+        rx_batch_deinit(&w->rx_batch);
+        tx_batch_deinit(&w->tx_batch);
+        free(w->dests);
+        w->dests = NULL;
+    }
+
+    peer_table_deinit(&(sss->edges));
+    comm_table_deinit(&(sss->edge_comms));
+
+    free_retired(sss->retiring);
+    free_retired(sss->retired);
+    sss->retiring = NULL;
+    sss->retired = NULL;
+
+#ifdef N2N_SN_HAVE_WORKERS
+    pthread_mutex_destroy(&(sss->lock));
+#endif
 
 #ifdef N2N_MULTIPLE_SUPERNODES
     if (sss->sn_sock)
@@ -135,6 +419,12 @@ static uint16_t reg_lifetime(n2n_sn_t *sss)
 }
 
 
+/** Called by the edge table for every edge it drops. */
+static void edge_removed(n2n_peer_table_t *t, struct peer_info *peer, void *arg)
+{
+    comm_table_leave((n2n_comm_table_t *) arg, peer);
+}
+
 /** Update the edge table with the details of the edge which contacted the
  *  supernode. */
 static int update_edge(n2n_sn_t *sss,
@@ -151,20 +441,32 @@ static int update_edge(n2n_sn_t *sss,
                macaddr_str(mac_buf, edgeMac),
                sock_to_cstr(sockbuf, sender_sock));
 
-    scan = find_peer_by_mac(&sss->edges, edgeMac);
+    scan = peer_table_find(&sss->edges, edgeMac);
 
     if (NULL == scan)
     {
         /* Not known */
 
-        scan = (struct peer_info *) calloc(1, sizeof(struct peer_info)); /* deallocated in purge_expired_registrations */
+        scan = peer_table_add(&sss->edges, edgeMac, now); /* removed by purge_expired_peers */
 
         memcpy(scan->community_name, community, sizeof(n2n_community_t));
-        memcpy(&(scan->mac_addr), edgeMac, sizeof(n2n_mac_t));
         memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
 
-        /* insert this guy at the head of the edges list */
-        list_add(&sss->edges, &scan->list);
+        scan->community_id = N2N_COMMUNITY_NONE;
+        if (0 != comm_table_join(&sss->edge_comms, community, scan))
+        {
+            peer_table_remove(&sss->edges, scan);
+            return -1;
+        }
+
+#ifdef N2N_SN_HAVE_SHARDS
+        if ((sss->num_shards > 1) && (sn_shard_of(community, sss->num_shards) != sss->shard))
+        {
+            traceWarning("community %.*s registered with shard %u but belongs to shard %u",
+                         N2N_COMMUNITY_SIZE, (const char *) community, (unsigned int) sss->shard,
+                         (unsigned int) sn_shard_of(community, sss->num_shards));
+        }
+#endif
 
         traceInfo("update_edge created   %s ==> %s",
                    macaddr_str(mac_buf, edgeMac),
@@ -176,7 +478,18 @@ static int update_edge(n2n_sn_t *sss,
         if ((0 != memcmp(community, scan->community_name, sizeof(n2n_community_t))) ||
             (0 != sock_equal(sender_sock, &(scan->sock))))
         {
-            memcpy(scan->community_name, community, sizeof(n2n_community_t));
+            if (0 != memcmp(community, scan->community_name, sizeof(n2n_community_t)))
+            {
+                comm_table_leave(&sss->edge_comms, scan);
+                memcpy(scan->community_name, community, sizeof(n2n_community_t));
+
+                if (0 != comm_table_join(&sss->edge_comms, community, scan))
+                {
+                    peer_table_remove(&sss->edges, scan);
+                    return -1;
+                }
+            }
+
             memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
 
             traceInfo("update_edge updated   %s ==> %s",
@@ -192,50 +505,83 @@ static int update_edge(n2n_sn_t *sss,
 
     }
 
-    scan->last_seen = now;
+    peer_table_touch(&sss->edges, scan, now);
     return 0;
 }
 
 
 
-/** Try to forward a message to a unicast MAC. If the MAC is unknown then
- *  broadcast to all edges in the destination community.
+/** Try to forward a message to a unicast MAC. The message is dropped if the
+ *  MAC is unknown or belongs to an edge of another community.
+ *
+ *  The message is the hdr_len bytes at hdr followed by the len bytes at
+ *  payload, which is not copied and must stay valid until the transmit batch
+ *  of w has been flushed.
  */
-static int try_forward(n2n_sn_t *sss,
+static int try_forward(sn_worker_t *w,
                        const n2n_common_t *cmn,
                        const n2n_mac_t dstMac,
-                       const uint8_t *pktbuf,
-                       size_t pktsize)
+                       const uint8_t *hdr,
+                       size_t hdr_len,
+                       const uint8_t *payload,
+                       size_t len)
 {
-    struct peer_info   *scan;
+    n2n_sn_t           *sss = w->sss;
+    n2n_sock_t          dest;
+    int                 found;  /* 1: forward to dest, 0: unknown MAC, -1: other community */
+    uint32_t            seq;
     macstr_t            mac_buf;
     n2n_sock_str_t      sockbuf;
 
-    scan = find_peer_by_mac(&sss->edges, dstMac);
-
-    if (NULL != scan)
+    do
     {
-        int data_sent_len;
-        data_sent_len = sendto_sock(sss->sock, pktbuf, pktsize, &scan->sock);
+        const struct peer_info     *scan;
+        const struct n2n_community *comm;
+
+        seq = sn_edges_read_begin(sss);
 
-        if (data_sent_len == pktsize)
+        scan = peer_table_find(&sss->edges, dstMac);
+        comm = comm_table_find(&sss->edge_comms, cmn->community);
+
+        if (NULL == scan)
+        {
+            found = 0;
+        }
+        else if ((NULL == comm) || (scan->community_id != comm_table_id(&sss->edge_comms, comm)))
         {
-            ++(sss->stats.fwd);
+            found = -1;
+        }
+        else
+        {
+            dest = scan->sock;
+            found = 1;
+        }
+    } while (sn_edges_read_retry(sss, seq));
+
+    if (found > 0)
+    {
+        if (0 == tx_batch_splice(&w->tx_batch, hdr, hdr_len, payload, len, &dest))
+        {
+            ++(w->stats.fwd);
             traceDebug("unicast %lu to [%s] %s",
-                       pktsize,
-                       sock_to_cstr(sockbuf, &(scan->sock)),
-                       macaddr_str(mac_buf, scan->mac_addr));
+                       hdr_len + len,
+                       sock_to_cstr(sockbuf, &dest),
+                       macaddr_str(mac_buf, dstMac));
         }
         else
         {
-            ++(sss->stats.errors);
-            traceError("unicast %lu to [%s] %s FAILED (%d: %s)",
-                       pktsize,
-                       sock_to_cstr(sockbuf, &(scan->sock)),
-                       macaddr_str(mac_buf, scan->mac_addr),
-                       errno, strerror(errno));
+            traceError("unicast %lu to [%s] %s FAILED",
+                       hdr_len + len,
+                       sock_to_cstr(sockbuf, &dest),
+                       macaddr_str(mac_buf, dstMac));
         }
     }
+    else if (found < 0)
+    {
+        ++(w->stats.fwd_foreign);
+        traceDebug("try_forward %s not in community %.*s",
+                   macaddr_str(mac_buf, dstMac), N2N_COMMUNITY_SIZE, (const char *) cmn->community);
+    }
     else
     {
         traceDebug("try_forward unknown MAC");
@@ -247,56 +593,141 @@ static int try_forward(n2n_sn_t *sss,
 }
 
 
+/** Make room for num broadcast destinations in w->dests.
+ *
+ *  @return 0 on success, -1 on error
+ */
+static int grow_dests(sn_worker_t *w, size_t num)
+{
+    size_t      max_dests = MAX(w->max_dests, 16);
+    n2n_sock_t *dests;
+
+    while (max_dests < num)
+    {
+        max_dests <<= 1;
+    }
+
+    dests = (n2n_sock_t *) realloc(w->dests, max_dests * sizeof(n2n_sock_t));
+    if (NULL == dests)
+    {
+        traceError("grow_dests: unable to allocate %u destinations", (unsigned int) max_dests);
+        return -1;
+    }
+
+    w->dests = dests;
+    w->max_dests = max_dests;
+
+    return 0;
+}
+
 /** Try and broadcast a message to all edges in the community.
  *
  *  This will send the exact same datagram to zero or more edges registered to
- *  the supernode.
+ *  the supernode. The replicas are queued on the transmit batch and leave
+ *  with the rest of the burst. They all refer to the same payload; see
+ *  try_forward().
  */
-static int try_broadcast(n2n_sn_t *sss,
+static int try_broadcast(sn_worker_t *w,
                          const n2n_common_t *cmn,
                          const n2n_mac_t srcMac,
-                         const uint8_t *pktbuf,
-                         size_t pktsize)
+                         const uint8_t *hdr,
+                         size_t hdr_len,
+                         const uint8_t *payload,
+                         size_t len)
 {
-    struct peer_info   *scan;
-    macstr_t            mac_buf;
+    n2n_sn_t           *sss = w->sss;
+    size_t              num_dests;
+    size_t              i;
+    uint32_t            seq;
     n2n_sock_str_t      sockbuf;
 
     traceDebug("try_broadcast");
 
-    N2N_LIST_FOR_EACH_ENTRY(scan, &sss->edges)
+    /* Copy the destinations out first: replicas cannot be taken back if the
+     * community changes under our feet. */
+    do
     {
-        if ((0 == memcmp(scan->community_name, cmn->community, sizeof(n2n_community_t))) &&
-            (0 != memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t))))
-        /* REVISIT: exclude if the destination socket is where the packet came from. */
+        const struct n2n_community *comm;
+        struct peer_info * const   *members;
+        uint32_t                    num;
+
+        seq = sn_edges_read_begin(sss);
+        num_dests = 0;
+
+        comm = comm_table_find(&sss->edge_comms, cmn->community);
+        if (NULL == comm)
         {
-            int data_sent_len;
-            data_sent_len = sendto_sock(sss->sock, pktbuf, pktsize, &scan->sock);
+            continue;
+        }
 
-            if (data_sent_len != pktsize)
-            {
-                ++(sss->stats.errors);
-                traceWarning("multicast %lu to [%s] %s failed %s",
-                           pktsize,
-                           sock_to_cstr(sockbuf, &(scan->sock)),
-                           macaddr_str(mac_buf, scan->mac_addr),
-                           strerror(errno));
-            }
-            else
+        num = __atomic_load_n(&(comm->num_members), __ATOMIC_ACQUIRE);
+        members = __atomic_load_n(&(comm->members), __ATOMIC_ACQUIRE);
+
+        /* num only bounds members if neither changed in between. */
+        if (sn_edges_read_retry(sss, seq))
+        {
+            continue;
+        }
+
+        if ((num > w->max_dests) && (0 != grow_dests(w, num)))
+        {
+            return -1;
+        }
+
+        for (i = 0; i < num; ++i)
+        {
+            const struct peer_info *scan = members[i];
+
+            if (0 != memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)))
+            /* REVISIT: exclude if the destination socket is where the packet came from. */
             {
-                ++(sss->stats.broadcast);
-                traceDebug("multicast %lu to [%s] %s",
-                           pktsize,
-                           sock_to_cstr(sockbuf, &(scan->sock)),
-                           macaddr_str(mac_buf, scan->mac_addr));
+                w->dests[num_dests++] = scan->sock;
             }
         }
-    } /* loop */
+    } while (sn_edges_read_retry(sss, seq));
+
+    for (i = 0; i < num_dests; ++i)
+    {
+        if (0 != tx_batch_splice(&w->tx_batch, hdr, hdr_len, payload, len, &(w->dests[i])))
+        {
+            traceWarning("multicast %lu to [%s] failed",
+                         hdr_len + len,
+                         sock_to_cstr(sockbuf, &(w->dests[i])));
+        }
+        else
+        {
+            ++(w->stats.broadcast);
+            traceDebug("multicast %lu to [%s]",
+                       hdr_len + len,
+                       sock_to_cstr(sockbuf, &(w->dests[i])));
+        }
+    }
     
     return 0;
 }
 
 
+/** Add the statistics of w to those of tot. */
+static void sn_worker_add_stats(sn_worker_t *tot, const sn_worker_t *w)
+{
+    tot->stats.errors += w->stats.errors;
+    tot->stats.reg_super += w->stats.reg_super;
+    tot->stats.reg_super_nak += w->stats.reg_super_nak;
+    tot->stats.fwd += w->stats.fwd;
+    tot->stats.broadcast += w->stats.broadcast;
+    tot->stats.fwd_foreign += w->stats.fwd_foreign;
+    tot->stats.last_fwd = MAX(tot->stats.last_fwd, w->stats.last_fwd);
+    tot->stats.last_reg_super = MAX(tot->stats.last_reg_super, w->stats.last_reg_super);
+    tot->stats.rx_burst_max = MAX(tot->stats.rx_burst_max, w->stats.rx_burst_max);
+    tot->stats.tx_burst_max = MAX(tot->stats.tx_burst_max, w->stats.tx_burst_max);
+
+    tot->rx_batch.calls += w->rx_batch.calls;
+    tot->rx_batch.datagrams += w->rx_batch.datagrams;
+    tot->tx_batch.flushes += w->tx_batch.flushes;
+    tot->tx_batch.datagrams += w->tx_batch.datagrams;
+    tot->tx_batch.spliced += w->tx_batch.spliced;
+}
+
 static int process_mgmt(n2n_sn_t *sss,
                         const struct sockaddr_in *sender_sock,
                         const uint8_t *mgmt_buf,
@@ -306,54 +737,93 @@ static int process_mgmt(n2n_sn_t *sss,
     char resbuf[N2N_SN_PKTBUF_SIZE];
     size_t ressize = 0;
     ssize_t r;
+    sn_worker_t tot;
+    size_t i;
 
     traceDebug("process_mgmt");
 
+    memset(&tot, 0, sizeof(tot));
+    for (i = 0; i < sss->num_workers; ++i)
+    {
+        sn_worker_add_stats(&tot, &(sss->workers[i]));
+    }
+
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "----------------\n");
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "uptime    %lu\n", (now - sss->start_time));
 
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "workers   %u\n", (unsigned int) sss->num_workers);
+
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "edges     %u\n",
-                        (unsigned int) list_size(&sss->edges));
+                        (unsigned int) peer_table_size(&sss->edges));
+
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "comms     %u\n",
+                        (unsigned int) comm_table_size(&sss->edge_comms));
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "errors    %u\n",
-                        (unsigned int) sss->stats.errors);
+                        (unsigned int) tot.stats.errors);
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "reg_sup   %u\n",
-                        (unsigned int) sss->stats.reg_super);
+                        (unsigned int) tot.stats.reg_super);
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "reg_nak   %u\n",
-                        (unsigned int) sss->stats.reg_super_nak);
+                        (unsigned int) tot.stats.reg_super_nak);
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "fwd       %u\n",
-                        (unsigned int) sss->stats.fwd);
+                        (unsigned int) tot.stats.fwd);
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "broadcast %u\n",
-                        (unsigned int) sss->stats.broadcast);
+                        (unsigned int) tot.stats.broadcast);
+
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "foreign   %u\n",
+                        (unsigned int) tot.stats.fwd_foreign);
+
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "rx_batch  avg %u.%u max %u\n",
+                        batch_fill_x10(tot.rx_batch.datagrams, tot.rx_batch.calls) / 10,
+                        batch_fill_x10(tot.rx_batch.datagrams, tot.rx_batch.calls) % 10,
+                        (unsigned int) tot.stats.rx_burst_max);
+
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "tx_batch  avg %u.%u max %u spliced %lu\n",
+                        batch_fill_x10(tot.tx_batch.datagrams, tot.tx_batch.flushes) / 10,
+                        batch_fill_x10(tot.tx_batch.datagrams, tot.tx_batch.flushes) % 10,
+                        (unsigned int) tot.stats.tx_burst_max,
+                        (long unsigned int) tot.tx_batch.spliced);
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "last fwd  %lu sec ago\n",
-                        (long unsigned int) (now - sss->stats.last_fwd));
+                        (long unsigned int) (now - tot.stats.last_fwd));
 
     ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
                         "last reg  %lu sec ago\n",
-                        (long unsigned int) (now - sss->stats.last_reg_super));
+                        (long unsigned int) (now - tot.stats.last_reg_super));
 
 
+#ifdef N2N_SN_HAVE_SHARDS
+    if (sss->num_shards > 1)
+    {
+        ressize = sn_shards_mgmt(sss, resbuf, ressize);
+    }
+#endif
+
     r = sendto(sss->mgmt_sock, resbuf, ressize, 0/*flags*/,
                (struct sockaddr *) sender_sock, sizeof(struct sockaddr_in));
 
     if (r <= 0)
     {
-        ++(sss->stats.errors);
+        ++(sss->workers[0].stats.errors);
         traceError("process_mgmt : sendto failed. %s", strerror(errno));
     }
 
@@ -714,12 +1184,13 @@ static int process_sn_msg(n2n_sn_t *sss,
 /** Examine a datagram and determine what to do with it.
  *
  */
-static int process_udp(n2n_sn_t *sss,
+static int process_udp(sn_worker_t *w,
                        const struct sockaddr_in *sender_sock,
                        const uint8_t *udp_buf,
                        size_t udp_size,
                        time_t now)
 {
+    n2n_sn_t           *sss = w->sss;
     n2n_common_t        cmn; /* common fields in the packet header */
     size_t              rem;
     size_t              idx;
@@ -764,17 +1235,17 @@ static int process_udp(n2n_sn_t *sss,
     {
         /* PACKET from one edge to another edge via supernode. */
 
-        /* pkt will be modified in place and recoded to an output of potentially
-         * different size due to addition of the socket.*/
+        /* pkt will be modified in place and its header recoded to an output
+         * of potentially different size due to addition of the socket. The
+         * payload is sent from udp_buf behind the new header. */
         n2n_PACKET_t                    pkt; 
         n2n_common_t                    cmn2;
-        uint8_t                         encbuf[N2N_SN_PKTBUF_SIZE];
+        uint8_t                         hdrbuf[N2N_BATCH_HDR_MAX];
         size_t                          encx=0;
         int                             unicast; /* non-zero if unicast */
-        const uint8_t *                 rec_buf; /* either udp_buf or encbuf */
 
 
-        sss->stats.last_fwd = now;
+        w->stats.last_fwd = now;
         decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
 
         unicast = (0 == is_multi_broadcast_mac(pkt.dstMac));
@@ -796,13 +1267,8 @@ static int process_udp(n2n_sn_t *sss,
             pkt.sock.port = ntohs(sender_sock->sin_port);
             memcpy(pkt.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
 
-            rec_buf = encbuf;
-
-            /* Re-encode the header. */
-            encode_PACKET(encbuf, &encx, &cmn2, &pkt);
-
-            /* Copy the original payload unchanged */
-            encode_buf(encbuf, &encx, (udp_buf + idx), (udp_size - idx));
+            /* Re-encode the header. The original payload follows unchanged. */
+            encode_PACKET(hdrbuf, &encx, &cmn2, &pkt);
         }
         else
         {
@@ -811,18 +1277,17 @@ static int process_udp(n2n_sn_t *sss,
 
             traceDebug("Rx PACKET fwd unmodified");
 
-            rec_buf = udp_buf;
-            encx = udp_size;
+            idx = 0;
         }
 
         /* Common section to forward the final product. */
         if (unicast)
         {
-            try_forward(sss, &cmn, pkt.dstMac, rec_buf, encx);
+            try_forward(w, &cmn, pkt.dstMac, hdrbuf, encx, (udp_buf + idx), (udp_size - idx));
         }
         else
         {
-            try_broadcast(sss, &cmn, pkt.srcMac, rec_buf, encx);
+            try_broadcast(w, &cmn, pkt.srcMac, hdrbuf, encx, (udp_buf + idx), (udp_size - idx));
         }
     }/* MSG_TYPE_PACKET */
     else if (msg_type == MSG_TYPE_REGISTER)
@@ -831,12 +1296,11 @@ static int process_udp(n2n_sn_t *sss,
 
         n2n_REGISTER_t                  reg;
         n2n_common_t                    cmn2;
-        uint8_t                         encbuf[N2N_SN_PKTBUF_SIZE];
+        uint8_t                         hdrbuf[N2N_BATCH_HDR_MAX];
         size_t                          encx = 0;
         int                             unicast; /* non-zero if unicast */
-        const uint8_t *                 rec_buf; /* either udp_buf or encbuf */
 
-        sss->stats.last_fwd=now;
+        w->stats.last_fwd=now;
         decode_REGISTER( &reg, &cmn, udp_buf, &rem, &idx );
 
         unicast = (0 == is_multi_broadcast_mac(reg.dstMac));
@@ -859,24 +1323,19 @@ static int process_udp(n2n_sn_t *sss,
                 reg.sock.port = ntohs(sender_sock->sin_port);
                 memcpy(reg.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
 
-                rec_buf = encbuf;
-
-                /* Re-encode the header. */
-                encode_REGISTER(encbuf, &encx, &cmn2, &reg);
-
-                /* Copy the original payload unchanged */
-                encode_buf(encbuf, &encx, (udp_buf + idx), (udp_size - idx));
+                /* Re-encode the header. The original payload follows unchanged. */
+                encode_REGISTER(hdrbuf, &encx, &cmn2, &reg);
             }
             else
             {
                 /* Already from a supernode. Nothing to modify, just pass to
                  * destination. */
 
-                rec_buf = udp_buf;
-                encx = udp_size;
+                idx = 0;
             }
 
-            try_forward(sss, &cmn, reg.dstMac, rec_buf, encx); /* unicast only */
+            /* unicast only */
+            try_forward(w, &cmn, reg.dstMac, hdrbuf, encx, (udp_buf + idx), (udp_size - idx));
         }
         else
         {
@@ -897,8 +1356,8 @@ static int process_udp(n2n_sn_t *sss,
 
         /* Edge requesting registration with us.  */
         
-        sss->stats.last_reg_super = now;
-        ++(sss->stats.reg_super);
+        w->stats.last_reg_super = now;
+        ++(w->stats.reg_super);
         decode_REGISTER_SUPER(&reg, &cmn, udp_buf, &rem, &idx);
 
         init_cmn(&cmn2, n2n_register_super_ack,
@@ -920,6 +1379,7 @@ static int process_udp(n2n_sn_t *sss,
                    macaddr_str(mac_buf, reg.edgeMac),
                    sock_to_cstr(sockbuf, &(ack.sock)));
 
+        sn_edges_write_begin(sss);
         update_edge(sss, reg.edgeMac, cmn.community, &(ack.sock), now);
 
 #ifdef N2N_MULTIPLE_SUPERNODES
@@ -933,10 +1393,11 @@ static int process_udp(n2n_sn_t *sss,
             }
         }
 #endif
+        sn_edges_write_end(sss);
 
         encode_REGISTER_SUPER_ACK(ackbuf, &encx, &cmn2, &ack);
 
-        sendto(sss->sock, ackbuf, encx, 0,
+        sendto(w->sock, ackbuf, encx, 0,
                (struct sockaddr *) sender_sock, sizeof(struct sockaddr_in));
 
         traceDebug("Tx REGISTER_SUPER_ACK for %s [%s]",
@@ -950,11 +1411,67 @@ static int process_udp(n2n_sn_t *sss,
 }
 
 
+/** Receive a burst of datagrams from the socket of w, process each of them
+ *  and send everything they produced with as few system calls as possible.
+ *
+ *  @return number of datagrams processed or -1 if the socket failed
+ */
+static int process_burst(sn_worker_t *w, time_t now)
+{
+    size_t      queued = w->tx_batch.queued;
+    size_t      errors = w->tx_batch.errors;
+    ssize_t     n;
+    size_t      i;
+
+    n = rx_batch_recv(&w->rx_batch, w->sock);
+
+    if (n < 0)
+    {
+        traceError("recvfrom() failed %d errno %d (%s)", (int) n, errno, strerror(errno));
+        return -1;
+    }
+
+    w->stats.rx_burst_max = MAX(w->stats.rx_burst_max, (size_t) n);
+
+    for (i = 0; i < (size_t) n; ++i)
+    {
+        /* For UDP a length of zero just means no data (unlike TCP). */
+        /* Forwarded payloads stay in the receive buffers until the flush
+         * below. */
+        if (w->rx_batch.lens[i] > 0)
+        {
+            process_udp(w, &(w->rx_batch.addrs[i]), rx_batch_buf(&w->rx_batch, i),
+                        w->rx_batch.lens[i], now);
+        }
+    }
+
+    tx_batch_flush(&w->tx_batch);
+
+    w->stats.tx_burst_max = MAX(w->stats.tx_burst_max, w->tx_batch.queued - queued);
+    w->stats.errors += (w->tx_batch.errors - errors);
+
+    return n;
+}
+
+
 /** Help message to print if the command line arguments are not valid. */
 static void exit_help(int argc, char * const argv[])
 {
     fprintf(stderr, "%s usage\n", argv[0]);
     fprintf(stderr, "-l <lport>\tSet UDP main listen port to <lport>\n");
+    fprintf(stderr, "-B <batch>\tMove up to <batch> datagrams per system call (default %u, max %u)\n",
+            N2N_SN_BATCH_DFL, N2N_BATCH_MAX);
+    fprintf(stderr, "-M <edges>\tRemember up to <edges> edges (default %u, max %u)\n",
+            N2N_SN_EDGES_DFL, N2N_PEER_TABLE_MAX);
+#ifdef N2N_SN_HAVE_WORKERS
+    fprintf(stderr, "-T <threads>\tForward with <threads> worker threads, each on its own socket (max %u)\n",
+            N2N_SN_WORKERS_MAX);
+    fprintf(stderr, "-A <cpus>\tPin worker i to the i-th CPU of the comma separated list <cpus>\n");
+#endif
+#ifdef N2N_SN_HAVE_SHARDS
+    fprintf(stderr, "-S <shards>\tSplit the communities between <shards> processes (max %u). Not with -T.\n",
+            N2N_SN_WORKERS_MAX);
+#endif
 
 #ifdef N2N_MULTIPLE_SUPERNODES
     fprintf(stderr, "-s <snm_port>\tSet SNM listen port to <snm_port>\n");
@@ -977,6 +1494,11 @@ static int run_loop(n2n_sn_t *sss);
 static const struct option long_options[] = {
   { "foreground",      no_argument,       NULL, 'f' },
   { "local-port",      required_argument, NULL, 'l' },
+  { "batch",           required_argument, NULL, 'B' },
+  { "max-edges",       required_argument, NULL, 'M' },
+  { "threads",         required_argument, NULL, 'T' },
+  { "cpus",            required_argument, NULL, 'A' },
+  { "shards",          required_argument, NULL, 'S' },
 #ifdef N2N_MULTIPLE_SUPERNODES
   { "sn-port",         required_argument, NULL, 's' },
   { "supernode",       required_argument, NULL, 'i' },
@@ -997,9 +1519,9 @@ int main(int argc, char * const argv[])
         int opt;
 
 #ifdef N2N_MULTIPLE_SUPERNODES
-        const char *optstring = "fl:s:i:vh";
+        const char *optstring = "fl:B:M:T:A:S:s:i:vh";
 #else
-        const char *optstring = "fl:vh";
+        const char *optstring = "fl:B:M:T:A:S:vh";
 #endif
 
         while ((opt = getopt_long(argc, argv, optstring, long_options, NULL)) != -1)
@@ -1009,6 +1531,44 @@ int main(int argc, char * const argv[])
             case 'l': /* local-port */
                 sss.lport = atoi(optarg);
                 break;
+            case 'B': /* batch */
+                sss.batch_size = MAX(1, MIN(atoi(optarg), N2N_BATCH_MAX));
+                break;
+            case 'M': /* max-edges */
+                sss.max_edges = MAX(1, MIN(atoi(optarg), N2N_PEER_TABLE_MAX));
+                break;
+            case 'T': /* threads */
+                sss.num_workers = MAX(1, MIN(atoi(optarg), N2N_SN_WORKERS_MAX));
+                break;
+            case 'S': /* shards */
+                sss.num_shards = MAX(1, MIN(atoi(optarg), N2N_SN_WORKERS_MAX));
+                break;
+            case 'A': /* cpus */
+            {
+                const char *p = optarg;
+                size_t      i;
+
+                for (i = 0; i < N2N_SN_WORKERS_MAX; ++i)
+                {
+                    char *end;
+                    long  cpu = strtol(p, &end, 10);
+
+                    if ((end == p) || (cpu < 0))
+                    {
+                        traceError("Invalid CPU list '%s'", optarg);
+                        exit_help(argc, argv);
+                    }
+
+                    sss.workers[i].cpu = (int) cpu;
+
+                    if (',' != *end)
+                    {
+                        break;
+                    }
+                    p = end + 1;
+                }
+                break;
+            }
 #ifdef N2N_MULTIPLE_SUPERNODES
             case 's':
                 sss.sn_port = atoi(optarg);
@@ -1048,7 +1608,43 @@ int main(int argc, char * const argv[])
 
     traceDebug("traceLevel is %d", traceLevel);
 
-    sss.sock = open_socket(sss.lport, 1 /*bind ANY*/);
+#ifndef N2N_SN_HAVE_WORKERS
+    if (sss.num_workers > 1)
+    {
+        traceWarning("Worker threads are not supported on this platform; using one.");
+        sss.num_workers = 1;
+    }
+#endif
+
+#ifndef N2N_SN_HAVE_SHARDS
+    if (sss.num_shards > 1)
+    {
+        traceWarning("Shards are not supported by this build; using one.");
+        sss.num_shards = 1;
+    }
+#endif
+
+    if ((sss.num_shards > 1) && (sss.num_workers > 1))
+    {
+        traceWarning("-T cannot be combined with -S; using one thread per shard.");
+        sss.num_workers = 1;
+    }
+
+    if ((0 != peer_table_init(&sss.edges, sss.max_edges)) ||
+        (0 != comm_table_init(&sss.edge_comms, sss.max_edges)))
+    {
+        traceError("Failed to allocate the edge table");
+        exit(-2);
+    }
+    peer_table_set_remove(&sss.edges, edge_removed, &sss.edge_comms);
+
+    if (sss.num_workers > 1)
+    {
+        /* Member arrays may be in use by other workers when they go. */
+        comm_table_set_retire(&sss.edge_comms, sn_retire, &sss);
+    }
+
+    sss.sock = open_socket_opt(sss.lport, 1 /*bind ANY*/, (sss.num_workers > 1) || (sss.num_shards > 1));
     if (-1 == sss.sock)
     {
         traceError("Failed to open main socket. %s", strerror(errno));
@@ -1059,15 +1655,40 @@ int main(int argc, char * const argv[])
         traceNormal("supernode is listening on UDP %u (main)", sss.lport);
     }
 
-    sss.mgmt_sock = open_socket(N2N_SN_MGMT_PORT, 0 /* bind LOOPBACK */);
-    if (-1 == sss.mgmt_sock)
+#ifdef N2N_SN_HAVE_SHARDS
+    /* From here on we may be any of the shards. */
+    if ((sss.num_shards > 1) && (0 != sn_start_shards(&sss)))
     {
-        traceError("Failed to open management socket. %s", strerror(errno));
+        traceError("Failed to start the shards");
         exit(-2);
     }
-    else
+#endif
+
+#ifdef WIN32
+    sss.batch_size = 1;
+#endif
+
+    sss.workers[0].sock = sss.sock;
+
+    if ((0 != rx_batch_init(&sss.workers[0].rx_batch, sss.batch_size, N2N_SN_PKTBUF_SIZE)) ||
+        (0 != tx_batch_init(&sss.workers[0].tx_batch, sss.sock, sss.batch_size, N2N_SN_PKTBUF_SIZE)))
+    {
+        traceError("Failed to allocate batch buffers");
+        exit(-2);
+    }
+
+    if (0 == sss.shard) /* Shard 0 answers for all shards. */
     {
-        traceNormal("supernode is listening on UDP %u (management)", N2N_SN_MGMT_PORT);
+        sss.mgmt_sock = open_socket(N2N_SN_MGMT_PORT, 0 /* bind LOOPBACK */);
+        if (-1 == sss.mgmt_sock)
+        {
+            traceError("Failed to open management socket. %s", strerror(errno));
+            exit(-2);
+        }
+        else
+        {
+            traceNormal("supernode is listening on UDP %u (management)", N2N_SN_MGMT_PORT);
+        }
     }
 
 #ifdef N2N_MULTIPLE_SUPERNODES
@@ -1096,126 +1717,539 @@ int main(int argc, char * const argv[])
 }
 
 
-/** Long lived processing entry point. Split out from main to simply
- *  daemonisation on some platforms. */
-static int run_loop(n2n_sn_t *sss)
+/* ************************************** */
+/* Event loop handlers */
+
+static void sn_udp_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    if (process_burst((sn_worker_t *) arg, now) < 0)
+    {
+        /* The fd is no good now. Maybe we lost our interface. */
+        evloop_stop(loop);
+    }
+}
+
+static void sn_mgmt_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
 {
-    uint8_t pktbuf[N2N_SN_PKTBUF_SIZE];
-    int keep_running = 1;
+    n2n_sn_t           *sss = (n2n_sn_t *) arg;
+    uint8_t             pktbuf[N2N_SN_PKTBUF_SIZE];
+    struct sockaddr_in  sender_sock;
+    socklen_t           i;
+    ssize_t             bread;
 
-    sss->start_time = time(NULL);
+    i = sizeof(sender_sock);
+    bread = recvfrom(fd, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
+                     (struct sockaddr *) &sender_sock, &i);
 
-    while (keep_running)
+    if (bread <= 0)
     {
-        int              rc;
-        ssize_t          bread;
-        int              max_sock;
-        fd_set           socket_mask;
-        struct timeval   wait_time;
-        time_t           now = 0;
+        traceError("recvfrom() failed %d errno %d (%s)", (int) bread, errno, strerror(errno));
+        evloop_stop(loop);
+        return;
+    }
 
-        FD_ZERO(&socket_mask);
-        max_sock = MAX(sss->sock, sss->mgmt_sock);
+    /* We have a datagram to process */
+    process_mgmt(sss, &sender_sock, pktbuf, bread, now);
+}
 
 #ifdef N2N_MULTIPLE_SUPERNODES
-        max_sock = MAX(max_sock, sss->sn_sock);
-        FD_SET(sss->sn_sock, &socket_mask);
+static void sn_snm_cb(n2n_evloop_t *loop, SOCKET fd, time_t now, void *arg)
+{
+    n2n_sn_t           *sss = (n2n_sn_t *) arg;
+    uint8_t             pktbuf[N2N_SN_PKTBUF_SIZE];
+    struct sockaddr_in  sender_sock;
+    socklen_t           i;
+    ssize_t             bread;
 
-        if (sss->snm_discovery_state != N2N_SNM_STATE_READY)
+    i = sizeof(sender_sock);
+    bread = recvfrom(fd, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
+                     (struct sockaddr *) &sender_sock, &i);
+
+    if (bread <= 0)
+    {
+        traceError("recvfrom() failed %d errno %d (%s)", (int) bread, errno, strerror(errno));
+        evloop_stop(loop);
+        return;
+    }
+
+    /* We have a datagram to process */
+    SN_LOCK(sss);
+    process_sn_msg(sss, &sender_sock, pktbuf, bread, now);
+    SN_UNLOCK(sss);
+}
+
+static void sn_discovery_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_sn_t *sss = (n2n_sn_t *) arg;
+
+    if (sss->snm_discovery_state != N2N_SNM_STATE_READY)
+    {
+        SN_LOCK(sss);
+        communities_discovery(sss, now);
+        SN_UNLOCK(sss);
+    }
+}
+#endif
+
+static void sn_purge_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_sn_t *sss = (n2n_sn_t *) arg;
+
+    sn_edges_write_begin(sss);
+    purge_expired_peers(&(sss->edges));
+    sn_edges_write_end(sss);
+
+    sn_reclaim(sss);
+}
+
+
+#ifdef N2N_SN_HAVE_WORKERS
+
+/* ************************************** */
+/* Worker threads */
+
+/** Pin the calling thread to the CPU of w, if it has one. */
+static void sn_worker_pin(sn_worker_t *w)
+{
+    if (w->cpu < 0)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    {
+        cpu_set_t set;
+        int       rc;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (0 != rc)
         {
-            communities_discovery(sss, time(NULL));
+            traceWarning("worker %u: unable to pin to CPU %d (%s)",
+                         (unsigned int) w->id, w->cpu, strerror(rc));
         }
+        else
+        {
+            traceNormal("worker %u pinned to CPU %d", (unsigned int) w->id, w->cpu);
+        }
+    }
+#else
+    traceWarning("worker %u: CPU pinning is not supported on this platform", (unsigned int) w->id);
 #endif
+}
+
+/** After every round of events: w holds no pointers into the edge table. */
+static void sn_worker_post(n2n_evloop_t *loop, void *arg)
+{
+    sn_worker_t *w = (sn_worker_t *) arg;
+
+    __atomic_store_n(&(w->quiescent), w->quiescent + 1, __ATOMIC_RELEASE);
+}
+
+/** Once a second: leave when the supernode stops. Also makes sure an idle
+ *  worker still reaches sn_worker_post() now and then. */
+static void sn_worker_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    sn_worker_t *w = (sn_worker_t *) arg;
+
+    if (!__atomic_load_n(&(w->sss->workers_running), __ATOMIC_RELAXED))
+    {
+        evloop_stop(loop);
+    }
+}
+
+static void *sn_worker_thread(void *arg)
+{
+    sn_worker_t    *w = (sn_worker_t *) arg;
+    n2n_evloop_t    loop;
+
+    sn_worker_pin(w);
+
+    evloop_init(&loop);
+
+    if ((0 != evloop_add_io(&loop, w->sock, 0, sn_udp_cb, w)) ||
+        (0 != evloop_add_timer(&loop, 1, sn_worker_timer, w)))
+    {
+        traceError("worker %u: failed to set up the event loop", (unsigned int) w->id);
+    }
+    else
+    {
+        evloop_set_post(&loop, sn_worker_post, w);
+        evloop_run(&loop);
+    }
+
+    evloop_deinit(&loop);
+
+    return NULL;
+}
+
+/** Give workers 1..num_workers-1 their sockets and batches, then start their
+ *  threads. */
+static int sn_start_workers(n2n_sn_t *sss)
+{
+    size_t i;
+
+    sn_worker_pin(&(sss->workers[0]));
+
+    if (sss->num_workers < 2)
+    {
+        return 0;
+    }
 
-        FD_SET(sss->sock, &socket_mask);
-        FD_SET(sss->mgmt_sock, &socket_mask);
+    sss->workers_running = 1;
 
-        wait_time.tv_sec = 10;
-        wait_time.tv_usec = 0;
-        rc = select(max_sock + 1, &socket_mask, NULL, NULL, &wait_time);
+    for (i = 1; i < sss->num_workers; ++i)
+    {
+        sn_worker_t *w = &(sss->workers[i]);
 
-        now = time(NULL);
+        w->sock = open_socket_opt(sss->lport, 1 /*bind ANY*/, 1 /*reuse port*/);
+        if (w->sock < 0)
+        {
+            traceError("worker %u: failed to bind UDP port %u", (unsigned int) i, (unsigned int) sss->lport);
+            return -1;
+        }
 
-        if (rc > 0)
+        if ((0 != rx_batch_init(&w->rx_batch, sss->batch_size, N2N_SN_PKTBUF_SIZE)) ||
+            (0 != tx_batch_init(&w->tx_batch, w->sock, sss->batch_size, N2N_SN_PKTBUF_SIZE)))
         {
-#ifdef N2N_MULTIPLE_SUPERNODES
-            if (FD_ISSET(sss->sn_sock, &socket_mask))
-            {
-                struct sockaddr_in  sender_sock;
-                size_t              i;
+            return -1;
+        }
 
-                i = sizeof(sender_sock);
-                bread = recvfrom(sss->sn_sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
-                                 (struct sockaddr *)&sender_sock, (socklen_t*)&i);
+        if (0 != pthread_create(&w->thread, NULL, sn_worker_thread, w))
+        {
+            traceError("worker %u: pthread_create failed %s", (unsigned int) i, strerror(errno));
+            return -1;
+        }
+    }
 
-                if (bread <= 0)
-                {
-                    traceError("recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
-                    keep_running = 0;
-                    break;
-                }
+    traceNormal("Started %u workers on UDP port %u", (unsigned int) sss->num_workers, (unsigned int) sss->lport);
 
-                /* We have a datagram to process */
-                process_sn_msg(sss, &sender_sock, pktbuf, bread, now);
-            }
-#endif
+    return 0;
+}
 
-            if (FD_ISSET(sss->sock, &socket_mask)) 
-            {
-                struct sockaddr_in  sender_sock;
-                socklen_t           i;
+/** Stop the worker threads and wait until they have finished. */
+static void sn_stop_workers(n2n_sn_t *sss)
+{
+    size_t i;
 
-                i = sizeof(sender_sock);
-                bread = recvfrom(sss->sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
-                                 (struct sockaddr *) &sender_sock, (socklen_t*) &i);
+    __atomic_store_n(&(sss->workers_running), 0, __ATOMIC_RELAXED);
+
+    for (i = 1; i < sss->num_workers; ++i)
+    {
+        if (sss->workers[i].thread)
+        {
+            pthread_join(sss->workers[i].thread, NULL);
+            sss->workers[i].thread = 0;
+        }
+    }
+}
+
+#endif /* #ifdef N2N_SN_HAVE_WORKERS */
 
-                if (bread < 0) /* For UDP bread of zero just means no data (unlike TCP). */
-                {
-                    /* The fd is no good now. Maybe we lost our interface. */
-                    traceError("recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
-                    keep_running = 0;
-                    break;
-                }
 
-                /* We have a datagram to process */
-                if (bread > 0)
+#ifdef N2N_SN_HAVE_SHARDS
+
+/* ************************************** */
+/* Shards
+ *
+ * With -S the supernode runs as several processes which share nothing but
+ * the UDP port. A classic BPF program on the reuseport group of the main
+ * port steers every datagram to the shard owning its community, so each
+ * shard keeps the edges of its communities to itself.
+ */
+
+/** Shard owning community: the 32 bit words of the name, in network byte
+ *  order, folded by xor and hashed. Must match sn_attach_steering(). */
+static uint32_t sn_shard_of(const n2n_community_t community, size_t num_shards)
+{
+    uint32_t h = 0;
+    size_t   i;
+
+    for (i = 0; i < N2N_COMMUNITY_SIZE; i += sizeof(uint32_t))
+    {
+        uint32_t w;
+
+        memcpy(&w, community + i, sizeof(uint32_t));
+        h ^= ntohl(w);
+    }
+
+    return ((h * 0x9E3779B1U) >> 16) % num_shards;
+}
+
+/** Have the kernel hand each datagram for the reuseport group of sock to the
+ *  socket at index sn_shard_of(community), counting in the order the
+ *  sockets were bound. The program sees the UDP payload. Datagrams too short
+ *  to hold a community go to the first socket. */
+static int sn_attach_steering(SOCKET sock, size_t num_shards)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, N2N_COMMUNITY_OFFSET),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, N2N_COMMUNITY_OFFSET + 4),
+        BPF_STMT(BPF_ALU  | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, N2N_COMMUNITY_OFFSET + 8),
+        BPF_STMT(BPF_ALU  | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD   | BPF_W   | BPF_ABS, N2N_COMMUNITY_OFFSET + 12),
+        BPF_STMT(BPF_ALU  | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU  | BPF_MUL | BPF_K, 0x9E3779B1U),
+        BPF_STMT(BPF_ALU  | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU  | BPF_MOD | BPF_K, (uint32_t) num_shards),
+        BPF_STMT(BPF_RET  | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+
+    prog.len    = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    {
+        traceError("Unable to attach the shard steering program [%s]", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Bind the sockets of shards 1..num_shards-1 next to the main socket, steer
+ *  datagrams between them and fork a process for each. Returns in every
+ *  shard with sss->shard and sss->sock set for it.
+ *
+ *  @return 0 on success, -1 on error
+ */
+static int sn_start_shards(n2n_sn_t *sss)
+{
+    SOCKET  socks[N2N_SN_WORKERS_MAX];
+    pid_t   parent = getpid();
+    size_t  i;
+
+    socks[0] = sss->sock;
+
+    for (i = 1; i < sss->num_shards; ++i)
+    {
+        socks[i] = open_socket_opt(sss->lport, 1 /*bind ANY*/, 1 /*reuse port*/);
+        if (socks[i] < 0)
+        {
+            traceError("shard %u: failed to bind UDP port %u", (unsigned int) i, (unsigned int) sss->lport);
+            return -1;
+        }
+    }
+
+    if (0 != sn_attach_steering(sss->sock, sss->num_shards))
+    {
+        return -1;
+    }
+
+    sss->shards = (struct sn_shard_info *) mmap(NULL, sss->num_shards * sizeof(struct sn_shard_info),
+                                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == (void *) sss->shards)
+    {
+        traceError("Unable to map the shard table [%s]", strerror(errno));
+        sss->shards = NULL;
+        return -1;
+    }
+
+    for (i = 1; i < sss->num_shards; ++i)
+    {
+        pid_t pid = fork();
+
+        if (pid < 0)
+        {
+            traceError("shard %u: fork failed %s", (unsigned int) i, strerror(errno));
+            return -1;
+        }
+
+        if (0 == pid)
+        {
+            size_t j;
+
+            /* Leave with shard 0. */
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent)
+            {
+                exit(0);
+            }
+
+            for (j = 0; j < sss->num_shards; ++j)
+            {
+                if (j != i)
                 {
-                    /* And the datagram has data (not just a header) */
-                    process_udp(sss, &sender_sock, pktbuf, bread, now);
+                    closesocket(socks[j]);
                 }
             }
 
-            if (FD_ISSET(sss->mgmt_sock, &socket_mask)) 
-            {
-                struct sockaddr_in  sender_sock;
-                size_t              i;
+            sss->shard = i;
+            sss->sock = socks[i];
+            sss->workers[0].cpu = sss->workers[i].cpu;
 
-                i = sizeof(sender_sock);
-                bread = recvfrom(sss->mgmt_sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
-                                 (struct sockaddr *) &sender_sock, (socklen_t*) &i);
+            traceNormal("shard %u started", (unsigned int) i);
 
-                if (bread <= 0)
-                {
-                    traceError("recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
-                    keep_running = 0;
-                    break;
-                }
+            return 0;
+        }
 
-                /* We have a datagram to process */
-                process_mgmt(sss, &sender_sock, pktbuf, bread, now);
-            }
+        sss->shard_pids[i] = pid;
+        closesocket(socks[i]); /* The shard holds it in the group. */
+    }
+
+    traceNormal("Started %u shards on UDP port %u", (unsigned int) sss->num_shards, (unsigned int) sss->lport);
+
+    return 0;
+}
+
+/** Shard 0: stop the other shards and wait until they have finished. */
+static void sn_stop_shards(n2n_sn_t *sss)
+{
+    size_t i;
+
+    if (0 != sss->shard)
+    {
+        return;
+    }
+
+    for (i = 1; i < sss->num_shards; ++i)
+    {
+        if (sss->shard_pids[i] > 0)
+        {
+            kill(sss->shard_pids[i], SIGTERM);
+            waitpid(sss->shard_pids[i], NULL, 0);
+            sss->shard_pids[i] = 0;
         }
-        else
+    }
+}
+
+/** Once a second: publish the state of this shard and, in shard 0, notice
+ *  shards that have gone. */
+static void sn_shard_timer(n2n_evloop_t *loop, time_t now, void *arg)
+{
+    n2n_sn_t               *sss = (n2n_sn_t *) arg;
+    struct sn_shard_info   *info = &(sss->shards[sss->shard]);
+    const sn_worker_t      *w = &(sss->workers[0]);
+    size_t                  id;
+    size_t                  n = 0;
+
+    info->pid       = getpid();
+    info->rx        = w->rx_batch.datagrams;
+    info->fwd       = w->stats.fwd;
+    info->broadcast = w->stats.broadcast;
+    info->reg_super = w->stats.reg_super;
+    info->edges     = peer_table_size(&sss->edges);
+    info->num_comms = comm_table_size(&sss->edge_comms);
+
+    for (id = 0; (id < sss->edge_comms.capacity) && (n < MIN(info->num_comms, N2N_SN_SHARD_COMMS)); ++id)
+    {
+        if (sss->edge_comms.comms[id].num_members > 0)
         {
-            traceDebug("timeout");
+            memcpy(info->comms[n++], sss->edge_comms.comms[id].name, sizeof(n2n_community_t));
         }
+    }
 
-        purge_expired_registrations(&(sss->edges));
+    if (0 == sss->shard)
+    {
+        pid_t pid;
 
-    } /* while */
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        {
+            /* The kernel has closed its socket, which renumbers the group. */
+            traceError("shard process %d exited; stopping", (int) pid);
+            evloop_stop(loop);
+        }
+    }
+}
 
-    deinit_sn(sss);
+/** Append a line per shard to the management reply in resbuf.
+ *
+ *  @return the new length of the reply
+ */
+static size_t sn_shards_mgmt(const n2n_sn_t *sss, char *resbuf, size_t ressize)
+{
+    size_t total = 0;
+    size_t i;
 
-    return 0;
+    for (i = 0; i < sss->num_shards; ++i)
+    {
+        total += sss->shards[i].rx;
+    }
+
+    ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                        "shards    %u\n", (unsigned int) sss->num_shards);
+
+    for (i = 0; (i < sss->num_shards) && (ressize < N2N_SN_PKTBUF_SIZE); ++i)
+    {
+        const struct sn_shard_info *info = &(sss->shards[i]);
+        size_t c;
+
+        ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                            "shard %-2u  pid %d rx %lu (%u%%) fwd %lu bcast %lu reg %lu edges %u comms %u",
+                            (unsigned int) i, (int) info->pid, (long unsigned int) info->rx,
+                            (unsigned int) (total ? (100 * info->rx / total) : 0),
+                            (long unsigned int) info->fwd, (long unsigned int) info->broadcast,
+                            (long unsigned int) info->reg_super,
+                            (unsigned int) info->edges, (unsigned int) info->num_comms);
+
+        for (c = 0; (c < MIN(info->num_comms, N2N_SN_SHARD_COMMS)) && (ressize < N2N_SN_PKTBUF_SIZE); ++c)
+        {
+            ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                                " %.*s", N2N_COMMUNITY_SIZE, (const char *) info->comms[c]);
+        }
+
+        if (ressize < N2N_SN_PKTBUF_SIZE)
+        {
+            ressize += snprintf(resbuf + ressize, N2N_SN_PKTBUF_SIZE - ressize,
+                                (info->num_comms > N2N_SN_SHARD_COMMS) ? " ...\n" : "\n");
+        }
+    }
+
+    return MIN(ressize, N2N_SN_PKTBUF_SIZE - 1);
 }
 
+#endif /* #ifdef N2N_SN_HAVE_SHARDS */
+
+
+/** Long lived processing entry point. Split out from main to simply
+ *  daemonisation on some platforms. */
+static int run_loop(n2n_sn_t *sss)
+{
+    n2n_evloop_t loop;
+    int          rc = 0;
+
+    sss->start_time = n2n_now();
+
+    evloop_init(&loop);
+
+    if (
+#ifdef N2N_SN_HAVE_WORKERS
+        (0 != sn_start_workers(sss)) ||
+#endif
+        (0 != evloop_add_io(&loop, sss->sock, 0, sn_udp_cb, &(sss->workers[0]))) ||
+        ((sss->mgmt_sock >= 0) && (0 != evloop_add_io(&loop, sss->mgmt_sock, 0, sn_mgmt_cb, sss))) ||
+#ifdef N2N_SN_HAVE_SHARDS
+        ((sss->num_shards > 1) && (0 != evloop_add_timer(&loop, 1, sn_shard_timer, sss))) ||
+#endif
+#ifdef N2N_MULTIPLE_SUPERNODES
+        (0 != evloop_add_io(&loop, sss->sn_sock, 0, sn_snm_cb, sss)) ||
+        (0 != evloop_add_timer(&loop, 1, sn_discovery_timer, sss)) ||
+#endif
+        (0 != evloop_add_timer(&loop, N2N_SN_PURGE_INTERVAL, sn_purge_timer, sss)))
+    {
+        traceError("Failed to set up the event loop");
+        rc = -1;
+    }
+    else
+    {
+        rc = evloop_run(&loop);
+    }
+
+#ifdef N2N_SN_HAVE_WORKERS
+    sn_stop_workers(sss);
+#endif
+#ifdef N2N_SN_HAVE_SHARDS
+    sn_stop_shards(sss);
+#endif
+    evloop_deinit(&loop);
+    deinit_sn(sss);
+
+    return rc;
+}
@@ -1,9 +1,276 @@
 #include "n2n.h"
 #include "n2n_keyfile.h"
+#include "n2n_hc.h"
+#include "twofish.h"
 #include <assert.h>
 #include <stdio.h>
 #include <sys/stat.h>
 
+#define TEST_HC_FRAMES  20
+#define TEST_HC_PAYLOAD 100
+
+static uint32_t test_fnv1a(const uint8_t *p, size_t n)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        h = (h ^ p[i]) * 16777619U;
+    }
+
+    return h;
+}
+
+/** Index of the Rx context of peer the receive table of n2n_hc.c used to be
+ *  direct mapped by. */
+static unsigned int test_hc_slot(const n2n_mac_t peer)
+{
+    uint32_t h = test_fnv1a(peer, N2N_MAC_SIZE);
+
+    return ((h >> 8) ^ (h << 4)) & 0xFF;
+}
+
+/** Build frame i of a TCP stream from src into f, at 14 + 20 + 20 + payload
+ *  bytes. */
+static size_t test_hc_frame(uint8_t *f, const n2n_mac_t src, size_t i)
+{
+    static const n2n_mac_t dst = { 0x02, 0, 0, 0, 0, 0x01 };
+    size_t len = 14 + 20 + 20 + TEST_HC_PAYLOAD;
+    uint32_t seq = 1000 + (i * TEST_HC_PAYLOAD);
+    uint32_t sum = 0;
+    size_t j;
+
+    memset(f, 0, len);
+    memcpy(f, dst, N2N_MAC_SIZE);
+    memcpy(f + 6, src, N2N_MAC_SIZE);
+    f[12] = 0x08;
+
+    f[14] = 0x45;
+    f[16] = (len - 14) >> 8;
+    f[17] = (len - 14) & 0xFF;
+    f[19] = i & 0xFF;                           /* IP ID */
+    f[22] = 64;
+    f[23] = IPPROTO_TCP;
+    memcpy(f + 26, "\x0a\x63\x00\x02\x0a\x63\x00\x01", 8);
+    for (j = 0; j < 20; j += 2)
+    {
+        sum += (f[14 + j] << 8) | f[14 + j + 1];
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    f[24] = (~sum >> 8) & 0xFF;
+    f[25] = ~sum & 0xFF;
+
+    f[34] = 0x13;                               /* ports 5004 -> 80 */
+    f[35] = 0x8c;
+    f[37] = 80;
+    f[38] = seq >> 24;
+    f[39] = (seq >> 16) & 0xFF;
+    f[40] = (seq >> 8) & 0xFF;
+    f[41] = seq & 0xFF;
+    f[46] = 0x50;                               /* data offset */
+    f[47] = 0x18;                               /* PSH ACK */
+    f[48] = 0x10;                               /* window */
+    f[50] = i & 0xFF;                           /* checksum, carried as it is */
+
+    for (j = 0; j < TEST_HC_PAYLOAD; ++j)
+    {
+        f[54 + j] = (uint8_t) (i + j);
+    }
+
+    return len;
+}
+
+/** Two peers whose header compression contexts map to the same place at the
+ *  receiver send their frames interleaved. Every frame must be restored. */
+static int test_hc_collision(void)
+{
+    static const n2n_mac_t rx_mac = { 0x02, 0, 0, 0, 0, 0x01 };
+    n2n_mac_t peer[2] = { { 0x02, 0, 0, 0, 0, 0x02 }, { 0x02, 0, 0, 0, 0x01, 0 } };
+    n2n_hc_t tx[2];
+    n2n_hc_t rx;
+    size_t ok = 0;
+    size_t i;
+    int p;
+
+    /* A second peer whose context lands where the first one's does. */
+    while (test_hc_slot(peer[1]) != test_hc_slot(peer[0]))
+    {
+        if (0 == ++(peer[1][5]))
+        {
+            ++(peer[1][4]);
+        }
+    }
+
+    hc_init(&tx[0], 0);
+    hc_init(&tx[1], 0);
+    hc_init(&rx, 0);
+
+    for (i = 0; i < TEST_HC_FRAMES; ++i)
+    {
+        for (p = 0; p < 2; ++p)
+        {
+            uint8_t buf[16 + N2N_PKT_BUF_SIZE];
+            uint8_t orig[N2N_PKT_BUF_SIZE];
+            uint8_t out[N2N_PKT_BUF_SIZE];
+            uint8_t *f = buf + 16;
+            size_t len = test_hc_frame(f, peer[p], i);
+            int n;
+
+            memcpy(orig, f, len);
+            n = hc_compress(&tx[p], rx_mac, &f, len, 16);
+            if (n <= 0)
+            {
+                fprintf(stderr, "hc: frame %u of peer %d not compressed\n", (unsigned int) i, p);
+                return -1;
+            }
+
+            n = hc_expand(&rx, peer[p], f, n, out, sizeof(out));
+            ok += ((n == (int) len) && (0 == memcmp(out, orig, len)));
+        }
+    }
+
+    fprintf(stderr, "hc: %u of %u frames restored, %u rx errors\n", (unsigned int) ok,
+            2 * TEST_HC_FRAMES, (unsigned int) rx.stats.rx_errors);
+
+    hc_deinit(&tx[0]);
+    hc_deinit(&tx[1]);
+    hc_deinit(&rx);
+
+    return ((2 * TEST_HC_FRAMES == ok) && (0 == rx.stats.rx_errors)) ? 0 : -1;
+}
+
+/* Twofish raw CBC known answers, from the byte-queue engine TwoFishEncryptRaw()
+ * used before the word-wise one: zero IV, a single zero padded block for up to
+ * 16 bytes and ciphertext stealing for a short last block. The plaintext octet
+ * i of a len octet input is i * 7 + len. */
+static const char *test_tf_keys[] = {
+    "secret",
+    "0123456789abcdef",
+    "0123456789abcdefghijklmn",
+    "0123456789abcdefghijklmnopqrstuv" };
+
+static const struct
+{
+    unsigned int    key;
+    uint32_t        len;
+    const char     *ct;                 /* hex; at least one block */
+} test_tf_vectors[] = {
+    { 0,  5, "a69298ffe521584a63d2314fcb0ceaeb" },
+    { 0, 16, "5534292c10acf45ebecb6d071a898930" },
+    { 0, 17, "93e42e2ea2e50cd2b645c199be34c1dcc3" },
+    { 0, 47, "4bc3c79f1c793de49bb62c97fb0fbca7034b7ebc1a6a9d331a41e0e243de8c2a"
+               "cf28b1fabe0ca59d4ab65b0ff9a779" },
+    { 0, 64, "39f1d4c3234f4d96c732a49b029dd85dc22e04fd81eb65d69935f2fe01bcae49"
+               "0f0fccf3d519304d306478efa7dddffc9a330c8be2538db3b20ff701577c5887" },
+    { 1,  5, "883988d95ad4c823d4f228b85a456f7f" },
+    { 1, 16, "a61e90eb554a0f966fe2540f47f6ecd3" },
+    { 1, 17, "318e747c8600e4c95ce15b4cdbb6460134" },
+    { 1, 47, "7964167e87c4d0d55ffa8a0592063546683ab4418771ded67a062d5b54338de8"
+               "60647e1346b98d97e521ff399123a7" },
+    { 1, 64, "68cedbaa733b98daf83e7757f365c2eb449ab13adda02a80c86be660cb786aaa"
+               "586223521353f76657fa4275b238218c887496ad1fd8599a00d3e36c3482d6c6" },
+    { 2,  5, "abb776227dc7b9254b1c272d51dd34fb" },
+    { 2, 16, "4f6a421cb171efb40cf59b8b8102239b" },
+    { 2, 17, "8cbc68ce70df56d7f57affadb6a88f7802" },
+    { 2, 47, "ed5904d517f4dace878b8f36417fe68895ffd4228875c9bb2fe4d7a067b14608"
+               "0d8db5c56009f73bb71025abfd325b" },
+    { 2, 64, "9b832a509d996fcd46d0290016ca1a01dcb83b2a3bce430f7802ddd80c89297c"
+               "ff5dfd37889acb62f16facdb67ea00c8ce59c7f9582f7e7ced5812dbc3bc0a91" },
+    { 3,  5, "461da76d94394304d62b253c6e38d8d7" },
+    { 3, 16, "3733ab8550789112a772145197b4d804" },
+    { 3, 17, "1e5f921f889eec5168698adb082a043f83" },
+    { 3, 47, "7d6e6b730212bdbfbcf653a1b632fd63ab476224ebf6257a3b8af33b4935b95c"
+               "d27ee54d96a7b1e33f396d71258fbd" },
+    { 3, 64, "61a55ea98593bf2ad744929b4e06d534b3cbbf7e720585825997a7d7b3dd941a"
+               "cf5e254da8fef25bc6969d20a1e8cda5e021f9a67e94f29654095678d8727537" },
+};
+
+static size_t test_unhex(uint8_t *out, const char *hex)
+{
+    size_t n = 0;
+    unsigned int b;
+
+    while (hex[0] && hex[1] && (1 == sscanf(hex, "%2x", &b)))
+    {
+        out[n++] = (uint8_t) b;
+        hex += 2;
+    }
+
+    return n;
+}
+
+/** Encrypt and decrypt each known answer in place and out of place.
+ *
+ *  @return 0 if every output matches, -1 otherwise
+ */
+static int test_twofish_kat(void)
+{
+    const size_t total = sizeof(test_tf_vectors) / sizeof(test_tf_vectors[0]);
+    size_t ok = 0;
+    size_t v;
+
+    for (v = 0; v < total; ++v)
+    {
+        const char *key = test_tf_keys[test_tf_vectors[v].key];
+        uint32_t len = test_tf_vectors[v].len;
+        uint8_t pt[128];
+        uint8_t ct[128];
+        uint8_t out[128];
+        uint8_t buf[128];
+        TWOFISH *tf;
+        size_t ctlen;
+        uint32_t i;
+        int good = 1;
+
+        for (i = 0; i < len; ++i)
+        {
+            pt[i] = (uint8_t) (i * 7 + len);
+        }
+        ctlen = test_unhex(ct, test_tf_vectors[v].ct);
+
+        tf = TwoFishInit((const uint8_t *) key, strlen(key));
+        if (NULL == tf)
+        {
+            fprintf(stderr, "twofish: TwoFishInit failed\n");
+            return -1;
+        }
+
+        /* Out of place, then in place. */
+        memset(out, 0, sizeof(out));
+        good &= (ctlen == TwoFishEncryptRaw(pt, out, len, tf)) && (0 == memcmp(out, ct, ctlen));
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, pt, len);
+        good &= (ctlen == TwoFishEncryptRaw(buf, buf, len, tf)) && (0 == memcmp(buf, ct, ctlen));
+
+        memset(out, 0, sizeof(out));
+        good &= (ctlen == TwoFishDecryptRaw(ct, out, ctlen, tf)) && (0 == memcmp(out, pt, len));
+
+        memcpy(buf, ct, ctlen);
+        good &= (ctlen == TwoFishDecryptRaw(buf, buf, ctlen, tf)) && (0 == memcmp(buf, pt, len));
+
+        TwoFishDestroy(tf);
+
+        if (good)
+        {
+            ++ok;
+        }
+        else
+        {
+            fprintf(stderr, "twofish: key of %u octets, %u octets: mismatch\n",
+                    (unsigned int) strlen(key), (unsigned int) len);
+        }
+    }
+
+    fprintf(stderr, "twofish: %u of %u known answers match\n", (unsigned int) ok, (unsigned int) total);
+
+    return (total == ok) ? 0 : -1;
+}
+
 int main(int arc, const char *argv[])
 {
     int e;
@@ -20,5 +287,17 @@ int main(int arc, const char *argv[])
         fprintf(stderr, "Stored %d keys.\n", e);
     }
 
+    if (0 != test_hc_collision())
+    {
+        fprintf(stderr, "hc: FAILED\n");
+        return 1;
+    }
+
+    if (0 != test_twofish_kat())
+    {
+        fprintf(stderr, "twofish: FAILED\n");
+        return 1;
+    }
+
     return 0;
 }
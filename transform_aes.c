@@ -15,10 +15,18 @@
 #include <strings.h> /* index() */
 #endif
 
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define N2N_AES_HAVE_AESNI      /* batches run on AES-NI where the CPU has it */
+#include <immintrin.h>
+#endif
+
 #define N2N_AES_NUM_SA                  32 /* space for SAa */
 
 #define N2N_AES_TRANSFORM_VERSION       1  /* version of the transform encoding */
 #define N2N_AES_IVEC_SIZE               32 /* Enough space for biggest AES ivec */
+#define N2N_AES_MAX_ROUNDS              14
+#define N2N_AES_LANES                   4  /* packets a batch interleaves */
+#define N2N_AES_MAX_JOBS                64 /* packets a batch takes at once */
 
 typedef unsigned char n2n_aes_ivec_t[N2N_AES_IVEC_SIZE];
 
@@ -30,6 +38,11 @@ struct sa_aes
     n2n_aes_ivec_t      enc_ivec;       /* tx CBC state */
     AES_KEY             dec_key;        /* tx key */
     n2n_aes_ivec_t      dec_ivec;       /* tx CBC state */
+#if defined(N2N_AES_HAVE_AESNI)
+    int                 ni_rounds;      /* 0 unless the AES-NI round keys are set */
+    __m128i             ni_enc[N2N_AES_MAX_ROUNDS + 1];
+    __m128i             ni_dec[N2N_AES_MAX_ROUNDS + 1]; /* for the equivalent inverse cipher */
+#endif
 };
 
 typedef struct sa_aes sa_aes_t;
@@ -112,6 +125,9 @@ static size_t aes_best_keysize(size_t numBytes)
     }
 }
 
+#define TRANSOP_AES_HEADROOM     (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_NONCE_SIZE)
+#define TRANSOP_AES_TAILROOM     AES_BLOCK_SIZE /* At most one block of padding. */
+
 /** The aes packet format consists of:
  *
  *  - a 8-bit aes encoding version in clear text
@@ -120,76 +136,103 @@ static size_t aes_best_keysize(size_t numBytes)
  *
  *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
  *         |<------ encrypted ------>|
+ *
+ *  The version, SA and nonce are written in the headroom in front of the
+ *  payload and the padding behind it, leaving the assembly of nonce, payload
+ *  and padding to be encrypted where it lies.
+ *
+ *  @return length of the assembly or -1 if there is no room for the padding
  */
-static int transop_encode_aes(n2n_trans_op_t  *arg,
-                              uint8_t         *outbuf,
-                              size_t           out_len,
-                              const uint8_t   *inbuf,
-                              size_t           in_len)
+static int aes_encode_prepare(const sa_aes_t *sa, uint8_t *payload, size_t in_len, size_t tailroom)
 {
     int len2 = -1;
-    transop_aes_t *priv = (transop_aes_t *) arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
-    uint32_t *pnonce;
+    uint8_t *outbuf = payload - TRANSOP_AES_HEADROOM;
+    uint8_t *assembly = payload - TRANSOP_AES_NONCE_SIZE;
+    uint32_t nonce;
 
-    if ((in_len + TRANSOP_AES_NONCE_SIZE) <= N2N_PKT_BUF_SIZE)
+    if (tailroom >= TRANSOP_AES_TAILROOM)
     {
-        if ((in_len + TRANSOP_AES_NONCE_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_VER_SIZE) <= out_len)
-        {
-            int len = -1;
-            size_t idx = 0;
-            sa_aes_t *sa;
-            size_t tx_sa_num = 0;
-
-            /* The transmit sa is periodically updated */
-            tx_sa_num = aes_choose_tx_sa(priv);
-
-            sa = &(priv->sa[tx_sa_num]); /* Proper Tx SA index */
-        
-            traceDebug("encode_aes %lu with SA %lu.", in_len, sa->sa_id);
-
-            /* Encode the aes format version. */
-            encode_uint8(outbuf, &idx, N2N_AES_TRANSFORM_VERSION);
-
-            /* Encode the security association (SA) number */
-            encode_uint32(outbuf, &idx, sa->sa_id);
-
-            /* Encrypt the assembly contents and write the ciphertext after the SA. */
-            len = in_len + TRANSOP_AES_NONCE_SIZE;
-
-            /* The assembly buffer is a source for encrypting data. The nonce is
-             * written in first followed by the packet payload. The whole
-             * contents of assembly are encrypted. */
-            pnonce = (uint32_t *) assembly;
-            *pnonce = rand();
-            memcpy(assembly + TRANSOP_AES_NONCE_SIZE, inbuf, in_len);
-
-            /* Need at least one encrypted byte at the end for the padding. */
-            len2 = ((len / AES_BLOCK_SIZE) + 1) * AES_BLOCK_SIZE; /* Round up to next whole AES adding at least one byte. */
-            assembly[len2 - 1] = (len2 - len);
-            traceDebug("padding = %u", assembly[len2 - 1]);
-
-            memset(&(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
-            AES_cbc_encrypt(assembly, /* source */
-                            outbuf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE, /* dest */
-                            len2, /* enc size */
-                            &(sa->enc_key), sa->enc_ivec, 1 /* encrypt */);
-
-            len2 += TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE; /* size of data carried in UDP. */
-        }
-        else
-        {
-            traceError("encode_aes outbuf too small.");
-        }
+        int len = -1;
+        size_t idx = 0;
+
+        traceDebug("encode_aes %lu with SA %lu.", in_len, sa->sa_id);
+
+        /* Encode the aes format version. */
+        encode_uint8(outbuf, &idx, N2N_AES_TRANSFORM_VERSION);
+
+        /* Encode the security association (SA) number */
+        encode_uint32(outbuf, &idx, sa->sa_id);
+
+        /* Encrypt the assembly contents and write the ciphertext after the SA. */
+        len = in_len + TRANSOP_AES_NONCE_SIZE;
+
+        /* The assembly is the nonce followed by the packet payload, and is
+         * encrypted in place. */
+        nonce = rand();
+        memcpy(assembly, &nonce, TRANSOP_AES_NONCE_SIZE);
+
+        /* Need at least one encrypted byte at the end for the padding. */
+        len2 = ((len / AES_BLOCK_SIZE) + 1) * AES_BLOCK_SIZE; /* Round up to next whole AES adding at least one byte. */
+        assembly[len2 - 1] = (len2 - len);
+        traceDebug("padding = %u", assembly[len2 - 1]);
     }
     else
     {
-        traceError("encode_aes inbuf too big to encrypt.");
+        traceError("encode_aes no room for the padding.");
     }
 
     return len2;
 }
 
+/** Encrypt the payload where it lies. See aes_encode_prepare(). */
+static int transop_encode_aes_inplace(n2n_trans_op_t  *arg,
+                                      uint8_t         *payload,
+                                      size_t           in_len,
+                                      size_t           tailroom)
+{
+    transop_aes_t *priv = (transop_aes_t *) arg->priv;
+    uint8_t *assembly = payload - TRANSOP_AES_NONCE_SIZE;
+    sa_aes_t *sa;
+    int len2;
+
+    /* The transmit sa is periodically updated */
+    sa = &(priv->sa[aes_choose_tx_sa(priv)]); /* Proper Tx SA index */
+
+    len2 = aes_encode_prepare(sa, payload, in_len, tailroom);
+
+    if (len2 > 0)
+    {
+        memset(&(sa->enc_ivec), 0, sizeof(n2n_aes_ivec_t));
+        AES_cbc_encrypt(assembly, /* source */
+                        assembly, /* dest */
+                        len2, /* enc size */
+                        &(sa->enc_key), sa->enc_ivec, 1 /* encrypt */);
+
+        len2 += TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE; /* size of data carried in UDP. */
+    }
+
+    return len2;
+}
+
+/** Encode inbuf into outbuf. See transop_encode_aes_inplace(). */
+static int transop_encode_aes(n2n_trans_op_t  *arg,
+                              uint8_t         *outbuf,
+                              size_t           out_len,
+                              const uint8_t   *inbuf,
+                              size_t           in_len)
+{
+    if ((in_len + TRANSOP_AES_HEADROOM + TRANSOP_AES_TAILROOM) > out_len)
+    {
+        traceError("encode_aes outbuf too small.");
+        return -1;
+    }
+
+    memcpy(outbuf + TRANSOP_AES_HEADROOM, inbuf, in_len);
+
+    return transop_encode_aes_inplace(arg, outbuf + TRANSOP_AES_HEADROOM, in_len,
+                                      out_len - TRANSOP_AES_HEADROOM - in_len);
+}
+
 
 /* Search through the array of SAs to find the one with the required ID.
  *
@@ -214,27 +257,17 @@ static ssize_t aes_find_sa(const transop_aes_t *priv, const n2n_sa_t req_id)
 }
 
 
-/** The aes packet format consists of:
+/** Check the version and SA of the in_len bytes of the aes packet format at
+ *  inbuf (see aes_encode_prepare()).
  *
- *  - a 8-bit aes encoding version in clear text
- *  - a 32-bit SA number in clear text
- *  - ciphertext encrypted from a 32-bit nonce followed by the payload.
- *
- *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
- *         |<------ encrypted ------>|
+ *  @return the SA to decrypt the ciphertext with, whose length is set in
+ *          *len, or NULL if the packet cannot be decoded
  */
-static int transop_decode_aes(n2n_trans_op_t   *arg,
-                              uint8_t          *outbuf,
-                              size_t            out_len,
-                              const uint8_t    *inbuf,
-                              size_t            in_len)
+static sa_aes_t *aes_decode_sa(transop_aes_t *priv, const uint8_t *inbuf, size_t in_len, int *len)
 {
-    int len = 0;
-    transop_aes_t *priv = (transop_aes_t *) arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
+    *len = 0;
 
-    if (   ((in_len - (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE)) <= N2N_PKT_BUF_SIZE)       /* Cipher text fits in assembly */
-        && (in_len >= (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_NONCE_SIZE)))  /* Has at least version, SA and nonce */
+    if (in_len >= (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE + TRANSOP_AES_NONCE_SIZE)) /* Has at least version, SA and nonce */
     {
         n2n_sa_t   sa_rx;
         ssize_t    sa_idx = -1;
@@ -257,49 +290,15 @@ static int transop_decode_aes(n2n_trans_op_t   *arg,
 
                 traceDebug("decode_aes %lu with SA %lu.", in_len, sa_rx, sa->sa_id);
 
-                len = (in_len - (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE));
+                *len = (in_len - (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE));
 
-                if (0 == (len % AES_BLOCK_SIZE))
-                {
-                    uint8_t padding;
-
-                    memset(&(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
-                    AES_cbc_encrypt((inbuf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE),
-                                    assembly, /* destination */
-                                    len,
-                                    &(sa->dec_key),
-                                    sa->dec_ivec, 0 /* decrypt */);
-
-                    /* last byte is how much was padding: max value should be
-                     * AES_BLOCKSIZE-1 */
-                    padding = assembly[len - 1] & 0xff;
-
-                    if (len >= (padding + TRANSOP_AES_NONCE_SIZE))
-                    {
-                        /* strictly speaking for this to be an ethernet packet
-                         * it is going to need to be even bigger; but this is
-                         * enough to prevent segfaults. */
-                        traceDebug("padding = %u", padding);
-                        len -= padding;
-
-                        len -= TRANSOP_AES_NONCE_SIZE; /* size of ethernet packet */
-
-                        /* Step over 4-byte random nonce value */
-                        memcpy(outbuf,
-                               assembly + TRANSOP_AES_NONCE_SIZE, 
-                               len);
-                    }
-                    else
-                    {
-                        traceWarning("UDP payload decryption failed.");
-                    }
-                }
-                else
+                if (0 == (*len % AES_BLOCK_SIZE))
                 {
-                    traceWarning("Encrypted length %d is not a multiple of AES_BLOCK_SIZE (%d)", len, AES_BLOCK_SIZE);
-                    len = 0;
+                    return sa;
                 }
 
+                traceWarning("Encrypted length %d is not a multiple of AES_BLOCK_SIZE (%d)", *len, AES_BLOCK_SIZE);
+                *len = 0;
             }
             else
             {
@@ -322,9 +321,471 @@ static int transop_decode_aes(n2n_trans_op_t   *arg,
         traceError("decode_aes inbuf wrong size (%ul) to decrypt.", in_len);
     }
 
+    return NULL;
+}
+
+/** Strip the nonce and padding from the len bytes of decrypted assembly.
+ *
+ *  @return length of the payload, which *payload then points at, or 0
+ */
+static int aes_decode_unpad(uint8_t *assembly, int len, uint8_t **payload)
+{
+    /* last byte is how much was padding: max value should be
+     * AES_BLOCKSIZE-1 */
+    uint8_t padding = assembly[len - 1] & 0xff;
+
+    if (len >= (padding + TRANSOP_AES_NONCE_SIZE))
+    {
+        /* strictly speaking for this to be an ethernet packet
+         * it is going to need to be even bigger; but this is
+         * enough to prevent segfaults. */
+        traceDebug("padding = %u", padding);
+        len -= padding;
+
+        len -= TRANSOP_AES_NONCE_SIZE; /* size of ethernet packet */
+
+        /* Step over 4-byte random nonce value */
+        *payload = assembly + TRANSOP_AES_NONCE_SIZE;
+    }
+    else
+    {
+        traceWarning("UDP payload decryption failed.");
+        len = 0;
+    }
+
+    return len;
+}
+
+/** The ciphertext of the aes packet format (see aes_encode_prepare()) is
+ *  decrypted into assembly, which may be the ciphertext itself. On success
+ *  *payload points at the payload inside assembly.
+ */
+static int aes_decode(transop_aes_t    *priv,
+                      const uint8_t    *inbuf,
+                      size_t            in_len,
+                      uint8_t          *assembly,
+                      uint8_t         **payload)
+{
+    int len = 0;
+    sa_aes_t *sa = aes_decode_sa(priv, inbuf, in_len, &len);
+
+    if (sa)
+    {
+        memset(&(sa->dec_ivec), 0, sizeof(n2n_aes_ivec_t));
+        AES_cbc_encrypt((inbuf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE),
+                        assembly, /* destination */
+                        len,
+                        &(sa->dec_key),
+                        sa->dec_ivec, 0 /* decrypt */);
+
+        len = aes_decode_unpad(assembly, len, payload);
+    }
+
+    return len;
+}
+
+/** Decode inbuf into outbuf. See aes_decode(). */
+static int transop_decode_aes(n2n_trans_op_t   *arg,
+                              uint8_t          *outbuf,
+                              size_t            out_len,
+                              const uint8_t    *inbuf,
+                              size_t            in_len)
+{
+    uint8_t assembly[N2N_PKT_BUF_SIZE];
+    uint8_t *payload = NULL;
+    int len;
+
+    if ((in_len - (TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE)) > N2N_PKT_BUF_SIZE) /* Cipher text fits in assembly */
+    {
+        traceError("decode_aes inbuf wrong size (%ul) to decrypt.", in_len);
+        return 0;
+    }
+
+    len = aes_decode((transop_aes_t *) arg->priv, inbuf, in_len, assembly, &payload);
+
+    if (len > (int) out_len)
+    {
+        traceError("decode_aes outbuf too small.");
+        len = 0;
+    }
+    else if (len > 0)
+    {
+        memcpy(outbuf, payload, len);
+    }
+
     return len;
 }
 
+/** Decrypt the payload where it lies in buf. See aes_decode(). */
+static int transop_decode_aes_inplace(n2n_trans_op_t   *arg,
+                                      uint8_t          *buf,
+                                      size_t            in_len,
+                                      uint8_t         **payload)
+{
+    return aes_decode((transop_aes_t *) arg->priv, buf, in_len,
+                      buf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE, payload);
+}
+
+#if defined(N2N_AES_HAVE_AESNI)
+
+/* ********************************** */
+/* Batches on AES-NI
+ *
+ * CBC encryption of one packet is a chain of dependent AESENC instructions,
+ * each waiting for the one before. A batch keeps N2N_AES_LANES packets in
+ * flight and runs their chains side by side, so the latency of one hides
+ * behind the others; a lane whose packet is done takes the next one. The
+ * output is that of AES_cbc_encrypt() on the same assembly.
+ */
+
+/** A packet of a batch: nblocks blocks at buf, en/decrypted in place. */
+struct aes_ni_job
+{
+    uint8_t            *buf;
+    size_t              nblocks;
+    const __m128i      *keys;
+};
+
+static int aes_ni_supported(void)
+{
+    static int supported = -1;
+
+    if (supported < 0)
+    {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("aes") ? 1 : 0;
+    }
+
+    return supported;
+}
+
+/** SubWord() of the key expansion, applying the S-box to each octet. */
+__attribute__((target("aes")))
+static uint32_t aes_ni_subword(uint32_t w)
+{
+    /* AESKEYGENASSIST puts SubWord() of its second word in its first. */
+    return (uint32_t) _mm_cvtsi128_si32(_mm_aeskeygenassist_si128(_mm_set_epi32(0, 0, (int) w, 0), 0));
+}
+
+/** Expand the keysize bytes of key into the round keys of sa, as FIPS-197. */
+__attribute__((target("aes")))
+static void aes_ni_set_keys(sa_aes_t *sa, const uint8_t *key, size_t keysize)
+{
+    static const uint8_t rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+    uint32_t w[4 * (N2N_AES_MAX_ROUNDS + 1)];
+    size_t nk = keysize / 4;
+    size_t rounds = nk + 6;
+    size_t i;
+
+    memcpy(w, key, keysize); /* words keep the byte order of the key */
+
+    for (i = nk; i < 4 * (rounds + 1); ++i)
+    {
+        uint32_t t = w[i - 1];
+
+        if (0 == (i % nk))
+        {
+            t = aes_ni_subword((t >> 8) | (t << 24)) ^ rcon[(i / nk) - 1];
+        }
+        else if ((nk > 6) && (4 == (i % nk)))
+        {
+            t = aes_ni_subword(t);
+        }
+
+        w[i] = w[i - nk] ^ t;
+    }
+
+    for (i = 0; i <= rounds; ++i)
+    {
+        sa->ni_enc[i] = _mm_loadu_si128((const __m128i *) &(w[4 * i]));
+    }
+
+    sa->ni_dec[0] = sa->ni_enc[rounds];
+    for (i = 1; i < rounds; ++i)
+    {
+        sa->ni_dec[i] = _mm_aesimc_si128(sa->ni_enc[rounds - i]);
+    }
+    sa->ni_dec[rounds] = sa->ni_enc[0];
+
+    sa->ni_rounds = (int) rounds;
+}
+
+/** CBC-encrypt the count jobs, all of rounds rounds, from a zero IV. */
+__attribute__((target("aes")))
+static void aes_ni_cbc_encrypt(const struct aes_ni_job *jobs, size_t count, int rounds)
+{
+    struct aes_ni_job lane[N2N_AES_LANES];
+    __m128i x[N2N_AES_LANES];
+    unsigned int busy = 0;
+    size_t next = 0;
+    size_t l;
+    int r;
+
+    if (0 == count)
+    {
+        return;
+    }
+
+    for (l = 0; l < N2N_AES_LANES; ++l)
+    {
+        /* An idle lane runs along on its last block, which is not stored. */
+        lane[l] = jobs[0];
+        lane[l].nblocks = 0;
+        x[l] = _mm_setzero_si128();
+    }
+
+    for (;;)
+    {
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            if ((0 == lane[l].nblocks) && (next < count))
+            {
+                lane[l] = jobs[next++];
+                x[l] = _mm_setzero_si128(); /* the IV */
+                busy |= (1U << l);
+            }
+        }
+
+        if (0 == busy)
+        {
+            break;
+        }
+
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            if (lane[l].nblocks)
+            {
+                x[l] = _mm_xor_si128(x[l], _mm_loadu_si128((const __m128i *) lane[l].buf));
+            }
+            x[l] = _mm_xor_si128(x[l], lane[l].keys[0]);
+        }
+
+        for (r = 1; r < rounds; ++r)
+        {
+            for (l = 0; l < N2N_AES_LANES; ++l)
+            {
+                x[l] = _mm_aesenc_si128(x[l], lane[l].keys[r]);
+            }
+        }
+
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            x[l] = _mm_aesenclast_si128(x[l], lane[l].keys[rounds]);
+
+            if (lane[l].nblocks)
+            {
+                _mm_storeu_si128((__m128i *) lane[l].buf, x[l]);
+                lane[l].buf += AES_BLOCK_SIZE;
+
+                if (0 == --(lane[l].nblocks))
+                {
+                    busy &= ~(1U << l);
+                }
+            }
+        }
+    }
+}
+
+/** CBC-decrypt the count jobs, all of rounds rounds, from a zero IV. */
+__attribute__((target("aes")))
+static void aes_ni_cbc_decrypt(const struct aes_ni_job *jobs, size_t count, int rounds)
+{
+    struct aes_ni_job lane[N2N_AES_LANES];
+    __m128i prev[N2N_AES_LANES];
+    __m128i c[N2N_AES_LANES];
+    __m128i x[N2N_AES_LANES];
+    unsigned int busy = 0;
+    size_t next = 0;
+    size_t l;
+    int r;
+
+    if (0 == count)
+    {
+        return;
+    }
+
+    for (l = 0; l < N2N_AES_LANES; ++l)
+    {
+        lane[l] = jobs[0];
+        lane[l].nblocks = 0;
+        prev[l] = _mm_setzero_si128();
+        c[l] = _mm_setzero_si128();
+    }
+
+    for (;;)
+    {
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            if ((0 == lane[l].nblocks) && (next < count))
+            {
+                lane[l] = jobs[next++];
+                prev[l] = _mm_setzero_si128(); /* the IV */
+                busy |= (1U << l);
+            }
+        }
+
+        if (0 == busy)
+        {
+            break;
+        }
+
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            if (lane[l].nblocks)
+            {
+                c[l] = _mm_loadu_si128((const __m128i *) lane[l].buf);
+            }
+            x[l] = _mm_xor_si128(c[l], lane[l].keys[0]);
+        }
+
+        for (r = 1; r < rounds; ++r)
+        {
+            for (l = 0; l < N2N_AES_LANES; ++l)
+            {
+                x[l] = _mm_aesdec_si128(x[l], lane[l].keys[r]);
+            }
+        }
+
+        for (l = 0; l < N2N_AES_LANES; ++l)
+        {
+            x[l] = _mm_aesdeclast_si128(x[l], lane[l].keys[rounds]);
+
+            if (lane[l].nblocks)
+            {
+                _mm_storeu_si128((__m128i *) lane[l].buf, _mm_xor_si128(x[l], prev[l]));
+                prev[l] = c[l];
+                lane[l].buf += AES_BLOCK_SIZE;
+
+                if (0 == --(lane[l].nblocks))
+                {
+                    busy &= ~(1U << l);
+                }
+            }
+        }
+    }
+}
+
+/** Encode a batch of payloads in place, as transop_encode_aes_inplace(). */
+static size_t transop_encode_aes_batch(n2n_trans_op_t   *arg,
+                                       n2n_trans_buf_t  *bufs,
+                                       size_t            count)
+{
+    transop_aes_t *priv = (transop_aes_t *) arg->priv;
+    struct aes_ni_job jobs[N2N_AES_MAX_JOBS];
+    size_t njobs = 0;
+    size_t done = 0;
+    sa_aes_t *sa;
+    size_t i;
+
+    if (count > N2N_AES_MAX_JOBS)
+    {
+        return transop_encode_aes_batch(arg, bufs, N2N_AES_MAX_JOBS) +
+               transop_encode_aes_batch(arg, bufs + N2N_AES_MAX_JOBS, count - N2N_AES_MAX_JOBS);
+    }
+
+    sa = &(priv->sa[aes_choose_tx_sa(priv)]);
+
+    for (i = 0; i < count; ++i)
+    {
+        n2n_trans_buf_t *b = &(bufs[i]);
+
+        if (0 == sa->ni_rounds)
+        {
+            b->ret = transop_encode_aes_inplace(arg, b->buf, b->len, b->tailroom);
+        }
+        else
+        {
+            b->ret = aes_encode_prepare(sa, b->buf, b->len, b->tailroom);
+
+            if (b->ret > 0)
+            {
+                jobs[njobs].buf = b->buf - TRANSOP_AES_NONCE_SIZE;
+                jobs[njobs].nblocks = b->ret / AES_BLOCK_SIZE;
+                jobs[njobs].keys = sa->ni_enc;
+                ++njobs;
+
+                b->ret += TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE; /* size of data carried in UDP. */
+            }
+        }
+
+        done += (b->ret > 0);
+    }
+
+    if (njobs > 0)
+    {
+        aes_ni_cbc_encrypt(jobs, njobs, sa->ni_rounds);
+    }
+
+    return done;
+}
+
+/** Decode a batch of packets in place, as transop_decode_aes_inplace(). */
+static size_t transop_decode_aes_batch(n2n_trans_op_t   *arg,
+                                       n2n_trans_buf_t  *bufs,
+                                       size_t            count)
+{
+    transop_aes_t *priv = (transop_aes_t *) arg->priv;
+    struct aes_ni_job jobs[N2N_AES_MAX_JOBS];
+    n2n_trans_buf_t *owner[N2N_AES_MAX_JOBS];
+    size_t njobs = 0;
+    size_t done = 0;
+    int rounds = 0;
+    size_t i;
+
+    if (count > N2N_AES_MAX_JOBS)
+    {
+        return transop_decode_aes_batch(arg, bufs, N2N_AES_MAX_JOBS) +
+               transop_decode_aes_batch(arg, bufs + N2N_AES_MAX_JOBS, count - N2N_AES_MAX_JOBS);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        n2n_trans_buf_t *b = &(bufs[i]);
+        int len = 0;
+        sa_aes_t *sa = aes_decode_sa(priv, b->buf, b->len, &len);
+
+        b->out = NULL;
+        b->ret = len;
+
+        if (NULL == sa)
+        {
+            continue;
+        }
+
+        if ((sa->ni_rounds > 0) && ((0 == rounds) || (sa->ni_rounds == rounds)))
+        {
+            rounds = sa->ni_rounds;
+            jobs[njobs].buf = b->buf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE;
+            jobs[njobs].nblocks = len / AES_BLOCK_SIZE;
+            jobs[njobs].keys = sa->ni_dec;
+            owner[njobs] = b;
+            ++njobs;
+        }
+        else
+        {
+            /* A key of another size than the rest of the batch. */
+            b->ret = transop_decode_aes_inplace(arg, b->buf, b->len, &(b->out));
+            done += (b->ret > 0);
+        }
+    }
+
+    if (njobs > 0)
+    {
+        aes_ni_cbc_decrypt(jobs, njobs, rounds);
+    }
+
+    for (i = 0; i < njobs; ++i)
+    {
+        owner[i]->ret = aes_decode_unpad(owner[i]->buf + TRANSOP_AES_VER_SIZE + TRANSOP_AES_SA_SIZE,
+                                         owner[i]->ret, &(owner[i]->out));
+        done += (owner[i]->ret > 0);
+    }
+
+    return done;
+}
+
+#endif /* #if defined(N2N_AES_HAVE_AESNI) */
+
 static int transop_addspec_aes(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
 {
     int retval = 1;
@@ -364,8 +825,8 @@ static int transop_addspec_aes(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspe
                 memset(&(sa->enc_key), 0, sizeof(AES_KEY));
                 memset(&(sa->dec_key), 0, sizeof(AES_KEY));
 
-                memset(&(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
-                memset(&(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
+                memset(&(sa->enc_ivec), 0, sizeof(n2n_aes_ivec_t));
+                memset(&(sa->dec_ivec), 0, sizeof(n2n_aes_ivec_t));
 
                 aes_keysize_bytes = aes_best_keysize(pstat);
                 aes_keysize_bits = 8 * aes_keysize_bytes;
@@ -377,6 +838,13 @@ static int transop_addspec_aes(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspe
                 AES_set_encrypt_key(keybuf, aes_keysize_bits, &(sa->enc_key));
                 AES_set_decrypt_key(keybuf, aes_keysize_bits, &(sa->dec_key));
                 /* Leave ivecs set to all zeroes */
+#if defined(N2N_AES_HAVE_AESNI)
+                sa->ni_rounds = 0;
+                if (aes_ni_supported())
+                {
+                    aes_ni_set_keys(sa, keybuf, aes_keysize_bytes);
+                }
+#endif
                 
                 traceDebug("transop_addspec_aes sa_id=%u, %u bits data=%s.\n",
                            priv->sa[priv->num_sa].sa_id, aes_keysize_bits, sep + 1);
@@ -473,6 +941,16 @@ int transop_aes_init(n2n_trans_op_t *ttt)
         ttt->deinit        = transop_deinit_aes;
         ttt->fwd           = transop_encode_aes;
         ttt->rev           = transop_decode_aes;
+        ttt->headroom      = TRANSOP_AES_HEADROOM;
+        ttt->fwd_inplace   = transop_encode_aes_inplace;
+        ttt->rev_inplace   = transop_decode_aes_inplace;
+#if defined(N2N_AES_HAVE_AESNI)
+        if (aes_ni_supported())
+        {
+            ttt->fwd_batch = transop_encode_aes_batch;
+            ttt->rev_batch = transop_decode_aes_batch;
+        }
+#endif
 
         for (i = 0; i < N2N_AES_NUM_SA; ++i)
         {
@@ -480,9 +958,12 @@ int transop_aes_init(n2n_trans_op_t *ttt)
             sa->sa_id = 0;
             memset(&(sa->spec),     0, sizeof(n2n_cipherspec_t));
             memset(&(sa->enc_key),  0, sizeof(AES_KEY));
-            memset(&(sa->enc_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
+            memset(&(sa->enc_ivec), 0, sizeof(n2n_aes_ivec_t));
             memset(&(sa->dec_key),  0, sizeof(AES_KEY));
-            memset(&(sa->dec_ivec), 0, sizeof(N2N_AES_IVEC_SIZE));
+            memset(&(sa->dec_ivec), 0, sizeof(n2n_aes_ivec_t));
+#if defined(N2N_AES_HAVE_AESNI)
+            sa->ni_rounds = 0;
+#endif
         }
 
         retval = 0;
@@ -0,0 +1,530 @@
+/*
+ * transform_aesgcm.c
+ *
+ * AES-GCM transform. Keyed like AES-CBC from the key schedule, but each frame
+ * is sealed with an AEAD cipher through the OpenSSL EVP interface, which uses
+ * AES-NI and carry-less multiplication where the CPU has them. There is no
+ * padding; the frame grows by the nonce and the tag only.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#if defined(N2N_HAVE_AES)
+
+
+#include "openssl/evp.h"
+#include "openssl/rand.h"
+#ifndef _MSC_VER
+/* Not included in Visual Studio 2008 */
+#include <strings.h> /* index() */
+#endif
+
+#define N2N_AESGCM_NUM_SA               32 /* space for SAs */
+
+#define N2N_AESGCM_TRANSFORM_VERSION    1  /* version of the transform encoding */
+
+#define TRANSOP_AESGCM_VER_SIZE         1
+#define TRANSOP_AESGCM_SA_SIZE          4
+#define TRANSOP_AESGCM_IV_SIZE          12
+#define TRANSOP_AESGCM_TAG_SIZE         16
+#define TRANSOP_AESGCM_AAD_SIZE         (TRANSOP_AESGCM_VER_SIZE + TRANSOP_AESGCM_SA_SIZE)
+
+#define TRANSOP_AESGCM_HEADROOM         (TRANSOP_AESGCM_AAD_SIZE + TRANSOP_AESGCM_IV_SIZE)
+#define TRANSOP_AESGCM_TAILROOM         TRANSOP_AESGCM_TAG_SIZE
+
+struct sa_aesgcm
+{
+    n2n_cipherspec_t    spec;           /* cipher spec parameters */
+    n2n_sa_t            sa_id;          /* security association index */
+    EVP_CIPHER_CTX     *enc_ctx;        /* tx key schedule */
+    EVP_CIPHER_CTX     *dec_ctx;        /* rx key schedule */
+    uint8_t             iv[TRANSOP_AESGCM_IV_SIZE]; /* next tx IV */
+};
+
+typedef struct sa_aesgcm sa_aesgcm_t;
+
+
+/** AES-GCM transform state data.
+ *
+ *  Like that of AES-CBC: the SAs of the key schedule, each with a lifetime
+ *  and an SA number. The cipher contexts of an SA are set up with its key
+ *  when the SA is added so that a frame only loads its IV.
+ */
+struct transop_aesgcm
+{
+    ssize_t             tx_sa;
+    size_t              num_sa;
+    sa_aesgcm_t         sa[N2N_AESGCM_NUM_SA];
+};
+
+typedef struct transop_aesgcm transop_aesgcm_t;
+
+static int transop_deinit_aesgcm(n2n_trans_op_t *arg)
+{
+    transop_aesgcm_t *priv = (transop_aesgcm_t *) arg->priv;
+    size_t i;
+
+    if (priv)
+    {
+        for (i = 0; i < N2N_AESGCM_NUM_SA; ++i)
+        {
+            sa_aesgcm_t *sa = &(priv->sa[i]);
+
+            if (sa->enc_ctx)
+            {
+                EVP_CIPHER_CTX_free(sa->enc_ctx);
+            }
+
+            if (sa->dec_ctx)
+            {
+                EVP_CIPHER_CTX_free(sa->dec_ctx);
+            }
+        }
+
+        free(priv);
+    }
+
+    arg->priv = NULL; /* return to fully uninitialised state */
+
+    return 0;
+}
+
+/** Step the IV of sa on to the next frame. The first four octets are fixed,
+ *  the last eight count frames big-endian from a random start. */
+static void aesgcm_next_iv(sa_aesgcm_t *sa)
+{
+    size_t i = TRANSOP_AESGCM_IV_SIZE;
+
+    while ((i > 4) && (0 == ++(sa->iv[i - 1])))
+    {
+        --i;
+    }
+}
+
+/** The AES-GCM packet format consists of:
+ *
+ *  - a 8-bit encoding version in clear text
+ *  - a 32-bit SA number in clear text
+ *  - the 96-bit IV in clear text
+ *  - the payload encrypted, not padded
+ *  - the 128-bit tag over the version, SA number and ciphertext.
+ *
+ *  [V|SSSS|iiiiiiiiiiii|DDDDDDDDDDDDDDDDDDD|tttttttttttttttt]
+ *                      |<-- encrypted -->|
+ *
+ *  The version, SA and IV are written in the headroom in front of the
+ *  payload, the payload is encrypted where it lies and the tag is written
+ *  after it.
+ */
+static int transop_encode_aesgcm_inplace(n2n_trans_op_t  *arg,
+                                         uint8_t         *payload,
+                                         size_t           in_len,
+                                         size_t           tailroom)
+{
+    transop_aesgcm_t *priv = (transop_aesgcm_t *) arg->priv;
+    uint8_t *outbuf = payload - TRANSOP_AESGCM_HEADROOM;
+    sa_aesgcm_t *sa;
+    size_t idx = 0;
+    int len = 0;
+    int flen = 0;
+
+    if (tailroom < TRANSOP_AESGCM_TAILROOM)
+    {
+        traceError("encode_aesgcm no room for the tag.");
+        return -1;
+    }
+
+    if ((priv->tx_sa < 0) || (NULL == priv->sa[priv->tx_sa].enc_ctx))
+    {
+        traceError("encode_aesgcm no SA to encode with.");
+        return -1;
+    }
+
+    sa = &(priv->sa[priv->tx_sa]); /* The transmit sa is periodically updated in tick */
+
+    traceDebug("encode_aesgcm %lu with SA %lu.", in_len, sa->sa_id);
+
+    encode_uint8(outbuf, &idx, N2N_AESGCM_TRANSFORM_VERSION);
+    encode_uint32(outbuf, &idx, sa->sa_id);
+    encode_buf(outbuf, &idx, sa->iv, TRANSOP_AESGCM_IV_SIZE);
+
+    aesgcm_next_iv(sa);
+
+    if ((1 != EVP_EncryptInit_ex(sa->enc_ctx, NULL, NULL, NULL, outbuf + TRANSOP_AESGCM_AAD_SIZE)) ||
+        (1 != EVP_EncryptUpdate(sa->enc_ctx, NULL, &len, outbuf, TRANSOP_AESGCM_AAD_SIZE)) ||
+        (1 != EVP_EncryptUpdate(sa->enc_ctx, payload, &len, payload, in_len)) ||
+        (1 != EVP_EncryptFinal_ex(sa->enc_ctx, payload + len, &flen)) ||
+        (1 != EVP_CIPHER_CTX_ctrl(sa->enc_ctx, EVP_CTRL_GCM_GET_TAG, TRANSOP_AESGCM_TAG_SIZE,
+                                  payload + in_len)))
+    {
+        traceError("encode_aesgcm failed to encrypt.");
+        return -1;
+    }
+
+    return TRANSOP_AESGCM_HEADROOM + in_len + TRANSOP_AESGCM_TAG_SIZE;
+}
+
+/** Encode inbuf into outbuf. See transop_encode_aesgcm_inplace(). */
+static int transop_encode_aesgcm(n2n_trans_op_t  *arg,
+                                 uint8_t         *outbuf,
+                                 size_t           out_len,
+                                 const uint8_t   *inbuf,
+                                 size_t           in_len)
+{
+    if ((in_len + TRANSOP_AESGCM_HEADROOM + TRANSOP_AESGCM_TAILROOM) > out_len)
+    {
+        traceError("encode_aesgcm outbuf too small.");
+        return -1;
+    }
+
+    memcpy(outbuf + TRANSOP_AESGCM_HEADROOM, inbuf, in_len);
+
+    return transop_encode_aesgcm_inplace(arg, outbuf + TRANSOP_AESGCM_HEADROOM, in_len,
+                                         out_len - TRANSOP_AESGCM_HEADROOM - in_len);
+}
+
+
+/* Search through the array of SAs to find the one with the required ID.
+ *
+ * @return array index where found or -1 if not found
+ */
+static ssize_t aesgcm_find_sa(const transop_aesgcm_t *priv, const n2n_sa_t req_id)
+{
+    size_t i;
+
+    for (i = 0; i < priv->num_sa; ++i)
+    {
+        if (req_id == priv->sa[i].sa_id)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/** Check and decrypt the ciphertext of inbuf into out, which may be the
+ *  ciphertext itself. See transop_encode_aesgcm_inplace() for the format.
+ *
+ *  @return length of the payload, or 0 if the packet is not authentic or
+ *  cannot be decoded
+ */
+static int aesgcm_decode(transop_aesgcm_t *priv,
+                         const uint8_t    *inbuf,
+                         size_t            in_len,
+                         uint8_t          *out)
+{
+    n2n_sa_t   sa_rx;
+    ssize_t    sa_idx;
+    size_t     rem = in_len;
+    size_t     idx = 0;
+    uint8_t    ver = 0;
+    sa_aesgcm_t *sa;
+    const uint8_t *ciphertext = inbuf + TRANSOP_AESGCM_HEADROOM;
+    int        clen;
+    int        len = 0;
+    int        flen = 0;
+
+    if (in_len < (TRANSOP_AESGCM_HEADROOM + TRANSOP_AESGCM_TAG_SIZE))
+    {
+        traceError("decode_aesgcm inbuf wrong size (%ul) to decrypt.", in_len);
+        return 0;
+    }
+
+    decode_uint8(&ver, inbuf, &rem, &idx);
+    if (N2N_AESGCM_TRANSFORM_VERSION != ver)
+    {
+        traceError("decode_aesgcm unsupported version %u.", ver);
+        return 0;
+    }
+
+    decode_uint32(&sa_rx, inbuf, &rem, &idx);
+    sa_idx = aesgcm_find_sa(priv, sa_rx);
+    if (sa_idx < 0)
+    {
+        /* Wrong security association; drop the packet as it is undecodable. */
+        traceError("decode_aesgcm SA number %lu not found.", sa_rx);
+        return 0;
+    }
+
+    sa = &(priv->sa[sa_idx]);
+    clen = in_len - TRANSOP_AESGCM_HEADROOM - TRANSOP_AESGCM_TAG_SIZE;
+
+    traceDebug("decode_aesgcm %lu with SA %lu.", in_len, sa->sa_id);
+
+    if ((1 != EVP_DecryptInit_ex(sa->dec_ctx, NULL, NULL, NULL, inbuf + TRANSOP_AESGCM_AAD_SIZE)) ||
+        (1 != EVP_DecryptUpdate(sa->dec_ctx, NULL, &len, inbuf, TRANSOP_AESGCM_AAD_SIZE)) ||
+        (1 != EVP_DecryptUpdate(sa->dec_ctx, out, &len, ciphertext, clen)) ||
+        (1 != EVP_CIPHER_CTX_ctrl(sa->dec_ctx, EVP_CTRL_GCM_SET_TAG, TRANSOP_AESGCM_TAG_SIZE,
+                                  (void *) (ciphertext + clen))) ||
+        (EVP_DecryptFinal_ex(sa->dec_ctx, out + len, &flen) <= 0))
+    {
+        traceWarning("UDP payload decryption failed.");
+        return 0;
+    }
+
+    return clen;
+}
+
+/** Decode inbuf into outbuf. See aesgcm_decode(). */
+static int transop_decode_aesgcm(n2n_trans_op_t   *arg,
+                                 uint8_t          *outbuf,
+                                 size_t            out_len,
+                                 const uint8_t    *inbuf,
+                                 size_t            in_len)
+{
+    if ((in_len >= TRANSOP_AESGCM_HEADROOM + TRANSOP_AESGCM_TAG_SIZE) &&
+        (in_len - TRANSOP_AESGCM_HEADROOM - TRANSOP_AESGCM_TAG_SIZE > out_len))
+    {
+        traceError("decode_aesgcm outbuf too small.");
+        return 0;
+    }
+
+    return aesgcm_decode((transop_aesgcm_t *) arg->priv, inbuf, in_len, outbuf);
+}
+
+/** Decrypt the payload where it lies in buf. See aesgcm_decode(). */
+static int transop_decode_aesgcm_inplace(n2n_trans_op_t   *arg,
+                                         uint8_t          *buf,
+                                         size_t            in_len,
+                                         uint8_t         **payload)
+{
+    *payload = buf + TRANSOP_AESGCM_HEADROOM;
+
+    return aesgcm_decode((transop_aesgcm_t *) arg->priv, buf, in_len, *payload);
+}
+
+/** Load the key of keybuf into ctx for direction enc. */
+static int aesgcm_setup_ctx(EVP_CIPHER_CTX **ctx, const EVP_CIPHER *cipher,
+                            const uint8_t *keybuf, int enc)
+{
+    if (NULL == *ctx)
+    {
+        *ctx = EVP_CIPHER_CTX_new();
+        if (NULL == *ctx)
+        {
+            return -1;
+        }
+    }
+
+    /* The IV is 96 bits, the EVP default for GCM, and is loaded per frame. */
+    if (1 != EVP_CipherInit_ex(*ctx, cipher, NULL, keybuf, NULL, enc))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int transop_addspec_aesgcm(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
+{
+    transop_aesgcm_t *priv = (transop_aesgcm_t *) arg->priv;
+    const char *op = (const char *) cspec->opaque;
+    const char *sep = index(op, '_');
+    uint8_t keybuf[N2N_MAX_KEYSIZE];
+    char tmp[256];
+    const EVP_CIPHER *cipher;
+    n2n_sa_t sa_id;
+    ssize_t sa_idx;
+    ssize_t pstat;
+    sa_aesgcm_t *sa;
+    size_t s;
+
+    if (NULL == sep)
+    {
+        traceError("transop_addspec_aesgcm : bad key data - missing '_'.\n");
+        return 1;
+    }
+
+    s = MIN((size_t) (sep - op), sizeof(tmp) - 1);
+    memcpy(tmp, op, s);
+    tmp[s] = 0;
+    sa_id = strtoul(tmp, NULL, 10);
+
+    memset(keybuf, 0, N2N_MAX_KEYSIZE);
+    pstat = n2n_parse_hex(keybuf, N2N_MAX_KEYSIZE, sep + 1, strlen(sep + 1));
+    if (pstat <= 0)
+    {
+        traceError("transop_addspec_aesgcm : bad key data.\n");
+        return 1;
+    }
+
+    /* A reloaded key schedule replaces the SAs it names again. */
+    sa_idx = aesgcm_find_sa(priv, sa_id);
+    if (sa_idx < 0)
+    {
+        if (priv->num_sa >= N2N_AESGCM_NUM_SA)
+        {
+            traceError("transop_addspec_aesgcm : full.\n");
+            return 1;
+        }
+
+        sa_idx = priv->num_sa;
+    }
+
+    sa = &(priv->sa[sa_idx]);
+
+    /* Shorter keys are padded with zeroes to the next AES key size. */
+    if (pstat > 24)
+    {
+        cipher = EVP_aes_256_gcm();
+    }
+    else if (pstat > 16)
+    {
+        cipher = EVP_aes_192_gcm();
+    }
+    else
+    {
+        cipher = EVP_aes_128_gcm();
+    }
+
+    if ((0 != aesgcm_setup_ctx(&(sa->enc_ctx), cipher, keybuf, 1)) ||
+        (0 != aesgcm_setup_ctx(&(sa->dec_ctx), cipher, keybuf, 0)) ||
+        (1 != RAND_bytes(sa->iv, TRANSOP_AESGCM_IV_SIZE)))
+    {
+        traceError("transop_addspec_aesgcm : cipher setup failed.\n");
+        memset(keybuf, 0, sizeof(keybuf));
+        return 1;
+    }
+
+    memset(keybuf, 0, sizeof(keybuf));
+
+    sa->spec = *cspec;
+    sa->sa_id = sa_id;
+
+    if ((size_t) sa_idx == priv->num_sa)
+    {
+        ++(priv->num_sa);
+    }
+
+    traceDebug("transop_addspec_aesgcm sa_id=%u, %u bits.\n",
+               sa->sa_id, 8 * EVP_CIPHER_key_length(cipher));
+
+    return 0;
+}
+
+
+static n2n_tostat_t transop_tick_aesgcm(n2n_trans_op_t *arg, time_t now)
+{
+    transop_aesgcm_t *priv = (transop_aesgcm_t *) arg->priv;
+    size_t i;
+    n2n_tostat_t r;
+
+    memset(&r, 0, sizeof(r));
+
+    for (i = 0; i < priv->num_sa; ++i)
+    {
+        if (0 == validCipherSpec(&(priv->sa[i].spec), now))
+        {
+            traceInfo("transop_aesgcm choosing tx_sa=%u (valid for %lu sec)",
+                      priv->sa[i].sa_id, priv->sa[i].spec.valid_until - now);
+            priv->tx_sa = i;
+            r.can_tx = 1;
+            r.tx_spec = priv->sa[i].spec;
+            break;
+        }
+    }
+
+    if (0 == r.can_tx)
+    {
+        traceInfo("transop_aesgcm no keys are currently valid. Keeping tx_sa=%d", (int) priv->tx_sa);
+    }
+
+    return r;
+}
+
+
+int transop_aesgcm_init(n2n_trans_op_t *ttt)
+{
+    transop_aesgcm_t *priv = NULL;
+
+    if (ttt->priv)
+    {
+        transop_deinit_aesgcm(ttt);
+    }
+
+    memset(ttt, 0, sizeof(n2n_trans_op_t));
+
+    priv = (transop_aesgcm_t *) calloc(1, sizeof(transop_aesgcm_t));
+    if (NULL == priv)
+    {
+        traceError("Failed to allocate priv for aesgcm");
+        return 1;
+    }
+
+    priv->tx_sa = 0; /* We will use this sa index for encoding. */
+
+    ttt->priv          = priv;
+    ttt->transform_id  = N2N_TRANSFORM_ID_AESGCM;
+    ttt->addspec       = transop_addspec_aesgcm;
+    ttt->tick          = transop_tick_aesgcm; /* chooses a new tx_sa */
+    ttt->deinit        = transop_deinit_aesgcm;
+    ttt->fwd           = transop_encode_aesgcm;
+    ttt->rev           = transop_decode_aesgcm;
+    ttt->headroom      = TRANSOP_AESGCM_HEADROOM;
+    ttt->fwd_inplace   = transop_encode_aesgcm_inplace;
+    ttt->rev_inplace   = transop_decode_aesgcm_inplace;
+
+    return 0;
+}
+
+#else /* #if defined(N2N_HAVE_AES) */
+
+static int transop_deinit_aesgcm(n2n_trans_op_t *arg)
+{
+    arg->priv = NULL;
+
+    return 0;
+}
+
+static int transop_encode_aesgcm(n2n_trans_op_t  *arg,
+                                 uint8_t         *outbuf,
+                                 size_t           out_len,
+                                 const uint8_t   *inbuf,
+                                 size_t           in_len)
+{
+    return -1;
+}
+
+static int transop_decode_aesgcm(n2n_trans_op_t   *arg,
+                                 uint8_t          *outbuf,
+                                 size_t            out_len,
+                                 const uint8_t    *inbuf,
+                                 size_t            in_len)
+{
+    return -1;
+}
+
+static int transop_addspec_aesgcm(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
+{
+    traceDebug("transop_addspec_aesgcm AES not built into edge.\n");
+
+    return -1;
+}
+
+static n2n_tostat_t transop_tick_aesgcm(n2n_trans_op_t *arg, time_t now)
+{
+    n2n_tostat_t r;
+
+    memset(&r, 0, sizeof(r));
+
+    return r;
+}
+
+int transop_aesgcm_init(n2n_trans_op_t *ttt)
+{
+    memset(ttt, 0, sizeof(n2n_trans_op_t));
+
+    ttt->transform_id  = N2N_TRANSFORM_ID_AESGCM;
+    ttt->addspec       = transop_addspec_aesgcm;
+    ttt->tick          = transop_tick_aesgcm;
+    ttt->deinit        = transop_deinit_aesgcm;
+    ttt->fwd           = transop_encode_aesgcm;
+    ttt->rev           = transop_decode_aesgcm;
+
+    return 0;
+}
+
+#endif /* #if defined(N2N_HAVE_AES) */
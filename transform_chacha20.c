@@ -0,0 +1,404 @@
+/*
+ * transform_chacha20.c
+ *
+ * ChaCha20-Poly1305 transform. Keyed like AES from the key schedule; the
+ * cipher is built in (see chacha20poly1305.h), so it is there without OpenSSL
+ * and fast on CPUs without AES instructions.
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+#include "chacha20poly1305.h"
+#ifndef _MSC_VER
+/* Not included in Visual Studio 2008 */
+#include <strings.h> /* index() */
+#endif
+
+#define N2N_CHACHA20_NUM_SA             32 /* space for SAs */
+
+#define N2N_CHACHA20_TRANSFORM_VERSION  1  /* version of the transform encoding */
+
+#define TRANSOP_CHACHA20_VER_SIZE       1
+#define TRANSOP_CHACHA20_SA_SIZE        4
+#define TRANSOP_CHACHA20_AAD_SIZE       (TRANSOP_CHACHA20_VER_SIZE + TRANSOP_CHACHA20_SA_SIZE)
+
+#define TRANSOP_CHACHA20_HEADROOM       (TRANSOP_CHACHA20_AAD_SIZE + CHACHA20_NONCE_SIZE)
+#define TRANSOP_CHACHA20_TAILROOM       POLY1305_TAG_SIZE
+
+struct sa_chacha20
+{
+    n2n_cipherspec_t    spec;           /* cipher spec parameters */
+    n2n_sa_t            sa_id;          /* security association index */
+    chacha20poly1305_t  key;
+    uint8_t             nonce[CHACHA20_NONCE_SIZE]; /* next tx nonce */
+};
+
+typedef struct sa_chacha20 sa_chacha20_t;
+
+
+/** ChaCha20-Poly1305 transform state data: the SAs of the key schedule, each
+ *  with a lifetime and an SA number, as for AES. */
+struct transop_chacha20
+{
+    ssize_t             tx_sa;
+    size_t              num_sa;
+    sa_chacha20_t       sa[N2N_CHACHA20_NUM_SA];
+};
+
+typedef struct transop_chacha20 transop_chacha20_t;
+
+static int transop_deinit_chacha20(n2n_trans_op_t *arg)
+{
+    transop_chacha20_t *priv = (transop_chacha20_t *) arg->priv;
+
+    if (priv)
+    {
+        memset(priv, 0, sizeof(transop_chacha20_t)); /* key matter */
+        free(priv);
+    }
+
+    arg->priv = NULL; /* return to fully uninitialised state */
+
+    return 0;
+}
+
+/** Fill nonce with a random starting point. Nonces need only be unique, so
+ *  without a random source a mix of the time and addresses will do. */
+static void chacha20_seed_nonce(uint8_t nonce[CHACHA20_NONCE_SIZE])
+{
+    size_t i;
+#ifndef WIN32
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd >= 0)
+    {
+        ssize_t r = read(fd, nonce, CHACHA20_NONCE_SIZE);
+
+        close(fd);
+        if (CHACHA20_NONCE_SIZE == r)
+        {
+            return;
+        }
+    }
+#endif
+
+    for (i = 0; i < CHACHA20_NONCE_SIZE; ++i)
+    {
+        nonce[i] ^= (uint8_t) (rand() ^ (time(NULL) >> (8 * (i % 4))) ^ ((size_t) nonce >> (8 * (i % 8))));
+    }
+}
+
+/** Step the nonce of sa on to the next frame. The first four octets are
+ *  fixed, the last eight count frames big-endian from a random start. */
+static void chacha20_next_nonce(sa_chacha20_t *sa)
+{
+    size_t i = CHACHA20_NONCE_SIZE;
+
+    while ((i > 4) && (0 == ++(sa->nonce[i - 1])))
+    {
+        --i;
+    }
+}
+
+/** The ChaCha20-Poly1305 packet format consists of:
+ *
+ *  - a 8-bit encoding version in clear text
+ *  - a 32-bit SA number in clear text
+ *  - the 96-bit nonce in clear text
+ *  - the payload encrypted, not padded
+ *  - the 128-bit Poly1305 tag over the version, SA number and ciphertext.
+ *
+ *  [V|SSSS|nnnnnnnnnnnn|DDDDDDDDDDDDDDDDDDD|tttttttttttttttt]
+ *                      |<-- encrypted -->|
+ *
+ *  The version, SA and nonce are written in the headroom in front of the
+ *  payload, the payload is encrypted where it lies and the tag is written
+ *  after it.
+ */
+static int transop_encode_chacha20_inplace(n2n_trans_op_t  *arg,
+                                           uint8_t         *payload,
+                                           size_t           in_len,
+                                           size_t           tailroom)
+{
+    transop_chacha20_t *priv = (transop_chacha20_t *) arg->priv;
+    uint8_t *outbuf = payload - TRANSOP_CHACHA20_HEADROOM;
+    sa_chacha20_t *sa;
+    size_t idx = 0;
+
+    if (tailroom < TRANSOP_CHACHA20_TAILROOM)
+    {
+        traceError("encode_chacha20 no room for the tag.");
+        return -1;
+    }
+
+    if ((priv->tx_sa < 0) || ((size_t) priv->tx_sa >= priv->num_sa))
+    {
+        traceError("encode_chacha20 no SA to encode with.");
+        return -1;
+    }
+
+    sa = &(priv->sa[priv->tx_sa]); /* The transmit sa is periodically updated in tick */
+
+    traceDebug("encode_chacha20 %lu with SA %lu.", in_len, sa->sa_id);
+
+    encode_uint8(outbuf, &idx, N2N_CHACHA20_TRANSFORM_VERSION);
+    encode_uint32(outbuf, &idx, sa->sa_id);
+    encode_buf(outbuf, &idx, sa->nonce, CHACHA20_NONCE_SIZE);
+
+    chacha20_next_nonce(sa);
+
+    chacha20poly1305_seal(&(sa->key), outbuf + TRANSOP_CHACHA20_AAD_SIZE,
+                          outbuf, TRANSOP_CHACHA20_AAD_SIZE,
+                          payload, in_len, payload + in_len);
+
+    return TRANSOP_CHACHA20_HEADROOM + in_len + POLY1305_TAG_SIZE;
+}
+
+/** Encode inbuf into outbuf. See transop_encode_chacha20_inplace(). */
+static int transop_encode_chacha20(n2n_trans_op_t  *arg,
+                                   uint8_t         *outbuf,
+                                   size_t           out_len,
+                                   const uint8_t   *inbuf,
+                                   size_t           in_len)
+{
+    if ((in_len + TRANSOP_CHACHA20_HEADROOM + TRANSOP_CHACHA20_TAILROOM) > out_len)
+    {
+        traceError("encode_chacha20 outbuf too small.");
+        return -1;
+    }
+
+    memcpy(outbuf + TRANSOP_CHACHA20_HEADROOM, inbuf, in_len);
+
+    return transop_encode_chacha20_inplace(arg, outbuf + TRANSOP_CHACHA20_HEADROOM, in_len,
+                                           out_len - TRANSOP_CHACHA20_HEADROOM - in_len);
+}
+
+
+/* Search through the array of SAs to find the one with the required ID.
+ *
+ * @return array index where found or -1 if not found
+ */
+static ssize_t chacha20_find_sa(const transop_chacha20_t *priv, const n2n_sa_t req_id)
+{
+    size_t i;
+
+    for (i = 0; i < priv->num_sa; ++i)
+    {
+        if (req_id == priv->sa[i].sa_id)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+/** Check and decrypt the ciphertext of inbuf into out, which may be the
+ *  ciphertext itself. See transop_encode_chacha20_inplace() for the format.
+ *
+ *  @return length of the payload, or 0 if the packet is not authentic or
+ *  cannot be decoded
+ */
+static int chacha20_decode(transop_chacha20_t *priv,
+                           const uint8_t      *inbuf,
+                           size_t              in_len,
+                           uint8_t            *out)
+{
+    n2n_sa_t   sa_rx;
+    ssize_t    sa_idx;
+    size_t     rem = in_len;
+    size_t     idx = 0;
+    uint8_t    ver = 0;
+    size_t     clen;
+
+    if (in_len < (TRANSOP_CHACHA20_HEADROOM + POLY1305_TAG_SIZE))
+    {
+        traceError("decode_chacha20 inbuf wrong size (%ul) to decrypt.", in_len);
+        return 0;
+    }
+
+    decode_uint8(&ver, inbuf, &rem, &idx);
+    if (N2N_CHACHA20_TRANSFORM_VERSION != ver)
+    {
+        traceError("decode_chacha20 unsupported version %u.", ver);
+        return 0;
+    }
+
+    decode_uint32(&sa_rx, inbuf, &rem, &idx);
+    sa_idx = chacha20_find_sa(priv, sa_rx);
+    if (sa_idx < 0)
+    {
+        /* Wrong security association; drop the packet as it is undecodable. */
+        traceError("decode_chacha20 SA number %lu not found.", sa_rx);
+        return 0;
+    }
+
+    clen = in_len - TRANSOP_CHACHA20_HEADROOM - POLY1305_TAG_SIZE;
+
+    traceDebug("decode_chacha20 %lu with SA %lu.", in_len, sa_rx);
+
+    if (0 != chacha20poly1305_open(&(priv->sa[sa_idx].key), inbuf + TRANSOP_CHACHA20_AAD_SIZE,
+                                   inbuf, TRANSOP_CHACHA20_AAD_SIZE,
+                                   inbuf + TRANSOP_CHACHA20_HEADROOM, clen,
+                                   inbuf + TRANSOP_CHACHA20_HEADROOM + clen, out))
+    {
+        traceWarning("UDP payload decryption failed.");
+        return 0;
+    }
+
+    return clen;
+}
+
+/** Decode inbuf into outbuf. See chacha20_decode(). */
+static int transop_decode_chacha20(n2n_trans_op_t   *arg,
+                                   uint8_t          *outbuf,
+                                   size_t            out_len,
+                                   const uint8_t    *inbuf,
+                                   size_t            in_len)
+{
+    if ((in_len >= TRANSOP_CHACHA20_HEADROOM + POLY1305_TAG_SIZE) &&
+        (in_len - TRANSOP_CHACHA20_HEADROOM - POLY1305_TAG_SIZE > out_len))
+    {
+        traceError("decode_chacha20 outbuf too small.");
+        return 0;
+    }
+
+    return chacha20_decode((transop_chacha20_t *) arg->priv, inbuf, in_len, outbuf);
+}
+
+/** Decrypt the payload where it lies in buf. See chacha20_decode(). */
+static int transop_decode_chacha20_inplace(n2n_trans_op_t   *arg,
+                                           uint8_t          *buf,
+                                           size_t            in_len,
+                                           uint8_t         **payload)
+{
+    *payload = buf + TRANSOP_CHACHA20_HEADROOM;
+
+    return chacha20_decode((transop_chacha20_t *) arg->priv, buf, in_len, *payload);
+}
+
+static int transop_addspec_chacha20(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
+{
+    transop_chacha20_t *priv = (transop_chacha20_t *) arg->priv;
+    const char *op = (const char *) cspec->opaque;
+    const char *sep = index(op, '_');
+    uint8_t keybuf[N2N_MAX_KEYSIZE];
+    char tmp[256];
+    n2n_sa_t sa_id;
+    ssize_t sa_idx;
+    ssize_t pstat;
+    sa_chacha20_t *sa;
+    size_t s;
+
+    if (NULL == sep)
+    {
+        traceError("transop_addspec_chacha20 : bad key data - missing '_'.\n");
+        return 1;
+    }
+
+    s = MIN((size_t) (sep - op), sizeof(tmp) - 1);
+    memcpy(tmp, op, s);
+    tmp[s] = 0;
+    sa_id = strtoul(tmp, NULL, 10);
+
+    /* Shorter keys are padded with zeroes to 256 bits. */
+    memset(keybuf, 0, N2N_MAX_KEYSIZE);
+    pstat = n2n_parse_hex(keybuf, N2N_MAX_KEYSIZE, sep + 1, strlen(sep + 1));
+    if (pstat <= 0)
+    {
+        traceError("transop_addspec_chacha20 : bad key data.\n");
+        return 1;
+    }
+
+    /* A reloaded key schedule replaces the SAs it names again. */
+    sa_idx = chacha20_find_sa(priv, sa_id);
+    if (sa_idx < 0)
+    {
+        if (priv->num_sa >= N2N_CHACHA20_NUM_SA)
+        {
+            traceError("transop_addspec_chacha20 : full.\n");
+            return 1;
+        }
+
+        sa_idx = priv->num_sa++;
+    }
+
+    sa = &(priv->sa[sa_idx]);
+    sa->spec = *cspec;
+    sa->sa_id = sa_id;
+    chacha20poly1305_init(&(sa->key), keybuf);
+    chacha20_seed_nonce(sa->nonce);
+
+    memset(keybuf, 0, sizeof(keybuf));
+
+    traceDebug("transop_addspec_chacha20 sa_id=%u, %u key bytes, %s kernel.\n",
+               sa->sa_id, (unsigned int) pstat, chacha20_kernel_name(chacha20_kernel()));
+
+    return 0;
+}
+
+
+static n2n_tostat_t transop_tick_chacha20(n2n_trans_op_t *arg, time_t now)
+{
+    transop_chacha20_t *priv = (transop_chacha20_t *) arg->priv;
+    size_t i;
+    n2n_tostat_t r;
+
+    memset(&r, 0, sizeof(r));
+
+    for (i = 0; i < priv->num_sa; ++i)
+    {
+        if (0 == validCipherSpec(&(priv->sa[i].spec), now))
+        {
+            traceInfo("transop_chacha20 choosing tx_sa=%u (valid for %lu sec)",
+                      priv->sa[i].sa_id, priv->sa[i].spec.valid_until - now);
+            priv->tx_sa = i;
+            r.can_tx = 1;
+            r.tx_spec = priv->sa[i].spec;
+            break;
+        }
+    }
+
+    if (0 == r.can_tx)
+    {
+        traceInfo("transop_chacha20 no keys are currently valid. Keeping tx_sa=%d", (int) priv->tx_sa);
+    }
+
+    return r;
+}
+
+
+int transop_chacha20_init(n2n_trans_op_t *ttt)
+{
+    transop_chacha20_t *priv = NULL;
+
+    if (ttt->priv)
+    {
+        transop_deinit_chacha20(ttt);
+    }
+
+    memset(ttt, 0, sizeof(n2n_trans_op_t));
+
+    priv = (transop_chacha20_t *) calloc(1, sizeof(transop_chacha20_t));
+    if (NULL == priv)
+    {
+        traceError("Failed to allocate priv for chacha20");
+        return 1;
+    }
+
+    priv->tx_sa = 0; /* We will use this sa index for encoding. */
+
+    ttt->priv          = priv;
+    ttt->transform_id  = N2N_TRANSFORM_ID_CHACHA20;
+    ttt->addspec       = transop_addspec_chacha20;
+    ttt->tick          = transop_tick_chacha20; /* chooses a new tx_sa */
+    ttt->deinit        = transop_deinit_chacha20;
+    ttt->fwd           = transop_encode_chacha20;
+    ttt->rev           = transop_decode_chacha20;
+    ttt->headroom      = TRANSOP_CHACHA20_HEADROOM;
+    ttt->fwd_inplace   = transop_encode_chacha20_inplace;
+    ttt->rev_inplace   = transop_decode_chacha20_inplace;
+
+    return 0;
+}
@@ -31,6 +31,17 @@ static int transop_encode_null(n2n_trans_op_t   *arg,
     return retval;
 }
 
+/** The payload is its own encoding. */
+static int transop_encode_null_inplace(n2n_trans_op_t   *arg,
+                                       uint8_t          *payload,
+                                       size_t            in_len,
+                                       size_t            tailroom)
+{
+    traceDebug("encode_null %lu in place", in_len);
+
+    return in_len;
+}
+
 static int transop_decode_null(n2n_trans_op_t   *arg,
                                uint8_t          *outbuf,
                                size_t            out_len,
@@ -53,6 +64,53 @@ static int transop_decode_null(n2n_trans_op_t   *arg,
     return retval;
 }
 
+/** The payload is its own decoding. */
+static int transop_decode_null_inplace(n2n_trans_op_t   *arg,
+                                       uint8_t          *buf,
+                                       size_t            in_len,
+                                       uint8_t         **payload)
+{
+    traceDebug("decode_null %lu in place", in_len);
+    *payload = buf;
+
+    return in_len;
+}
+
+/** Each payload is its own encoding. */
+static size_t transop_encode_null_batch(n2n_trans_op_t   *arg,
+                                        n2n_trans_buf_t  *bufs,
+                                        size_t            count)
+{
+    size_t done = 0;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].ret = bufs[i].len;
+        done += (bufs[i].ret > 0);
+    }
+
+    return done;
+}
+
+/** Each payload is its own decoding. */
+static size_t transop_decode_null_batch(n2n_trans_op_t   *arg,
+                                        n2n_trans_buf_t  *bufs,
+                                        size_t            count)
+{
+    size_t done = 0;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        bufs[i].out = bufs[i].buf;
+        bufs[i].ret = bufs[i].len;
+        done += (bufs[i].ret > 0);
+    }
+
+    return done;
+}
+
 static int transop_addspec_null(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
 {
     return 0;
@@ -81,4 +139,9 @@ void transop_null_init(n2n_trans_op_t *ttt)
     ttt->tick           = transop_tick_null;
     ttt->fwd            = transop_encode_null;
     ttt->rev            = transop_decode_null;
+    ttt->headroom       = 0;
+    ttt->fwd_inplace    = transop_encode_null_inplace;
+    ttt->rev_inplace    = transop_decode_null_inplace;
+    ttt->fwd_batch      = transop_encode_null_batch;
+    ttt->rev_batch      = transop_decode_null_batch;
 }
@@ -80,6 +80,9 @@ static size_t tf_choose_tx_sa(transop_tf_t *priv)
 #define TRANSOP_TF_NONCE_SIZE   4
 #define TRANSOP_TF_SA_SIZE      4
 
+#define TRANSOP_TF_HEADROOM     (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE)
+#define TRANSOP_TF_TAILROOM     TwoFish_BLOCK_SIZE /* A short last block is written out whole. */
+
 /** The twofish packet format consists of:
  *
  *  - a 8-bit twofish encoding version in clear text
@@ -88,73 +91,85 @@ static size_t tf_choose_tx_sa(transop_tf_t *priv)
  *
  *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
  *         |<------ encrypted ------>|
+ *
+ *  The version, SA and nonce are written in the headroom in front of the
+ *  payload and the nonce and payload are encrypted where they lie.
  */
-static int transop_encode_twofish(n2n_trans_op_t   *arg,
-                                  uint8_t          *outbuf,
-                                  size_t            out_len,
-                                  const uint8_t    *inbuf,
-                                  size_t            in_len)
+static int transop_encode_twofish_inplace(n2n_trans_op_t   *arg,
+                                          uint8_t          *payload,
+                                          size_t            in_len,
+                                          size_t            tailroom)
 {
     int len = -1;
     transop_tf_t *priv = (transop_tf_t *) arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
-    uint32_t *pnonce;
+    uint8_t *outbuf = payload - TRANSOP_TF_HEADROOM;
+    uint32_t nonce;
 
-    if ((in_len + TRANSOP_TF_NONCE_SIZE) <= N2N_PKT_BUF_SIZE)
+    if (tailroom >= TRANSOP_TF_TAILROOM)
     {
-        if ((in_len + TRANSOP_TF_NONCE_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_VER_SIZE) <= out_len)
-        {
-            size_t idx = 0;
-            sa_twofish_t *sa;
-            size_t tx_sa_num = 0;
+        size_t idx = 0;
+        sa_twofish_t *sa;
+        size_t tx_sa_num = 0;
 
-            /* The transmit sa is periodically updated */
-            tx_sa_num = tf_choose_tx_sa(priv);
+        /* The transmit sa is periodically updated */
+        tx_sa_num = tf_choose_tx_sa(priv);
 
-            sa = &(priv->sa[tx_sa_num]); /* Proper Tx SA index */
+        sa = &(priv->sa[tx_sa_num]); /* Proper Tx SA index */
 
-            traceDebug("encode_twofish %lu with SA %lu.", in_len, sa->sa_id);
+        traceDebug("encode_twofish %lu with SA %lu.", in_len, sa->sa_id);
 
-            /* Encode the twofish format version. */
-            encode_uint8(outbuf, &idx, N2N_TWOFISH_TRANSFORM_VERSION);
+        /* Encode the twofish format version. */
+        encode_uint8(outbuf, &idx, N2N_TWOFISH_TRANSFORM_VERSION);
 
-            /* Encode the security association (SA) number */
-            encode_uint32(outbuf, &idx, sa->sa_id);
+        /* Encode the security association (SA) number */
+        encode_uint32(outbuf, &idx, sa->sa_id);
 
-            /* The assembly buffer is a source for encrypting data. The nonce is
-             * written in first followed by the packet payload. The whole
-             * contents of assembly are encrypted. */
-            pnonce = (uint32_t *) assembly;
-            *pnonce = rand();
-            memcpy(assembly + TRANSOP_TF_NONCE_SIZE, inbuf, in_len);
+        /* The nonce goes right in front of the payload. Both are encrypted
+         * in place. */
+        nonce = rand();
+        memcpy(payload - TRANSOP_TF_NONCE_SIZE, &nonce, TRANSOP_TF_NONCE_SIZE);
 
-            /* Encrypt the assembly contents and write the ciphertext after the SA. */
-            len = TwoFishEncryptRaw(assembly, /* source */
-                                    outbuf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE,
-                                    in_len + TRANSOP_TF_NONCE_SIZE, /* enc size */
-                                    sa->enc_tf);
-            if (len > 0)
-            {
-                len += TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE; /* size of data carried in UDP. */
-            }
-            else
-            {
-                traceError("encode_twofish encryption failed.");
-            }
+        len = TwoFishEncryptRaw(payload - TRANSOP_TF_NONCE_SIZE, /* source */
+                                payload - TRANSOP_TF_NONCE_SIZE, /* dest */
+                                in_len + TRANSOP_TF_NONCE_SIZE, /* enc size */
+                                sa->enc_tf);
+        if (len > 0)
+        {
+            len += TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE; /* size of data carried in UDP. */
         }
         else
         {
-            traceError("encode_twofish outbuf too small.");
+            traceError("encode_twofish encryption failed.");
+            len = -1;
         }
     }
     else
     {
-        traceError("encode_twofish inbuf too big to encrypt.");
+        traceError("encode_twofish no room for the last cipher block.");
     }
 
     return len;
 }
 
+/** Encode inbuf into outbuf. See transop_encode_twofish_inplace(). */
+static int transop_encode_twofish(n2n_trans_op_t   *arg,
+                                  uint8_t          *outbuf,
+                                  size_t            out_len,
+                                  const uint8_t    *inbuf,
+                                  size_t            in_len)
+{
+    if ((in_len + TRANSOP_TF_HEADROOM + TRANSOP_TF_TAILROOM) > out_len)
+    {
+        traceError("encode_twofish outbuf too small.");
+        return -1;
+    }
+
+    memcpy(outbuf + TRANSOP_TF_HEADROOM, inbuf, in_len);
+
+    return transop_encode_twofish_inplace(arg, outbuf + TRANSOP_TF_HEADROOM, in_len,
+                                          out_len - TRANSOP_TF_HEADROOM - in_len);
+}
+
 
 /* Search through the array of SAs to find the one with the required ID.
  *
@@ -187,19 +202,19 @@ static ssize_t twofish_find_sa(const transop_tf_t *priv, const n2n_sa_t req_id)
  *
  *  [V|SSSS|nnnnDDDDDDDDDDDDDDDDDDDDD]
  *         |<------ encrypted ------>|
+ *
+ *  The ciphertext is decrypted into assembly, which may be the ciphertext
+ *  itself. On success *payload points at the payload inside assembly.
  */
-static int transop_decode_twofish(n2n_trans_op_t   *arg,
-                                  uint8_t          *outbuf,
-                                  size_t            out_len,
-                                  const uint8_t    *inbuf,
-                                  size_t            in_len)
+static int twofish_decode(transop_tf_t     *priv,
+                          const uint8_t    *inbuf,
+                          size_t            in_len,
+                          uint8_t          *assembly,
+                          uint8_t         **payload)
 {
     int len = 0;
-    transop_tf_t *priv = (transop_tf_t *) arg->priv;
-    uint8_t assembly[N2N_PKT_BUF_SIZE];
 
-    if (   ((in_len - (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE)) <= N2N_PKT_BUF_SIZE)     /* Cipher text fits in assembly */
-        && (in_len >= (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE))) /* Has at least version, SA and nonce */
+    if (in_len >= (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_NONCE_SIZE)) /* Has at least version, SA and nonce */
     {
         n2n_sa_t sa_rx;
         ssize_t sa_idx = -1;
@@ -232,9 +247,7 @@ static int transop_decode_twofish(n2n_trans_op_t   *arg,
                     /* Step over 4-byte random nonce value */
                     len -= TRANSOP_TF_NONCE_SIZE; /* size of ethernet packet */
 
-                    memcpy(outbuf,
-                           assembly + TRANSOP_TF_NONCE_SIZE,
-                           len);
+                    *payload = assembly + TRANSOP_TF_NONCE_SIZE;
                 }
                 else
                 {
@@ -266,6 +279,48 @@ static int transop_decode_twofish(n2n_trans_op_t   *arg,
     return len;
 }
 
+/** Decode inbuf into outbuf. See twofish_decode(). */
+static int transop_decode_twofish(n2n_trans_op_t   *arg,
+                                  uint8_t          *outbuf,
+                                  size_t            out_len,
+                                  const uint8_t    *inbuf,
+                                  size_t            in_len)
+{
+    uint8_t assembly[N2N_PKT_BUF_SIZE];
+    uint8_t *payload = NULL;
+    int len;
+
+    if ((in_len - (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE)) > N2N_PKT_BUF_SIZE) /* Cipher text fits in assembly */
+    {
+        traceError("decode_twofish inbuf wrong size (%ul) to decrypt.", in_len);
+        return 0;
+    }
+
+    len = twofish_decode((transop_tf_t *) arg->priv, inbuf, in_len, assembly, &payload);
+
+    if (len > (int) out_len)
+    {
+        traceError("decode_twofish outbuf too small.");
+        len = 0;
+    }
+    else if (len > 0)
+    {
+        memcpy(outbuf, payload, len);
+    }
+
+    return len;
+}
+
+/** Decrypt the payload where it lies in buf. See twofish_decode(). */
+static int transop_decode_twofish_inplace(n2n_trans_op_t   *arg,
+                                          uint8_t          *buf,
+                                          size_t            in_len,
+                                          uint8_t         **payload)
+{
+    return twofish_decode((transop_tf_t *) arg->priv, buf, in_len,
+                          buf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE, payload);
+}
+
 static int transop_addspec_twofish(n2n_trans_op_t *arg, const n2n_cipherspec_t *cspec)
 {
     int retval = 1;
@@ -416,6 +471,9 @@ int transop_twofish_setup(n2n_trans_op_t *ttt,
             ttt->tick          = transop_tick_twofish; /* chooses a new tx_sa */
             ttt->fwd           = transop_encode_twofish;
             ttt->rev           = transop_decode_twofish;
+            ttt->headroom      = TRANSOP_TF_HEADROOM;
+            ttt->fwd_inplace   = transop_encode_twofish_inplace;
+            ttt->rev_inplace   = transop_decode_twofish_inplace;
 
             retval = 0;
         }
@@ -463,6 +521,9 @@ int transop_twofish_init(n2n_trans_op_t *ttt)
         ttt->deinit         = transop_deinit_twofish;
         ttt->fwd            = transop_encode_twofish;
         ttt->rev            = transop_decode_twofish;
+        ttt->headroom       = TRANSOP_TF_HEADROOM;
+        ttt->fwd_inplace    = transop_encode_twofish_inplace;
+        ttt->rev_inplace    = transop_decode_twofish_inplace;
 
         for (i = 0; i < N2N_TWOFISH_NUM_SA; ++i)
         {
@@ -16,6 +16,7 @@
 */
 
 #include "n2n.h"
+#include "n2n_vnet.h"
 
 #ifdef __linux__
 
@@ -84,9 +85,32 @@ int tuntap_open(tuntap_dev *device,
 
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI; /* Want a TAP device for layer 2 frames. */
+#ifdef N2N_HAVE_TAP_MQ
+    if (device->multi_queue)
+    {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    device->vnet = NULL;
+    if (device->offload)
+    {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+#endif
     strncpy(ifr.ifr_name, dev, IFNAMSIZ);
     rc = ioctl(device->fd, TUNSETIFF, (void *) &ifr);
 
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if ((rc < 0) && device->offload)
+    {
+        traceWarning("TAP offloads unavailable [%s]; continuing without", strerror(errno));
+        device->offload = 0;
+        ifr.ifr_flags &= ~IFF_VNET_HDR;
+        rc = ioctl(device->fd, TUNSETIFF, (void *) &ifr);
+    }
+#endif
+
     if (rc < 0)
     {
         traceError("ioctl() [%s][%d]\n", strerror(errno), rc);
@@ -94,6 +118,14 @@ int tuntap_open(tuntap_dev *device,
         return -1;
     }
 
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if (device->offload && (NULL == (device->vnet = vnet_open(device->fd))))
+    {
+        close(device->fd);
+        return -1;
+    }
+#endif
+
     /* Store the device name for later reuse */
     strncpy(device->dev_name, ifr.ifr_name, MIN(IFNAMSIZ, N2N_IFNAMSIZ));
 
@@ -140,19 +172,108 @@ int tuntap_open(tuntap_dev *device,
 
 int tuntap_read(struct tuntap_dev *tuntap, unsigned char *buf, int len)
 {
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if (NULL != tuntap->vnet)
+    {
+        return vnet_read(tuntap->vnet, buf, len);
+    }
+#endif
     return (read(tuntap->fd, buf, len));
 }
 
 int tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len)
 {
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if (NULL != tuntap->vnet)
+    {
+        return vnet_write(tuntap->vnet, buf, len);
+    }
+#endif
     return (write(tuntap->fd, buf, len));
 }
 
 void tuntap_close(struct tuntap_dev *tuntap)
 {
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    vnet_free(tuntap->vnet);
+    tuntap->vnet = NULL;
+#endif
     close(tuntap->fd);
 }
 
+#ifdef N2N_HAVE_TAP_OFFLOAD
+/** Non-zero while segments of a large frame already read remain to be
+ *  returned by tuntap_read(), which then does not block. */
+int tuntap_pending(const struct tuntap_dev *tuntap)
+{
+    return (NULL != tuntap->vnet) && vnet_pending(tuntap->vnet);
+}
+
+/** Write the frames tuntap_write() held back to coalesce them. Called once
+ *  per main loop iteration. */
+void tuntap_flush(struct tuntap_dev *tuntap)
+{
+    if (NULL != tuntap->vnet)
+    {
+        vnet_flush(tuntap->vnet);
+    }
+}
+#endif
+
+#ifdef N2N_HAVE_TAP_MQ
+/** Attach one more queue to a device opened with multi_queue set. Frames
+ *  sent by the kernel are spread over the queues by flow; frames may be
+ *  written to any queue. On success queue becomes a copy of tuntap for the
+ *  new queue, with offload state of its own.
+ *
+ *  @return - negative value on error
+ *          - file-descriptor of the new queue on success
+ */
+int tuntap_open_queue(const struct tuntap_dev *tuntap, struct tuntap_dev *queue)
+{
+    struct ifreq ifr;
+    int fd;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0)
+    {
+        traceError("open(/dev/net/tun) [%s][%d]", strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE;
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if (NULL != tuntap->vnet)
+    {
+        ifr.ifr_flags |= IFF_VNET_HDR; /* The flags apply to the whole device. */
+    }
+#endif
+    strncpy(ifr.ifr_name, tuntap->dev_name, IFNAMSIZ);
+
+    if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0)
+    {
+        traceError("ioctl(TUNSETIFF) queue on %s [%s][%d]", tuntap->dev_name, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    *queue = *tuntap;
+    queue->fd = fd;
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if ((NULL != tuntap->vnet) && (NULL == (queue->vnet = vnet_new(fd))))
+    {
+        close(fd);
+        queue->fd = -1;
+        return -1;
+    }
+#endif
+
+    return fd;
+}
+#endif
+
 /* Fill out the ip_addr value from the interface. Called to pick up dynamic
  * address changes. */
 void tuntap_get_address(struct tuntap_dev *tuntap)
@@ -113,10 +113,22 @@ static uint32_t TwoFish_MDS[4][256]; /* TwoFish_MDS matrix */
 
 /*#define	TwoFish__b(x,N)	(((uint8_t *)&x)[((N)&3)^TwoFish_ADDR_XOR])*/ /* pick bytes out of a dword */
 
-#define	TwoFish_b0(x)			TwoFish__b(x,0)		/* extract LSB of uint32_t  */
-#define	TwoFish_b1(x)			TwoFish__b(x,1)
-#define	TwoFish_b2(x)			TwoFish__b(x,2)
-#define	TwoFish_b3(x)			TwoFish__b(x,3)		/* extract MSB of uint32_t  */
+#define	TwoFish_b0(x)			((uint8_t)(x))		/* extract LSB of uint32_t  */
+#define	TwoFish_b1(x)			((uint8_t)((x)>>8))
+#define	TwoFish_b2(x)			((uint8_t)((x)>>16))
+#define	TwoFish_b3(x)			((uint8_t)((x)>>24))	/* extract MSB of uint32_t  */
+
+/* The key dependent S-box is four tables of 256 words, one per byte of the
+ * g function input, each entry already multiplied through the MDS matrix. */
+#define	TwoFish_S0(s,i)			((s)[        (i)])
+#define	TwoFish_S1(s,i)			((s)[0x100 + (i)])
+#define	TwoFish_S2(s,i)			((s)[0x200 + (i)])
+#define	TwoFish_S3(s,i)			((s)[0x300 + (i)])
+
+#define	TwoFish_G0(s,x)			(TwoFish_S0(s,TwoFish_b0(x)) ^ TwoFish_S1(s,TwoFish_b1(x)) ^ \
+					 TwoFish_S2(s,TwoFish_b2(x)) ^ TwoFish_S3(s,TwoFish_b3(x)))
+#define	TwoFish_G1(s,x)			(TwoFish_S0(s,TwoFish_b3(x)) ^ TwoFish_S1(s,TwoFish_b0(x)) ^ \
+					 TwoFish_S2(s,TwoFish_b1(x)) ^ TwoFish_S3(s,TwoFish_b2(x)))
 
 uint8_t TwoFish__b(uint32_t x,int n)
 {	n&=3;
@@ -190,6 +202,200 @@ void TwoFishDestroy(TWOFISH *tfdata)
 }
 
 
+/* Little endian words from and to unaligned bytes. */
+static inline uint32_t _TwoFish_Load32(const uint8_t *p)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  uint32_t w;
+
+  memcpy(&w,p,sizeof(w));
+  return w;
+#else
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+#endif
+}
+
+static inline void _TwoFish_Store32(uint8_t *p,uint32_t w)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  memcpy(p,&w,sizeof(w));
+#else
+  p[0] = (uint8_t)(w      );
+  p[1] = (uint8_t)(w >>  8);
+  p[2] = (uint8_t)(w >> 16);
+  p[3] = (uint8_t)(w >> 24);
+#endif
+}
+
+static inline void _TwoFish_LoadBlock(uint32_t x[4],const uint8_t *p)
+{	x[0] = _TwoFish_Load32(p);
+  x[1] = _TwoFish_Load32(p + 4);
+  x[2] = _TwoFish_Load32(p + 8);
+  x[3] = _TwoFish_Load32(p + 12);
+}
+
+static inline void _TwoFish_StoreBlock(uint8_t *p,const uint32_t x[4])
+{	_TwoFish_Store32(p,      x[0]);
+  _TwoFish_Store32(p + 4,  x[1]);
+  _TwoFish_Store32(p + 8,  x[2]);
+  _TwoFish_Store32(p + 12, x[3]);
+}
+
+/* Encrypt one block held as words. out receives the words in the order they
+ * are stored, and may be the same as in. */
+static inline void _TwoFish_EncryptWords(const uint32_t in[4],uint32_t out[4],const TWOFISH *tfdata)
+{	const uint32_t *s = tfdata->sBox;
+  const uint32_t *k = tfdata->subKeys + 8;
+  uint32_t x0 = in[0] ^ tfdata->subKeys[0];
+  uint32_t x1 = in[1] ^ tfdata->subKeys[1];
+  uint32_t x2 = in[2] ^ tfdata->subKeys[2];
+  uint32_t x3 = in[3] ^ tfdata->subKeys[3];
+  uint32_t t0,t1;
+  int R;
+
+  for (R = 0; R < TwoFish_ROUNDS; R += 2, k += 4)
+    {   t0 = TwoFish_G0(s, x0);
+      t1 = TwoFish_G1(s, x1);
+      x2 ^= t0 + t1 + k[0];
+      x2  = x2 >> 1 | x2 << 31;
+      x3  = x3 << 1 | x3 >> 31;
+      x3 ^= t0 + (t1<<1) + k[1];
+
+      t0 = TwoFish_G0(s, x2);
+      t1 = TwoFish_G1(s, x3);
+      x0 ^= t0 + t1 + k[2];
+      x0  = x0 >> 1 | x0 << 31;
+      x1  = x1 << 1 | x1 >> 31;
+      x1 ^= t0 + (t1<<1) + k[3];
+    }
+
+  out[0] = x2 ^ tfdata->subKeys[4];
+  out[1] = x3 ^ tfdata->subKeys[5];
+  out[2] = x0 ^ tfdata->subKeys[6];
+  out[3] = x1 ^ tfdata->subKeys[7];
+}
+
+/* Decrypt one block held as words, the inverse of _TwoFish_EncryptWords(). */
+static inline void _TwoFish_DecryptWords(const uint32_t in[4],uint32_t out[4],const TWOFISH *tfdata)
+{	const uint32_t *s = tfdata->sBox;
+  const uint32_t *k = tfdata->subKeys + 7 + (TwoFish_ROUNDS*2);
+  uint32_t x0 = in[0] ^ tfdata->subKeys[4];	/* swap input and output whitening keys when decrypting */
+  uint32_t x1 = in[1] ^ tfdata->subKeys[5];
+  uint32_t x2 = in[2] ^ tfdata->subKeys[6];
+  uint32_t x3 = in[3] ^ tfdata->subKeys[7];
+  uint32_t t0,t1;
+  int R;
+
+  for (R = 0; R < TwoFish_ROUNDS; R += 2, k -= 4)
+    {   t0 = TwoFish_G0(s, x0);
+      t1 = TwoFish_G1(s, x1);
+      x3 ^= t0 + (t1<<1) + k[0];
+      x3  = x3 >> 1 | x3 << 31;
+      x2  = x2 << 1 | x2 >> 31;
+      x2 ^= t0 + t1 + k[-1];
+
+      t0 = TwoFish_G0(s, x2);
+      t1 = TwoFish_G1(s, x3);
+      x1 ^= t0 + (t1<<1) + k[-2];
+      x1  = x1 >> 1 | x1 << 31;
+      x0  = x0 << 1 | x0 >> 31;
+      x0 ^= t0 + t1 + k[-3];
+    }
+
+  out[0] = x2 ^ tfdata->subKeys[0];
+  out[1] = x3 ^ tfdata->subKeys[1];
+  out[2] = x0 ^ tfdata->subKeys[2];
+  out[3] = x1 ^ tfdata->subKeys[3];
+}
+
+/* en/decryption in CBC mode straight from in to out, which may be the same
+ * buffer. This gives the output of _TwoFish_CryptRaw() on a reset CBC: a
+ * zero IV, the short last block of more than one block stolen from the
+ * ciphertext before it, and a single short block padded with zeroes and
+ * written out whole. Unlike _TwoFish_CryptRaw() it works on words, does not
+ * queue blocks in tfdata and writes nothing past out+len for more than one
+ * block, so tfdata is only read. */
+uint32_t _TwoFish_CryptRawDirect(const uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,const TWOFISH *tfdata)
+{	uint32_t iv[4] = { 0, 0, 0, 0 };
+  uint32_t c[4];
+  uint32_t x[4];
+  uint8_t last[TwoFish_BLOCK_SIZE];
+  uint8_t tail[TwoFish_BLOCK_SIZE];
+  uint32_t rem,n,i;
+
+  if(in==NULL || out==NULL || len==0 || tfdata==NULL)
+    return 0;
+
+  if(len<=TwoFish_BLOCK_SIZE)				/* one block without CBC */
+    {	memset(last,0,TwoFish_BLOCK_SIZE);
+      memcpy(last,in,len);
+      _TwoFish_LoadBlock(x,last);
+      if(decrypt)
+	_TwoFish_DecryptWords(x,x,tfdata);
+      else
+	_TwoFish_EncryptWords(x,x,tfdata);
+      _TwoFish_StoreBlock(out,x);
+      return TwoFish_BLOCK_SIZE;
+    }
+
+  rem=len%TwoFish_BLOCK_SIZE;
+  n=len/TwoFish_BLOCK_SIZE-(rem?1:0);			/* full blocks before any stealing */
+
+  if(!decrypt)
+    {	for(i=0;i<n;i++,in+=TwoFish_BLOCK_SIZE,out+=TwoFish_BLOCK_SIZE)
+	{	_TwoFish_LoadBlock(x,in);
+	  x[0]^=iv[0]; x[1]^=iv[1]; x[2]^=iv[2]; x[3]^=iv[3];
+	  _TwoFish_EncryptWords(x,iv,tfdata);
+	  _TwoFish_StoreBlock(out,iv);
+	}
+      if(rem)
+	{	/* C(n-1) is chained as usual and the zero padded Pn on it; */
+	  /* the latter goes out first and C(n-1) is cut short after it. */
+	  _TwoFish_LoadBlock(x,in);
+	  x[0]^=iv[0]; x[1]^=iv[1]; x[2]^=iv[2]; x[3]^=iv[3];
+	  _TwoFish_EncryptWords(x,c,tfdata);
+	  memset(tail,0,TwoFish_BLOCK_SIZE);
+	  memcpy(tail,in+TwoFish_BLOCK_SIZE,rem);
+	  _TwoFish_LoadBlock(x,tail);
+	  x[0]^=c[0]; x[1]^=c[1]; x[2]^=c[2]; x[3]^=c[3];
+	  _TwoFish_EncryptWords(x,x,tfdata);
+	  _TwoFish_StoreBlock(last,c);
+	  _TwoFish_StoreBlock(out,x);
+	  memcpy(out+TwoFish_BLOCK_SIZE,last,rem);
+	}
+    }
+  else
+    {	for(i=0;i<n;i++,in+=TwoFish_BLOCK_SIZE,out+=TwoFish_BLOCK_SIZE)
+	{	_TwoFish_LoadBlock(c,in);
+	  _TwoFish_DecryptWords(c,x,tfdata);
+	  x[0]^=iv[0]; x[1]^=iv[1]; x[2]^=iv[2]; x[3]^=iv[3];
+	  memcpy(iv,c,sizeof(iv));
+	  _TwoFish_StoreBlock(out,x);
+	}
+      if(rem)
+	{	/* The full block decrypts to the zero padded Pn xor C(n-1), */
+	  /* which gives Pn and the part of C(n-1) that was cut off. */
+	  _TwoFish_LoadBlock(c,in);
+	  _TwoFish_DecryptWords(c,x,tfdata);
+	  _TwoFish_StoreBlock(last,x);
+	  memcpy(tail,in+TwoFish_BLOCK_SIZE,rem);
+	  for(i=0;i<rem;i++)
+	    {	uint8_t b=tail[i];
+
+	      tail[i]^=last[i];			/* Pn */
+	      last[i]=b;				/* C(n-1) */
+	    }
+	  _TwoFish_LoadBlock(c,last);
+	  _TwoFish_DecryptWords(c,x,tfdata);
+	  x[0]^=iv[0]; x[1]^=iv[1]; x[2]^=iv[2]; x[3]^=iv[3];
+	  _TwoFish_StoreBlock(out,x);
+	  memcpy(out+TwoFish_BLOCK_SIZE,tail,rem);
+	}
+    }
+
+  return len;
+}
+
 /* en/decryption with CBC mode */
 uint32_t _TwoFish_CryptRawCBC(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata)
 {	uint32_t rl;
@@ -247,9 +453,7 @@ uint32_t TwoFishEncryptRaw(uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
 			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,FALSE,tfdata);	/* and go for it. */
+{	return _TwoFish_CryptRawDirect(in,out,len,FALSE,tfdata);	/* straight into output buffer. */
 }
 
 /*	TwoFish Raw Decryption
@@ -268,9 +472,7 @@ uint32_t TwoFishDecryptRaw(uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
 			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,TRUE,tfdata);	/* and go for it. */
+{	return _TwoFish_CryptRawDirect(in,out,len,TRUE,tfdata);	/* straight into output buffer. */
 }
 
 /*	TwoFish Free
@@ -607,10 +809,10 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
     {   b0 = b1 = b2 = b3 = i;
       switch (k64Cnt & 3)
         {	case 1: /* 64-bit keys */
-	    tfdata->sBox[      2*i  ] = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
-	    tfdata->sBox[      2*i+1] = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
-	    tfdata->sBox[0x200+2*i  ] = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
-	    tfdata->sBox[0x200+2*i+1] = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
+	    TwoFish_S0(tfdata->sBox,i) = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
+	    TwoFish_S1(tfdata->sBox,i) = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
+	    TwoFish_S2(tfdata->sBox,i) = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
+	    TwoFish_S3(tfdata->sBox,i) = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
 	    break;
 	case 0: /* 256-bit keys (same as 4) */
 	  b0 = (TwoFish_P[TwoFish_P_04][b0]) ^ TwoFish_b0(k3);
@@ -623,19 +825,19 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
 	  b2 = (TwoFish_P[TwoFish_P_23][b2]) ^ TwoFish_b2(k2);
 	  b3 = (TwoFish_P[TwoFish_P_33][b3]) ^ TwoFish_b3(k2);
 	case 2: /* 128-bit keys */
-	  tfdata->sBox[      2*i  ]=
+	  TwoFish_S0(tfdata->sBox,i)=
 	    TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][(TwoFish_P[TwoFish_P_02][b0]) ^
 						    TwoFish_b0(k1)]) ^ TwoFish_b0(k0)];
 
-	  tfdata->sBox[      2*i+1]=
+	  TwoFish_S1(tfdata->sBox,i)=
 	    TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][(TwoFish_P[TwoFish_P_12][b1]) ^
 						    TwoFish_b1(k1)]) ^ TwoFish_b1(k0)];
 
-	  tfdata->sBox[0x200+2*i  ]=
+	  TwoFish_S2(tfdata->sBox,i)=
 	    TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][(TwoFish_P[TwoFish_P_22][b2]) ^
 						    TwoFish_b2(k1)]) ^ TwoFish_b2(k0)];
 
-	  tfdata->sBox[0x200+2*i+1]=
+	  TwoFish_S3(tfdata->sBox,i)=
 	    TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][(TwoFish_P[TwoFish_P_32][b3]) ^
 						    TwoFish_b3(k1)]) ^ TwoFish_b3(k0)];
 	}
@@ -713,16 +915,19 @@ void _TwoFish_BlockCrypt(uint8_t *in,uint8_t *out,uint32_t size,int decrypt,TWOF
 	  _TwoFish_qBlockPop(CnMinusOne,PnMinusOne,tfdata);
 	  _TwoFish_BlockCrypt16(CnMinusOne,CBCplusCprime,decrypt,tfdata);
 
+	  /* keep Cn aside first, in and out may be the same buffer */
+	  memcpy(Pn,in,size);
+
 	  /* we then xor the first few bytes with the "in" bytes (Cn) */
 	  /* to recover Pn, which we put in out */
-	  for(p=in,pout=out,i=0;i<size;i++,p++,pout++)
-	    *pout=*p ^ CBCplusCprime[i];
+	  for(pout=out,i=0;i<size;i++,pout++)
+	    *pout=Pn[i] ^ CBCplusCprime[i];
 
 	  /* We now recover the original CnMinusOne, which consists of */
 	  /* the first "size" bytes of "in" data, followed by the */
 	  /* "Cprime" portion of CBCplusCprime */
-	  for(p=in,i=0;i<size;i++,p++)
-	    CnMinusOne[i]=*p;
+	  for(i=0;i<size;i++)
+	    CnMinusOne[i]=Pn[i];
 	  for(;i<TwoFish_BLOCK_SIZE;i++)
 	    CnMinusOne[i]=CBCplusCprime[i];
 
@@ -782,103 +987,14 @@ void _TwoFish_FlushOutput(uint8_t *b,uint32_t len,TWOFISH *tfdata)
 }
 
 void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata)
-{	uint32_t x0,x1,x2,x3;
-  uint32_t k,t0,t1,R;
-
-
-  x0=*in++;
-  x0|=(*in++ << 8 );
-  x0|=(*in++ << 16);
-  x0|=(*in++ << 24);
-  x1=*in++;
-  x1|=(*in++ << 8 );
-  x1|=(*in++ << 16);
-  x1|=(*in++ << 24);
-  x2=*in++;
-  x2|=(*in++ << 8 );
-  x2|=(*in++ << 16);
-  x2|=(*in++ << 24);
-  x3=*in++;
-  x3|=(*in++ << 8 );
-  x3|=(*in++ << 16);
-  x3|=(*in++ << 24);
+{	uint32_t x[4];
 
+  _TwoFish_LoadBlock(x,in);
   if(decrypt)
-    {	x0 ^= tfdata->subKeys[4];	/* swap input and output whitening keys when decrypting */
-      x1 ^= tfdata->subKeys[5];
-      x2 ^= tfdata->subKeys[6];
-      x3 ^= tfdata->subKeys[7];
-
-      k = 7+(TwoFish_ROUNDS*2);
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-	{   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x3  = x3 >> 1 | x3 << 31;
-	  x2  = x2 << 1 | x2 >> 31;
-	  x2 ^= t0 + t1 + tfdata->subKeys[k--];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x1  = x1 >> 1 | x1 << 31;
-	  x0  = x0 << 1 | x0 >> 31;
-	  x0 ^= t0 + t1 + tfdata->subKeys[k--];
-        }
-
-      x2 ^= tfdata->subKeys[0];
-      x3 ^= tfdata->subKeys[1];
-      x0 ^= tfdata->subKeys[2];
-      x1 ^= tfdata->subKeys[3];
-    }
+    _TwoFish_DecryptWords(x,x,tfdata);
   else
-    {	x0 ^= tfdata->subKeys[0];
-      x1 ^= tfdata->subKeys[1];
-      x2 ^= tfdata->subKeys[2];
-      x3 ^= tfdata->subKeys[3];
-
-      k = 8;
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-        {   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x2 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x2  = x2 >> 1 | x2 << 31;
-	  x3  = x3 << 1 | x3 >> 31;
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x0 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x0  = x0 >> 1 | x0 << 31;
-	  x1  = x1 << 1 | x1 >> 31;
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-        }
-
-      x2 ^= tfdata->subKeys[4];
-      x3 ^= tfdata->subKeys[5];
-      x0 ^= tfdata->subKeys[6];
-      x1 ^= tfdata->subKeys[7];
-    }
-
-  *out++ = (uint8_t)(x2      );
-  *out++ = (uint8_t)(x2 >>  8);
-  *out++ = (uint8_t)(x2 >> 16);
-  *out++ = (uint8_t)(x2 >> 24);
-
-  *out++ = (uint8_t)(x3      );
-  *out++ = (uint8_t)(x3 >>  8);
-  *out++ = (uint8_t)(x3 >> 16);
-  *out++ = (uint8_t)(x3 >> 24);
-
-  *out++ = (uint8_t)(x0      );
-  *out++ = (uint8_t)(x0 >>  8);
-  *out++ = (uint8_t)(x0 >> 16);
-  *out++ = (uint8_t)(x0 >> 24);
-
-  *out++ = (uint8_t)(x1      );
-  *out++ = (uint8_t)(x1 >>  8);
-  *out++ = (uint8_t)(x1 >> 16);
-  *out++ = (uint8_t)(x1 >> 24);
+    _TwoFish_EncryptWords(x,x,tfdata);
+  _TwoFish_StoreBlock(out,x);
 }
 
 /**
@@ -945,24 +1061,18 @@ uint32_t _TwoFish_F32(uint32_t k64Cnt,uint32_t x,uint32_t *k32)
 }
 
 uint32_t _TwoFish_Fe320(uint32_t *lsBox,uint32_t x)
-{   return lsBox[        TwoFish_b0(x)<<1    ]^
-    lsBox[      ((TwoFish_b1(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b2(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b3(x)<<1)|1)];
+{   return TwoFish_G0(lsBox,x);
 }
 
 uint32_t _TwoFish_Fe323(uint32_t *lsBox,uint32_t x)
-{   return lsBox[       (TwoFish_b3(x)<<1)   ]^
-    lsBox[      ((TwoFish_b0(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b1(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b2(x)<<1)|1)];
+{   return TwoFish_G1(lsBox,x);
 }
 
 uint32_t _TwoFish_Fe32(uint32_t *lsBox,uint32_t x,uint32_t R)
-{   return lsBox[      2*TwoFish__b(x,R  )  ]^
-    lsBox[      2*TwoFish__b(x,R+1)+1]^
-    lsBox[0x200+2*TwoFish__b(x,R+2)  ]^
-    lsBox[0x200+2*TwoFish__b(x,R+3)+1];
+{   return TwoFish_S0(lsBox,TwoFish__b(x,R  ))^
+    TwoFish_S1(lsBox,TwoFish__b(x,R+1))^
+    TwoFish_S2(lsBox,TwoFish__b(x,R+2))^
+    TwoFish_S3(lsBox,TwoFish__b(x,R+3));
 }
 
 
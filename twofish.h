@@ -110,7 +110,7 @@ enum
 
 typedef struct    
 {
-    uint32_t sBox[4 * 256];                    /* Key dependent S-box */
+    uint32_t sBox[4 * 256];                    /* Key dependent S-box, through the MDS matrix */
     uint32_t subKeys[TwoFish_TOTAL_SUBKEYS];   /* Subkeys  */
     uint8_t key[TwoFish_KEY_LENGTH];           /* Encryption Key */
     uint8_t *output;                           /* Pointer to output buffer */
@@ -271,6 +271,7 @@ uint32_t TwoFishDecrypt(uint8_t *in,uint8_t **out,signed long len,bool binhex,TW
 
 uint8_t TwoFish__b(uint32_t x,int n);
 void _TwoFish_BinHex(uint8_t *buf,uint32_t len,bool bintohex);
+uint32_t _TwoFish_CryptRawDirect(const uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,const TWOFISH *tfdata);
 uint32_t _TwoFish_CryptRawCBC(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
 uint32_t _TwoFish_CryptRaw16(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
 uint32_t _TwoFish_CryptRaw(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
@@ -251,6 +251,10 @@ int encode_REGISTER(uint8_t *base,
     {
         retval += encode_sock(base, idx, &(reg->sock));
     }
+    if (common->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += encode_uint8(base, idx, reg->options);
+    }
 
     return retval;
 }
@@ -272,6 +276,11 @@ int decode_REGISTER(n2n_REGISTER_t *reg,
         retval += decode_sock(&(reg->sock), base, rem, idx);
     }
 
+    if (cmn->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += decode_uint8(&(reg->options), base, rem, idx);
+    }
+
     return retval;
 }
 
@@ -325,6 +334,11 @@ int encode_REGISTER_ACK(uint8_t *base,
         retval += encode_sock(base, idx, &(reg->sock));
     }
 
+    if (common->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += encode_uint8(base, idx, reg->options);
+    }
+
     return retval;
 }
 
@@ -348,6 +362,11 @@ int decode_REGISTER_ACK(n2n_REGISTER_ACK_t *reg,
         retval += decode_sock(&(reg->sock), base, rem, idx);
     }
 
+    if (cmn->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += decode_uint8(&(reg->options), base, rem, idx);
+    }
+
     return retval;
 }
 
@@ -431,6 +450,10 @@ int encode_PACKET(uint8_t *base,
         retval += encode_sock(base, idx, &(pkt->sock));
     }
     retval += encode_uint16(base, idx, pkt->transform);
+    if (common->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += encode_uint8(base, idx, pkt->options);
+    }
 
     return retval;
 }
@@ -454,6 +477,11 @@ int decode_PACKET(n2n_PACKET_t *pkt,
 
     retval += decode_uint16(&(pkt->transform), base, rem, idx);
 
+    if (cmn->flags & N2N_FLAGS_OPTIONS)
+    {
+        retval += decode_uint8(&(pkt->options), base, rem, idx);
+    }
+
     return retval;
 }
 